@@ -189,6 +189,8 @@ static int LoadPartitionContents(const char* filename, FileContents* file) {
                        partition);
                 return -1;
             }
+            // overlap the flash reads with the hashing
+            mtd_read_ahead(ctx, MTD_READ_AHEAD_BLOCKS);
             break;
 
         case EMMC:
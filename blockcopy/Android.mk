@@ -0,0 +1,22 @@
+LOCAL_PATH := $(call my-dir)
+
+ifneq ($(TARGET_SIMULATOR),true)
+ifeq ($(TARGET_ARCH),arm)
+
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES := block_copy.c
+LOCAL_MODULE := libblockcopy
+LOCAL_MODULE_TAGS := eng
+include $(BUILD_STATIC_LIBRARY)
+
+endif	# TARGET_ARCH == arm
+endif	# !TARGET_SIMULATOR
+
+# block_copy against the old stdio loop, runs on the build host
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES := block_copy_bench.c block_copy.c
+LOCAL_CFLAGS += -DHAVE_POSIX_FADVISE
+LOCAL_LDLIBS += -lpthread
+LOCAL_MODULE := block_copy_bench
+LOCAL_MODULE_TAGS := tests
+include $(BUILD_HOST_EXECUTABLE)
@@ -0,0 +1,541 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "block_copy.h"
+
+// one being read while the other is written
+#define BLOCK_COPY_BUFFERS  2
+// BLOCK_COPY_SKIP_SAME compares and writes in chunks this big
+#define BLOCK_COPY_CHUNK    (64 * 1024)
+
+typedef struct {
+    off64_t pos;            // in the output
+    uint64_t len;
+} block_copy_extent;
+
+typedef struct {
+    int in;
+    int out;
+    int flags;
+    int pad;                // BLOCK_COPY_PAD pads with this byte
+    int direct_in;          // each owned by the thread on that end
+    int direct_out;
+    uint64_t left;          // BLOCK_COPY_ALL, or what the reader still has to read
+    off64_t in_pos;         // for the page cache hints, -1 on pipes
+    char* buffers[BLOCK_COPY_BUFFERS];
+    size_t lens[BLOCK_COPY_BUFFERS];
+
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    unsigned int filled;    // buffers read, counting up
+    unsigned int taken;     // buffers written
+    int done;               // the reader read its last buffer
+    int stop;               // the writer gave up
+    int error;              // errno of the reader
+
+    // BLOCK_COPY_SKIP_SAME, the writer's
+    off64_t in_start;
+    off64_t out_start;
+    off64_t out_pos;
+    char* old;              // what the output held
+    block_copy_extent* written;
+    int written_count;
+    int written_alloc;
+    uint64_t changed;
+
+    block_copy_progress_fn progress;
+    block_copy_data_fn data;
+    void* cookie;
+    uint64_t copied;        // of the input, padding not counted
+    uint64_t total;         // 0 if not known
+} block_copy_state;
+
+#ifdef HAVE_POSIX_FADVISE
+static void advise(int fd, off64_t offset, off64_t len, int advice)
+{
+    if (offset >= 0)
+        posix_fadvise(fd, offset, len, advice);
+}
+#else
+// older bionic has no posix_fadvise, the hints are only hints
+#define advise(fd, offset, len, advice) do { } while (0)
+#endif
+
+static int set_direct(int fd, int on)
+{
+    int fl = fcntl(fd, F_GETFL);
+    if (fl < 0)
+        return -1;
+    if (!!(fl & O_DIRECT) == on)
+        return 0;
+    return fcntl(fd, F_SETFL, on ? fl | O_DIRECT : fl & ~O_DIRECT);
+}
+
+// O_DIRECT needs aligned lengths and offsets, and some file systems turn
+// it down only at the first read or write.  Either way that end goes
+// back to the page cache.
+static void drop_direct(int fd, int* direct)
+{
+    if (*direct) {
+        set_direct(fd, 0);
+        *direct = 0;
+    }
+}
+
+// Reads a whole buffer, or less at the end of the input.
+static ssize_t read_buffer(block_copy_state* c, char* buffer)
+{
+    size_t len = BLOCK_COPY_BUFFER_SIZE;
+    if (c->left != BLOCK_COPY_ALL && c->left < len)
+        len = c->left;
+    if (len % BLOCK_COPY_ALIGN != 0)
+        drop_direct(c->in, &c->direct_in);
+
+    size_t done = 0;
+    while (done < len) {
+        ssize_t r = read(c->in, buffer + done, len - done);
+        if (r < 0 && errno == EINVAL && c->direct_in) {
+            drop_direct(c->in, &c->direct_in);
+            continue;
+        }
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r < 0)
+            return -1;
+        if (r == 0)
+            break;
+        done += r;
+    }
+    if (c->left != BLOCK_COPY_ALL) {
+        c->left -= done;
+        if (done < len) {
+            errno = EIO;
+            return -1;
+        }
+    }
+    // nothing reads the data twice
+    if (c->in_pos >= 0) {
+        advise(c->in, c->in_pos, done, POSIX_FADV_DONTNEED);
+        c->in_pos += done;
+    }
+    return done;
+}
+
+static ssize_t pread_full(int fd, char* buffer, size_t len, off64_t pos, int* direct)
+{
+    size_t done = 0;
+    while (done < len) {
+        ssize_t r = pread64(fd, buffer + done, len - done, pos + done);
+        if (r < 0 && errno == EINVAL && *direct) {
+            drop_direct(fd, direct);
+            continue;
+        }
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r < 0)
+            return -1;
+        if (r == 0)
+            break;
+        done += r;
+    }
+    return done;
+}
+
+static int pwrite_full(int fd, const char* buffer, size_t len, off64_t pos, int* direct)
+{
+    size_t done = 0;
+    while (done < len) {
+        ssize_t w = pwrite64(fd, buffer + done, len - done, pos + done);
+        if (w < 0 && errno == EINVAL && *direct) {
+            drop_direct(fd, direct);
+            continue;
+        }
+        if (w < 0 && errno == EINTR)
+            continue;
+        if (w <= 0)
+            return -1;
+        done += w;
+    }
+    return 0;
+}
+
+static int add_written(block_copy_state* c, off64_t pos, size_t len)
+{
+    block_copy_extent* last = c->written_count > 0 ? &c->written[c->written_count - 1] : NULL;
+    if (last != NULL && last->pos + (off64_t) last->len == pos) {
+        last->len += len;
+        return 0;
+    }
+    if (c->written_count == c->written_alloc) {
+        int alloc = c->written_alloc * 2 + 16;
+        block_copy_extent* written = realloc(c->written, alloc * sizeof(block_copy_extent));
+        if (written == NULL)
+            return -1;
+        c->written = written;
+        c->written_alloc = alloc;
+    }
+    c->written[c->written_count].pos = pos;
+    c->written[c->written_count].len = len;
+    c->written_count++;
+    return 0;
+}
+
+// Only writes the chunks that differ from what the output already holds,
+// and remembers them for verify_written.
+static int write_changed(block_copy_state* c, const char* buffer, size_t len)
+{
+    size_t done;
+    for (done = 0; done < len; done += BLOCK_COPY_CHUNK) {
+        size_t n = len - done < BLOCK_COPY_CHUNK ? len - done : BLOCK_COPY_CHUNK;
+        off64_t pos = c->out_pos + done;
+        // past the end of the output nothing is the same
+        ssize_t r = pread_full(c->out, c->old, n, pos, &c->direct_out);
+        if (r < 0)
+            return -1;
+        if ((size_t) r == n && memcmp(c->old, buffer + done, n) == 0)
+            continue;
+        if (pwrite_full(c->out, buffer + done, n, pos, &c->direct_out) ||
+                add_written(c, pos, n))
+            return -1;
+        c->changed += n;
+    }
+    c->out_pos += len;
+    return 0;
+}
+
+// Reads what write_changed wrote back from the output, which is synced,
+// and checks it against the input.
+static int verify_written(block_copy_state* c)
+{
+    char* expected = c->buffers[0];
+    int direct_in = 0;
+    int i;
+    for (i = 0; i < c->written_count; i++) {
+        uint64_t done;
+        for (done = 0; done < c->written[i].len; done += BLOCK_COPY_BUFFER_SIZE) {
+            uint64_t left = c->written[i].len - done;
+            size_t n = left < BLOCK_COPY_BUFFER_SIZE ? left : BLOCK_COPY_BUFFER_SIZE;
+            off64_t pos = c->written[i].pos + done;
+            if (n % BLOCK_COPY_ALIGN != 0)
+                drop_direct(c->out, &c->direct_out);
+            // from the device, not the page cache
+            advise(c->out, pos, n, POSIX_FADV_DONTNEED);
+            ssize_t r = pread_full(c->in, expected, n, c->in_start + (pos - c->out_start), &direct_in);
+            if (r < 0)
+                return -1;
+            // the rest was padding
+            memset(expected + r, 0, n - r);
+            if (pread_full(c->out, c->old, n, pos, &c->direct_out) != (ssize_t) n)
+                return -1;
+            if (memcmp(expected, c->old, n) != 0) {
+                printf("block_copy: verify failed at %lld\n", (long long) pos);
+                errno = EIO;
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+static int write_all(block_copy_state* c, const char* buffer, size_t len)
+{
+    size_t done = 0;
+    while (done < len) {
+        ssize_t w = write(c->out, buffer + done, len - done);
+        if (w < 0 && errno == EINVAL && c->direct_out) {
+            drop_direct(c->out, &c->direct_out);
+            continue;
+        }
+        if (w < 0 && errno == EINTR)
+            continue;
+        if (w <= 0)
+            return -1;
+        done += w;
+    }
+    return 0;
+}
+
+static int write_buffer(block_copy_state* c, char* buffer, size_t len)
+{
+    size_t data_len = len;
+    if ((c->flags & BLOCK_COPY_PAD) && len % BLOCK_COPY_ALIGN != 0) {
+        size_t padded = (len + BLOCK_COPY_ALIGN - 1) / BLOCK_COPY_ALIGN * BLOCK_COPY_ALIGN;
+        memset(buffer + len, c->pad, padded - len);
+        len = padded;
+    }
+    if (len % BLOCK_COPY_ALIGN != 0)
+        drop_direct(c->out, &c->direct_out);
+    int ret = (c->flags & BLOCK_COPY_SKIP_SAME) ?
+            write_changed(c, buffer, len) : write_all(c, buffer, len);
+    if (ret == 0 && c->data != NULL)
+        c->data(c->cookie, buffer, data_len);
+    if (ret == 0 && c->progress != NULL) {
+        c->copied += data_len;
+        c->progress(c->cookie, c->copied, c->total);
+    }
+    return ret;
+}
+
+// pipes can't be synced
+static int sync_out(int out)
+{
+    int saved = errno;
+    if (fsync(out) != 0 && errno != EINVAL)
+        return -1;
+    errno = saved;
+    return 0;
+}
+
+static int is_last(block_copy_state* c, ssize_t len)
+{
+    return len < BLOCK_COPY_BUFFER_SIZE || c->left == 0;
+}
+
+static void* reader_thread(void* cookie)
+{
+    block_copy_state* c = (block_copy_state*) cookie;
+    for (;;) {
+        pthread_mutex_lock(&c->mutex);
+        while (!c->stop && c->filled - c->taken == BLOCK_COPY_BUFFERS)
+            pthread_cond_wait(&c->cond, &c->mutex);
+        int stop = c->stop;
+        unsigned int slot = c->filled % BLOCK_COPY_BUFFERS;
+        pthread_mutex_unlock(&c->mutex);
+        if (stop)
+            break;
+
+        ssize_t len = read_buffer(c, c->buffers[slot]);
+
+        pthread_mutex_lock(&c->mutex);
+        if (len < 0)
+            c->error = errno;
+        else if (len > 0) {
+            c->lens[slot] = len;
+            c->filled++;
+        }
+        c->done = len < 0 || is_last(c, len);
+        stop = c->done;
+        pthread_cond_signal(&c->cond);
+        pthread_mutex_unlock(&c->mutex);
+        if (stop)
+            break;
+    }
+    return NULL;
+}
+
+static int copy_threaded(block_copy_state* c)
+{
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, reader_thread, c) != 0)
+        return 1;
+
+    int ret = 0;
+    for (;;) {
+        pthread_mutex_lock(&c->mutex);
+        while (c->taken == c->filled && !c->done)
+            pthread_cond_wait(&c->cond, &c->mutex);
+        int empty = c->taken == c->filled;
+        unsigned int slot = c->taken % BLOCK_COPY_BUFFERS;
+        pthread_mutex_unlock(&c->mutex);
+        if (empty)
+            break;
+
+        int written = write_buffer(c, c->buffers[slot], c->lens[slot]);
+
+        pthread_mutex_lock(&c->mutex);
+        if (written == 0)
+            c->taken++;
+        else
+            c->stop = 1;
+        pthread_cond_signal(&c->cond);
+        pthread_mutex_unlock(&c->mutex);
+        if (written != 0) {
+            ret = -1;
+            break;
+        }
+    }
+    int saved = errno;
+    pthread_join(thread, NULL);
+    errno = saved;
+    if (ret == 0 && c->error != 0) {
+        errno = c->error;
+        ret = -1;
+    }
+    return ret;
+}
+
+static int copy_in_turn(block_copy_state* c)
+{
+    for (;;) {
+        ssize_t len = read_buffer(c, c->buffers[0]);
+        if (len < 0)
+            return -1;
+        if (len > 0 && write_buffer(c, c->buffers[0], len))
+            return -1;
+        if (is_last(c, len))
+            return 0;
+    }
+}
+
+int block_copy(int in, int out, uint64_t length, int flags)
+{
+    return block_copy_with_progress(in, out, length, flags, NULL, NULL);
+}
+
+static int copy_fds(int in, int out, uint64_t length, int flags,
+        block_copy_progress_fn progress, block_copy_data_fn data, void* cookie)
+{
+    block_copy_state c;
+    memset(&c, 0, sizeof(c));
+    c.in = in;
+    c.out = out;
+    c.flags = flags;
+    c.left = length;
+    c.in_pos = lseek64(in, 0, SEEK_CUR);
+    advise(in, c.in_pos, 0, POSIX_FADV_SEQUENTIAL);
+    c.progress = progress;
+    c.data = data;
+    c.cookie = cookie;
+    c.total = length;
+    struct stat st;
+    if (length == BLOCK_COPY_ALL)
+        c.total = c.in_pos >= 0 && fstat(in, &st) == 0 && S_ISREG(st.st_mode) &&
+                st.st_size > c.in_pos ? (uint64_t) (st.st_size - c.in_pos) : 0;
+
+    // O_DIRECT also needs the position aligned
+    off64_t out_pos = lseek64(out, 0, SEEK_CUR);
+    c.direct_in = (flags & BLOCK_COPY_DIRECT_IN) && c.in_pos >= 0 &&
+            c.in_pos % BLOCK_COPY_ALIGN == 0 && set_direct(in, 1) == 0;
+    c.direct_out = (flags & BLOCK_COPY_DIRECT_OUT) && out_pos >= 0 &&
+            out_pos % BLOCK_COPY_ALIGN == 0 && set_direct(out, 1) == 0;
+    // the verify reads the input again
+    if (c.in_pos < 0 || out_pos < 0)
+        c.flags &= ~BLOCK_COPY_SKIP_SAME;
+    c.in_start = c.in_pos;
+    c.out_start = c.out_pos = out_pos;
+
+    int ret = 0;
+    int i;
+    for (i = 0; i < BLOCK_COPY_BUFFERS; i++) {
+        c.buffers[i] = memalign(BLOCK_COPY_ALIGN, BLOCK_COPY_BUFFER_SIZE);
+        if (c.buffers[i] == NULL)
+            ret = -1;
+    }
+    if (c.flags & BLOCK_COPY_SKIP_SAME) {
+        c.old = memalign(BLOCK_COPY_ALIGN, BLOCK_COPY_BUFFER_SIZE);
+        if (c.old == NULL)
+            ret = -1;
+    }
+
+    if (ret == 0) {
+        pthread_mutex_init(&c.mutex, NULL);
+        pthread_cond_init(&c.cond, NULL);
+        ret = 1;
+        if (!(flags & BLOCK_COPY_NO_THREAD))
+            ret = copy_threaded(&c);
+        // without a thread, one buffer does
+        if (ret == 1)
+            ret = copy_in_turn(&c);
+        pthread_cond_destroy(&c.cond);
+        pthread_mutex_destroy(&c.mutex);
+    }
+
+    if (ret == 0 && (c.flags & (BLOCK_COPY_SYNC | BLOCK_COPY_SKIP_SAME)))
+        ret = sync_out(out);
+    if (c.flags & BLOCK_COPY_SKIP_SAME) {
+        if (ret == 0)
+            ret = verify_written(&c);
+        if (ret == 0)
+            printf("block_copy: wrote %llu of %llu bytes, the rest was unchanged\n",
+                    (unsigned long long) c.changed,
+                    (unsigned long long) (c.out_pos - c.out_start));
+        // the writes went around the file position
+        lseek64(out, c.out_pos, SEEK_SET);
+    }
+    drop_direct(in, &c.direct_in);
+    drop_direct(out, &c.direct_out);
+    for (i = 0; i < BLOCK_COPY_BUFFERS; i++)
+        free(c.buffers[i]);
+    free(c.old);
+    free(c.written);
+    return ret;
+}
+
+int block_copy_with_progress(int in, int out, uint64_t length, int flags,
+        block_copy_progress_fn progress, void* cookie)
+{
+    return copy_fds(in, out, length, flags, progress, NULL, cookie);
+}
+
+int block_copy_fill(int out, int value, uint64_t length, int flags,
+        block_copy_progress_fn progress, void* cookie)
+{
+    block_copy_state c;
+    memset(&c, 0, sizeof(c));
+    c.in = -1;
+    c.out = out;
+    c.flags = flags & (BLOCK_COPY_DIRECT_OUT | BLOCK_COPY_SYNC | BLOCK_COPY_PAD);
+    c.pad = value;
+    c.progress = progress;
+    c.cookie = cookie;
+    c.total = length;
+    off64_t out_pos = lseek64(out, 0, SEEK_CUR);
+    c.direct_out = (flags & BLOCK_COPY_DIRECT_OUT) && out_pos >= 0 &&
+            out_pos % BLOCK_COPY_ALIGN == 0 && set_direct(out, 1) == 0;
+
+    char* buffer = memalign(BLOCK_COPY_ALIGN, BLOCK_COPY_BUFFER_SIZE);
+    int ret = buffer == NULL ? -1 : 0;
+    if (buffer != NULL)
+        memset(buffer, value, BLOCK_COPY_BUFFER_SIZE);
+    while (ret == 0 && length > 0) {
+        size_t len = length < BLOCK_COPY_BUFFER_SIZE ? length : BLOCK_COPY_BUFFER_SIZE;
+        ret = write_buffer(&c, buffer, len);
+        length -= len;
+    }
+    if (ret == 0 && (c.flags & BLOCK_COPY_SYNC))
+        ret = sync_out(out);
+    drop_direct(out, &c.direct_out);
+    free(buffer);
+    return ret;
+}
+
+int block_copy_path(const char* in, const char* out, int flags)
+{
+    return block_copy_path_with_data(in, out, flags, NULL, NULL);
+}
+
+int block_copy_path_with_data(const char* in, const char* out, int flags,
+        block_copy_data_fn data, void* cookie)
+{
+    int in_fd = open(in, O_RDONLY | O_LARGEFILE);
+    if (in_fd < 0)
+        return -1;
+    int out_fd = STDOUT_FILENO;
+    if (strcmp(out, "-") == 0)
+        ;
+    // what is there is compared against, so it stays
+    else if (flags & BLOCK_COPY_SKIP_SAME)
+        out_fd = open(out, O_RDWR | O_LARGEFILE);
+    else
+        out_fd = open(out, O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE, 0666);
+    if (out_fd < 0) {
+        close(in_fd);
+        return -1;
+    }
+
+    int ret = copy_fds(in_fd, out_fd, BLOCK_COPY_ALL, flags, NULL, data, cookie);
+    int saved = errno;
+    if (out_fd != STDOUT_FILENO && close(out_fd) != 0 && ret == 0)
+        ret = -1;
+    else
+        errno = saved;
+    close(in_fd);
+    return ret;
+}
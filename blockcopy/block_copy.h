@@ -0,0 +1,64 @@
+#ifndef BLOCK_COPY_H
+#define BLOCK_COPY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// The raw copies between partitions and image files: a reader thread
+// fills large aligned buffers while the caller's thread writes the one
+// before, and the end of the data is copied at its exact length.
+#define BLOCK_COPY_BUFFER_SIZE  (1024 * 1024)
+#define BLOCK_COPY_ALIGN        4096
+
+// Copy until the end of the input.
+#define BLOCK_COPY_ALL          ((uint64_t) -1)
+
+// O_DIRECT on the input or output, meant for the block device side.  An
+// end that won't take it is used through the page cache.
+#define BLOCK_COPY_DIRECT_IN    0x1
+#define BLOCK_COPY_DIRECT_OUT   0x2
+// fsync the output before returning
+#define BLOCK_COPY_SYNC         0x4
+// pad the last write to BLOCK_COPY_ALIGN, for devices that only take
+// whole pages: with zeros, or the value block_copy_fill writes
+#define BLOCK_COPY_PAD          0x8
+// read and write in turn on the caller's thread
+#define BLOCK_COPY_NO_THREAD    0x10
+// compare the output with the input first and only write the 64KB
+// chunks that differ, then sync and read those back.  Both ends have to
+// be seekable, for the verify reads the input again.
+#define BLOCK_COPY_SKIP_SAME    0x20
+
+// Copies length bytes from the current position of in to out.  Returns 0
+// if all of them made it, -1 with errno set otherwise; running out of
+// input early is an error unless length is BLOCK_COPY_ALL.
+int block_copy(int in, int out, uint64_t length, int flags);
+
+// Called on the caller's thread after every buffer written, with the
+// bytes of input written so far and how many there are in all, 0 if that
+// isn't known (BLOCK_COPY_ALL from something other than a file).
+typedef void (*block_copy_progress_fn)(void* cookie, uint64_t done, uint64_t total);
+
+// block_copy, telling progress how far it got.  progress may be NULL.
+int block_copy_with_progress(int in, int out, uint64_t length, int flags,
+        block_copy_progress_fn progress, void* cookie);
+
+// Writes length bytes of value at the current position of out, a buffer
+// at a time.  Takes BLOCK_COPY_DIRECT_OUT, BLOCK_COPY_SYNC and
+// BLOCK_COPY_PAD, the rest of the flags are for copies.
+int block_copy_fill(int out, int value, uint64_t length, int flags,
+        block_copy_progress_fn progress, void* cookie);
+
+// The same from file to file, "-" is stdout.  The output is created or
+// truncated like fopen(out, "w") would, unless it is compared against.
+int block_copy_path(const char* in, const char* out, int flags);
+
+// Called on the caller's thread with every buffer of input once it is
+// written, in order, to look at the data on the way, eg. to hash it.
+typedef void (*block_copy_data_fn)(void* cookie, const char* data, size_t len);
+
+// block_copy_path, handing what it copies to data.  data may be NULL.
+int block_copy_path_with_data(const char* in, const char* out, int flags,
+        block_copy_data_fn data, void* cookie);
+
+#endif
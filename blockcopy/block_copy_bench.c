@@ -0,0 +1,215 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+
+#include "block_copy.h"
+
+// Times block_copy against the 512 byte stdio loop the raw eMMC and BML
+// paths used before it:
+//
+//   block_copy_bench [-i <input>] [-o <output>] [-s <bytes>] [-d <dir>]
+//
+// Point -i and -o at loop devices (losetup -f --show <file>) to measure
+// the block device paths.  Without them the input is a file of -s random
+// bytes in <dir>, 64MB and a bit by default so the tail is odd.  Caches
+// are dropped before every run.  Returns 1 if a copy doesn't read back.
+
+static void usage()
+{
+    fprintf(stderr, "usage: block_copy_bench [-i <input>] [-o <output>] [-s <bytes>] [-d <dir>]\n");
+    exit(2);
+}
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// The loop mmc_raw_copy, mmc_raw_dump_internal and
+// cmd_bml_backup_raw_partition had, byte by byte for odd sizes.
+static int stdio_copy(const char* in_file, const char* out_file)
+{
+    FILE* in = fopen(in_file, "r");
+    if (in == NULL)
+        return -1;
+    FILE* out = fopen(out_file, "w");
+    if (out == NULL) {
+        fclose(in);
+        return -1;
+    }
+    int ret = 0;
+    char buf[512];
+    fseek(in, 0L, SEEK_END);
+    unsigned sz = ftell(in);
+    fseek(in, 0L, SEEK_SET);
+    if (sz % 512) {
+        int ch;
+        while ((ch = fgetc(in)) != EOF)
+            fputc(ch, out);
+    }
+    else {
+        unsigned i;
+        for (i = 0; ret == 0 && i < sz / 512; i++) {
+            if (fread(buf, 512, 1, in) != 1 || fwrite(buf, 512, 1, out) != 1)
+                ret = -1;
+        }
+    }
+    fflush(out);
+    fsync(fileno(out));
+    fclose(out);
+    fclose(in);
+    return ret;
+}
+
+static int make_input(const char* path, off64_t size)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return -1;
+    char buf[65536];
+    unsigned int seed = 1;
+    off64_t done;
+    size_t i;
+    for (done = 0; done < size; done += sizeof(buf)) {
+        for (i = 0; i < sizeof(buf); i++)
+            buf[i] = rand_r(&seed);
+        size_t len = size - done < (off64_t) sizeof(buf) ? size - done : sizeof(buf);
+        if (write(fd, buf, len) != (ssize_t) len) {
+            close(fd);
+            return -1;
+        }
+    }
+    return close(fd);
+}
+
+static off64_t get_size(const char* path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    off64_t size = lseek64(fd, 0, SEEK_END);
+    close(fd);
+    return size;
+}
+
+// so every run reads from the device, not from memory
+static void drop_cache(const char* path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return;
+    struct stat st;
+    fsync(fd);
+    if (fstat(fd, &st) == 0 && S_ISBLK(st.st_mode))
+        ioctl(fd, BLKFLSBUF, 0);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+}
+
+// Returns 0 if the first size bytes of both match.
+static int compare(const char* a_path, const char* b_path, off64_t size)
+{
+    FILE* a = fopen(a_path, "r");
+    FILE* b = fopen(b_path, "r");
+    int ret = -1;
+    if (a != NULL && b != NULL) {
+        char x[65536], y[65536];
+        off64_t done = 0;
+        ret = 0;
+        while (ret == 0 && done < size) {
+            size_t len = size - done < (off64_t) sizeof(x) ? size - done : sizeof(x);
+            if (fread(x, 1, len, a) != len || fread(y, 1, len, b) != len || memcmp(x, y, len))
+                ret = -1;
+            done += len;
+        }
+    }
+    if (a != NULL) fclose(a);
+    if (b != NULL) fclose(b);
+    return ret;
+}
+
+int main(int argc, char** argv)
+{
+    char dir[PATH_MAX] = "/tmp";
+    char in[PATH_MAX] = "";
+    char out[PATH_MAX] = "";
+    off64_t size = 64 * 1024 * 1024 + 777;
+    int c;
+
+    while ((c = getopt(argc, argv, "i:o:s:d:")) != -1) {
+        switch (c) {
+            case 'i': snprintf(in, sizeof(in), "%s", optarg); break;
+            case 'o': snprintf(out, sizeof(out), "%s", optarg); break;
+            case 's': size = atoll(optarg); break;
+            case 'd': snprintf(dir, sizeof(dir), "%s", optarg); break;
+            default: usage();
+        }
+    }
+    if (optind != argc)
+        usage();
+
+    int made_input = in[0] == '\0';
+    int made_output = out[0] == '\0';
+    if (made_input) {
+        sprintf(in, "%s/block_copy_bench.in", dir);
+        if (make_input(in, size)) {
+            fprintf(stderr, "block_copy_bench: can't write %s (%s)\n", in, strerror(errno));
+            return 1;
+        }
+    }
+    if (made_output)
+        sprintf(out, "%s/block_copy_bench.out", dir);
+    // a device copies the whole of itself
+    size = get_size(in);
+    if (size < 0) {
+        fprintf(stderr, "block_copy_bench: can't open %s (%s)\n", in, strerror(errno));
+        return 1;
+    }
+
+    static const struct {
+        const char* name;
+        int flags;
+    } runs[] = {
+        { "stdio 512", -1 },
+        { "in turn", BLOCK_COPY_NO_THREAD | BLOCK_COPY_SYNC },
+        { "threaded", BLOCK_COPY_SYNC },
+        { "threaded direct", BLOCK_COPY_DIRECT_IN | BLOCK_COPY_DIRECT_OUT | BLOCK_COPY_SYNC },
+        // onto what the runs before left, like flashing the same image again
+        { "skip unchanged", BLOCK_COPY_DIRECT_IN | BLOCK_COPY_DIRECT_OUT | BLOCK_COPY_SKIP_SAME },
+    };
+    int ret = 0;
+    unsigned int i;
+    for (i = 0; i < sizeof(runs) / sizeof(runs[0]); i++) {
+        drop_cache(in);
+        drop_cache(out);
+        double start = now();
+        int r = runs[i].flags < 0 ? stdio_copy(in, out) : block_copy_path(in, out, runs[i].flags);
+        double seconds = now() - start;
+        if (r != 0) {
+            fprintf(stderr, "block_copy_bench: %s failed (%s)\n", runs[i].name, strerror(errno));
+            ret = 1;
+            continue;
+        }
+        printf("%-16s %8.2f MB/s\n", runs[i].name, size / seconds / (1024 * 1024));
+        if (compare(in, out, size)) {
+            fprintf(stderr, "block_copy_bench: %s doesn't read back\n", runs[i].name);
+            ret = 1;
+        }
+    }
+
+    if (made_input)
+        unlink(in);
+    if (made_output)
+        unlink(out);
+    return ret;
+}
@@ -11,6 +11,7 @@ $(foreach board_define,$(BOARD_RECOVERY_DEFINES), \
   )
 
 LOCAL_SRC_FILES := bmlutils.c
+LOCAL_C_INCLUDES += bootable/recovery
 LOCAL_MODULE := libbmlutils
 LOCAL_MODULE_TAGS := eng
 include $(BUILD_STATIC_LIBRARY)
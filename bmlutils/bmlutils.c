@@ -20,6 +20,8 @@
 #include <signal.h>
 #include <sys/wait.h>
 
+#include "blockcopy/block_copy.h"
+
 extern int __system(const char *command);
 #define BML_UNLOCK_ALL				0x8A29		///< unlock all partition RO -> RW
 
@@ -31,10 +33,10 @@ extern int __system(const char *command);
 #define BOARD_BML_RECOVERY          "/dev/block/bml8"
 #endif
 
-static int restore_internal(const char* bml, const char* filename)
+static int restore_internal(const char* bml, const char* filename,
+        block_copy_progress_fn progress, void* cookie)
 {
-    char buf[4096];
-    int dstfd, srcfd, bytes_read, bytes_written, total_read = 0;
+    int dstfd, srcfd, ret = 0;
     if (filename == NULL)
         srcfd = 0;
     else {
@@ -44,117 +46,140 @@ static int restore_internal(const char* bml, const char* filename)
     }
     dstfd = open(bml, O_RDWR | O_LARGEFILE);
     if (dstfd < 0)
-        return 3;
-    if (ioctl(dstfd, BML_UNLOCK_ALL, 0))
-        return 4;
-    do {
-        total_read += bytes_read = read(srcfd, buf, 4096);
-        if (!bytes_read)
-            break;
-        if (bytes_read < 4096)
-            memset(&buf[bytes_read], 0, 4096 - bytes_read);
-        if (write(dstfd, buf, 4096) < 4096)
-            return 5;
-    } while(bytes_read == 4096);
-    
-    close(dstfd);
-    close(srcfd);
-    
-    return 0;
+        ret = 3;
+    else if (ioctl(dstfd, BML_UNLOCK_ALL, 0))
+        ret = 4;
+    // bml only takes whole pages
+    else if (block_copy_with_progress(srcfd, dstfd, BLOCK_COPY_ALL,
+            BLOCK_COPY_PAD | BLOCK_COPY_DIRECT_OUT, progress, cookie))
+        ret = 5;
+
+    if (dstfd >= 0)
+        close(dstfd);
+    if (srcfd != 0)
+        close(srcfd);
+    return ret;
+}
+
+// Flashing recovery or a device path writes the image twice, boot
+// first, the progress of each write is scaled to its part of the whole.
+typedef struct {
+    block_copy_progress_fn progress;
+    void* cookie;
+    int pass;
+    int passes;
+} bml_restore_progress;
+
+static void restore_progress(void* cookie, uint64_t done, uint64_t total)
+{
+    bml_restore_progress* p = (bml_restore_progress*) cookie;
+    p->progress(p->cookie, total * p->pass + done, total * p->passes);
 }
 
 int cmd_bml_restore_raw_partition(const char *partition, const char *filename)
+{
+    return cmd_bml_restore_raw_partition_progress(partition, filename, NULL, NULL);
+}
+
+int cmd_bml_restore_raw_partition_progress(const char *partition, const char *filename,
+        block_copy_progress_fn progress, void* cookie)
 {
     if (strcmp(partition, "boot") != 0 && strcmp(partition, "recovery") != 0 && strcmp(partition, "recoveryonly") != 0 && partition[0] != '/')
         return 6;
 
+    bml_restore_progress p;
+    p.progress = progress;
+    p.cookie = cookie;
+    p.pass = 0;
+    p.passes = strcmp(partition, "recovery") == 0 || partition[0] == '/' ? 2 : 1;
+    if (progress != NULL) {
+        progress = restore_progress;
+        cookie = &p;
+    }
+
     int ret = -1;
     if (strcmp(partition, "recoveryonly") != 0) {
         // always restore boot, regardless of whether recovery or boot is flashed.
         // this is because boot and recovery are the same on some samsung phones.
         // unless of course, recoveryonly is explictly chosen (bml8)
-        ret = restore_internal(BOARD_BML_BOOT, filename);
+        ret = restore_internal(BOARD_BML_BOOT, filename, progress, cookie);
         if (ret != 0)
             return ret;
+        p.pass++;
     }
 
     if (strcmp(partition, "recovery") == 0 || strcmp(partition, "recoveryonly") == 0)
-        ret = restore_internal(BOARD_BML_RECOVERY, filename);
+        ret = restore_internal(BOARD_BML_RECOVERY, filename, progress, cookie);
 
     // support explicitly provided device paths
     if (partition[0] == '/')
-        ret = restore_internal(partition, filename);
+        ret = restore_internal(partition, filename, progress, cookie);
     return ret;
 }
 
-int cmd_bml_backup_raw_partition(const char *partition, const char *out_file)
+static const char* bml_device(const char *partition)
 {
-    char* bml;
     if (strcmp("boot", partition) == 0)
-        bml = BOARD_BML_BOOT;
-    else if (strcmp("recovery", partition) == 0)
-        bml = BOARD_BML_RECOVERY;
-    else if (partition[0] == '/') {
-        // support explicitly provided device paths
-        bml = partition;
-    }
-    else {
-        printf("Invalid partition.\n");
-        return -1;
-    }
-
-    int ch;
-    FILE *in;
-    FILE *out;
-    int val = 0;
-    char buf[512];
-    unsigned sz = 0;
-    unsigned i;
-    int ret = -1;
-    char *in_file = bml;
+        return BOARD_BML_BOOT;
+    if (strcmp("recovery", partition) == 0)
+        return BOARD_BML_RECOVERY;
+    // support explicitly provided device paths
+    if (partition[0] == '/')
+        return partition;
+    printf("Invalid partition.\n");
+    return NULL;
+}
 
-    in  = fopen ( in_file,  "r" );
-    if (in == NULL)
-        goto ERROR3;
+int cmd_bml_backup_raw_partition_data(const char *partition, const char *out_file,
+        block_copy_data_fn data, void* cookie)
+{
+    const char* bml = bml_device(partition);
+    if (bml == NULL)
+        return -1;
 
-    out = fopen ( out_file,  "w" );
-    if (out == NULL)
-        goto ERROR2;
+    return block_copy_path_with_data(bml, out_file, BLOCK_COPY_DIRECT_IN | BLOCK_COPY_SYNC,
+            data, cookie);
+}
 
-    fseek(in, 0L, SEEK_END);
-    sz = ftell(in);
-    fseek(in, 0L, SEEK_SET);
+int cmd_bml_backup_raw_partition(const char *partition, const char *out_file)
+{
+    return cmd_bml_backup_raw_partition_data(partition, out_file, NULL, NULL);
+}
 
-    if (sz % 512)
-    {
-        while ( ( ch = fgetc ( in ) ) != EOF )
-            fputc ( ch, out );
+// Writes value over the first length bytes of a device, all of it if
+// length is BLOCK_COPY_ALL.  bml devices have to be unlocked first.
+static int fill_internal(const char* bml, int value, uint64_t length, int unlock)
+{
+    int fd = open(bml, O_RDWR | O_LARGEFILE);
+    if (fd < 0) {
+        printf("error opening %s\n", bml);
+        return -1;
     }
+    int ret = -1;
+    off64_t size = lseek64(fd, 0, SEEK_END);
+    if (length == BLOCK_COPY_ALL)
+        length = size;
+    if (size < 0 || lseek64(fd, 0, SEEK_SET) != 0)
+        printf("error seeking %s\n", bml);
+    else if (unlock && ioctl(fd, BML_UNLOCK_ALL, 0))
+        printf("error unlocking %s\n", bml);
+    else if (block_copy_fill(fd, value, length, BLOCK_COPY_DIRECT_OUT | BLOCK_COPY_SYNC, NULL, NULL))
+        printf("error writing %s (%s)\n", bml, strerror(errno));
     else
-    {
-        for (i=0; i< (sz/512); i++)
-        {
-            if ((fread(buf, 512, 1, in)) != 1)
-                goto ERROR1;
-            if ((fwrite(buf, 512, 1, out)) != 1)
-                goto ERROR1;
-        }
-    }
-
-    fsync(out);
-    ret = 0;
-ERROR1:
-    fclose ( out );
-ERROR2:
-    fclose ( in );
-ERROR3:
+        ret = 0;
+    if (close(fd))
+        ret = -1;
     return ret;
 }
 
 int cmd_bml_erase_raw_partition(const char *partition)
 {
-    // TODO: implement raw wipe
-    return 0;
+    const char* bml = bml_device(partition);
+    if (bml == NULL)
+        return -1;
+
+    // what the flash under it reads back as once erased
+    return fill_internal(bml, 0xff, BLOCK_COPY_ALL, 1);
 }
 
 int cmd_bml_erase_partition(const char *partition, const char *filesystem)
@@ -185,11 +210,10 @@ int format_rfs_device (const char *device, const char *path) {
         sectorsize = "1";
     } 
 
-    // dump 10KB of zeros to partition before format due to fat.format bug
+    // dump 40KB of zeros to partition before format due to fat.format bug
     char cmd[PATH_MAX];
 
-    sprintf(cmd, "/sbin/dd if=/dev/zero of=%s bs=4096 count=10", device);
-    if(__system(cmd)) {
+    if (fill_internal(device, 0, 10 * 4096, 0)) {
         printf("failure while zeroing rfs partition.\n");
         return -1;
     }
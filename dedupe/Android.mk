@@ -22,3 +22,11 @@ LOCAL_UNSTRIPPED_PATH := $(PRODUCT_OUT)/symbols/utilities
 LOCAL_MODULE_PATH := $(PRODUCT_OUT)/utilities
 LOCAL_FORCE_STATIC_EXECUTABLE := true
 include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES := dedupe.c
+LOCAL_MODULE := libdedupe
+LOCAL_MODULE_TAGS := eng
+LOCAL_CFLAGS += -Dmain=dedupe_main
+LOCAL_C_INCLUDES := external/openssl/include
+include $(BUILD_STATIC_LIBRARY)
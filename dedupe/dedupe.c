@@ -5,29 +5,67 @@
 #include <openssl/ripemd.h>
 #include <errno.h>
 #include <dirent.h>
+#include <fnmatch.h>
 #include <limits.h>
+#include <stdarg.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include <fcntl.h>
 #include <limits.h>
 
-typedef struct DEDUPE_STORE_CONTEXT {
+#include "dedupe.h"
+
+#define DEDUPE_BUFFER_SIZE (64 * 1024)
+#define SHA256_HEX_LENGTH (SHA256_DIGEST_LENGTH * 2)
+// stores and restores are made durable this often, in bytes of file data
+#define DEDUPE_CHECKPOINT_INTERVAL (64 * 1024 * 1024)
+// the tree changed under a resumed store, it has to start over
+#define DEDUPE_RESTART -2
+
+struct DEDUPE_STORE_CONTEXT {
     char blob_dir[PATH_MAX];
     FILE *output_manifest;
+    const char **excludes;
+    dedupe_callback callback;
+    dedupe_checkpoint_callback checkpoint;
+    void *cookie;
+    // entries walked so far, and how many of them a resumed store
+    // already has in the manifest
+    unsigned long long entries;
+    unsigned long long skip;
+    char skip_name[PATH_MAX];
+    uint64_t bytes;
+    uint64_t next_checkpoint;
+    // of the manifest as it is written
+    MD5_CTX md5;
+    int manifest_error;
+    char buffer[DEDUPE_BUFFER_SIZE];
 };
 
 static void usage(char** argv) {
-    fprintf(stderr, "usage: %s c input_directory blob_dir output_manifest\n", argv[0]);
-    fprintf(stderr, "usage: %s x input_manifest blob_dir output_directory\n", argv[0]);
+    fprintf(stderr, "usage: %s c input_directory blob_dir output_manifest [exclude...]\n", argv[0]);
+    fprintf(stderr, "usage: %s x input_manifest blob_dir output_directory [pattern...]\n", argv[0]);
+    fprintf(stderr, "usage: %s gc blob_dir manifest...\n", argv[0]);
 }
 
-static int copy_file(const char *dst, const char *src) {
-    char buf[4096];
-    int dstfd, srcfd, bytes_read, bytes_written, total_read = 0;
+static void sha256_to_hex(const unsigned char *sumdata, char *psum) {
+    int j;
+    for (j = 0; j < SHA256_DIGEST_LENGTH; j++)
+        sprintf(&psum[(j*2)], "%02x", (int)sumdata[j]);
+    psum[SHA256_HEX_LENGTH] = '\0';
+}
+
+// Copies src to dst and stores the sha256 of the copied data in rptr.
+static int copy_file(const char *dst, const char *src, char *buf, unsigned char *rptr) {
+    int dstfd, srcfd;
+    ssize_t bytes_read;
+    SHA256_CTX c;
     if (src == NULL)
         return 1;
     if (dst == NULL)
         return 2;
-    
+
     srcfd = open(src, O_RDONLY);
     if (srcfd < 0)
         return 3;
@@ -38,90 +76,152 @@ static int copy_file(const char *dst, const char *src) {
         return 4;
     }
 
-    while (bytes_read = read(srcfd, buf, 4096)) {
-        total_read += bytes_read;
-        if (write(dstfd, buf, bytes_read) != bytes_read)
+    SHA256_Init(&c);
+    while ((bytes_read = read(srcfd, buf, DEDUPE_BUFFER_SIZE)) != 0) {
+        if (bytes_read < 0 && errno == EINTR)
+            continue;
+        if (bytes_read < 0 || write(dstfd, buf, bytes_read) != bytes_read) {
+            close(dstfd);
+            close(srcfd);
             return 5;
+        }
+        SHA256_Update(&c, buf, bytes_read);
     }
+    SHA256_Final(rptr, &c);
 
-    close(dstfd);
     close(srcfd);
-    
+    if (close(dstfd))
+        return 5;
     return 0;
 }
 
-static void do_sha256sum(FILE *mfile, unsigned char *rptr) {
-    char rdata[BUFSIZ];
-    int rsize;
+static int do_sha256sum_file(const char* filename, char *buf, unsigned char *rptr) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Unable to open file: %s\n", filename);
+        return 1;
+    }
     SHA256_CTX c;
-    
     SHA256_Init(&c);
-    while(!feof(mfile)) {
-        rsize = fread(rdata, sizeof(char), BUFSIZ, mfile);
-        if(rsize > 0) {
-            SHA256_Update(&c, rdata, rsize);
+    ssize_t rsize;
+    while ((rsize = read(fd, buf, DEDUPE_BUFFER_SIZE)) != 0) {
+        if (rsize < 0 && errno == EINTR)
+            continue;
+        if (rsize < 0) {
+            fprintf(stderr, "Error reading file: %s\n", filename);
+            close(fd);
+            return 1;
         }
+        SHA256_Update(&c, buf, rsize);
     }
-
     SHA256_Final(rptr, &c);
+    close(fd);
+    return 0;
 }
 
-static int do_sha256sum_file(const char* filename, unsigned char *rptr) {
-    FILE *f = fopen(filename, "rb");
-    if (f == NULL) {
-        fprintf(stderr, "Unable to open file: %s\n", filename);
-        return 1;
+static int store_st(struct DEDUPE_STORE_CONTEXT *context, struct stat st, const char* path, const char* name);
+
+// Every manifest line goes through here, so the manifest is hashed as
+// it is written.
+static void print_manifest(struct DEDUPE_STORE_CONTEXT *context, const char *format, ...) {
+    char line[PATH_MAX + 128];
+    char *text = line;
+    va_list ap;
+    va_start(ap, format);
+    int len = vsnprintf(line, sizeof(line), format, ap);
+    va_end(ap);
+    if (len >= (int)sizeof(line)) {
+        text = malloc(len + 1);
+        if (text == NULL) {
+            context->manifest_error = 1;
+            return;
+        }
+        va_start(ap, format);
+        vsnprintf(text, len + 1, format, ap);
+        va_end(ap);
     }
-    do_sha256sum(f, rptr);
-    fclose(f);
-    return 0;
+    if (len > 0) {
+        MD5_Update(&context->md5, text, len);
+        fwrite(text, 1, len, context->output_manifest);
+    }
+    if (text != line)
+        free(text);
 }
 
-static int store_st(struct DEDUPE_STORE_CONTEXT *context, struct stat st, const char* s);
-
-void print_stat(struct DEDUPE_STORE_CONTEXT *context, char type, struct stat st, const char *f) {
-    fprintf(context->output_manifest, "%c\t%o\t%d\t%d\t%s\t", type, st.st_mode & (S_IRWXU | S_IRWXG | S_IRWXO | S_ISUID | S_ISGID), st.st_uid, st.st_gid, f);
+static void print_stat(struct DEDUPE_STORE_CONTEXT *context, char type, struct stat st, const char *f) {
+    print_manifest(context, "%c\t%o\t%d\t%d\t%s\t", type, st.st_mode & (S_IRWXU | S_IRWXG | S_IRWXO | S_ISUID | S_ISGID), st.st_uid, st.st_gid, f);
 }
 
-static int store_file(struct DEDUPE_STORE_CONTEXT *context, struct stat st, const char* f) {
-    printf("%s\n", f);
+static int store_file(struct DEDUPE_STORE_CONTEXT *context, struct stat st, const char* path) {
     unsigned char sumdata[SHA256_DIGEST_LENGTH];
     int ret;
-    if (ret = do_sha256sum_file(f, sumdata)) {
-        fprintf(stderr, "Error calculating sha256sum of %s\n", f);
-        return ret; 
+    if (ret = do_sha256sum_file(path, context->buffer, sumdata)) {
+        fprintf(stderr, "Error calculating sha256sum of %s\n", path);
+        return ret;
     }
     char psum[128];
-    int j;
-    for (j = 0; j < SHA256_DIGEST_LENGTH; j++)
-        sprintf(&psum[(j*2)], "%02x", (int)sumdata[j]);
-    psum[(SHA256_DIGEST_LENGTH * 2)] = '\0';
+    sha256_to_hex(sumdata, psum);
 
+    // the blob store is shared by all backups, most files of a new
+    // backup are already in it.
     char out_blob[PATH_MAX];
+    struct stat blob_st;
     sprintf(out_blob, "%s/%s", context->blob_dir, psum);
-    if (ret = copy_file(out_blob, f)) {
-        fprintf(stderr, "Error copying blob %s\n", f);
-        return ret;
+    if (lstat(out_blob, &blob_st) != 0 || blob_st.st_size != st.st_size) {
+        // copy to a temporary name first, so an interrupted backup never
+        // leaves a truncated blob behind.  The file may have changed since
+        // it was hashed, name the blob after what was actually copied.
+        char tmp_blob[PATH_MAX];
+        sprintf(tmp_blob, "%s/%s.tmp", context->blob_dir, psum);
+        if (ret = copy_file(tmp_blob, path, context->buffer, sumdata)) {
+            fprintf(stderr, "Error copying blob %s\n", path);
+            unlink(tmp_blob);
+            return ret;
+        }
+        sha256_to_hex(sumdata, psum);
+        sprintf(out_blob, "%s/%s", context->blob_dir, psum);
+        if (rename(tmp_blob, out_blob)) {
+            fprintf(stderr, "Error storing blob %s\n", out_blob);
+            unlink(tmp_blob);
+            return 6;
+        }
+    }
+
+    print_manifest(context, "%s\t%lld\t\n", psum, (long long)st.st_size);
+    return 0;
+}
+
+static int is_excluded(struct DEDUPE_STORE_CONTEXT *context, const char *name) {
+    const char **exclude;
+    if (context->excludes == NULL)
+        return 0;
+    // names are "./relative/path"
+    if (strncmp(name, "./", 2) == 0)
+        name += 2;
+    for (exclude = context->excludes; *exclude != NULL; exclude++) {
+        if (strcmp(name, *exclude) == 0)
+            return 1;
     }
-    
-    fprintf(context->output_manifest, "%s\t%d\t\n", psum, st.st_size);
     return 0;
 }
 
-static int store_dir(struct DEDUPE_STORE_CONTEXT *context, struct stat st, const char* d) {
-    printf("%s\n", d);
+static int store_dir(struct DEDUPE_STORE_CONTEXT *context, struct stat st, const char* d, const char* name) {
     DIR *dp = opendir(d);
-    if (d == NULL) {
+    if (dp == NULL) {
         fprintf(stderr, "Error opening directory: %s\n", d);
         return 1;
     }
     struct dirent *ep;
     char full_path[PATH_MAX];
+    char child_name[PATH_MAX];
     while (ep = readdir(dp)) {
         if (strcmp(ep->d_name, ".") == 0)
             continue;
         if (strcmp(ep->d_name, "..") == 0)
             continue;
+        sprintf(child_name, "%s/%s", name, ep->d_name);
+        if (is_excluded(context, child_name))
+            continue;
         struct stat cst;
         int ret;
         sprintf(full_path, "%s/%s", d, ep->d_name);
@@ -130,198 +230,470 @@ static int store_dir(struct DEDUPE_STORE_CONTEXT *context, struct stat st, const
             closedir(dp);
             return ret;
         }
-        
-        if (ret = store_st(context, cst, full_path))
+
+        if (ret = store_st(context, cst, full_path, child_name)) {
+            closedir(dp);
             return ret;
+        }
     }
     closedir(dp);
     return 0;
 }
 
 static int store_link(struct DEDUPE_STORE_CONTEXT *context, struct stat st, const char* l) {
-    printf("%s\n", l);
     char link[PATH_MAX];
-    int ret = readlink(l, link, PATH_MAX);
+    int ret = readlink(l, link, PATH_MAX - 1);
     if (ret < 0) {
         fprintf(stderr, "Error reading symlink\n");
         return errno;
     }
     link[ret] = '\0';
-    fprintf(context->output_manifest, "%s\t\n", link);
+    print_manifest(context, "%s\t\n", link);
     return 0;
 }
 
-static int store_st(struct DEDUPE_STORE_CONTEXT *context, struct stat st, const char* s) {
+// Manifest lines and blobs written so far are synced, and the caller
+// learns how to pick up from the entry named name.
+static int store_checkpoint(struct DEDUPE_STORE_CONTEXT *context, const char* name) {
+    // the checkpoint is a line of text
+    if (strchr(name, '\n') != NULL)
+        return 0;
+    if (fflush(context->output_manifest))
+        return 1;
+    sync();
+    char checkpoint[PATH_MAX + 64];
+    snprintf(checkpoint, sizeof(checkpoint), "s %llu %lld %s", context->entries,
+             (long long)ftello(context->output_manifest), name);
+    context->checkpoint(checkpoint, context->cookie);
+    context->next_checkpoint = context->bytes + DEDUPE_CHECKPOINT_INTERVAL;
+    return 0;
+}
+
+static int store_st(struct DEDUPE_STORE_CONTEXT *context, struct stat st, const char* path, const char* name) {
+    if (context->entries < context->skip) {
+        // already in the manifest of the interrupted store
+        context->entries++;
+        if (context->callback != NULL)
+            context->callback(NULL, S_ISREG(st.st_mode) ? st.st_size : 0, context->cookie);
+        if (S_ISDIR(st.st_mode))
+            return store_dir(context, st, path, name);
+        return 0;
+    }
+    if (context->skip > 0 && context->entries == context->skip && strcmp(name, context->skip_name) != 0)
+        return DEDUPE_RESTART;
+    if (context->checkpoint != NULL && context->bytes >= context->next_checkpoint) {
+        int ret;
+        if (ret = store_checkpoint(context, name))
+            return ret;
+    }
+    context->entries++;
+    if (S_ISREG(st.st_mode))
+        context->bytes += st.st_size;
+
+    if (context->callback != NULL)
+        context->callback(name, S_ISREG(st.st_mode) ? st.st_size : 0, context->cookie);
     if (S_ISREG(st.st_mode)) {
-        print_stat(context, 'f', st, s);
-        return store_file(context, st, s);
+        print_stat(context, 'f', st, name);
+        return store_file(context, st, path);
     }
     else if (S_ISDIR(st.st_mode)) {
-        print_stat(context, 'd', st, s);
-        fprintf(context->output_manifest, "\n");
-        return store_dir(context, st, s);
+        print_stat(context, 'd', st, name);
+        print_manifest(context, "\n");
+        return store_dir(context, st, path, name);
     }
     else if (S_ISLNK(st.st_mode)) {
-        print_stat(context, 'l', st, s);
-        return store_link(context, st, s);
+        print_stat(context, 'l', st, name);
+        return store_link(context, st, path);
     }
     else {
-        fprintf(stderr, "Skipping special: %s\n", s);
+        fprintf(stderr, "Skipping special: %s\n", path);
         return 0;
     }
 }
 
-void get_full_path(char *out_path, char *rel_path) {
-    char tmp[PATH_MAX];
-    getcwd(tmp, PATH_MAX);
-    chdir(rel_path);
-    getcwd(out_path, PATH_MAX);
-    chdir(tmp);
+// Hashes what an interrupted store left of the manifest, up to size.
+static int hash_manifest(struct DEDUPE_STORE_CONTEXT *context, const char* manifest, long long size) {
+    int fd = open(manifest, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    while (size > 0) {
+        ssize_t r = read(fd, context->buffer, size < DEDUPE_BUFFER_SIZE ? size : DEDUPE_BUFFER_SIZE);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            break;
+        MD5_Update(&context->md5, context->buffer, r);
+        size -= r;
+    }
+    close(fd);
+    return size == 0 ? 0 : -1;
+}
+
+static int store_tree(const char* directory, const char* blob_dir, const char* manifest,
+                      const char** excludes, unsigned char* md5, const char* resume,
+                      dedupe_checkpoint_callback checkpoint, dedupe_callback callback, void* cookie) {
+    struct stat st;
+    int ret;
+    if (0 != (ret = lstat(directory, &st))) {
+        fprintf(stderr, "Error opening input_file/input_directory.\n");
+        return ret;
+    }
+
+    if (!S_ISDIR(st.st_mode)) {
+        fprintf(stderr, "%s must be a directory.\n", directory);
+        return 1;
+    }
+
+    struct DEDUPE_STORE_CONTEXT *context = malloc(sizeof(struct DEDUPE_STORE_CONTEXT));
+    if (context == NULL)
+        return 1;
+    memset(context, 0, sizeof(*context));
+    if (realpath(blob_dir, context->blob_dir) == NULL) {
+        fprintf(stderr, "Unable to open blob directory %s\n", blob_dir);
+        free(context);
+        return 1;
+    }
+    context->excludes = excludes;
+    context->callback = callback;
+    context->checkpoint = checkpoint;
+    context->cookie = cookie;
+    context->next_checkpoint = DEDUPE_CHECKPOINT_INTERVAL;
+    MD5_Init(&context->md5);
+
+    // "s <entries> <manifest size> <name of the next entry>"
+    long long manifest_size;
+    int consumed;
+    if (resume != NULL &&
+            sscanf(resume, "s %llu %lld %n", &context->skip, &manifest_size, &consumed) == 2 &&
+            strlen(resume + consumed) < sizeof(context->skip_name) &&
+            truncate(manifest, manifest_size) == 0 &&
+            (md5 == NULL || hash_manifest(context, manifest, manifest_size) == 0)) {
+        strcpy(context->skip_name, resume + consumed);
+        context->output_manifest = fopen(manifest, "ab");
+    }
+    else {
+        context->skip = 0;
+        // a resume that fell through may have hashed part of the old one
+        MD5_Init(&context->md5);
+        context->output_manifest = fopen(manifest, "wb");
+    }
+    if (context->output_manifest == NULL) {
+        fprintf(stderr, "Unable to open output file %s\n", manifest);
+        free(context);
+        return 1;
+    }
+
+    ret = store_dir(context, st, directory, ".");
+    if (ret == 0 && context->entries < context->skip)
+        ret = DEDUPE_RESTART;
+    if ((fclose(context->output_manifest) || context->manifest_error) && ret == 0) {
+        fprintf(stderr, "Error writing %s\n", manifest);
+        ret = 1;
+    }
+    if (md5 != NULL)
+        MD5_Final(md5, &context->md5);
+    free(context);
+    return ret;
+}
+
+int dedupe_store(const char* directory, const char* blob_dir, const char* manifest,
+                 const char** excludes, dedupe_callback callback, void* cookie) {
+    return store_tree(directory, blob_dir, manifest, excludes, NULL, NULL, NULL, callback, cookie);
+}
+
+int dedupe_store_resume(const char* directory, const char* blob_dir, const char* manifest,
+                        const char** excludes, unsigned char* md5, const char* resume,
+                        dedupe_checkpoint_callback checkpoint, dedupe_callback callback, void* cookie) {
+    int ret = store_tree(directory, blob_dir, manifest, excludes, md5, resume, checkpoint, callback, cookie);
+    if (ret == DEDUPE_RESTART) {
+        // the blobs that were stored are found again, only the walk and
+        // the hashing are repeated
+        fprintf(stderr, "%s changed since the checkpoint, starting over\n", directory);
+        ret = store_tree(directory, blob_dir, manifest, excludes, md5, NULL, checkpoint, callback, cookie);
+    }
+    return ret;
 }
 
 static char* tokenize(char *out, const char* line, const char sep) {
+    if (line == NULL)
+        return NULL;
     while (*line != sep) {
         if (*line == '\0') {
             return NULL;
         }
-        
+
         *out = *line;
         out++;
         line++;
     }
-    
+
     *out = '\0';
     // resume at the next char
     return ++line;
 }
 
-static int dec_to_oct(int dec) {
-    int ret = 0;
-    int mult = 1;
-    while (dec != 0) {
-        int rem = dec % 10;
-        ret += (rem * mult);
-        dec /= 10;
-        mult *= 8;
-    }
-    
-    return ret;
+// Manifest entries are selected if a pattern matches their name (without
+// the leading "./") or the name of a directory they are in.
+static int is_selected(const char** patterns, const char* name) {
+    if (patterns == NULL)
+        return 1;
+    char tmp[PATH_MAX];
+    strncpy(tmp, strncmp(name, "./", 2) == 0 ? name + 2 : name, sizeof(tmp) - 1);
+    tmp[sizeof(tmp) - 1] = '\0';
+    for (;;) {
+        const char** pattern;
+        for (pattern = patterns; *pattern != NULL; pattern++) {
+            if (fnmatch(*pattern, tmp, 0) == 0)
+                return 1;
+        }
+        char* slash = strrchr(tmp, '/');
+        if (slash == NULL)
+            return 0;
+        *slash = '\0';
+    }
 }
 
-int main(int argc, char** argv) {
-    if (argc != 5) {
-        usage(argv);
+static int restore_manifest(const char* manifest, const char* blob_dir, const char* directory,
+                            const char** patterns, const char* resume, dedupe_checkpoint_callback checkpoint,
+                            dedupe_callback callback, void* cookie) {
+    FILE *input_manifest = fopen(manifest, "rb");
+    if (input_manifest == NULL) {
+        fprintf(stderr, "Unable to open input manifest %s\n", manifest);
         return 1;
     }
 
-    if (strcmp(argv[1], "c") == 0) {
-        struct stat st;
-        int ret;
-        if (0 != (ret = lstat(argv[2], &st))) {
-            fprintf(stderr, "Error opening input_file/input_directory.\n");
-            return ret;
+    // "r <manifest offset>", everything before it is restored.  Entries
+    // are complete when their line is done, nothing is left for later.
+    long long offset;
+    if (resume != NULL && (sscanf(resume, "r %lld", &offset) != 1 || fseeko(input_manifest, offset, SEEK_SET))) {
+        fprintf(stderr, "Can't resume %s from %s\n", manifest, resume);
+        fclose(input_manifest);
+        return 1;
+    }
+    uint64_t bytes = 0;
+    uint64_t next_checkpoint = DEDUPE_CHECKPOINT_INTERVAL;
+
+    char *buf = malloc(DEDUPE_BUFFER_SIZE);
+    if (buf == NULL) {
+        fclose(input_manifest);
+        return 1;
+    }
+
+    int ret = 0;
+    char line[PATH_MAX * 2];
+    for (;;) {
+        if (checkpoint != NULL && bytes >= next_checkpoint) {
+            sync();
+            char str[64];
+            snprintf(str, sizeof(str), "r %lld", (long long)ftello(input_manifest));
+            checkpoint(str, cookie);
+            next_checkpoint = bytes + DEDUPE_CHECKPOINT_INTERVAL;
         }
-        
-        if (!S_ISDIR(st.st_mode)) {
-            fprintf(stderr, "%s must be a directory.\n", argv[2]);
-            return 1;
+        if (fgets(line, sizeof(line), input_manifest) == NULL)
+            break;
+        char type[4];
+        char mode[8];
+        char uid[32];
+        char gid[32];
+        char name[PATH_MAX];
+        char filename[PATH_MAX];
+
+        char *token = line;
+        token = tokenize(type, token, '\t');
+        token = tokenize(mode, token, '\t');
+        token = tokenize(uid, token, '\t');
+        token = tokenize(gid, token, '\t');
+        token = tokenize(name, token, '\t');
+        if (token == NULL) {
+            fprintf(stderr, "Corrupt manifest line: %s\n", line);
+            ret = 1;
+            break;
         }
-        
-        char blob_dir[PATH_MAX];
-        struct DEDUPE_STORE_CONTEXT context;
-        context.output_manifest = fopen(argv[4], "wb");
-        if (context.output_manifest == NULL) {
-            fprintf(stderr, "Unable to open output file %s\n", argv[4]);
-            return 1;
+
+        if (!is_selected(patterns, name))
+            continue;
+
+        // names are relative to the stored directory, "./..."
+        sprintf(filename, "%s/%s", directory, strncmp(name, "./", 2) == 0 ? name + 2 : name);
+        int mode_oct = strtol(mode, NULL, 8);
+        int uid_int = atoi(uid);
+        int gid_int = atoi(gid);
+        if (callback != NULL && strcmp(type, "f") != 0)
+            callback(name, 0, cookie);
+        if (strcmp(type, "f") == 0) {
+            char sha256[128];
+            token = tokenize(sha256, token, '\t');
+            if (token == NULL || strlen(sha256) != SHA256_HEX_LENGTH) {
+                fprintf(stderr, "Corrupt manifest line: %s\n", line);
+                ret = 1;
+                break;
+            }
+
+            char blob_file[PATH_MAX];
+            unsigned char sumdata[SHA256_DIGEST_LENGTH];
+            char psum[128];
+            sprintf(blob_file, "%s/%s", blob_dir, sha256);
+            struct stat bst;
+            uint64_t size = stat(blob_file, &bst) == 0 ? bst.st_size : 0;
+            bytes += size;
+            if (callback != NULL)
+                callback(name, size, cookie);
+            unlink(filename);
+            if (ret = copy_file(filename, blob_file, buf, sumdata)) {
+                fprintf(stderr, "Unable to copy file %s\n", filename);
+                break;
+            }
+            // blobs are named after their contents, check them for free
+            // while they are copied.
+            sha256_to_hex(sumdata, psum);
+            if (strcmp(psum, sha256) != 0) {
+                fprintf(stderr, "Corrupt blob %s\n", blob_file);
+                ret = 1;
+                break;
+            }
+
+            chown(filename, uid_int, gid_int);
+            chmod(filename, mode_oct);
         }
-        get_full_path(context.blob_dir, argv[3]);
-        chdir(argv[2]);
-        
-        return store_dir(&context, st, ".");
-    }
-    else if (strcmp(argv[1], "x") == 0) {
-        FILE *input_manifest = fopen(argv[2], "rb");
-        if (input_manifest == NULL) {
-            fprintf(stderr, "Unable to open input manifest %s\n", argv[2]);
-            return 1;
+        else if (strcmp(type, "l") == 0) {
+            char link[PATH_MAX];
+            token = tokenize(link, token, '\t');
+            if (token == NULL) {
+                fprintf(stderr, "Corrupt manifest line: %s\n", line);
+                ret = 1;
+                break;
+            }
+
+            unlink(filename);
+            symlink(link, filename);
+
+            // Android has no lchmod, and chmod follows symlinks
+            //chmod(filename, mode_oct);
+            lchown(filename, uid_int, gid_int);
         }
+        else if (strcmp(type, "d") == 0) {
+            mkdir(filename, mode_oct);
 
-        char blob_dir[PATH_MAX];
-        char *output_dir = argv[4];
-        get_full_path(blob_dir, argv[3]);
-    
-        printf("%s\n" , output_dir);
-        chdir(output_dir);
-        
-        char line[PATH_MAX];
-        while (fgets(line, PATH_MAX, input_manifest)) {
-            //printf("%s", line);
-            
-            char type[4];
-            char mode[8];
-            char uid[32];
-            char gid[32];
-            char filename[PATH_MAX];
-            
+            chown(filename, uid_int, gid_int);
+            chmod(filename, mode_oct);
+        }
+        else {
+            fprintf(stderr, "Unknown type %s\n", type);
+            ret = 1;
+            break;
+        }
+    }
+
+    free(buf);
+    fclose(input_manifest);
+    return ret;
+}
+
+int dedupe_restore(const char* manifest, const char* blob_dir, const char* directory,
+                   dedupe_callback callback, void* cookie) {
+    return restore_manifest(manifest, blob_dir, directory, NULL, NULL, NULL, callback, cookie);
+}
+
+int dedupe_restore_resume(const char* manifest, const char* blob_dir, const char* directory,
+                          const char* resume, dedupe_checkpoint_callback checkpoint,
+                          dedupe_callback callback, void* cookie) {
+    return restore_manifest(manifest, blob_dir, directory, NULL, resume, checkpoint, callback, cookie);
+}
+
+int dedupe_restore_paths(const char* manifest, const char* blob_dir, const char* directory,
+                         const char** patterns, dedupe_callback callback, void* cookie) {
+    return restore_manifest(manifest, blob_dir, directory, patterns, NULL, NULL, callback, cookie);
+}
+
+static int compare_sums(const void *a, const void *b) {
+    return memcmp(a, b, SHA256_HEX_LENGTH);
+}
+
+int dedupe_gc(const char* blob_dir, const char** manifests) {
+    char (*sums)[SHA256_HEX_LENGTH + 1] = NULL;
+    int count = 0;
+    int alloc = 0;
+    const char **manifest;
+    char line[PATH_MAX * 2];
+
+    for (manifest = manifests; *manifest != NULL; manifest++) {
+        FILE *f = fopen(*manifest, "rb");
+        if (f == NULL) {
+            fprintf(stderr, "Unable to open manifest %s, not collecting garbage\n", *manifest);
+            free(sums);
+            return 1;
+        }
+        while (fgets(line, sizeof(line), f)) {
+            char field[PATH_MAX];
             char *token = line;
-            token = tokenize(type, token, '\t');
-            token = tokenize(mode, token, '\t');
-            token = tokenize(uid, token, '\t');
-            token = tokenize(gid, token, '\t');
-            token = tokenize(filename, token, '\t');
-            
-            int mode_oct = dec_to_oct(atoi(mode));
-            int uid_int = atoi(uid);
-            int gid_int = atoi(gid);
-            int ret;
-            printf("%s\t%s\t%s\t%s\t%s\t", type, mode, uid, gid, filename);
-            if (strcmp(type, "f") == 0) {
-                char sha256[128];
-                token = tokenize(sha256, token, '\t');
-                char sizeStr[32];
-                token = tokenize(sizeStr, token, '\t');
-                int size = atoi(sizeStr);
-                printf("%s\t%d\n", sha256, size);
-                
-                char blob_file[PATH_MAX];
-                sprintf(blob_file, "%s/%s", blob_dir, sha256);
-                if (ret = copy_file(filename, blob_file)) {
-                    fprintf(stderr, "Unable to copy file %s\n", filename);
-                    fclose(input_manifest);
-                    return ret;
+            int i;
+            if (line[0] != 'f')
+                continue;
+            // type, mode, uid, gid, name, sha256
+            for (i = 0; i < 6 && token != NULL; i++)
+                token = tokenize(field, token, '\t');
+            if (token == NULL || strlen(field) != SHA256_HEX_LENGTH)
+                continue;
+            if (count == alloc) {
+                alloc = alloc ? alloc * 2 : 1024;
+                void *grown = realloc(sums, alloc * sizeof(*sums));
+                if (grown == NULL) {
+                    fclose(f);
+                    free(sums);
+                    return 1;
                 }
-                
-                chmod(filename, mode_oct);
-                chown(filename, uid_int, gid_int);
-            }
-            else if (strcmp(type, "l") == 0) {
-                char link[41];
-                token = tokenize(link, token, '\t');
-                printf("%s\n", link);
-                
-                symlink(link, filename);
-
-                // Android has no lchmod, and chmod follows symlinks
-                //chmod(filename, mode_oct);
-                lchown(filename, uid_int, gid_int);
+                sums = grown;
             }
-            else if (strcmp(type, "d") == 0) {
-                printf("\n");
+            strcpy(sums[count++], field);
+        }
+        fclose(f);
+    }
+    if (count > 0)
+        qsort(sums, count, sizeof(*sums), compare_sums);
 
-                mkdir(filename, mode_oct);
+    DIR *dp = opendir(blob_dir);
+    if (dp == NULL) {
+        fprintf(stderr, "Error opening directory: %s\n", blob_dir);
+        free(sums);
+        return 1;
+    }
+    int removed = 0;
+    struct dirent *ep;
+    char blob_file[PATH_MAX];
+    while (ep = readdir(dp)) {
+        if (ep->d_name[0] == '.')
+            continue;
+        if (strlen(ep->d_name) == SHA256_HEX_LENGTH && count > 0 &&
+                bsearch(ep->d_name, sums, count, sizeof(*sums), compare_sums) != NULL)
+            continue;
+        sprintf(blob_file, "%s/%s", blob_dir, ep->d_name);
+        if (unlink(blob_file) == 0)
+            removed++;
+    }
+    closedir(dp);
+    free(sums);
+    printf("Removed %d unused blobs.\n", removed);
+    return 0;
+}
 
-                chmod(filename, mode_oct);
-                chown(filename, uid_int, gid_int);
-            }
-            else {
-                fprintf(stderr, "Unknown type %s\n", type);
-                fclose(input_manifest);
-                return 1;
-            }
-        }
-        
-        fclose(input_manifest);
-        return 0;
+static void print_name(const char* name, uint64_t bytes, void* cookie) {
+    printf("%s\n", name);
+}
+
+int main(int argc, char** argv) {
+    if (argc >= 5 && strcmp(argv[1], "c") == 0) {
+        const char **excludes = NULL;
+        if (argc > 5)
+            excludes = (const char**)argv + 5;
+        return dedupe_store(argv[2], argv[3], argv[4], excludes, print_name, NULL);
+    }
+    else if (argc >= 5 && strcmp(argv[1], "x") == 0) {
+        if (argc > 5)
+            return dedupe_restore_paths(argv[2], argv[3], argv[4], (const char**)argv + 5, print_name, NULL);
+        return dedupe_restore(argv[2], argv[3], argv[4], print_name, NULL);
+    }
+    else if (argc >= 3 && strcmp(argv[1], "gc") == 0) {
+        return dedupe_gc(argv[2], (const char**)argv + 3);
     }
     else {
         usage(argv);
@@ -0,0 +1,61 @@
+#ifndef DEDUPE_H_
+#define DEDUPE_H_
+
+#include <stdint.h>
+
+// Called with the manifest name (eg. "./app/Foo.apk") of every entry
+// stored or restored, and the size of its data (0 unless it is a file).
+// Entries a resumed store already has are reported with a NULL name.
+typedef void (*dedupe_callback)(const char* name, uint64_t bytes, void* cookie);
+
+// Called every 64MB of file data with a line of text telling how to
+// resume the store or restore from there, once what came before is
+// synced to disk.
+typedef void (*dedupe_checkpoint_callback)(const char* checkpoint, void* cookie);
+
+// Stores the contents of directory in blob_dir, one blob per distinct
+// file named after its sha256, and writes the tree to manifest.  Blobs
+// that are already in blob_dir are not written again, so blob_dir can
+// be shared by any number of backups.
+//
+// excludes is an optional NULL terminated list of paths relative to
+// directory (eg. "media") that are skipped with everything below them.
+// Returns 0 on success.
+int dedupe_store(const char* directory, const char* blob_dir, const char* manifest,
+                 const char** excludes, dedupe_callback callback, void* cookie);
+
+// Like dedupe_store, but if resume is not NULL the manifest an
+// interrupted store left behind is cut back to that checkpoint and the
+// store goes on from there.  If the tree no longer matches the
+// manifest, it starts over; the blobs already stored are reused.  If md5
+// is not NULL, it is filled in with the md5 sum of the manifest as it is
+// written, so it needn't be read again.
+int dedupe_store_resume(const char* directory, const char* blob_dir, const char* manifest,
+                        const char** excludes, unsigned char* md5, const char* resume,
+                        dedupe_checkpoint_callback checkpoint, dedupe_callback callback, void* cookie);
+
+// Rebuilds the tree described by manifest below directory.  The sha256
+// of every blob is checked as it is copied.  Returns 0 on success.
+int dedupe_restore(const char* manifest, const char* blob_dir, const char* directory,
+                   dedupe_callback callback, void* cookie);
+
+// Like dedupe_restore, but if resume is not NULL the entries before
+// that checkpoint are taken to be restored already.
+int dedupe_restore_resume(const char* manifest, const char* blob_dir, const char* directory,
+                          const char* resume, dedupe_checkpoint_callback checkpoint,
+                          dedupe_callback callback, void* cookie);
+
+// Like dedupe_restore, but only restores the entries selected by
+// patterns, a NULL terminated list of fnmatch(3) patterns for names
+// relative to directory (eg. "data/com.foo" or "*.db").  Selecting a
+// directory selects everything below it.  Only the manifest is read
+// in full, it is the index of the backup.
+int dedupe_restore_paths(const char* manifest, const char* blob_dir, const char* directory,
+                         const char** patterns, dedupe_callback callback, void* cookie);
+
+// Deletes the blobs in blob_dir that none of the NULL terminated list
+// of manifests refers to, along with leftovers of interrupted stores.
+// Nothing is deleted if a manifest can't be read.  Returns 0 on success.
+int dedupe_gc(const char* blob_dir, const char** manifests);
+
+#endif
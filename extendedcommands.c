@@ -335,6 +335,21 @@ void show_choose_zip_menu(const char *mount_point)
         install_zip(file);
 }
 
+// Offers to finish the restore that was interrupted in backup_path, if
+// any.  Returns 1 if it was resumed.  Declining throws the journal away,
+// so the restore that follows starts from the beginning.
+static int resume_interrupted_restore(const char* backup_path)
+{
+    if (!nandroid_has_interrupted_restore(backup_path))
+        return 0;
+    if (confirm_selection("Resume interrupted restore?", "Yes - Resume restore")) {
+        nandroid_resume(backup_path);
+        return 1;
+    }
+    nandroid_discard_journal(backup_path);
+    return 0;
+}
+
 void show_nandroid_restore_menu(const char* path)
 {
     if (ensure_path_mounted(path) != 0) {
@@ -352,6 +367,8 @@ void show_nandroid_restore_menu(const char* path)
     char* file = choose_file_menu(tmp, NULL, headers);
     if (file == NULL)
         return;
+    if (resume_interrupted_restore(file))
+        return;
 
     if (confirm_selection("Confirm restore?", "Yes - Restore"))
         nandroid_restore(file, 1, 1, 1, 1, 1, 0);
@@ -746,6 +763,98 @@ void show_partition_menu()
 
 }
 
+// Browses the files in the backup of dir's partition, returns the
+// file or folder to restore, or NULL.
+static char* choose_backup_file_menu(const char* backup_path, const char* dir)
+{
+    static char* headers[] = {  "Choose files to restore",
+                                "",
+                                NULL
+    };
+
+    char** children = nandroid_list_backup_dir(backup_path, dir);
+    if (children == NULL)
+        return NULL;
+
+    int count = 0;
+    while (children[count] != NULL)
+        count++;
+    char** list = (char**) malloc((count + 2) * sizeof(char*));
+    list[0] = strdup("** restore this folder **");
+    int i;
+    for (i = 0; i < count; i++)
+        list[i + 1] = strdup(children[i]);
+    list[count + 1] = NULL;
+
+    static char ret[PATH_MAX];
+    char* return_value = NULL;
+    for (;;)
+    {
+        int chosen_item = get_menu_selection(headers, list, 0, 0);
+        if (chosen_item == GO_BACK)
+            break;
+        if (chosen_item == 0)
+        {
+            strcpy(ret, dir);
+            return_value = ret;
+            break;
+        }
+        char path[PATH_MAX];
+        char* child = children[chosen_item - 1];
+        sprintf(path, "%s/%s", dir, child);
+        int len = strlen(path);
+        if (path[len - 1] == '/')
+        {
+            path[len - 1] = '\0';
+            char* subret = choose_backup_file_menu(backup_path, path);
+            if (subret != NULL)
+            {
+                return_value = subret;
+                break;
+            }
+            continue;
+        }
+        strcpy(ret, path);
+        return_value = ret;
+        break;
+    }
+    free_string_array(list);
+    free_string_array(children);
+    return return_value;
+}
+
+static void show_nandroid_restore_files_menu(const char* backup_path)
+{
+    static char* headers[] = {  "Restore files from",
+                                "",
+                                NULL
+    };
+
+    static char* list[] = { "system",
+                            "data",
+                            "cache",
+                            "sd-ext",
+                            NULL
+    };
+
+    int chosen_item = get_menu_selection(headers, list, 0, 0);
+    if (chosen_item == GO_BACK)
+        return;
+    char dir[PATH_MAX];
+    sprintf(dir, "/%s", list[chosen_item]);
+    char* path = choose_backup_file_menu(backup_path, dir);
+    if (path == NULL)
+        return;
+
+    char confirm[PATH_MAX];
+    snprintf(confirm, sizeof(confirm), "Yes - Restore %s", path);
+    if (confirm_selection("Confirm restore?", confirm))
+    {
+        const char* paths[] = { path, NULL };
+        nandroid_restore_paths(backup_path, paths);
+    }
+}
+
 void show_nandroid_advanced_restore_menu(const char* path)
 {
     if (ensure_path_mounted(path) != 0) {
@@ -767,6 +876,8 @@ void show_nandroid_advanced_restore_menu(const char* path)
     char* file = choose_file_menu(tmp, NULL, advancedheaders);
     if (file == NULL)
         return;
+    if (resume_interrupted_restore(file))
+        return;
 
     static char* headers[] = {  "Nandroid Advanced Restore",
                                 "",
@@ -778,13 +889,14 @@ void show_nandroid_advanced_restore_menu(const char* path)
                             "Restore data",
                             "Restore cache",
                             "Restore sd-ext",
+                            "Restore files...",
                             "Restore wimax",
                             NULL
     };
     
     if (0 != get_partition_device("wimax", tmp)) {
         // disable wimax restore option
-        list[5] = NULL;
+        list[6] = NULL;
     }
 
     static char* confirm_restore  = "Confirm restore?";
@@ -813,12 +925,32 @@ void show_nandroid_advanced_restore_menu(const char* path)
                 nandroid_restore(file, 0, 0, 0, 0, 1, 0);
             break;
         case 5:
+            show_nandroid_restore_files_menu(file);
+            break;
+        case 6:
             if (confirm_selection(confirm_restore, "Yes - Restore wimax"))
                 nandroid_restore(file, 0, 0, 0, 0, 0, 1);
             break;
     }
 }
 
+// Offers to finish the newest backup on volume that was interrupted, if
+// any.  Returns 1 if it was resumed.
+static int resume_interrupted_backup(const char* volume)
+{
+    char backup_dir[PATH_MAX];
+    char backup_path[PATH_MAX];
+    if (ensure_path_mounted(volume) != 0)
+        return 0;
+    sprintf(backup_dir, "%s/clockworkmod/backup", volume);
+    if (nandroid_find_interrupted_backup(backup_dir, backup_path) != 0)
+        return 0;
+    if (!confirm_selection("Resume interrupted backup?", "Yes - Resume backup"))
+        return 0;
+    nandroid_backup(backup_path);
+    return 1;
+}
+
 void show_nandroid_menu()
 {
     static char* headers[] = {  "Nandroid",
@@ -829,6 +961,7 @@ void show_nandroid_menu()
     static char* list[] = { "backup",
                             "restore",
                             "advanced restore",
+                            "free unused backup data",
                             "backup to internal sdcard",
                             "restore from internal sdcard",
                             "advanced restore from internal sdcard",
@@ -836,7 +969,7 @@ void show_nandroid_menu()
     };
 
     if (volume_for_path("/emmc") == NULL)
-        list[3] = NULL;
+        list[4] = NULL;
 
     int chosen_item = get_menu_selection(headers, list, 0, 0);
     switch (chosen_item)
@@ -844,6 +977,8 @@ void show_nandroid_menu()
         case 0:
             {
                 char backup_path[PATH_MAX];
+                if (resume_interrupted_backup("/sdcard"))
+                    break;
                 time_t t = time(NULL);
                 struct tm *tmp = localtime(&t);
                 if (tmp == NULL)
@@ -866,8 +1001,19 @@ void show_nandroid_menu()
             show_nandroid_advanced_restore_menu("/sdcard");
             break;
         case 3:
+            if (ensure_path_mounted("/sdcard") != 0) {
+                ui_print("Can't mount /sdcard\n");
+                break;
+            }
+            nandroid_dedupe_gc("/sdcard/clockworkmod/blobs");
+            if (volume_for_path("/emmc") != NULL && ensure_path_mounted("/emmc") == 0)
+                nandroid_dedupe_gc("/emmc/clockworkmod/blobs");
+            break;
+        case 4:
             {
                 char backup_path[PATH_MAX];
+                if (resume_interrupted_backup("/emmc"))
+                    break;
                 time_t t = time(NULL);
                 struct tm *tmp = localtime(&t);
                 if (tmp == NULL)
@@ -883,10 +1029,10 @@ void show_nandroid_menu()
                 nandroid_backup(backup_path);
             }
             break;
-        case 4:
+        case 5:
             show_nandroid_restore_menu("/emmc");
             break;
-        case 5:
+        case 6:
             show_nandroid_advanced_restore_menu("/emmc");
             break;
     }
@@ -143,12 +143,26 @@ int main(int argc, char **argv) {
 
 int main(int argc, char **argv)
 {
+    // -f: erase ahead and verify once at the end, instead of every block
+    // -c: only write what differs from the partition (eMMC)
+    int flags = 0;
+    while (argc > 3 && argv[1][0] == '-') {
+        if (strcmp(argv[1], "-f") == 0)
+            flags |= RESTORE_RAW_FAST;
+        else if (strcmp(argv[1], "-c") == 0)
+            flags |= RESTORE_RAW_SKIP_UNCHANGED;
+        else
+            break;
+        argc--;
+        argv++;
+    }
+
     if (argc != 3) {
-        fprintf(stderr, "usage: %s partition file.img\n", argv[0]);
+        fprintf(stderr, "usage: %s [-f] [-c] partition file.img\n", argv[0]);
         return 2;
     }
 
-    int ret = restore_raw_partition(NULL, argv[1], argv[2]);
+    int ret = restore_raw_partition_flags(NULL, argv[1], argv[2], flags);
     if (ret != 0)
         fprintf(stderr, "failed with error: %d\n", ret);
     return ret;
@@ -1,10 +1,19 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <signal.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <sys/ioctl.h>
 #include <sys/wait.h>
 #include <stdio.h>
 
+#include "blockcopy/block_copy.h"
 #include "flashutils/flashutils.h"
+#include "flashutils/sparse_image.h"
+#include "mmcutils/mmcutils.h"
+#include "mtdutils/mtdutils.h"
 
 #ifndef BOARD_BML_BOOT
 #define BOARD_BML_BOOT              "/dev/block/bml7"
@@ -14,6 +23,10 @@
 #define BOARD_BML_RECOVERY          "/dev/block/bml8"
 #endif
 
+#define BML_UNLOCK_ALL              0x8A29
+
+#define SPARSE_BACKUP_BUFFER_SIZE   (1024 * 1024)
+
 int the_flash_type = UNKNOWN;
 
 int device_flash_type()
@@ -65,30 +78,267 @@ static int detect_partition(const char *partitionType, const char *partition)
     return type;
 }
 int restore_raw_partition(const char* partitionType, const char *partition, const char *filename)
+{
+    return restore_raw_partition_flags(partitionType, partition, filename, 0);
+}
+
+// Sparse images are expanded straight onto the partition.  Don't care
+// chunks are skipped on block devices; on MTD they are left erased,
+// which is all writing a block of 0xff does there.
+typedef struct {
+    int fd;
+    MtdWriteContext* mtd;
+} sparse_restore;
+
+static int sparse_restore_write(void* cookie, const char* data, size_t len)
+{
+    sparse_restore* restore = (sparse_restore*) cookie;
+    if (restore->mtd != NULL)
+        return mtd_write_data(restore->mtd, data, len) == (ssize_t) len ? 0 : -1;
+    while (len > 0) {
+        ssize_t w = write(restore->fd, data, len);
+        if (w < 0 && errno == EINTR)
+            continue;
+        if (w <= 0)
+            return -1;
+        data += w;
+        len -= w;
+    }
+    return 0;
+}
+
+static int sparse_restore_skip(void* cookie, uint64_t len)
+{
+    sparse_restore* restore = (sparse_restore*) cookie;
+    char erased[4096];
+    memset(erased, 0xff, sizeof(erased));
+    while (len > 0) {
+        size_t n = len < sizeof(erased) ? len : sizeof(erased);
+        if (sparse_restore_write(restore, erased, n))
+            return -1;
+        len -= n;
+    }
+    return 0;
+}
+
+// Returns -2 if the image was written but didn't verify, like
+// cmd_mtd_restore_raw_partition_flags does inside.
+static int restore_sparse_mtd(const char* partition, const char* filename, int mtd_flags)
+{
+    const MtdPartition* p;
+    if (mtd_scan_partitions() <= 0 || (p = mtd_find_partition_by_name(partition)) == NULL) {
+        printf("can't find %s partition\n", partition);
+        return -1;
+    }
+    sparse_restore restore;
+    restore.fd = -1;
+    restore.mtd = mtd_write_partition_flags(p, mtd_flags | MTD_WRITE_DEFER_FIRST_BLOCK);
+    if (restore.mtd == NULL) {
+        printf("error writing %s\n", partition);
+        return -1;
+    }
+    printf("flashing %s from sparse image %s\n", partition, filename);
+    // not closed: that would write the header over half an image
+    if (sparse_image_read(filename, sparse_restore_write, sparse_restore_skip, &restore)) {
+        mtd_write_abort(restore.mtd);
+        return -1;
+    }
+    return mtd_write_close(restore.mtd) ? -2 : 0;
+}
+
+// Block devices take the raw chunks through block_copy, which can skip
+// what the device already holds.  Progress is across every pass over the
+// image, BML recovery writes boot first.
+typedef struct {
+    int fd;
+    int copy_flags;
+    restore_progress_fn progress;
+    void* cookie;
+    int pass;
+    int passes;
+    uint64_t done;          // before the current chunk
+    uint64_t total;
+} sparse_device_restore;
+
+static void sparse_device_progress(void* cookie, uint64_t done, uint64_t total)
+{
+    sparse_device_restore* restore = (sparse_device_restore*) cookie;
+    // done and total are the chunk's
+    restore->progress(restore->cookie, restore->done + done, restore->total);
+}
+
+static int sparse_device_chunk(void* cookie, int fd, const sparse_chunk* chunk)
+{
+    sparse_device_restore* restore = (sparse_device_restore*) cookie;
+    block_copy_progress_fn progress = restore->progress != NULL ? sparse_device_progress : NULL;
+    const unsigned char* bytes = (const unsigned char*) &chunk->fill;
+    int ret;
+    if (chunk->offset == 0)
+        restore->done = chunk->image_size * restore->pass;
+    restore->total = chunk->image_size * restore->passes;
+    switch (chunk->type) {
+        case SPARSE_CHUNK_RAW:
+            ret = block_copy_with_progress(fd, restore->fd, chunk->len, restore->copy_flags,
+                    progress, restore);
+            break;
+        case SPARSE_CHUNK_FILL:
+            if (bytes[0] == bytes[1] && bytes[0] == bytes[2] && bytes[0] == bytes[3]) {
+                ret = block_copy_fill(restore->fd, bytes[0], chunk->len, restore->copy_flags,
+                        progress, restore);
+                break;
+            }
+            {
+                // a pattern block_copy_fill can't write
+                sparse_restore plain;
+                uint32_t pattern[1024];
+                uint64_t left = chunk->len;
+                size_t i;
+                plain.fd = restore->fd;
+                plain.mtd = NULL;
+                for (i = 0; i < sizeof(pattern) / sizeof(pattern[0]); i++)
+                    pattern[i] = chunk->fill;
+                ret = 0;
+                while (ret == 0 && left > 0) {
+                    size_t n = left < sizeof(pattern) ? left : sizeof(pattern);
+                    ret = sparse_restore_write(&plain, (const char*) pattern, n);
+                    left -= n;
+                }
+            }
+            break;
+        default:
+            ret = lseek64(restore->fd, chunk->len, SEEK_CUR) < 0 ? -1 : 0;
+            break;
+    }
+    restore->done += chunk->len;
+    if (ret == 0 && restore->progress != NULL)
+        restore->progress(restore->cookie, restore->done, restore->total);
+    return ret;
+}
+
+static int restore_sparse_device(const char* device, const char* filename, int bml,
+        sparse_device_restore* restore)
+{
+    restore->fd = open(device, O_RDWR | O_LARGEFILE);
+    if (restore->fd < 0) {
+        printf("error opening %s\n", device);
+        return -1;
+    }
+    int ret = -1;
+    if (bml && ioctl(restore->fd, BML_UNLOCK_ALL, 0))
+        printf("error unlocking %s\n", device);
+    else
+        ret = sparse_image_read_chunks(filename, sparse_device_chunk, restore);
+    if (fsync(restore->fd))
+        ret = -1;
+    if (close(restore->fd))
+        ret = -1;
+    restore->pass++;
+    return ret;
+}
+
+static int restore_sparse_partition(int type, const char *partition, const char *filename, int flags,
+        restore_progress_fn progress, void* cookie)
+{
+    char device[PATH_MAX];
+    int ret;
+    sparse_device_restore restore;
+    memset(&restore, 0, sizeof(restore));
+    restore.progress = progress;
+    restore.cookie = cookie;
+    restore.passes = 1;
+    switch (type) {
+        case MTD: {
+            int mtd_flags = (flags & RESTORE_RAW_FAST) ? MTD_WRITE_FAST : 0;
+            ret = restore_sparse_mtd(partition, filename, mtd_flags);
+            if (ret == -2 && mtd_flags != 0) {
+                printf("\nverify failed, writing %s again block by block\n", partition);
+                ret = restore_sparse_mtd(partition, filename, 0);
+            }
+            return ret < 0 ? -1 : ret;
+        }
+        case MMC:
+            if (partition[0] == '/')
+                strcpy(device, partition);
+            else if (cmd_mmc_get_partition_device(partition, device) != 0)
+                return -1;
+            restore.copy_flags = BLOCK_COPY_DIRECT_OUT;
+            if (flags & RESTORE_RAW_SKIP_UNCHANGED)
+                restore.copy_flags |= BLOCK_COPY_SKIP_SAME;
+            return restore_sparse_device(device, filename, 0, &restore);
+        case BML:
+            // bml only takes whole pages
+            restore.copy_flags = BLOCK_COPY_PAD | BLOCK_COPY_DIRECT_OUT;
+            if (partition[0] == '/')
+                return restore_sparse_device(partition, filename, 1, &restore);
+            // boot goes with recovery, as in cmd_bml_restore_raw_partition
+            if (strcmp(partition, "boot") != 0 && strcmp(partition, "recovery") != 0 &&
+                    strcmp(partition, "recoveryonly") != 0)
+                return -1;
+            if (strcmp(partition, "recovery") == 0)
+                restore.passes = 2;
+            if (strcmp(partition, "recoveryonly") != 0 &&
+                    (ret = restore_sparse_device(BOARD_BML_BOOT, filename, 1, &restore)) != 0)
+                return ret;
+            if (strcmp(partition, "boot") == 0)
+                return 0;
+            return restore_sparse_device(BOARD_BML_RECOVERY, filename, 1, &restore);
+        default:
+            return -1;
+    }
+}
+
+int restore_raw_partition_flags(const char* partitionType, const char *partition, const char *filename, int flags)
+{
+    return restore_raw_partition_progress(partitionType, partition, filename, flags, NULL, NULL);
+}
+
+int restore_raw_partition_progress(const char* partitionType, const char *partition, const char *filename, int flags,
+        restore_progress_fn progress, void* cookie)
 {
     int type = detect_partition(partitionType, partition);
+    if (is_sparse_image(filename))
+        return restore_sparse_partition(type, partition, filename, flags, progress, cookie);
     switch (type) {
         case MTD:
-            return cmd_mtd_restore_raw_partition(partition, filename);
+            return cmd_mtd_restore_raw_partition_flags(partition, filename,
+                    (flags & RESTORE_RAW_FAST) ? MTD_WRITE_FAST : 0);
         case MMC:
-            return cmd_mmc_restore_raw_partition(partition, filename);
+            return cmd_mmc_restore_raw_partition_flags(partition, filename,
+                    (flags & RESTORE_RAW_SKIP_UNCHANGED) ? MMC_RESTORE_SKIP_UNCHANGED : 0);
         case BML:
-            return cmd_bml_restore_raw_partition(partition, filename);
+            return cmd_bml_restore_raw_partition_progress(partition, filename, progress, cookie);
         default:
             return -1;
     }
 }
 
+static int backup_sparse_partition(const char* partitionType, const char *partition, const char *filename);
+
 int backup_raw_partition(const char* partitionType, const char *partition, const char *filename)
 {
+    return backup_raw_partition_flags(partitionType, partition, filename, 0);
+}
+
+int backup_raw_partition_flags(const char* partitionType, const char *partition, const char *filename, int flags)
+{
+    return backup_raw_partition_data(partitionType, partition, filename, flags, NULL, NULL);
+}
+
+int backup_raw_partition_data(const char* partitionType, const char *partition, const char *filename, int flags,
+        backup_data_fn data, void* cookie)
+{
+    // the headers are filled in at the end, so stdout stays raw
+    if ((flags & BACKUP_RAW_SPARSE) && strcmp(filename, "-") != 0)
+        return backup_sparse_partition(partitionType, partition, filename);
+
     int type = detect_partition(partitionType, partition);
     switch (type) {
         case MTD:
-            return cmd_mtd_backup_raw_partition(partition, filename);
+            return cmd_mtd_backup_raw_partition_data(partition, filename, data, cookie);
         case MMC:
-            return cmd_mmc_backup_raw_partition(partition, filename);
+            return cmd_mmc_backup_raw_partition_data(partition, filename, data, cookie);
         case BML:
-            return cmd_bml_backup_raw_partition(partition, filename);
+            return cmd_bml_backup_raw_partition_data(partition, filename, data, cookie);
         default:
             printf("unable to detect device type");
             return -1;
@@ -154,3 +404,161 @@ int get_partition_device(const char *partition, char *device)
             return -1;
     }
 }
+
+struct raw_partition_reader {
+    int fd;
+    MtdReadContext* mtd;
+    size_t erase_size;
+    int eof;
+};
+
+raw_partition_reader* open_raw_partition(const char* partitionType, const char* partition)
+{
+    raw_partition_reader* reader = calloc(1, sizeof(raw_partition_reader));
+    if (reader == NULL)
+        return NULL;
+    reader->fd = -1;
+
+    char device[PATH_MAX];
+    int type = detect_partition(partitionType, partition);
+    switch (type) {
+        case MTD: {
+            // bad blocks are skipped, the same as cmd_mtd_backup_raw_partition
+            const MtdPartition* p;
+            if (mtd_scan_partitions() <= 0 ||
+                    (p = mtd_find_partition_by_name(partition)) == NULL ||
+                    mtd_partition_info(p, NULL, &reader->erase_size, NULL) != 0 ||
+                    (reader->mtd = mtd_read_partition(p)) == NULL) {
+                free(reader);
+                return NULL;
+            }
+            mtd_read_ahead(reader->mtd, MTD_READ_AHEAD_BLOCKS);
+            return reader;
+        }
+        case MMC:
+            if (partition[0] == '/')
+                strcpy(device, partition);
+            else if (cmd_mmc_get_partition_device(partition, device) != 0) {
+                free(reader);
+                return NULL;
+            }
+            break;
+        case BML:
+            if (strcmp(partition, "boot") == 0)
+                strcpy(device, BOARD_BML_BOOT);
+            else if (strcmp(partition, "recovery") == 0)
+                strcpy(device, BOARD_BML_RECOVERY);
+            else if (partition[0] == '/')
+                strcpy(device, partition);
+            else {
+                free(reader);
+                return NULL;
+            }
+            break;
+        default:
+            free(reader);
+            return NULL;
+    }
+
+    reader->fd = open(device, O_RDONLY);
+    if (reader->fd < 0) {
+        free(reader);
+        return NULL;
+    }
+    return reader;
+}
+
+ssize_t read_raw_partition(raw_partition_reader* reader, char* data, size_t len)
+{
+    size_t done = 0;
+    while (done < len && !reader->eof) {
+        ssize_t r;
+        if (reader->mtd != NULL) {
+            // whole erase blocks at a time, mtd_read_data only notices
+            // the end of the partition when it needs another block
+            size_t chunk = len - done < reader->erase_size ? len - done : reader->erase_size;
+            r = mtd_read_data(reader->mtd, data + done, chunk);
+            if (r < 0 && errno == ENOSPC)
+                r = 0;
+        }
+        else {
+            r = read(reader->fd, data + done, len - done);
+            if (r < 0 && errno == EINTR)
+                continue;
+        }
+        if (r < 0)
+            return -1;
+        if (r == 0)
+            reader->eof = 1;
+        done += r;
+    }
+    return done;
+}
+
+void close_raw_partition(raw_partition_reader* reader)
+{
+    if (reader->mtd != NULL)
+        mtd_read_close(reader->mtd);
+    if (reader->fd >= 0)
+        close(reader->fd);
+    free(reader);
+}
+
+// The sparse block size that divides what the reader returns, 0 if no
+// sensible one does.
+static unsigned int sparse_block_size(raw_partition_reader* reader)
+{
+    if (reader->mtd != NULL)
+        return reader->erase_size % 4096 == 0 ? 4096 : reader->erase_size;
+    off64_t size = lseek64(reader->fd, 0, SEEK_END);
+    if (size < 0 || lseek64(reader->fd, 0, SEEK_SET) != 0)
+        return 0;
+    if (size % 4096 == 0)
+        return 4096;
+    return size % 512 == 0 ? 512 : 0;
+}
+
+static int backup_sparse_partition(const char* partitionType, const char *partition, const char *filename)
+{
+    raw_partition_reader* reader = open_raw_partition(partitionType, partition);
+    if (reader == NULL) {
+        printf("error opening %s\n", partition);
+        return -1;
+    }
+    unsigned int block_size = sparse_block_size(reader);
+    if (block_size == 0) {
+        close_raw_partition(reader);
+        return backup_raw_partition(partitionType, partition, filename);
+    }
+
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+        close_raw_partition(reader);
+        printf("error opening %s\n", filename);
+        return -1;
+    }
+    sparse_writer* writer = sparse_writer_open(fd, block_size);
+    // erased MTD blocks are left erased by a restore instead of written
+    if (writer != NULL && reader->mtd != NULL)
+        sparse_writer_set_dont_care(writer, 0xffffffff);
+    char* buffer = malloc(SPARSE_BACKUP_BUFFER_SIZE);
+    int ret = writer != NULL && buffer != NULL ? 0 : -1;
+    ssize_t len = 0;
+    while (ret == 0 && (len = read_raw_partition(reader, buffer, SPARSE_BACKUP_BUFFER_SIZE)) > 0) {
+        if (sparse_writer_write(writer, buffer, len))
+            ret = -1;
+    }
+    if (ret == 0 && len < 0)
+        ret = -1;
+    if (writer != NULL && sparse_writer_close(writer))
+        ret = -1;
+    if (close(fd))
+        ret = -1;
+    free(buffer);
+    close_raw_partition(reader);
+    if (ret != 0) {
+        unlink(filename);
+        printf("error writing %s\n", filename);
+    }
+    return ret;
+}
@@ -1,13 +1,53 @@
 #ifndef FLASHUTILS_H
 #define FLASHUTILS_H
 
+#include <stdint.h>
+#include <sys/types.h>
+
+// Sparse images (see sparse_image.h) are expanded onto the partition,
+// skipping what they don't care about.
 int restore_raw_partition(const char* partitionType, const char *partition, const char *filename);
+
+// With RESTORE_RAW_FAST, MTD partitions are erased ahead of the writes and
+// read back in one pass at the end instead of block by block.  If that
+// finds a bad write, the image is written again the slow way.
+#define RESTORE_RAW_FAST 1
+// With RESTORE_RAW_SKIP_UNCHANGED, eMMC partitions are compared with the
+// image and only the parts that differ are written and read back.
+#define RESTORE_RAW_SKIP_UNCHANGED 2
+int restore_raw_partition_flags(const char* partitionType, const char *partition, const char *filename, int flags);
+// Called as the image is written with the bytes written so far and in
+// all, 0 if that isn't known.  BML restores and sparse images on eMMC
+// and BML report progress, MTD restores and plain eMMC ones don't call it.
+typedef void (*restore_progress_fn)(void* cookie, uint64_t done, uint64_t total);
+int restore_raw_partition_progress(const char* partitionType, const char *partition, const char *filename, int flags,
+        restore_progress_fn progress, void* cookie);
 int backup_raw_partition(const char* partitionType, const char *partition, const char *filename);
+
+// With BACKUP_RAW_SPARSE, runs of blocks that repeat a 32 bit value, like
+// zeroes, are stored as fill chunks of a sparse image, and erased MTD
+// blocks as don't care chunks.  Images written to stdout stay raw.
+#define BACKUP_RAW_SPARSE 1
+int backup_raw_partition_flags(const char* partitionType, const char *partition, const char *filename, int flags);
+// Called with the image in order as it is written, eg. to hash it on the
+// way instead of reading it back.  Sparse images aren't handed over,
+// their headers are filled in after the data.
+typedef void (*backup_data_fn)(void* cookie, const char* data, size_t len);
+int backup_raw_partition_data(const char* partitionType, const char *partition, const char *filename, int flags,
+        backup_data_fn data, void* cookie);
 int erase_raw_partition(const char* partitionType, const char *partition);
 int erase_partition(const char *partition, const char *filesystem);
 int mount_partition(const char *partition, const char *mount_point, const char *filesystem, int read_only);
 int get_partition_device(const char *partition, char *device);
 
+// Streams the contents of a raw partition, exactly as backup_raw_partition
+// would store them, for callers that want to look at the data first.
+// Reads are short only at the end of the partition.
+typedef struct raw_partition_reader raw_partition_reader;
+raw_partition_reader* open_raw_partition(const char* partitionType, const char* partition);
+ssize_t read_raw_partition(raw_partition_reader* reader, char* data, size_t len);
+void close_raw_partition(raw_partition_reader* reader);
+
 #define FLASH_MTD 0
 #define FLASH_MMC 1
 #define FLASH_BML 2
@@ -16,21 +56,31 @@ int is_mtd_device();
 char* get_default_filesystem();
 
 extern int cmd_mtd_restore_raw_partition(const char *partition, const char *filename);
+extern int cmd_mtd_restore_raw_partition_flags(const char *partition, const char *filename, int flags);
 extern int cmd_mtd_backup_raw_partition(const char *partition, const char *filename);
+extern int cmd_mtd_backup_raw_partition_data(const char *partition, const char *filename,
+        backup_data_fn data, void* cookie);
 extern int cmd_mtd_erase_raw_partition(const char *partition);
 extern int cmd_mtd_erase_partition(const char *partition, const char *filesystem);
 extern int cmd_mtd_mount_partition(const char *partition, const char *mount_point, const char *filesystem, int read_only);
 extern int cmd_mtd_get_partition_device(const char *partition, char *device);
 
 extern int cmd_mmc_restore_raw_partition(const char *partition, const char *filename);
+extern int cmd_mmc_restore_raw_partition_flags(const char *partition, const char *filename, int flags);
 extern int cmd_mmc_backup_raw_partition(const char *partition, const char *filename);
+extern int cmd_mmc_backup_raw_partition_data(const char *partition, const char *filename,
+        backup_data_fn data, void* cookie);
 extern int cmd_mmc_erase_raw_partition(const char *partition);
 extern int cmd_mmc_erase_partition(const char *partition, const char *filesystem);
 extern int cmd_mmc_mount_partition(const char *partition, const char *mount_point, const char *filesystem, int read_only);
 extern int cmd_mmc_get_partition_device(const char *partition, char *device);
 
 extern int cmd_bml_restore_raw_partition(const char *partition, const char *filename);
+extern int cmd_bml_restore_raw_partition_progress(const char *partition, const char *filename,
+        restore_progress_fn progress, void* cookie);
 extern int cmd_bml_backup_raw_partition(const char *partition, const char *filename);
+extern int cmd_bml_backup_raw_partition_data(const char *partition, const char *filename,
+        backup_data_fn data, void* cookie);
 extern int cmd_bml_erase_raw_partition(const char *partition);
 extern int cmd_bml_erase_partition(const char *partition, const char *filesystem);
 extern int cmd_bml_mount_partition(const char *partition, const char *mount_point, const char *filesystem, int read_only);
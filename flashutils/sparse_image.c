@@ -0,0 +1,361 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "sparse_image.h"
+
+// raw chunks are split so their size still fits total_sz
+#define SPARSE_MAX_RAW_BYTES    (64 * 1024 * 1024)
+#define SPARSE_IO_SIZE          (1024 * 1024)
+
+struct sparse_writer {
+    int fd;
+    unsigned int block_size;
+    off64_t base;           // where the image starts in the file
+    off64_t offset;         // where the next chunk goes
+    uint32_t total_blks;
+    uint32_t total_chunks;
+    int error;
+    int has_dont_care;
+    uint32_t dont_care;
+
+    // the chunk being written, its header is filled in when it ends
+    uint16_t type;          // 0 if there is none
+    uint32_t fill;
+    uint32_t blocks;
+    off64_t chunk_offset;
+};
+
+static int write_all(int fd, const void* data, size_t len)
+{
+    const char* p = (const char*) data;
+    while (len > 0) {
+        ssize_t w = write(fd, p, len);
+        if (w < 0 && errno == EINTR)
+            continue;
+        if (w <= 0)
+            return -1;
+        p += w;
+        len -= w;
+    }
+    return 0;
+}
+
+static int read_all(int fd, void* data, size_t len)
+{
+    char* p = (char*) data;
+    while (len > 0) {
+        ssize_t r = read(fd, p, len);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return -1;
+        p += r;
+        len -= r;
+    }
+    return 0;
+}
+
+sparse_writer* sparse_writer_open(int fd, unsigned int block_size)
+{
+    if (block_size == 0 || block_size % 4 != 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    sparse_writer* writer = calloc(1, sizeof(sparse_writer));
+    if (writer == NULL)
+        return NULL;
+    writer->fd = fd;
+    writer->block_size = block_size;
+    writer->base = lseek64(fd, 0, SEEK_CUR);
+    sparse_header header;
+    memset(&header, 0, sizeof(header));
+    // the real header goes in at close
+    if (writer->base < 0 || write_all(fd, &header, sizeof(header))) {
+        free(writer);
+        return NULL;
+    }
+    writer->offset = writer->base + sizeof(header);
+    return writer;
+}
+
+void sparse_writer_set_dont_care(sparse_writer* writer, uint32_t fill)
+{
+    writer->has_dont_care = 1;
+    writer->dont_care = fill;
+}
+
+static void end_chunk(sparse_writer* writer)
+{
+    if (writer->type == 0)
+        return;
+    sparse_chunk_header chunk;
+    chunk.chunk_type = writer->type;
+    chunk.reserved1 = 0;
+    chunk.chunk_sz = writer->blocks;
+    chunk.total_sz = sizeof(chunk);
+    if (writer->type == SPARSE_CHUNK_RAW)
+        chunk.total_sz += writer->blocks * writer->block_size;
+    else if (writer->type == SPARSE_CHUNK_FILL)
+        chunk.total_sz += sizeof(uint32_t);
+    if (pwrite64(writer->fd, &chunk, sizeof(chunk), writer->chunk_offset) != sizeof(chunk))
+        writer->error = 1;
+    writer->total_blks += writer->blocks;
+    writer->total_chunks++;
+    writer->type = 0;
+}
+
+static void start_chunk(sparse_writer* writer, uint16_t type, uint32_t fill)
+{
+    end_chunk(writer);
+    sparse_chunk_header chunk;
+    memset(&chunk, 0, sizeof(chunk));
+    writer->type = type;
+    writer->fill = fill;
+    writer->blocks = 0;
+    writer->chunk_offset = writer->offset;
+    if (write_all(writer->fd, &chunk, sizeof(chunk)))
+        writer->error = 1;
+    writer->offset += sizeof(chunk);
+    if (type == SPARSE_CHUNK_FILL) {
+        if (write_all(writer->fd, &fill, sizeof(fill)))
+            writer->error = 1;
+        writer->offset += sizeof(fill);
+    }
+}
+
+// Flushes the raw blocks collected by sparse_writer_write.
+static void write_raw(sparse_writer* writer, const char* data, size_t len)
+{
+    if (len == 0)
+        return;
+    if (write_all(writer->fd, data, len))
+        writer->error = 1;
+    writer->offset += len;
+}
+
+int sparse_writer_write(sparse_writer* writer, const char* data, size_t len)
+{
+    unsigned int size = writer->block_size;
+    if (len % size != 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    const char* raw = data;
+    size_t raw_len = 0;
+    size_t done;
+    for (done = 0; done < len && !writer->error; done += size) {
+        const char* block = data + done;
+        // a block that repeats its first word overlaps itself shifted by it
+        if (memcmp(block, block + sizeof(uint32_t), size - sizeof(uint32_t)) == 0) {
+            uint32_t fill;
+            memcpy(&fill, block, sizeof(fill));
+            uint16_t type = writer->has_dont_care && fill == writer->dont_care ?
+                    SPARSE_CHUNK_DONT_CARE : SPARSE_CHUNK_FILL;
+            write_raw(writer, raw, raw_len);
+            raw_len = 0;
+            if (writer->type != type || writer->fill != fill)
+                start_chunk(writer, type, fill);
+        }
+        else {
+            if (writer->type != SPARSE_CHUNK_RAW ||
+                    (writer->blocks + 1) * (uint64_t) size > SPARSE_MAX_RAW_BYTES) {
+                write_raw(writer, raw, raw_len);
+                raw_len = 0;
+                start_chunk(writer, SPARSE_CHUNK_RAW, 0);
+            }
+            if (raw_len == 0)
+                raw = block;
+            raw_len += size;
+        }
+        writer->blocks++;
+    }
+    write_raw(writer, raw, raw_len);
+    return writer->error ? -1 : 0;
+}
+
+int sparse_writer_close(sparse_writer* writer)
+{
+    end_chunk(writer);
+    sparse_header header;
+    header.magic = SPARSE_HEADER_MAGIC;
+    header.major_version = SPARSE_MAJOR_VERSION;
+    header.minor_version = 0;
+    header.file_hdr_sz = sizeof(sparse_header);
+    header.chunk_hdr_sz = sizeof(sparse_chunk_header);
+    header.blk_sz = writer->block_size;
+    header.total_blks = writer->total_blks;
+    header.total_chunks = writer->total_chunks;
+    header.image_checksum = 0;
+    if (pwrite64(writer->fd, &header, sizeof(header), writer->base) != sizeof(header))
+        writer->error = 1;
+    int ret = writer->error ? -1 : 0;
+    free(writer);
+    return ret;
+}
+
+int is_sparse_image(const char* filename)
+{
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return 0;
+    uint32_t magic = 0;
+    int ret = read_all(fd, &magic, sizeof(magic)) == 0 && magic == SPARSE_HEADER_MAGIC;
+    close(fd);
+    return ret;
+}
+
+// Skips what a newer version of the format put after a header.
+static int skip_bytes(int fd, size_t len)
+{
+    return len == 0 || lseek64(fd, len, SEEK_CUR) >= 0 ? 0 : -1;
+}
+
+int sparse_image_read_chunks(const char* filename, sparse_chunk_fn chunk_fn, void* cookie)
+{
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        printf("error opening %s\n", filename);
+        return -1;
+    }
+
+    sparse_header header;
+    if (read_all(fd, &header, sizeof(header)) ||
+            header.magic != SPARSE_HEADER_MAGIC ||
+            header.major_version != SPARSE_MAJOR_VERSION ||
+            header.file_hdr_sz < sizeof(sparse_header) ||
+            header.chunk_hdr_sz < sizeof(sparse_chunk_header) ||
+            header.blk_sz == 0 || header.blk_sz % 4 != 0 ||
+            skip_bytes(fd, header.file_hdr_sz - sizeof(sparse_header))) {
+        printf("%s is not a sparse image\n", filename);
+        close(fd);
+        return -1;
+    }
+
+    sparse_chunk c;
+    memset(&c, 0, sizeof(c));
+    c.image_size = (uint64_t) header.total_blks * header.blk_sz;
+    c.block_size = header.blk_sz;
+    int ret = 0;
+    uint32_t blocks = 0;
+    uint32_t i;
+    for (i = 0; ret == 0 && i < header.total_chunks; i++) {
+        sparse_chunk_header chunk;
+        if (read_all(fd, &chunk, sizeof(chunk)) ||
+                skip_bytes(fd, header.chunk_hdr_sz - sizeof(sparse_chunk_header))) {
+            ret = -1;
+            break;
+        }
+        c.type = chunk.chunk_type;
+        c.len = (uint64_t) chunk.chunk_sz * header.blk_sz;
+        c.fill = 0;
+        uint64_t data_sz = chunk.total_sz - header.chunk_hdr_sz;
+        off64_t data_pos;
+        switch (chunk.chunk_type) {
+            case SPARSE_CHUNK_RAW:
+                data_pos = lseek64(fd, 0, SEEK_CUR);
+                if (data_sz != c.len || data_pos < 0 || chunk_fn(cookie, fd, &c) ||
+                        lseek64(fd, data_pos + data_sz, SEEK_SET) < 0)
+                    ret = -1;
+                break;
+            case SPARSE_CHUNK_FILL:
+                if (data_sz != sizeof(c.fill) || read_all(fd, &c.fill, sizeof(c.fill)) ||
+                        chunk_fn(cookie, fd, &c))
+                    ret = -1;
+                break;
+            case SPARSE_CHUNK_DONT_CARE:
+                if (data_sz != 0 || chunk_fn(cookie, fd, &c))
+                    ret = -1;
+                break;
+            case SPARSE_CHUNK_CRC32:
+                // nothing checks it, nothing writes it
+                if (skip_bytes(fd, data_sz))
+                    ret = -1;
+                break;
+            default:
+                ret = -1;
+                break;
+        }
+        if (chunk.chunk_type != SPARSE_CHUNK_CRC32) {
+            blocks += chunk.chunk_sz;
+            c.offset += c.len;
+        }
+    }
+    if (ret == 0 && blocks != header.total_blks)
+        ret = -1;
+    if (ret != 0)
+        printf("error expanding sparse image %s\n", filename);
+
+    close(fd);
+    return ret;
+}
+
+typedef struct {
+    sparse_write_fn write_fn;
+    sparse_skip_fn skip_fn;
+    void* cookie;
+    char* buffer;
+    size_t buffer_size;
+} sparse_expand;
+
+// Writes len bytes of the buffer, repeated.
+static int expand_buffer(sparse_expand* e, uint64_t len)
+{
+    while (len > 0) {
+        size_t n = len < e->buffer_size ? len : e->buffer_size;
+        if (e->write_fn(e->cookie, e->buffer, n))
+            return -1;
+        len -= n;
+    }
+    return 0;
+}
+
+static int expand_chunk(void* cookie, int fd, const sparse_chunk* chunk)
+{
+    sparse_expand* e = (sparse_expand*) cookie;
+    uint64_t len = chunk->len;
+    size_t j;
+    if (e->buffer == NULL) {
+        // whole blocks, so the writes stay block aligned
+        e->buffer_size = chunk->block_size < SPARSE_IO_SIZE ?
+                SPARSE_IO_SIZE / chunk->block_size * chunk->block_size : chunk->block_size;
+        e->buffer = malloc(e->buffer_size);
+        if (e->buffer == NULL)
+            return -1;
+    }
+    switch (chunk->type) {
+        case SPARSE_CHUNK_RAW:
+            while (len > 0) {
+                size_t n = len < e->buffer_size ? len : e->buffer_size;
+                if (read_all(fd, e->buffer, n) || e->write_fn(e->cookie, e->buffer, n))
+                    return -1;
+                len -= n;
+            }
+            return 0;
+        case SPARSE_CHUNK_FILL:
+            for (j = 0; j < e->buffer_size; j += sizeof(chunk->fill))
+                memcpy(e->buffer + j, &chunk->fill, sizeof(chunk->fill));
+            return expand_buffer(e, len);
+        default:
+            if (e->skip_fn != NULL)
+                return e->skip_fn(e->cookie, len);
+            memset(e->buffer, 0, e->buffer_size);
+            return expand_buffer(e, len);
+    }
+}
+
+int sparse_image_read(const char* filename, sparse_write_fn write_fn, sparse_skip_fn skip_fn, void* cookie)
+{
+    sparse_expand e;
+    e.write_fn = write_fn;
+    e.skip_fn = skip_fn;
+    e.cookie = cookie;
+    e.buffer = NULL;
+    e.buffer_size = 0;
+    int ret = sparse_image_read_chunks(filename, expand_chunk, &e);
+    free(e.buffer);
+    return ret;
+}
@@ -0,0 +1,78 @@
+#ifndef SPARSE_IMAGE_H
+#define SPARSE_IMAGE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+// Android's sparse image format, the one make_ext4fs -s writes and
+// fastboot and simg2img read: a header, then chunks that each cover a
+// run of blocks with raw data, a repeated 32 bit value or nothing at all.
+#define SPARSE_HEADER_MAGIC     0xed26ff3a
+#define SPARSE_MAJOR_VERSION    1
+
+#define SPARSE_CHUNK_RAW        0xCAC1
+#define SPARSE_CHUNK_FILL       0xCAC2
+#define SPARSE_CHUNK_DONT_CARE  0xCAC3
+#define SPARSE_CHUNK_CRC32      0xCAC4
+
+typedef struct {
+    uint32_t magic;
+    uint16_t major_version;
+    uint16_t minor_version;
+    uint16_t file_hdr_sz;
+    uint16_t chunk_hdr_sz;
+    uint32_t blk_sz;            // bytes, a multiple of 4
+    uint32_t total_blks;        // in the expanded image
+    uint32_t total_chunks;
+    uint32_t image_checksum;
+} sparse_header;
+
+typedef struct {
+    uint16_t chunk_type;
+    uint16_t reserved1;
+    uint32_t chunk_sz;          // blocks in the expanded image
+    uint32_t total_sz;          // bytes in the file, header included
+} sparse_chunk_header;
+
+// Writes a sparse image to fd, which must be a regular file: the headers
+// are filled in once the chunks they cover are written.  Runs of blocks
+// that repeat a 32 bit value, like erased flash or zeroes, become fill
+// chunks and everything else raw chunks.
+typedef struct sparse_writer sparse_writer;
+sparse_writer* sparse_writer_open(int fd, unsigned int block_size);
+// Runs of blocks repeating fill become don't care chunks instead, for a
+// value the partition reads as without being written, eg. 0xffffffff on
+// MTD where a restore leaves the blocks erased.
+void sparse_writer_set_dont_care(sparse_writer* writer, uint32_t fill);
+// len must be a multiple of the block size.
+int sparse_writer_write(sparse_writer* writer, const char* data, size_t len);
+// Finishes the image and frees the writer, but leaves fd open.  Returns 0
+// if every write made it.
+int sparse_writer_close(sparse_writer* writer);
+
+// Returns 1 if filename starts with a sparse image header.
+int is_sparse_image(const char* filename);
+
+// Expands a sparse image in order: raw and fill chunks are passed to
+// write_fn, don't care chunks to skip_fn, which may be NULL to write
+// zeroes instead.  Both return 0 on success.  Returns 0 if the whole
+// image was read and taken.
+typedef int (*sparse_write_fn)(void* cookie, const char* data, size_t len);
+typedef int (*sparse_skip_fn)(void* cookie, uint64_t len);
+int sparse_image_read(const char* filename, sparse_write_fn write_fn, sparse_skip_fn skip_fn, void* cookie);
+
+// The same a chunk at a time, for callers that copy raw chunks straight
+// from the file.  For raw chunks fd is at their data, which chunk_fn may
+// read; the next chunk is found either way.
+typedef struct {
+    uint16_t type;          // SPARSE_CHUNK_RAW, _FILL or _DONT_CARE
+    uint32_t fill;
+    uint64_t offset;        // in the expanded image
+    uint64_t len;
+    uint64_t image_size;    // of the whole expanded image
+    uint32_t block_size;    // len and offset are multiples of it
+} sparse_chunk;
+typedef int (*sparse_chunk_fn)(void* cookie, int fd, const sparse_chunk* chunk);
+int sparse_image_read_chunks(const char* filename, sparse_chunk_fn chunk_fn, void* cookie);
+
+#endif
@@ -12,6 +12,7 @@ LOCAL_SRC_FILES := \
 	mmcutils.c
 
 LOCAL_MODULE := libmmcutils
+LOCAL_C_INCLUDES += bootable/recovery
 LOCAL_MODULE_TAGS := eng
 
 include $(BUILD_STATIC_LIBRARY)
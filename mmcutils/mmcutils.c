@@ -27,10 +27,14 @@
  * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <assert.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
 #include <string.h>
 #include <errno.h>
 #include <sys/types.h>
@@ -40,6 +44,8 @@
 #include <sys/mount.h>  // for _IOW, _IOR, mount()
 
 #include "mmcutils.h"
+#include "blockcopy/block_copy.h"
+#include "topology/topology.h"
 
 unsigned ext3_count = 0;
 char *ext3_partitions[] = {"system", "userdata", "cache", "NONE"};
@@ -61,12 +67,16 @@ typedef struct {
     MmcPartition *partitions;
     int partitions_allocd;
     int partition_count;
+    /* the TOPOLOGY_MMC generation the table was read at */
+    unsigned generation;
+    topology_index name_index;
 } MmcState;
 
 static MmcState g_mmc_state = {
     NULL,   // partitions
     0,      // partitions_allocd
-    -1      // partition_count
+    -1,     // partition_count
+    0       // generation
 };
 
 #define MMC_DEVICENAME "/dev/block/mmcblk0"
@@ -228,11 +238,182 @@ ERROR2:
     return ret;
 }
 
+/* Linux filesystem data and Microsoft basic data, as GUIDs are stored */
+static const unsigned char gpt_linux_data[16] = {
+    0xAF, 0x3D, 0xC6, 0x0F, 0x83, 0x84, 0x72, 0x47,
+    0x8E, 0x79, 0x3D, 0x69, 0xD8, 0x47, 0x7D, 0xE4
+};
+static const unsigned char gpt_basic_data[16] = {
+    0xA2, 0xA0, 0xD0, 0xEB, 0xE5, 0xB9, 0x33, 0x44,
+    0x87, 0xC0, 0x68, 0xB6, 0xB7, 0x26, 0x99, 0xC7
+};
+static const unsigned char gpt_unused[16];
+
+static unsigned
+gpt_crc32 (const unsigned char *data, size_t len) {
+    unsigned crc = 0xFFFFFFFF;
+    int i;
+    while (len--) {
+        crc ^= *data++;
+        for (i = 0; i < 8; i++)
+            crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+    }
+    return ~crc;
+}
+
+static uint64_t
+gpt_get_lba (const unsigned char *x) {
+    return GET_LWORD_FROM_BYTE(x) | (uint64_t)GET_LWORD_FROM_BYTE(x + 4) << 32;
+}
+
+/* Checks the header read from lba, with its crc. */
+static int
+gpt_header_valid (unsigned char *header, uint64_t lba) {
+    unsigned size = GET_LWORD_FROM_BYTE(&header[GPT_OFFSET_HEADER_SIZE]);
+    unsigned crc = GET_LWORD_FROM_BYTE(&header[GPT_OFFSET_HEADER_CRC]);
+    int valid;
+
+    if (memcmp(header, GPT_SIGNATURE, 8) != 0 ||
+        size < GPT_HEADER_SIZE_MIN || size > BLOCK_SIZE)
+        return 0;
+    /* the crc is computed with its own field zeroed */
+    PUT_LWORD_TO_BYTE(&header[GPT_OFFSET_HEADER_CRC], 0);
+    valid = gpt_crc32(header, size) == crc;
+    PUT_LWORD_TO_BYTE(&header[GPT_OFFSET_HEADER_CRC], crc);
+    return valid && gpt_get_lba(&header[GPT_OFFSET_CURRENT_LBA]) == lba;
+}
+
+/* Returns the number of partitions found, -1 on errors, or -2 if the
+ * device has no protective MBR and is not GPT at all. */
+static int
+mmc_read_gpt (const char *device, MmcPartition *gpt) {
+    unsigned char buffer[2 * BLOCK_SIZE];
+    unsigned char *header = &buffer[BLOCK_SIZE];
+    unsigned char *entries = NULL;
+    unsigned entry_count, entry_size, i, j;
+    int mmc_partition_count = 0;
+    int fd, ret = -1;
+
+    fd = open(device, O_RDONLY);
+    if (fd < 0)
+    {
+        printf("Can't open device: \"%s\"\n", device);
+        return -1;
+    }
+    /* the MBR and the primary header in one read */
+    if (pread(fd, buffer, sizeof(buffer), 0) != sizeof(buffer))
+    {
+        printf("Can't read device: \"%s\"\n", device);
+        goto ERROR;
+    }
+    ret = -2;
+    if (buffer[TABLE_SIGNATURE] != 0x55 || buffer[TABLE_SIGNATURE + 1] != 0xAA)
+        goto ERROR;
+    for (i = 0; i < 4; i++)
+        if (buffer[TABLE_ENTRY_0 + i * TABLE_ENTRY_SIZE + OFFSET_TYPE] == GPT_PROTECTIVE_TYPE)
+            break;
+    if (i == 4)
+        goto ERROR;
+
+    ret = -1;
+    if (!gpt_header_valid(header, 1))
+    {
+        /* the backup header is in the last sector */
+        off64_t end = lseek64(fd, 0, SEEK_END);
+        if (end < 2 * BLOCK_SIZE ||
+            pread64(fd, header, BLOCK_SIZE, end - BLOCK_SIZE) != BLOCK_SIZE ||
+            !gpt_header_valid(header, end / BLOCK_SIZE - 1))
+        {
+            printf("No valid GPT header on %s\n", device);
+            goto ERROR;
+        }
+        printf("Primary GPT header is corrupt, using the backup\n");
+    }
+
+    entry_count = GET_LWORD_FROM_BYTE(&header[GPT_OFFSET_ENTRY_COUNT]);
+    entry_size = GET_LWORD_FROM_BYTE(&header[GPT_OFFSET_ENTRY_SIZE]);
+    if (entry_size < GPT_ENTRY_SIZE_MIN ||
+        (uint64_t)entry_count * entry_size > GPT_ENTRIES_SIZE_MAX)
+        goto ERROR;
+
+    /* the whole entry array in one read */
+    entries = malloc(entry_count * entry_size);
+    if (entries == NULL ||
+        pread64(fd, entries, entry_count * entry_size,
+                gpt_get_lba(&header[GPT_OFFSET_ENTRIES_LBA]) * BLOCK_SIZE) !=
+                (ssize_t)(entry_count * entry_size) ||
+        gpt_crc32(entries, entry_count * entry_size) !=
+                GET_LWORD_FROM_BYTE(&header[GPT_OFFSET_ENTRIES_CRC]))
+    {
+        printf("Can't read the GPT partition entries on %s\n", device);
+        goto ERROR;
+    }
+
+    for (i = 0; i < entry_count && mmc_partition_count < MAX_PARTITIONS; i++)
+    {
+        const unsigned char *entry = &entries[i * entry_size];
+        MmcPartition *p = &gpt[mmc_partition_count];
+        char name[GPT_ENTRY_NAME_CHARS + 1];
+        char device_index[128];
+
+        if (memcmp(entry, gpt_unused, sizeof(gpt_unused)) == 0)
+            continue;
+
+        /* UTF-16LE, the names that matter here are ASCII */
+        for (j = 0; j < GPT_ENTRY_NAME_CHARS; j++)
+        {
+            unsigned c = entry[GPT_ENTRY_OFFSET_NAME + 2 * j] |
+                         entry[GPT_ENTRY_OFFSET_NAME + 2 * j + 1] << 8;
+            if (c == 0)
+                break;
+            name[j] = c < 0x80 ? c : '?';
+        }
+        name[j] = '\0';
+        if (name[0] != '\0')
+            p->name = strdup(name);
+
+        p->dfirstsec = gpt_get_lba(&entry[GPT_ENTRY_OFFSET_FIRST]);
+        p->dsize = gpt_get_lba(&entry[GPT_ENTRY_OFFSET_LAST]) - p->dfirstsec + 1;
+        if (memcmp(entry, gpt_linux_data, sizeof(gpt_linux_data)) == 0)
+            p->filesystem = strdup("ext4");
+        else if (memcmp(entry, gpt_basic_data, sizeof(gpt_basic_data)) == 0)
+            p->filesystem = strdup("vfat");
+
+        /* the kernel numbers GPT partitions by their entry */
+        sprintf(device_index, "%sp%u", device, i + 1);
+        p->device_index = strdup(device_index);
+        mmc_partition_count++;
+    }
+    ret = mmc_partition_count;
+
+ERROR:
+    free(entries);
+    close(fd);
+    return ret;
+}
+
+static const char *
+mmc_partition_key (const void *table, int i) {
+    const MmcPartition *p = &((const MmcPartition *) table)[i];
+    return p->device_index != NULL ? p->name : NULL;
+}
+
 int
 mmc_scan_partitions() {
+    if (g_mmc_state.partition_count >= 0 &&
+            g_mmc_state.generation == topology_generation(TOPOLOGY_MMC))
+        return g_mmc_state.partition_count;
+    return mmc_rescan_partitions();
+}
+
+int
+mmc_rescan_partitions() {
     int i;
     ssize_t nbytes;
+    unsigned generation = topology_generation(TOPOLOGY_MMC);
 
+    /* a held generation means other threads may be reading the table */
+    assert(!topology_held(TOPOLOGY_MMC));
     if (g_mmc_state.partitions == NULL) {
         const int nump = MAX_PARTITIONS;
         MmcPartition *partitions = malloc(nump * sizeof(*partitions));
@@ -268,13 +449,20 @@ mmc_scan_partitions() {
         }
     }
 
-    g_mmc_state.partition_count = mmc_read_mbr(MMC_DEVICENAME, g_mmc_state.partitions);
-    if(g_mmc_state.partition_count == -1)
+    g_mmc_state.partition_count = mmc_read_gpt(MMC_DEVICENAME, g_mmc_state.partitions);
+    if (g_mmc_state.partition_count == -2)
+        g_mmc_state.partition_count = mmc_read_mbr(MMC_DEVICENAME, g_mmc_state.partitions);
+    if(g_mmc_state.partition_count < 0)
     {
         printf("Error in reading mbr!\n");
-        // keep "partitions" around so we can free the names on a rescan.
+        // keep "partitions" around so we can free the names on a rescan,
+        // and read them again next time.
         g_mmc_state.partition_count = -1;
     }
+    /* names are looked up in the order of the table, the first one wins */
+    topology_index_build(&g_mmc_state.name_index, g_mmc_state.partitions,
+            g_mmc_state.partition_count, mmc_partition_key);
+    g_mmc_state.generation = generation;
     return g_mmc_state.partition_count;
 }
 
@@ -303,14 +491,10 @@ mmc_find_partition_by_name(const char *name)
     }
 
     if (g_mmc_state.partitions != NULL) {
-        int i;
-        for (i = 0; i < g_mmc_state.partitions_allocd; i++) {
-            MmcPartition *p = &g_mmc_state.partitions[i];
-            if (p->device_index !=NULL && p->name != NULL) {
-                if (strcmp(p->name, name) == 0) {
-                    return p;
-                }
-            }
+        int i = topology_index_find(&g_mmc_state.name_index,
+                g_mmc_state.partitions, mmc_partition_key, name);
+        if (i >= 0) {
+            return &g_mmc_state.partitions[i];
         }
     }
     return NULL;
@@ -420,112 +604,24 @@ mmc_mount_partition(const MmcPartition *partition, const char *mount_point,
             printf("Mount %s on %s read-only\n", devname, mount_point);
         }
     }
+    if (rv >= 0) {
+        topology_invalidate(TOPOLOGY_MOUNTS);
+    }
     return rv;
 }
 
 int
 mmc_raw_copy (const MmcPartition *partition, char *in_file) {
-    int ch;
-    FILE *in;
-    FILE *out;
-    int val = 0;
-    char buf[512];
-    unsigned sz = 0;
-    unsigned i;
-    int ret = -1;
-    char *out_file = partition->device_index;
-
-    in  = fopen ( in_file,  "r" );
-    if (in == NULL)
-        goto ERROR3;
-
-    out = fopen ( out_file,  "w" );
-    if (out == NULL)
-        goto ERROR2;
-
-    fseek(in, 0L, SEEK_END);
-    sz = ftell(in);
-    fseek(in, 0L, SEEK_SET);
-
-    if (sz % 512)
-    {
-        while ( ( ch = fgetc ( in ) ) != EOF )
-            fputc ( ch, out );
-    }
-    else
-    {
-        for (i=0; i< (sz/512); i++)
-        {
-            if ((fread(buf, 512, 1, in)) != 1)
-                goto ERROR1;
-            if ((fwrite(buf, 512, 1, out)) != 1)
-                goto ERROR1;
-        }
-    }
-
-    fsync(out);
-    ret = 0;
-ERROR1:
-    fclose ( out );
-ERROR2:
-    fclose ( in );
-ERROR3:
-    return ret;
-
+    return block_copy_path(in_file, partition->device_index,
+            BLOCK_COPY_DIRECT_OUT | BLOCK_COPY_SYNC);
 }
 
 
 int
 mmc_raw_dump_internal (const char* in_file, const char *out_file) {
-    int ch;
-    FILE *in;
-    FILE *out;
-    int val = 0;
-    char buf[512];
-    unsigned sz = 0;
-    unsigned i;
-    int ret = -1;
-
-    in  = fopen ( in_file,  "r" );
-    if (in == NULL)
-        goto ERROR3;
-
-    out = fopen ( out_file,  "w" );
-    if (out == NULL)
-        goto ERROR2;
-
-    fseek(in, 0L, SEEK_END);
-    sz = ftell(in);
-    fseek(in, 0L, SEEK_SET);
-
-    if (sz % 512)
-    {
-        while ( ( ch = fgetc ( in ) ) != EOF )
-            fputc ( ch, out );
-    }
-    else
-    {
-        for (i=0; i< (sz/512); i++)
-        {
-            if ((fread(buf, 512, 1, in)) != 1)
-                goto ERROR1;
-            if ((fwrite(buf, 512, 1, out)) != 1)
-                goto ERROR1;
-        }
-    }
-
-    fsync(out);
-    ret = 0;
-ERROR1:
-    fclose ( out );
-ERROR2:
-    fclose ( in );
-ERROR3:
-    return ret;
-
+    return block_copy_path(in_file, out_file, BLOCK_COPY_DIRECT_IN | BLOCK_COPY_SYNC);
 }
 
-// TODO: refactor this to not be a giant copy paste mess
 int
 mmc_raw_dump (const MmcPartition *partition, char *out_file) {
     return mmc_raw_dump_internal(partition->device_index, out_file);
@@ -588,34 +684,53 @@ ERROR3:
 
 }
 
-int cmd_mmc_restore_raw_partition(const char *partition, const char *filename)
+int cmd_mmc_restore_raw_partition_flags(const char *partition, const char *filename, int flags)
 {
+    char device[PATH_MAX];
     if (partition[0] != '/') {
         mmc_scan_partitions();
         const MmcPartition *p;
         p = mmc_find_partition_by_name(partition);
         if (p == NULL)
             return -1;
-        return mmc_raw_copy(p, filename);
+        if (!(flags & MMC_RESTORE_SKIP_UNCHANGED))
+            return mmc_raw_copy(p, filename);
+        strcpy(device, p->device_index);
     }
     else {
-        return mmc_raw_dump_internal(filename, partition);
+        strcpy(device, partition);
     }
+
+    int copy_flags = BLOCK_COPY_DIRECT_OUT | BLOCK_COPY_SYNC;
+    if (flags & MMC_RESTORE_SKIP_UNCHANGED)
+        copy_flags |= BLOCK_COPY_DIRECT_IN | BLOCK_COPY_SKIP_SAME;
+    return block_copy_path(filename, device, copy_flags);
 }
 
-int cmd_mmc_backup_raw_partition(const char *partition, const char *filename)
+int cmd_mmc_restore_raw_partition(const char *partition, const char *filename)
 {
+    return cmd_mmc_restore_raw_partition_flags(partition, filename, 0);
+}
+
+int cmd_mmc_backup_raw_partition_data(const char *partition, const char *filename,
+        block_copy_data_fn data, void *cookie)
+{
+    const char *device = partition;
     if (partition[0] != '/') {
         mmc_scan_partitions();
         const MmcPartition *p;
         p = mmc_find_partition_by_name(partition);
         if (p == NULL)
             return -1;
-        return mmc_raw_dump(p, filename);
-    }
-    else {
-        return mmc_raw_dump_internal(partition, filename);
+        device = p->device_index;
     }
+    return block_copy_path_with_data(device, filename, BLOCK_COPY_DIRECT_IN | BLOCK_COPY_SYNC,
+            data, cookie);
+}
+
+int cmd_mmc_backup_raw_partition(const char *partition, const char *filename)
+{
+    return cmd_mmc_backup_raw_partition_data(partition, filename, NULL, NULL);
 }
 
 int cmd_mmc_erase_raw_partition(const char *partition)
@@ -43,6 +43,24 @@
 #define OFFSET_TYPE               0x04
 #define OFFSET_FIRST_SEC          0x08
 #define OFFSET_SIZE               0x0C
+/* The same for GPT, in the header at LBA 1 and in its partition entries */
+#define GPT_PROTECTIVE_TYPE       0xEE
+#define GPT_SIGNATURE             "EFI PART"
+#define GPT_HEADER_SIZE_MIN       92
+#define GPT_OFFSET_HEADER_SIZE    0x0C
+#define GPT_OFFSET_HEADER_CRC     0x10
+#define GPT_OFFSET_CURRENT_LBA    0x18
+#define GPT_OFFSET_ENTRIES_LBA    0x48
+#define GPT_OFFSET_ENTRY_COUNT    0x50
+#define GPT_OFFSET_ENTRY_SIZE     0x54
+#define GPT_OFFSET_ENTRIES_CRC    0x58
+#define GPT_ENTRY_OFFSET_FIRST    0x20
+#define GPT_ENTRY_OFFSET_LAST     0x28
+#define GPT_ENTRY_OFFSET_NAME     0x38
+#define GPT_ENTRY_SIZE_MIN        0x80
+#define GPT_ENTRY_NAME_CHARS      36
+#define GPT_ENTRIES_SIZE_MAX      (1024 * 1024)
+
 #define COPYBUFF_SIZE             (1024 * 16)
 #define BINARY_IN_TABLE_SIZE      (16 * 512)
 #define MAX_FILE_ENTRIES          20
@@ -74,7 +92,11 @@
 typedef struct MmcPartition MmcPartition;
 
 /* Functions */
+/* The table is read, GPT if the MBR says so, and cached until a block
+ * uevent says it may have changed. */
 int mmc_scan_partitions();
+/* Reads the table again, after it was changed. */
+int mmc_rescan_partitions();
 const MmcPartition *mmc_find_partition_by_name(const char *name);
 int mmc_format_ext3 (MmcPartition *partition);
 int mmc_mount_partition(const MmcPartition *partition, const char *mount_point, \
@@ -83,6 +105,11 @@ int mmc_raw_copy (const MmcPartition *partition, char *in_file);
 int mmc_raw_read (const MmcPartition *partition, char *data, int data_size);
 int mmc_raw_write (const MmcPartition *partition, char *data, int data_size);
 
+// With MMC_RESTORE_SKIP_UNCHANGED the partition is read first and only
+// the chunks that differ from the image are written, then read back.
+#define MMC_RESTORE_SKIP_UNCHANGED 1
+int cmd_mmc_restore_raw_partition_flags(const char *partition, const char *filename, int flags);
+
 int format_ext2_device(const char *device);
 int format_ext3_device(const char *device);
 
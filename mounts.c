@@ -14,6 +14,7 @@
  * limitations under the License.
  */
 
+#include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -22,29 +23,44 @@
 #include <sys/mount.h>
 
 #include "mounts.h"
+#include "topology/proc_table.h"
+#include "topology/topology.h"
 
 typedef struct {
     MountedVolume *volumes;
     int volumes_allocd;
     int volume_count;
+    /* The TOPOLOGY_MOUNTS generation the volumes were read at, 0 if
+     * they weren't.
+     */
+    unsigned int generation;
+    topology_index device_index;
+    topology_index mount_point_index;
+    /* The volume strings point into it.
+     */
+    proc_table table;
 } MountsState;
 
 static MountsState g_mounts_state = {
     NULL,   // volumes
     0,      // volumes_allocd
-    0       // volume_count
+    0,      // volume_count
+    0,      // generation
+    { NULL, 0 },        // device_index
+    { NULL, 0 },        // mount_point_index
+    PROC_TABLE_INIT     // table
 };
 
-static inline void
-free_volume_internals(const MountedVolume *volume, int zero)
+static const char *
+volume_device(const void *table, int i)
 {
-    free((char *)volume->device);
-    free((char *)volume->mount_point);
-    free((char *)volume->filesystem);
-    free((char *)volume->flags);
-    if (zero) {
-        memset((void *)volume, 0, sizeof(*volume));
-    }
+    return ((const MountedVolume *) table)[i].device;
+}
+
+static const char *
+volume_mount_point(const void *table, int i)
+{
+    return ((const MountedVolume *) table)[i].mount_point;
 }
 
 #define PROC_MOUNTS_FILENAME   "/proc/mounts"
@@ -52,43 +68,35 @@ free_volume_internals(const MountedVolume *volume, int zero)
 int
 scan_mounted_volumes()
 {
-    char buf[2048];
-    const char *bufp;
+    char *line;
     int fd;
-    ssize_t nbytes;
-
-    if (g_mounts_state.volumes == NULL) {
-        const int numv = 32;
-        MountedVolume *volumes = malloc(numv * sizeof(*volumes));
-        if (volumes == NULL) {
-            errno = ENOMEM;
-            return -1;
-        }
-        g_mounts_state.volumes = volumes;
-        g_mounts_state.volumes_allocd = numv;
-        memset(volumes, 0, numv * sizeof(*volumes));
-    } else {
-        /* Free the old volume strings.
-         */
-        int i;
-        for (i = 0; i < g_mounts_state.volume_count; i++) {
-            free_volume_internals(&g_mounts_state.volumes[i], 1);
-        }
+    int ret;
+    unsigned int generation;
+
+    /* Nothing to do if the mount table hasn't changed since we read it.
+     */
+    generation = topology_generation(TOPOLOGY_MOUNTS);
+    if (g_mounts_state.volumes != NULL &&
+            g_mounts_state.generation == generation) {
+        return 0;
     }
+    /* A held generation means other threads may be reading the table.
+     */
+    assert(!topology_held(TOPOLOGY_MOUNTS));
+    g_mounts_state.generation = 0;
     g_mounts_state.volume_count = 0;
 
     /* Open and read the file contents.
      */
     fd = open(PROC_MOUNTS_FILENAME, O_RDONLY);
     if (fd < 0) {
-        goto bail;
+        return -1;
     }
-    nbytes = read(fd, buf, sizeof(buf) - 1);
+    ret = proc_table_read(&g_mounts_state.table, fd);
     close(fd);
-    if (nbytes < 0) {
-        goto bail;
+    if (ret < 0) {
+        return -1;
     }
-    buf[nbytes] = '\0';
 
     /* Parse the contents of the file, which looks like:
      *
@@ -104,69 +112,61 @@ scan_mounted_volumes()
      * The zeroes at the end are dummy placeholder fields to make the
      * output match Linux's /etc/mtab, but don't represent anything here.
      */
-    bufp = buf;
-    while (nbytes > 0) {
-        char device[64];
-        char mount_point[64];
-        char filesystem[64];
-        char flags[128];
-        int matches;
-
-        /* %as is a gnu extension that malloc()s a string for each field.
-         */
-        matches = sscanf(bufp, "%63s %63s %63s %127s",
-                device, mount_point, filesystem, flags);
-
-        if (matches == 4) {
-            device[sizeof(device)-1] = '\0';
-            mount_point[sizeof(mount_point)-1] = '\0';
-            filesystem[sizeof(filesystem)-1] = '\0';
-            flags[sizeof(flags)-1] = '\0';
-
-            MountedVolume *v =
-                    &g_mounts_state.volumes[g_mounts_state.volume_count++];
-            v->device = strdup(device);
-            v->mount_point = strdup(mount_point);
-            v->filesystem = strdup(filesystem);
-            v->flags = strdup(flags);
-        } else {
-printf("matches was %d on <<%.40s>>\n", matches, bufp);
+    while ((line = proc_table_line(&g_mounts_state.table)) != NULL) {
+        char *device = proc_table_field(&line);
+        char *mount_point = proc_table_field(&line);
+        char *filesystem = proc_table_field(&line);
+        char *flags = proc_table_field(&line);
+
+        if (flags == NULL) {
+            continue;
         }
-
-        /* Eat the line.
-         */
-        while (nbytes > 0 && *bufp != '\n') {
-            bufp++;
-            nbytes--;
-        }
-        if (nbytes > 0) {
-            bufp++;
-            nbytes--;
+        if (g_mounts_state.volume_count == g_mounts_state.volumes_allocd) {
+            int numv = g_mounts_state.volumes_allocd ?
+                    g_mounts_state.volumes_allocd * 2 : 32;
+            MountedVolume *volumes = realloc(g_mounts_state.volumes,
+                    numv * sizeof(*volumes));
+            if (volumes == NULL) {
+                g_mounts_state.volume_count = 0;
+                errno = ENOMEM;
+                return -1;
+            }
+            g_mounts_state.volumes = volumes;
+            g_mounts_state.volumes_allocd = numv;
         }
+
+        MountedVolume *v =
+                &g_mounts_state.volumes[g_mounts_state.volume_count++];
+        v->device = device;
+        v->mount_point = mount_point;
+        v->filesystem = filesystem;
+        v->flags = flags;
     }
 
+    if (topology_index_build(&g_mounts_state.device_index,
+                g_mounts_state.volumes, g_mounts_state.volume_count,
+                volume_device) < 0 ||
+            topology_index_build(&g_mounts_state.mount_point_index,
+                g_mounts_state.volumes, g_mounts_state.volume_count,
+                volume_mount_point) < 0) {
+        g_mounts_state.volume_count = 0;
+        errno = ENOMEM;
+        return -1;
+    }
+    g_mounts_state.generation = generation;
     return 0;
-
-bail:
-//TODO: free the strings we've allocated.
-    g_mounts_state.volume_count = 0;
-    return -1;
 }
 
 const MountedVolume *
 find_mounted_volume_by_device(const char *device)
 {
-    if (g_mounts_state.volumes != NULL) {
-        int i;
-        for (i = 0; i < g_mounts_state.volume_count; i++) {
-            MountedVolume *v = &g_mounts_state.volumes[i];
-            /* May be null if it was unmounted and we haven't rescanned.
-             */
-            if (v->device != NULL) {
-                if (strcmp(v->device, device) == 0) {
-                    return v;
-                }
-            }
+    if (g_mounts_state.generation != 0) {
+        /* Unmounted volumes are null until we rescan, and never match.
+         */
+        int i = topology_index_find(&g_mounts_state.device_index,
+                g_mounts_state.volumes, volume_device, device);
+        if (i >= 0) {
+            return &g_mounts_state.volumes[i];
         }
     }
     return NULL;
@@ -175,17 +175,11 @@ find_mounted_volume_by_device(const char *device)
 const MountedVolume *
 find_mounted_volume_by_mount_point(const char *mount_point)
 {
-    if (g_mounts_state.volumes != NULL) {
-        int i;
-        for (i = 0; i < g_mounts_state.volume_count; i++) {
-            MountedVolume *v = &g_mounts_state.volumes[i];
-            /* May be null if it was unmounted and we haven't rescanned.
-             */
-            if (v->mount_point != NULL) {
-                if (strcmp(v->mount_point, mount_point) == 0) {
-                    return v;
-                }
-            }
+    if (g_mounts_state.generation != 0) {
+        int i = topology_index_find(&g_mounts_state.mount_point_index,
+                g_mounts_state.volumes, volume_mount_point, mount_point);
+        if (i >= 0) {
+            return &g_mounts_state.volumes[i];
         }
     }
     return NULL;
@@ -200,7 +194,8 @@ unmount_mounted_volume(const MountedVolume *volume)
      */
     int ret = umount(volume->mount_point);
     if (ret == 0) {
-        free_volume_internals(volume, 1);
+        memset((void *)volume, 0, sizeof(*volume));
+        topology_invalidate(TOPOLOGY_MOUNTS);
         return 0;
     }
     return ret;
@@ -209,7 +204,11 @@ unmount_mounted_volume(const MountedVolume *volume)
 int
 remount_read_only(const MountedVolume* volume)
 {
-    return mount(volume->device, volume->mount_point, volume->filesystem,
-                 MS_NOATIME | MS_NODEV | MS_NODIRATIME |
-                 MS_RDONLY | MS_REMOUNT, 0);
+    int ret = mount(volume->device, volume->mount_point, volume->filesystem,
+                    MS_NOATIME | MS_NODEV | MS_NODIRATIME |
+                    MS_RDONLY | MS_REMOUNT, 0);
+    /* The flags have changed.
+     */
+    topology_invalidate(TOPOLOGY_MOUNTS);
+    return ret;
 }
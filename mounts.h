@@ -24,6 +24,10 @@ typedef struct {
  const char *flags;
 } MountedVolume;
 
+/* Reads /proc/mounts again only when the mount table may have changed
+ * since the last call: the kernel said so, or we mounted or unmounted
+ * something ourselves.
+ */
 int scan_mounted_volumes(void);
 
 const MountedVolume *find_mounted_volume_by_device(const char *device);
@@ -1,10 +1,11 @@
+LOCAL_PATH := $(call my-dir)
+
 ifneq ($(TARGET_SIMULATOR),true)
 ifeq ($(TARGET_ARCH),arm)
 
-LOCAL_PATH := $(call my-dir)
-
 include $(CLEAR_VARS)
 LOCAL_SRC_FILES := mtdutils.c
+LOCAL_C_INCLUDES += bootable/recovery
 LOCAL_MODULE := libmtdutils
 include $(BUILD_STATIC_LIBRARY)
 
@@ -26,10 +27,20 @@ LOCAL_MODULE_PATH := $(PRODUCT_OUT)/utilities
 LOCAL_UNSTRIPPED_PATH := $(PRODUCT_OUT)/symbols/utilities
 LOCAL_MODULE_STEM := bml_over_mtd
 LOCAL_C_INCLUDES += bootable/recovery/mtdutils
-LOCAL_STATIC_LIBRARIES := libmtdutils libcutils libc
+LOCAL_STATIC_LIBRARIES := libmtdutils libtopology libcutils libc
 LOCAL_FORCE_STATIC_EXECUTABLE := true
 include $(BUILD_EXECUTABLE)
 endif
 
 endif	# TARGET_ARCH == arm
 endif	# !TARGET_SIMULATOR
+
+# libmtdutils on a file backed NAND simulator, runs on the build host
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES := mtd_bench.c mtdutils.c mtdsim.c ../topology/topology.c ../topology/proc_table.c
+LOCAL_C_INCLUDES += bootable/recovery
+LOCAL_CFLAGS += -DMTD_SIMULATOR
+LOCAL_LDLIBS += -lpthread
+LOCAL_MODULE := mtd_bench
+LOCAL_MODULE_TAGS := tests
+include $(BUILD_HOST_EXECUTABLE)
@@ -171,6 +171,148 @@ static unsigned short* CreateEmptyBlockMapping(const MtdPartition* pSrcPart)
 	return pMapping;
 }
 
+// The mapping table sits at the start of a reservoir block: the mark, then
+// at 0x1000 the table of up to 100 source/destination block pairs.
+#define MAPPING_TABLE_OFFSET	0x1000
+#define MAPPING_TABLE_SHORTS	100
+
+// A mapping that was found and checked is kept here for the next dump or
+// flash in this session, the reservoir scan is the slow part.
+#define MAPPING_CACHE_FORMAT	"/tmp/bml_over_mtd.%s.%s"
+#define MAPPING_CACHE_MAGIC	"BMLMAP1"
+
+typedef struct {
+	char magic[8];
+	int srcPartStartBlock;
+	int reservoirPartStartBlock;
+	unsigned int srcSize;
+	unsigned int reservoirSize;
+	unsigned int eraseSize;
+	unsigned int writeSize;
+} BlockMappingCacheHeader;
+
+static void BlockMappingCacheHeaderFor(BlockMappingCacheHeader* header,
+		const MtdPartition* pSrcPart, int srcPartStartBlock,
+		const MtdPartition* pReservoirPart, int reservoirPartStartBlock, size_t writeSize)
+{
+	memset(header, 0, sizeof(*header));
+	strcpy(header->magic, MAPPING_CACHE_MAGIC);
+	header->srcPartStartBlock = srcPartStartBlock;
+	header->reservoirPartStartBlock = reservoirPartStartBlock;
+	header->srcSize = pSrcPart->size;
+	header->reservoirSize = pReservoirPart->size;
+	header->eraseSize = pSrcPart->erase_size;
+	header->writeSize = writeSize;
+}
+
+// Returns 0 if a mapping for these partitions at these start blocks and
+// with this geometry was read into pMapping.
+static int LoadBlockMapping(unsigned short* pMapping, int numSrcBlocks,
+		const MtdPartition* pSrcPart, int srcPartStartBlock,
+		const MtdPartition* pReservoirPart, int reservoirPartStartBlock, size_t writeSize)
+{
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), MAPPING_CACHE_FORMAT, pSrcPart->name, pReservoirPart->name);
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	BlockMappingCacheHeader want, header;
+	BlockMappingCacheHeaderFor(&want, pSrcPart, srcPartStartBlock,
+			pReservoirPart, reservoirPartStartBlock, writeSize);
+	size_t mappingSize = numSrcBlocks * sizeof(unsigned short);
+	int ret = -1;
+	if (read(fd, &header, sizeof(header)) == sizeof(header)
+			&& memcmp(&header, &want, sizeof(header)) == 0
+			&& read(fd, pMapping, mappingSize) == (ssize_t)mappingSize)
+		ret = 0;
+	close(fd);
+	return ret;
+}
+
+static void SaveBlockMapping(const unsigned short* pMapping, int numSrcBlocks,
+		const MtdPartition* pSrcPart, int srcPartStartBlock,
+		const MtdPartition* pReservoirPart, int reservoirPartStartBlock, size_t writeSize)
+{
+	char path[PATH_MAX], tmp[PATH_MAX];
+	snprintf(path, sizeof(path), MAPPING_CACHE_FORMAT, pSrcPart->name, pReservoirPart->name);
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	int fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+	if (fd < 0)
+		return;
+
+	BlockMappingCacheHeader header;
+	BlockMappingCacheHeaderFor(&header, pSrcPart, srcPartStartBlock,
+			pReservoirPart, reservoirPartStartBlock, writeSize);
+	size_t mappingSize = numSrcBlocks * sizeof(unsigned short);
+	int ok = write(fd, &header, sizeof(header)) == sizeof(header)
+			&& write(fd, pMapping, mappingSize) == (ssize_t)mappingSize;
+	if (close(fd) != 0 || !ok || rename(tmp, path) != 0)
+		unlink(tmp);
+}
+
+// Returns 1 if every bad source block, and only those, is mapped to a
+// good reservoir block.
+static int CheckBlockMapping(const unsigned short* pMapping, int numSrcBlocks,
+		const MtdPartition* pSrcPart, const MtdPartition* pReservoirPart, size_t erase)
+{
+	int mappingValid = 1;
+	BmlOverMtdReadContext* readctx = bml_over_mtd_read_partition(pSrcPart);
+	if (readctx == NULL)
+	{
+		fprintf(stderr, "Cannot open source partition for reading.\n");
+		return 0;
+	}
+	int currBlock = 0;
+	for (;currBlock < numSrcBlocks; ++currBlock)
+	{
+		loff_t pos = lseek64(readctx->fd, currBlock*erase, SEEK_SET);
+		int mgbb = ioctl(readctx->fd, MEMGETBADBLOCK, &pos);
+		if (mgbb == 0)
+		{
+			if (pMapping[currBlock]!=0xffff)
+			{
+				fprintf(stderr, "Consistency error: Good block has mapping entry %d -> %d\n", currBlock, pMapping[currBlock]);
+				mappingValid = 0;
+			}
+		} else
+		{
+			//Bad block!
+			if (pMapping[currBlock]==0xffff)
+			{
+				fprintf(stderr, "Consistency error: Bad block has no mapping entry \n");
+				mappingValid = 0;
+			} else
+			{
+				BmlOverMtdReadContext* reservoirReadCtx = bml_over_mtd_read_partition(pReservoirPart);
+				if (reservoirReadCtx == 0)
+				{
+					fprintf(stderr, "Reservoir partition cannot be opened for reading in consistency check.\n");
+					mappingValid = 0;
+				} else
+				{
+					pos = lseek64(reservoirReadCtx->fd, pMapping[currBlock]*erase, SEEK_SET);
+					mgbb = ioctl(reservoirReadCtx->fd, MEMGETBADBLOCK, &pos);
+					if (mgbb == 0)
+					{
+						printf("Bad block has properly mapped reservoir block %d -> %d\n",currBlock, pMapping[currBlock]);
+					}
+					else
+					{
+						fprintf(stderr, "Consistency error: Mapped block is bad, too. (%d -> %d)\n",currBlock, pMapping[currBlock]);
+						mappingValid = 0;
+					}
+					bml_over_mtd_read_close(reservoirReadCtx);
+				}
+			}
+
+		}
+
+	}
+	bml_over_mtd_read_close(readctx);
+	return mappingValid;
+}
+
 static const unsigned short* CreateBlockMapping(const MtdPartition* pSrcPart, int srcPartStartBlock,
 		const MtdPartition *pReservoirPart, int reservoirPartStartBlock)
 {
@@ -208,6 +350,18 @@ static const unsigned short* CreateBlockMapping(const MtdPartition* pSrcPart, in
 
 	printf("Partition info: Total %d, Erase %d, write %d\n", total, erase, write);
 
+	// blocks that went bad since make the check fail, and we look again
+	if (LoadBlockMapping(pMapping, numSrcBlocks, pSrcPart, srcPartStartBlock,
+			pReservoirPart, reservoirPartStartBlock, write) == 0)
+	{
+		if (CheckBlockMapping(pMapping, numSrcBlocks, pSrcPart, pReservoirPart, erase))
+		{
+			printf("Using the block mapping found before.\n");
+			return pMapping;
+		}
+		memset(pMapping, 0xFF, numSrcBlocks * sizeof(unsigned short));
+	}
+
 	BmlOverMtdReadContext *readctx = bml_over_mtd_read_partition(pReservoirPart);
 	if (readctx == NULL)
 	{
@@ -224,21 +378,29 @@ static const unsigned short* CreateBlockMapping(const MtdPartition* pSrcPart, in
 		return NULL;
 	}
 
+	// Only the pages with the mark and the table are read from each
+	// block, not the whole of it.
+	size_t headerSize = MAPPING_TABLE_OFFSET + MAPPING_TABLE_SHORTS * sizeof(unsigned short);
+	if (write > 0)
+		headerSize = (headerSize + write - 1) / write * write;
+	if (headerSize > erase)
+		headerSize = erase;
+
 	int foundMappingTable = 0;
 
 	int currOffset = total; //Offset *behind* the last byte
 	while (currOffset > 0)
 	{
 		currOffset -= erase;
-		loff_t pos = lseek64(readctx->fd, currOffset, SEEK_SET);
+		loff_t pos = currOffset;
 		int mgbb = ioctl(readctx->fd, MEMGETBADBLOCK, &pos);
 		if (mgbb != 0)
 		{
 			printf("Bad block %d in reservoir area, skipping.\n", currOffset/erase);
 			continue;
 		}
-		ssize_t readBytes = read(readctx->fd, readctx->buffer, erase);
-		if (readBytes != (ssize_t)erase)
+		ssize_t readBytes = pread64(readctx->fd, readctx->buffer, headerSize, currOffset);
+		if (readBytes != (ssize_t)headerSize)
 		{
 			fprintf(stderr, "Failed to read good block in reservoir area (%s).\n",
 					strerror(errno));
@@ -246,21 +408,21 @@ static const unsigned short* CreateBlockMapping(const MtdPartition* pSrcPart, in
 			bml_over_mtd_read_close(readctx);
 			return NULL;
 		}
-		if (readBytes >= 0x2000)
+		if (erase >= 0x2000)
 		{
 			char* buf = readctx->buffer;
 			if (buf[0]=='U' && buf[1]=='P' && buf[2]=='C' && buf[3]=='H')
 			{
 				printf ("Found mapping block mark at 0x%x (block %d).\n", currOffset, currOffset/erase);
 
-				unsigned short* mappings = (unsigned short*) &buf[0x1000];
+				unsigned short* mappings = (unsigned short*) &buf[MAPPING_TABLE_OFFSET];
 				if (mappings[0]==0 && mappings[1]==0xffff)
 				{
 					printf("Found start of mapping table.\n");
 					foundMappingTable = 1;
 					//Skip first entry (dummy)
 					unsigned short* mappingEntry = mappings + 2;
-					while (mappingEntry - mappings < 100
+					while (mappingEntry - mappings < MAPPING_TABLE_SHORTS
 							&& mappingEntry[0] != 0xffff)
 					{
 						unsigned short rawSrcBlk = mappingEntry[0];
@@ -323,70 +485,14 @@ static const unsigned short* CreateBlockMapping(const MtdPartition* pSrcPart, in
 	}
 
 	//Consistency and validity check
-	int mappingValid = 1;
-	readctx = bml_over_mtd_read_partition(pSrcPart);
-	if (readctx == NULL)
-	{
-		fprintf(stderr, "Cannot open source partition for reading.\n");
-		free(pMapping);
-		return NULL;
-	}
-	int currBlock = 0;
-	for (;currBlock < numSrcBlocks; ++currBlock)
-	{
-		loff_t pos = lseek64(readctx->fd, currBlock*erase, SEEK_SET);
-		int mgbb = ioctl(readctx->fd, MEMGETBADBLOCK, &pos);
-		if (mgbb == 0)
-		{
-			if (pMapping[currBlock]!=0xffff)
-			{
-				fprintf(stderr, "Consistency error: Good block has mapping entry %d -> %d\n", currBlock, pMapping[currBlock]);
-				mappingValid = 0;
-			}
-		} else
-		{
-			//Bad block!
-			if (pMapping[currBlock]==0xffff)
-			{
-				fprintf(stderr, "Consistency error: Bad block has no mapping entry \n");
-				mappingValid = 0;
-			} else
-			{
-				BmlOverMtdReadContext* reservoirReadCtx = bml_over_mtd_read_partition(pReservoirPart);
-				if (reservoirReadCtx == 0)
-				{
-					fprintf(stderr, "Reservoir partition cannot be opened for reading in consistency check.\n");
-					mappingValid = 0;
-				} else
-				{
-					pos = lseek64(reservoirReadCtx->fd, pMapping[currBlock]*erase, SEEK_SET);
-					mgbb = ioctl(reservoirReadCtx->fd, MEMGETBADBLOCK, &pos);
-					if (mgbb == 0)
-					{
-						printf("Bad block has properly mapped reservoir block %d -> %d\n",currBlock, pMapping[currBlock]);
-					}
-					else
-					{
-						fprintf(stderr, "Consistency error: Mapped block is bad, too. (%d -> %d)\n",currBlock, pMapping[currBlock]);
-						mappingValid = 0;
-					}
-
-				}
-				bml_over_mtd_read_close(reservoirReadCtx);
-			}
-
-		}
-
-	}
-	bml_over_mtd_read_close(readctx);
-
-
-	if (!mappingValid)
+	if (!CheckBlockMapping(pMapping, numSrcBlocks, pSrcPart, pReservoirPart, erase))
 	{
 		free(pMapping);
 		return NULL;
 	}
 
+	SaveBlockMapping(pMapping, numSrcBlocks, pSrcPart, srcPartStartBlock,
+			pReservoirPart, reservoirPartStartBlock, write);
 	return pMapping;
 }
 
@@ -0,0 +1,208 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "flashutils/flashutils.h"
+#include "mtdutils.h"
+#include "mtdsim.h"
+
+// Times libmtdutils on a simulated partition (see mtdsim.h):
+//
+//   mtd_bench [-s <partition MB>] [-e <erase KB>] [-w <page bytes>]
+//             [-n <image MB>] [-b <bad block>]... [-E <soft rate>]
+//             [-H <hard rate>] [-r|-W|-x|-i <us>] [-d <dir>]
+//
+// -r, -W, -x and -i are the latencies of a page read, a page write, a
+// block erase and an ioctl.  Every run prints its throughput and the
+// ioctls it took.  Returns 1 if what was restored doesn't read back.
+
+#define MTD_BENCH_NAME  "bench"
+
+static void usage()
+{
+    fprintf(stderr, "usage: mtd_bench [-s <partition MB>] [-e <erase KB>] [-w <page bytes>]\n"
+            "                 [-n <image MB>] [-b <bad block>]... [-E <soft rate>] [-H <hard rate>]\n"
+            "                 [-r <read us>] [-W <write us>] [-x <erase us>] [-i <ioctl us>] [-d <dir>]\n");
+    exit(2);
+}
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *name, double start, uint64_t bytes)
+{
+    MtdSimStats stats;
+    double seconds = now() - start;
+    mtdsim_get_stats(&stats);
+    printf("%-16s %8.2f MB/s %8llu ioctls (%llu erase, %llu bad block) %8llu blocks erased",
+           name, bytes / seconds / (1024 * 1024),
+           (unsigned long long) stats.ioctls,
+           (unsigned long long) stats.erase_ioctls,
+           (unsigned long long) stats.bad_block_ioctls,
+           (unsigned long long) stats.blocks_erased);
+    if (stats.ecc_soft || stats.ecc_hard)
+        printf(" ecc %llu/%llu", (unsigned long long) stats.ecc_soft,
+               (unsigned long long) stats.ecc_hard);
+    printf("\n");
+}
+
+static int make_image(const char *path, size_t size)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return -1;
+    char buf[4096];
+    unsigned int seed = 1;
+    size_t done, i;
+    for (done = 0; done < size; done += sizeof(buf)) {
+        for (i = 0; i < sizeof(buf); i++)
+            buf[i] = rand_r(&seed);
+        size_t len = size - done < sizeof(buf) ? size - done : sizeof(buf);
+        if (write(fd, buf, len) != (ssize_t) len) {
+            close(fd);
+            return -1;
+        }
+    }
+    return close(fd);
+}
+
+// Returns 0 if the first bytes of the backup match the image.
+static int compare(const char *image, const char *backup, size_t size)
+{
+    FILE *a = fopen(image, "r");
+    FILE *b = fopen(backup, "r");
+    int ret = -1;
+    if (a != NULL && b != NULL) {
+        char x[4096], y[4096];
+        size_t done = 0;
+        ret = 0;
+        while (ret == 0 && done < size) {
+            size_t len = size - done < sizeof(x) ? size - done : sizeof(x);
+            if (fread(x, 1, len, a) != len || fread(y, 1, len, b) != len || memcmp(x, y, len))
+                ret = -1;
+            done += len;
+        }
+    }
+    if (a != NULL) fclose(a);
+    if (b != NULL) fclose(b);
+    return ret;
+}
+
+int main(int argc, char **argv)
+{
+    MtdSimConfig config;
+    unsigned int bad_blocks[64];
+    char dir[256] = "/tmp";
+    unsigned int image_mb = 0;
+    int c;
+
+    memset(&config, 0, sizeof(config));
+    config.name = MTD_BENCH_NAME;
+    config.size = 64 * 1024 * 1024;
+    config.erase_size = 128 * 1024;
+    config.write_size = 2048;
+    config.bad_blocks = bad_blocks;
+    config.seed = 1;
+
+    while ((c = getopt(argc, argv, "s:e:w:n:b:E:H:r:W:x:i:d:")) != -1) {
+        switch (c) {
+            case 's': config.size = atoi(optarg) * 1024 * 1024; break;
+            case 'e': config.erase_size = atoi(optarg) * 1024; break;
+            case 'w': config.write_size = atoi(optarg); break;
+            case 'n': image_mb = atoi(optarg); break;
+            case 'b':
+                if (config.bad_block_count == sizeof(bad_blocks) / sizeof(bad_blocks[0]))
+                    usage();
+                bad_blocks[config.bad_block_count++] = atoi(optarg);
+                break;
+            case 'E': config.ecc_soft_rate = atof(optarg); break;
+            case 'H': config.ecc_hard_rate = atof(optarg); break;
+            case 'r': config.read_latency = atoi(optarg); break;
+            case 'W': config.write_latency = atoi(optarg); break;
+            case 'x': config.erase_latency = atoi(optarg); break;
+            case 'i': config.ioctl_latency = atoi(optarg); break;
+            case 'd': snprintf(dir, sizeof(dir), "%s", optarg); break;
+            default: usage();
+        }
+    }
+    if (optind != argc)
+        usage();
+
+    // by default the image fills the partition but for the bad blocks
+    // and some slack, like a boot image rarely does
+    size_t image_size = image_mb ? image_mb * 1024 * 1024 :
+            config.size - (config.bad_block_count + 2) * config.erase_size - 777;
+
+    char flash[PATH_MAX], image[PATH_MAX], backup[PATH_MAX], ecc[PATH_MAX];
+    if (snprintf(flash, sizeof(flash), "%s/mtd_bench.flash", dir) >= (int) sizeof(flash) ||
+            snprintf(image, sizeof(image), "%s/mtd_bench.img", dir) >= (int) sizeof(image) ||
+            snprintf(backup, sizeof(backup), "%s/mtd_bench.backup", dir) >= (int) sizeof(backup) ||
+            snprintf(ecc, sizeof(ecc), "%s.ecc", backup) >= (int) sizeof(ecc)) {
+        fprintf(stderr, "mtd_bench: %s: path too long\n", dir);
+        return 1;
+    }
+    config.image = flash;
+    if (mtdsim_init(&config) || make_image(image, image_size)) {
+        fprintf(stderr, "mtd_bench: can't set up %s (%s)\n", dir, strerror(errno));
+        return 1;
+    }
+
+    int ret = 0;
+    double start;
+    static const struct {
+        const char *name;
+        int flags;
+    } restores[] = {
+        { "restore", 0 },
+        { "restore fast", MTD_WRITE_FAST },
+    };
+    unsigned int i;
+    for (i = 0; i < sizeof(restores) / sizeof(restores[0]); i++) {
+        mtdsim_reset_stats();
+        start = now();
+        if (cmd_mtd_restore_raw_partition_flags(MTD_BENCH_NAME, image, restores[i].flags)) {
+            fprintf(stderr, "\nmtd_bench: %s failed\n", restores[i].name);
+            ret = 1;
+            continue;
+        }
+        report(restores[i].name, start, image_size);
+
+        mtdsim_reset_stats();
+        start = now();
+        if (cmd_mtd_backup_raw_partition(MTD_BENCH_NAME, backup)) {
+            fprintf(stderr, "\nmtd_bench: backup failed\n");
+            ret = 1;
+            continue;
+        }
+        report("backup", start, config.size);
+
+        // hard ECC errors make the reader skip blocks
+        if (config.ecc_hard_rate == 0 && compare(image, backup, image_size)) {
+            fprintf(stderr, "mtd_bench: %s doesn't read back\n", restores[i].name);
+            ret = 1;
+        }
+    }
+
+    mtdsim_reset_stats();
+    start = now();
+    if (cmd_mtd_erase_raw_partition(MTD_BENCH_NAME)) {
+        fprintf(stderr, "\nmtd_bench: erase failed\n");
+        ret = 1;
+    }
+    report("erase", start, config.size);
+
+    unlink(flash);
+    unlink(image);
+    unlink(backup);
+    unlink(ecc);
+    return ret;
+}
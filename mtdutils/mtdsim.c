@@ -0,0 +1,299 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <mtd/mtd-user.h>
+
+#include "mtdsim.h"
+
+#define MTDSIM_DEVICE   "/dev/mtd/mtd0"
+#define MTDSIM_MAX_FDS  1024
+
+static MtdSimConfig sim;
+static MtdSimStats stats;
+static struct mtd_ecc_stats ecc_stats;
+static unsigned char *bad;      // one byte per block
+static unsigned int seed;
+// set for the fds that are open on MTDSIM_DEVICE
+static unsigned char device_fds[MTDSIM_MAX_FDS];
+
+// simulated time not slept yet, slept off a millisecond at a time
+static unsigned int latency_debt;
+
+static void add_latency(unsigned int us)
+{
+    latency_debt += us;
+    if (latency_debt >= 1000) {
+        usleep(latency_debt);
+        latency_debt = 0;
+    }
+}
+
+static int is_device(int fd)
+{
+    return fd >= 0 && fd < MTDSIM_MAX_FDS && device_fds[fd];
+}
+
+static int chance(double rate)
+{
+    return rate > 0 && rand_r(&seed) < rate * ((double) RAND_MAX + 1);
+}
+
+int mtdsim_init(const MtdSimConfig *config)
+{
+    int i;
+    if (config->erase_size == 0 || config->write_size == 0 ||
+        config->size % config->erase_size != 0 ||
+        config->erase_size % config->write_size != 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    int fd = open(config->image, O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+        return -1;
+    int ret = ftruncate(fd, config->size);
+    close(fd);
+    if (ret)
+        return -1;
+
+    free(bad);
+    bad = calloc(config->size / config->erase_size, 1);
+    if (bad == NULL)
+        return -1;
+    for (i = 0; i < config->bad_block_count; i++) {
+        if (config->bad_blocks[i] < config->size / config->erase_size)
+            bad[config->bad_blocks[i]] = 1;
+    }
+
+    sim = *config;
+    seed = config->seed;
+    latency_debt = 0;
+    memset(&ecc_stats, 0, sizeof(ecc_stats));
+    ecc_stats.badblocks = config->bad_block_count;
+    mtdsim_reset_stats();
+    return 0;
+}
+
+void mtdsim_get_stats(MtdSimStats *s)
+{
+    *s = stats;
+}
+
+void mtdsim_reset_stats(void)
+{
+    memset(&stats, 0, sizeof(stats));
+}
+
+int mtdsim_open(const char *path, int flags, ...)
+{
+    mode_t mode = 0;
+    if (flags & O_CREAT) {
+        va_list args;
+        va_start(args, flags);
+        mode = va_arg(args, int);
+        va_end(args);
+    }
+
+    if (bad != NULL && strcmp(path, "/proc/mtd") == 0) {
+        // the partition table, in a file nobody else sees
+        char table[] = "/tmp/mtdsim.XXXXXX";
+        int fd = mkstemp(table);
+        if (fd < 0)
+            return -1;
+        unlink(table);
+        dprintf(fd, "dev:    size   erasesize  name\n"
+                "mtd0: %08x %08x \"%s\"\n", sim.size, sim.erase_size, sim.name);
+        lseek(fd, 0, SEEK_SET);
+        return fd;
+    }
+    if (bad != NULL && strcmp(path, MTDSIM_DEVICE) == 0) {
+        int fd = open(sim.image, flags & ~(O_CREAT | O_TRUNC));
+        if (fd >= MTDSIM_MAX_FDS) {
+            close(fd);
+            errno = EMFILE;
+            return -1;
+        }
+        if (fd >= 0)
+            device_fds[fd] = 1;
+        return fd;
+    }
+    return open(path, flags, mode);
+}
+
+int mtdsim_close(int fd)
+{
+    if (fd >= 0 && fd < MTDSIM_MAX_FDS)
+        device_fds[fd] = 0;
+    return close(fd);
+}
+
+ssize_t mtdsim_read(int fd, void *buf, size_t len)
+{
+    if (!is_device(fd))
+        return read(fd, buf, len);
+
+    off_t pos = lseek(fd, 0, SEEK_CUR);
+    if (pos + len > sim.size)
+        len = pos < (off_t) sim.size ? sim.size - pos : 0;
+    ssize_t ret = read(fd, buf, len);
+    if (ret <= 0)
+        return ret;
+
+    stats.reads++;
+    stats.bytes_read += ret;
+    add_latency((ret + sim.write_size - 1) / sim.write_size * sim.read_latency);
+
+    // the ECC errors are counted per block touched, as the driver would
+    off_t block;
+    for (block = pos / sim.erase_size; block <= (pos + ret - 1) / sim.erase_size; block++) {
+        if (chance(sim.ecc_hard_rate)) {
+            ecc_stats.failed++;
+            stats.ecc_hard++;
+        } else if (chance(sim.ecc_soft_rate)) {
+            ecc_stats.corrected++;
+            stats.ecc_soft++;
+        }
+    }
+    return ret;
+}
+
+ssize_t mtdsim_write(int fd, const void *buf, size_t len)
+{
+    if (!is_device(fd))
+        return write(fd, buf, len);
+
+    off_t pos = lseek(fd, 0, SEEK_CUR);
+    if (pos % sim.write_size != 0 || len % sim.write_size != 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (pos + len > sim.size) {
+        errno = ENOSPC;
+        return -1;
+    }
+
+    off_t block;
+    for (block = pos / sim.erase_size; block < (off_t) ((pos + len + sim.erase_size - 1) / sim.erase_size); block++) {
+        if (bad[block]) {
+            errno = EIO;
+            return -1;
+        }
+    }
+
+    // programming can only clear bits
+    char *data = malloc(len);
+    if (data == NULL)
+        return -1;
+    if (pread(fd, data, len, pos) != (ssize_t) len) {
+        free(data);
+        errno = EIO;
+        return -1;
+    }
+    size_t i;
+    for (i = 0; i < len; i++)
+        data[i] &= ((const char *) buf)[i];
+    ssize_t ret = write(fd, data, len);
+    free(data);
+    if (ret <= 0)
+        return ret;
+
+    stats.writes++;
+    stats.bytes_written += ret;
+    add_latency(ret / sim.write_size * sim.write_latency);
+    return ret;
+}
+
+off_t mtdsim_lseek(int fd, off_t offset, int whence)
+{
+    return lseek(fd, offset, whence);
+}
+
+off64_t mtdsim_lseek64(int fd, off64_t offset, int whence)
+{
+    return lseek64(fd, offset, whence);
+}
+
+static int erase(int fd, const struct erase_info_user *erase_info)
+{
+    if (erase_info->start % sim.erase_size != 0 ||
+        erase_info->length % sim.erase_size != 0 ||
+        erase_info->start + erase_info->length > sim.size) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    char *ones = malloc(sim.erase_size);
+    if (ones == NULL)
+        return -1;
+    memset(ones, 0xff, sim.erase_size);
+    int ret = 0;
+    unsigned int pos;
+    for (pos = erase_info->start; pos < erase_info->start + erase_info->length; pos += sim.erase_size) {
+        // the kernel stops at the first block it can't erase
+        if (bad[pos / sim.erase_size] ||
+            pwrite(fd, ones, sim.erase_size, pos) != (ssize_t) sim.erase_size) {
+            errno = EIO;
+            ret = -1;
+            break;
+        }
+        stats.blocks_erased++;
+        add_latency(sim.erase_latency);
+    }
+    free(ones);
+    return ret;
+}
+
+int mtdsim_ioctl(int fd, unsigned long request, void *arg)
+{
+    if (!is_device(fd))
+        return ioctl(fd, request, arg);
+
+    stats.ioctls++;
+    add_latency(sim.ioctl_latency);
+    switch (request) {
+        case MEMGETINFO: {
+            struct mtd_info_user *info = arg;
+            memset(info, 0, sizeof(*info));
+            info->type = MTD_NANDFLASH;
+            info->flags = MTD_CAP_NANDFLASH;
+            info->size = sim.size;
+            info->erasesize = sim.erase_size;
+            info->writesize = sim.write_size;
+            info->oobsize = sim.write_size / 32;
+            return 0;
+        }
+        case MEMERASE:
+            stats.erase_ioctls++;
+            return erase(fd, arg);
+        case MEMGETBADBLOCK: {
+            loff_t pos = *(loff_t *) arg;
+            stats.bad_block_ioctls++;
+            if (pos < 0 || pos >= sim.size) {
+                errno = EINVAL;
+                return -1;
+            }
+            return bad[pos / sim.erase_size];
+        }
+        case MEMSETBADBLOCK: {
+            loff_t pos = *(loff_t *) arg;
+            if (pos < 0 || pos >= sim.size) {
+                errno = EINVAL;
+                return -1;
+            }
+            if (!bad[pos / sim.erase_size])
+                ecc_stats.badblocks++;
+            bad[pos / sim.erase_size] = 1;
+            return 0;
+        }
+        case ECCGETSTATS:
+            memcpy(arg, &ecc_stats, sizeof(ecc_stats));
+            return 0;
+    }
+    errno = ENOTTY;
+    return -1;
+}
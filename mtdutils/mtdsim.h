@@ -0,0 +1,67 @@
+#ifndef MTDSIM_H_
+#define MTDSIM_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/* A NAND partition simulated on top of a regular file, for running
+ * libmtdutils on a machine without flash.  mtdutils.c built with
+ * -DMTD_SIMULATOR sends its open/read/write/lseek/ioctl calls here: the
+ * simulated partition shows up in /proc/mtd as mtd0 and /dev/mtd/mtd0
+ * is the backing file.  Any other path goes to the real file system.
+ *
+ * Writes can only clear bits, like on NAND, so data written over a block
+ * that wasn't erased comes out wrong instead of silently working.
+ */
+
+typedef struct {
+    const char *image;          /* backing file, created if missing */
+    const char *name;           /* partition name in /proc/mtd */
+    unsigned int size;
+    unsigned int erase_size;
+    unsigned int write_size;
+
+    /* factory bad blocks, by block number */
+    const unsigned int *bad_blocks;
+    int bad_block_count;
+
+    /* chance of a corrected / uncorrectable ECC error per block read */
+    double ecc_soft_rate;
+    double ecc_hard_rate;
+    unsigned int seed;
+
+    /* simulated time, in microseconds, per page read or written, per
+     * block erased and per ioctl on top of that */
+    unsigned int read_latency;
+    unsigned int write_latency;
+    unsigned int erase_latency;
+    unsigned int ioctl_latency;
+} MtdSimConfig;
+
+typedef struct {
+    uint64_t reads;
+    uint64_t writes;
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    uint64_t ioctls;
+    uint64_t erase_ioctls;
+    uint64_t blocks_erased;
+    uint64_t bad_block_ioctls;
+    uint64_t ecc_soft;
+    uint64_t ecc_hard;
+} MtdSimStats;
+
+/* Sets up the simulated partition.  Returns 0 on success. */
+int mtdsim_init(const MtdSimConfig *config);
+void mtdsim_get_stats(MtdSimStats *stats);
+void mtdsim_reset_stats(void);
+
+int mtdsim_open(const char *path, int flags, ...);
+int mtdsim_close(int fd);
+ssize_t mtdsim_read(int fd, void *buf, size_t len);
+ssize_t mtdsim_write(int fd, const void *buf, size_t len);
+off_t mtdsim_lseek(int fd, off_t offset, int whence);
+off64_t mtdsim_lseek64(int fd, off64_t offset, int whence);
+int mtdsim_ioctl(int fd, unsigned long request, void *arg);
+
+#endif  // MTDSIM_H_
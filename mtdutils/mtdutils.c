@@ -14,6 +14,10 @@
  * limitations under the License.
  */
 
+#include <limits.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -27,58 +31,184 @@
 #include <assert.h>
 
 #include "mtdutils.h"
+#include "topology/proc_table.h"
+#include "topology/topology.h"
+
+#ifdef MTD_SIMULATOR
+// host builds (mtd_bench) run on the file backed flash of mtdsim.c
+#include "mtdsim.h"
+#define open(...)                   mtdsim_open(__VA_ARGS__)
+#define close(fd)                   mtdsim_close(fd)
+#define read(fd, buf, len)          mtdsim_read(fd, buf, len)
+#define write(fd, buf, len)         mtdsim_write(fd, buf, len)
+#define lseek(fd, offset, whence)   mtdsim_lseek(fd, offset, whence)
+#define lseek64(fd, offset, whence) mtdsim_lseek64(fd, offset, whence)
+#define ioctl(fd, request, arg)     mtdsim_ioctl(fd, request, (void *) (arg))
+#endif
 
 struct MtdReadContext {
     const MtdPartition *partition;
     char *buffer;
     size_t consumed;
     int fd;
+
+    // ECC counters after the last block read, to tell whether the
+    // next one had errors
+    struct mtd_ecc_stats ecc_stats;
+    int have_ecc_stats;
+
+    mtd_block_callback block_callback;
+    void *block_cookie;
+
+    // set by mtd_read_ahead()
+    struct MtdReadAhead *ahead;
 };
 
+// What became of one erase block, handed from the read-ahead thread to
+// the reader.
+typedef struct {
+    loff_t pos;
+    int status;
+    unsigned int corrected;
+    unsigned int failed;
+} MtdBlockRead;
+
+// Blocks read by a thread ahead of mtd_read_data(), in a ring of slots.
+// Skipped blocks take a slot too, so they are reported in order.
+typedef struct MtdReadAhead {
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int slots;
+    char *buffers;
+    MtdBlockRead *reads;
+    // slots filled by the thread and taken by the reader, counting from
+    // the start
+    unsigned int filled;
+    unsigned int taken;
+    loff_t pos;     // next block the thread reads
+    int stop;
+    int done;
+    int error;      // errno for the reader once the thread is done
+} MtdReadAhead;
+
+// most blocks erased at once by MTD_WRITE_ERASE_AHEAD, at most 64
+// (erased_mask)
+#define MTD_ERASE_AHEAD_BLOCKS  64
+
 struct MtdWriteContext {
     const MtdPartition *partition;
     char *buffer;
     size_t stored;
     int fd;
-
-    off_t* bad_block_offsets;
-    int bad_block_alloc;
-    int bad_block_count;
+    int flags;
+
+    // blocks are read back into this
+    char *verify;
+
+    // MTD_WRITE_DEFER_FIRST_BLOCK: the first block of data and the
+    // block it goes to, which the rest is written after, and whether that
+    // is still erased from reserve_first_block()
+    char *first_block;
+    size_t first_stored;
+    off_t first_block_pos;
+    int first_block_erased;
+
+    // MTD_WRITE_ERASE_AHEAD: bit n is set if the block at
+    // erased_start + n * erase_size has been erased and not written yet.
+    // erase_ahead() last looked at the blocks up to erased_end, and looks
+    // at erase_ahead_blocks next time.
+    off_t erased_start;
+    off_t erased_end;
+    unsigned long long erased_mask;
+    int erase_ahead_blocks;
+
+    // MTD_WRITE_DEFER_VERIFY: where every block went, and its checksum
+    off_t *written_offsets;
+    unsigned long long *written_sums;
+    int written_alloc;
+    int written_count;
 };
 
 typedef struct {
-    MtdPartition *partitions;
+    // each allocated once and kept, callers hold on to them across rescans
+    MtdPartition **partitions;
     int partitions_allocd;
     int partition_count;
+    // the TOPOLOGY_MTD generation the partitions were read at
+    unsigned int generation;
+    topology_index name_index;
+    // the partition names point into it
+    proc_table table;
 } MtdState;
 
 static MtdState g_mtd_state = {
     NULL,   // partitions
     0,      // partitions_allocd
-    -1      // partition_count
+    -1,     // partition_count
+    0,      // generation
+    { NULL, 0 },        // name_index
+    PROC_TABLE_INIT     // table
 };
 
+static const char *
+mtd_partition_name(const void *table, int i)
+{
+    const MtdPartition *p = ((MtdPartition *const *) table)[i];
+    return p->device_index >= 0 ? p->name : NULL;
+}
+
+// Makes room for partitions numbered below count.
+static int
+mtd_grow_partitions(int count)
+{
+    int nump = g_mtd_state.partitions_allocd ? g_mtd_state.partitions_allocd : 32;
+    int i;
+    while (nump < count) {
+        nump *= 2;
+    }
+    if (nump == g_mtd_state.partitions_allocd) {
+        return 0;
+    }
+    // only the array of pointers moves
+    MtdPartition **partitions = realloc(g_mtd_state.partitions, nump * sizeof(*partitions));
+    if (partitions == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    g_mtd_state.partitions = partitions;
+    for (i = g_mtd_state.partitions_allocd; i < nump; i++) {
+        partitions[i] = calloc(1, sizeof(MtdPartition));
+        if (partitions[i] == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        partitions[i]->device_index = -1;
+        g_mtd_state.partitions_allocd = i + 1;
+    }
+    return 0;
+}
+
 #define MTD_PROC_FILENAME   "/proc/mtd"
 
 int
 mtd_scan_partitions()
 {
-    char buf[2048];
-    const char *bufp;
+    char *line;
     int fd;
     int i;
-    ssize_t nbytes;
+    unsigned int generation;
 
-    if (g_mtd_state.partitions == NULL) {
-        const int nump = 32;
-        MtdPartition *partitions = malloc(nump * sizeof(*partitions));
-        if (partitions == NULL) {
-            errno = ENOMEM;
-            return -1;
-        }
-        g_mtd_state.partitions = partitions;
-        g_mtd_state.partitions_allocd = nump;
-        memset(partitions, 0, nump * sizeof(*partitions));
+    // /proc/mtd only changes when an mtd uevent says so
+    generation = topology_generation(TOPOLOGY_MTD);
+    if (g_mtd_state.partition_count >= 0 && g_mtd_state.generation == generation) {
+        return g_mtd_state.partition_count;
+    }
+    // a held generation means other threads may be reading the table
+    assert(!topology_held(TOPOLOGY_MTD));
+
+    if (mtd_grow_partitions(1) < 0) {
+        return -1;
     }
     g_mtd_state.partition_count = 0;
 
@@ -87,11 +217,8 @@ mtd_scan_partitions()
      * may not even be possible.)
      */
     for (i = 0; i < g_mtd_state.partitions_allocd; i++) {
-        MtdPartition *p = &g_mtd_state.partitions[i];
-        if (p->name != NULL) {
-            free(p->name);
-            p->name = NULL;
-        }
+        MtdPartition *p = g_mtd_state.partitions[i];
+        p->name = NULL;
         p->device_index = -1;
     }
 
@@ -101,12 +228,11 @@ mtd_scan_partitions()
     if (fd < 0) {
         goto bail;
     }
-    nbytes = read(fd, buf, sizeof(buf) - 1);
+    i = proc_table_read(&g_mtd_state.table, fd);
     close(fd);
-    if (nbytes < 0) {
+    if (i < 0) {
         goto bail;
     }
-    buf[nbytes] = '\0';
 
     /* Parse the contents of the file, which looks like:
      *
@@ -119,48 +245,49 @@ mtd_scan_partitions()
      *     mtd4: 04000000 00020000 "system"
      *     mtd5: 03280000 00020000 "userdata"
      */
-    bufp = buf;
-    while (nbytes > 0) {
-        int mtdnum, mtdsize, mtderasesize;
-        int matches;
-        char mtdname[64];
-        mtdname[0] = '\0';
-        mtdnum = -1;
-
-        matches = sscanf(bufp, "mtd%d: %x %x \"%63[^\"]",
-                &mtdnum, &mtdsize, &mtderasesize, mtdname);
+    while ((line = proc_table_line(&g_mtd_state.table)) != NULL) {
+        int mtdnum = -1, mtdsize, mtderasesize;
+        char *name, *end;
+
         /* This will fail on the first line, which just contains
          * column headers.
          */
-        if (matches == 4) {
-            MtdPartition *p = &g_mtd_state.partitions[mtdnum];
-            p->device_index = mtdnum;
-            p->size = mtdsize;
-            p->erase_size = mtderasesize;
-            p->name = strdup(mtdname);
-            if (p->name == NULL) {
-                errno = ENOMEM;
-                goto bail;
-            }
-            g_mtd_state.partition_count++;
+        if (sscanf(line, "mtd%d: %x %x", &mtdnum, &mtdsize, &mtderasesize) != 3 ||
+                mtdnum < 0) {
+            continue;
         }
-
-        /* Eat the line.
-         */
-        while (nbytes > 0 && *bufp != '\n') {
-            bufp++;
-            nbytes--;
+        name = strchr(line, '"');
+        end = name != NULL ? strchr(name + 1, '"') : NULL;
+        if (end == NULL) {
+            continue;
         }
-        if (nbytes > 0) {
-            bufp++;
-            nbytes--;
+        *end = '\0';
+        if (mtd_grow_partitions(mtdnum + 1) < 0) {
+            goto bail;
         }
+
+        MtdPartition *p = g_mtd_state.partitions[mtdnum];
+        p->device_index = mtdnum;
+        if (p->size != (unsigned int) mtdsize || p->erase_size != (unsigned int) mtderasesize) {
+            // not the partition the block states were for
+            free(p->block_states);
+            p->block_states = NULL;
+        }
+        p->size = mtdsize;
+        p->erase_size = mtderasesize;
+        p->name = name + 1;
+        g_mtd_state.partition_count++;
     }
 
+    if (topology_index_build(&g_mtd_state.name_index, g_mtd_state.partitions,
+            g_mtd_state.partitions_allocd, mtd_partition_name) < 0) {
+        errno = ENOMEM;
+        goto bail;
+    }
+    g_mtd_state.generation = generation;
     return g_mtd_state.partition_count;
 
 bail:
-    // keep "partitions" around so we can free the names on a rescan.
     g_mtd_state.partition_count = -1;
     return -1;
 }
@@ -168,15 +295,11 @@ bail:
 const MtdPartition *
 mtd_find_partition_by_name(const char *name)
 {
-    if (g_mtd_state.partitions != NULL) {
-        int i;
-        for (i = 0; i < g_mtd_state.partitions_allocd; i++) {
-            MtdPartition *p = &g_mtd_state.partitions[i];
-            if (p->device_index >= 0 && p->name != NULL) {
-                if (strcmp(p->name, name) == 0) {
-                    return p;
-                }
-            }
+    if (g_mtd_state.partitions != NULL && g_mtd_state.partition_count >= 0) {
+        int i = topology_index_find(&g_mtd_state.name_index,
+                g_mtd_state.partitions, mtd_partition_name, name);
+        if (i >= 0) {
+            return g_mtd_state.partitions[i];
         }
     }
     return NULL;
@@ -203,6 +326,9 @@ mtd_mount_partition(const MtdPartition *partition, const char *mount_point,
             printf("Mount %s on %s read-only\n", devname, mount_point);
         }
     }
+    if (rv >= 0) {
+        topology_invalidate(TOPOLOGY_MOUNTS);
+    }
 #if 1   //TODO: figure out why this is happening; remove include of stat.h
     if (rv >= 0) {
         /* For some reason, the x bits sometimes aren't set on the root
@@ -247,6 +373,49 @@ mtd_partition_info(const MtdPartition *partition,
     return 0;
 }
 
+#define MTD_BLOCK_UNKNOWN   0
+#define MTD_BLOCK_GOOD      1
+#define MTD_BLOCK_BAD       2
+
+// Returns 1 if the block at pos is bad, asking the driver only the first
+// time.  Errors other than EOPNOTSUPP count as bad but aren't cached.
+static int block_is_bad(const MtdPartition *partition, int fd, loff_t pos)
+{
+    // the partition is const to the callers, the states are just a cache
+    MtdPartition *p = (MtdPartition *) partition;
+    size_t count = partition->size / partition->erase_size;
+    size_t block = pos / partition->erase_size;
+    if (p->block_states == NULL)
+        p->block_states = calloc(count, 1);
+    if (p->block_states != NULL && block < count &&
+        p->block_states[block] != MTD_BLOCK_UNKNOWN)
+        return p->block_states[block] == MTD_BLOCK_BAD;
+
+    int state;
+    int ret = ioctl(fd, MEMGETBADBLOCK, &pos);
+    if (ret == 0 || (ret == -1 && errno == EOPNOTSUPP)) {
+        state = MTD_BLOCK_GOOD;
+    } else if (ret > 0) {
+        state = MTD_BLOCK_BAD;
+    } else {
+        fprintf(stderr, "mtd: MEMGETBADBLOCK error at 0x%08llx (%s)\n",
+                (unsigned long long) pos, strerror(errno));
+        return 1;
+    }
+    if (p->block_states != NULL && block < count)
+        p->block_states[block] = state;
+    return state == MTD_BLOCK_BAD;
+}
+
+// Stops anything else from using a block a write gave up on.
+static void mark_block_bad(const MtdPartition *partition, off_t pos)
+{
+    MtdPartition *p = (MtdPartition *) partition;
+    size_t block = pos / partition->erase_size;
+    if (p->block_states != NULL && block < partition->size / partition->erase_size)
+        p->block_states[block] = MTD_BLOCK_BAD;
+}
+
 MtdReadContext *mtd_read_partition(const MtdPartition *partition)
 {
     MtdReadContext *ctx = (MtdReadContext*) malloc(sizeof(MtdReadContext));
@@ -262,55 +431,270 @@ MtdReadContext *mtd_read_partition(const MtdPartition *partition)
     sprintf(mtddevname, "/dev/mtd/mtd%d", partition->device_index);
     ctx->fd = open(mtddevname, O_RDONLY);
     if (ctx->fd < 0) {
-        free(ctx);
         free(ctx->buffer);
+        free(ctx);
         return NULL;
     }
 
     ctx->partition = partition;
     ctx->consumed = partition->erase_size;
+    ctx->have_ecc_stats = 0;
+    ctx->block_callback = NULL;
+    ctx->ahead = NULL;
     return ctx;
 }
 
+void mtd_read_set_block_callback(MtdReadContext *ctx, mtd_block_callback callback, void *cookie)
+{
+    ctx->block_callback = callback;
+    ctx->block_cookie = cookie;
+}
+
+static void report_block(MtdReadContext *ctx, const MtdBlockRead *r)
+{
+    if (ctx->block_callback != NULL)
+        ctx->block_callback(r->pos, r->status, r->corrected, r->failed, ctx->block_cookie);
+}
+
+int mtd_block_is_erased(const char *data, size_t len)
+{
+    const unsigned char *p = (const unsigned char *) data;
+    while (len > 0 && ((uintptr_t) p & 7) != 0) {
+        if (*p++ != 0xff) return 0;
+        len--;
+    }
+    const uint64_t *w = (const uint64_t *) p;
+    for (; len >= 8; len -= 8) {
+        if (*w++ != ~(uint64_t) 0) return 0;
+    }
+    p = (const unsigned char *) w;
+    while (len-- > 0) {
+        if (*p++ != 0xff) return 0;
+    }
+    return 1;
+}
+
+static int read_ecc_baseline(MtdReadContext *ctx)
+{
+    if (!ctx->have_ecc_stats) {
+        if (ioctl(ctx->fd, ECCGETSTATS, &ctx->ecc_stats)) {
+            fprintf(stderr, "mtd: ECCGETSTATS error (%s)\n", strerror(errno));
+            return -1;
+        }
+        ctx->have_ecc_stats = 1;
+    }
+    return 0;
+}
+
+// Reads the block at pos into data, or finds out why it can't.  Only
+// returns -1 if the ECC counters can't be read.
+static int read_one_block(MtdReadContext *ctx, loff_t pos, char *data, MtdBlockRead *r)
+{
+    const MtdPartition *partition = ctx->partition;
+    int fd = ctx->fd;
+    ssize_t size = partition->erase_size;
+    struct mtd_ecc_stats after;
+
+    r->pos = pos;
+    r->corrected = 0;
+    r->failed = 0;
+    if (block_is_bad(partition, fd, pos)) {
+        fprintf(stderr, "mtd: skipping bad block at 0x%08llx\n", (unsigned long long) pos);
+        r->status = MTD_BLOCK_SKIPPED_BAD;
+        return 0;
+    }
+    if (lseek64(fd, pos, SEEK_SET) != pos || read(fd, data, size) != size) {
+        fprintf(stderr, "mtd: read error at 0x%08llx (%s)\n",
+                (unsigned long long) pos, strerror(errno));
+        r->status = MTD_BLOCK_SKIPPED_ERROR;
+        return 0;
+    }
+    if (ioctl(fd, ECCGETSTATS, &after)) {
+        fprintf(stderr, "mtd: ECCGETSTATS error (%s)\n", strerror(errno));
+        return -1;
+    }
+    r->corrected = after.corrected - ctx->ecc_stats.corrected;
+    r->failed = after.failed - ctx->ecc_stats.failed;
+    // the baseline for the next read.
+    ctx->ecc_stats = after;
+    if (r->failed != 0) {
+        fprintf(stderr, "mtd: ECC errors (%d soft, %d hard) at 0x%08llx\n",
+                r->corrected, r->failed, (unsigned long long) pos);
+        r->status = MTD_BLOCK_SKIPPED_ERROR;
+    } else if (ctx->block_callback != NULL && mtd_block_is_erased(data, size)) {
+        r->status = MTD_BLOCK_ERASED;
+    } else {
+        r->status = MTD_BLOCK_READ;
+    }
+    return 0;
+}
+
+static void *read_ahead_thread(void *cookie)
+{
+    MtdReadContext *ctx = (MtdReadContext *) cookie;
+    MtdReadAhead *ahead = ctx->ahead;
+    const MtdPartition *partition = ctx->partition;
+    size_t size = partition->erase_size;
+    int error = 0;
+
+    if (read_ecc_baseline(ctx))
+        error = errno ? errno : EIO;
+    pthread_mutex_lock(&ahead->mutex);
+    while (!error && !ahead->stop &&
+           ahead->pos + size <= partition->size) {
+        if (ahead->filled - ahead->taken == (unsigned int) ahead->slots) {
+            pthread_cond_wait(&ahead->cond, &ahead->mutex);
+            continue;
+        }
+        int slot = ahead->filled % ahead->slots;
+        loff_t pos = ahead->pos;
+        pthread_mutex_unlock(&ahead->mutex);
+
+        int r = read_one_block(ctx, pos, ahead->buffers + slot * size, &ahead->reads[slot]);
+
+        pthread_mutex_lock(&ahead->mutex);
+        if (r) {
+            error = errno ? errno : EIO;
+            break;
+        }
+        ahead->filled++;
+        ahead->pos = pos + size;
+        pthread_cond_signal(&ahead->cond);
+    }
+    ahead->done = 1;
+    ahead->error = error ? error : ENOSPC;
+    pthread_cond_signal(&ahead->cond);
+    pthread_mutex_unlock(&ahead->mutex);
+    return NULL;
+}
+
+int mtd_read_ahead(MtdReadContext *ctx, int blocks)
+{
+    if (ctx->ahead != NULL || blocks <= 0)
+        return 0;
+
+    MtdReadAhead *ahead = calloc(1, sizeof(MtdReadAhead));
+    if (ahead == NULL)
+        return -1;
+    ahead->slots = blocks;
+    ahead->buffers = malloc((size_t) blocks * ctx->partition->erase_size);
+    ahead->reads = malloc(blocks * sizeof(MtdBlockRead));
+    ahead->pos = lseek64(ctx->fd, 0, SEEK_CUR);
+    if (ahead->buffers == NULL || ahead->reads == NULL || ahead->pos < 0) {
+        free(ahead->buffers);
+        free(ahead->reads);
+        free(ahead);
+        return -1;
+    }
+    pthread_mutex_init(&ahead->mutex, NULL);
+    pthread_cond_init(&ahead->cond, NULL);
+
+    ctx->ahead = ahead;
+    if (pthread_create(&ahead->thread, NULL, read_ahead_thread, ctx) != 0) {
+        ctx->ahead = NULL;
+        pthread_mutex_destroy(&ahead->mutex);
+        pthread_cond_destroy(&ahead->cond);
+        free(ahead->buffers);
+        free(ahead->reads);
+        free(ahead);
+        return -1;
+    }
+    return 0;
+}
+
+// Stops the read-ahead thread and leaves the fd at the first block the
+// reader hasn't taken yet.  Returns how many blocks it read ahead.
+static int stop_read_ahead(MtdReadContext *ctx)
+{
+    MtdReadAhead *ahead = ctx->ahead;
+    if (ahead == NULL)
+        return 0;
+
+    pthread_mutex_lock(&ahead->mutex);
+    ahead->stop = 1;
+    pthread_cond_signal(&ahead->cond);
+    pthread_mutex_unlock(&ahead->mutex);
+    pthread_join(ahead->thread, NULL);
+
+    loff_t pos = ahead->pos;
+    if (ahead->filled != ahead->taken)
+        pos = ahead->reads[ahead->taken % ahead->slots].pos;
+    lseek64(ctx->fd, pos, SEEK_SET);
+
+    int blocks = ahead->slots;
+    pthread_mutex_destroy(&ahead->mutex);
+    pthread_cond_destroy(&ahead->cond);
+    free(ahead->buffers);
+    free(ahead->reads);
+    free(ahead);
+    ctx->ahead = NULL;
+    return blocks;
+}
+
 // Seeks to a location in the partition.  Don't mix with reads of
 // anything other than whole blocks; unpredictable things will result.
-void mtd_read_skip_to(const MtdReadContext* ctx, size_t offset) {
+void mtd_read_skip_to(MtdReadContext* ctx, size_t offset) {
+    int blocks = stop_read_ahead(ctx);
     lseek64(ctx->fd, offset, SEEK_SET);
+    mtd_read_ahead(ctx, blocks);
 }
 
-static int read_block(const MtdPartition *partition, int fd, char *data)
+// Takes the next block the read-ahead thread read, reporting the ones it
+// had to skip on the way.
+static int take_read_ahead_block(MtdReadContext *ctx, char *data)
 {
-    struct mtd_ecc_stats before, after;
-    if (ioctl(fd, ECCGETSTATS, &before)) {
-        fprintf(stderr, "mtd: ECCGETSTATS error (%s)\n", strerror(errno));
-        return -1;
+    MtdReadAhead *ahead = ctx->ahead;
+    size_t size = ctx->partition->erase_size;
+
+    pthread_mutex_lock(&ahead->mutex);
+    for (;;) {
+        while (ahead->filled == ahead->taken && !ahead->done)
+            pthread_cond_wait(&ahead->cond, &ahead->mutex);
+        if (ahead->filled == ahead->taken) {
+            errno = ahead->error;
+            pthread_mutex_unlock(&ahead->mutex);
+            return -1;
+        }
+        int slot = ahead->taken % ahead->slots;
+        pthread_mutex_unlock(&ahead->mutex);
+
+        // the thread leaves the slot alone until it is taken
+        const MtdBlockRead *r = &ahead->reads[slot];
+        int got = r->status == MTD_BLOCK_READ || r->status == MTD_BLOCK_ERASED;
+        report_block(ctx, r);
+        if (got)
+            memcpy(data, ahead->buffers + slot * size, size);
+
+        pthread_mutex_lock(&ahead->mutex);
+        ahead->taken++;
+        pthread_cond_signal(&ahead->cond);
+        if (got) {
+            pthread_mutex_unlock(&ahead->mutex);
+            return 0;
+        }
     }
+}
+
+static int read_block(MtdReadContext *ctx, char *data)
+{
+    if (ctx->ahead != NULL)
+        return take_read_ahead_block(ctx, data);
 
-    loff_t pos = lseek64(fd, 0, SEEK_CUR);
+    const MtdPartition *partition = ctx->partition;
+    if (read_ecc_baseline(ctx))
+        return -1;
+
+    loff_t pos = lseek64(ctx->fd, 0, SEEK_CUR);
 
     ssize_t size = partition->erase_size;
-    int mgbb;
 
     while (pos + size <= (int) partition->size) {
-        if (lseek64(fd, pos, SEEK_SET) != pos || read(fd, data, size) != size) {
-            fprintf(stderr, "mtd: read error at 0x%08llx (%s)\n",
-                    pos, strerror(errno));
-        } else if (ioctl(fd, ECCGETSTATS, &after)) {
-            fprintf(stderr, "mtd: ECCGETSTATS error (%s)\n", strerror(errno));
+        MtdBlockRead r;
+        if (read_one_block(ctx, pos, data, &r))
             return -1;
-        } else if (after.failed != before.failed) {
-            fprintf(stderr, "mtd: ECC errors (%d soft, %d hard) at 0x%08llx\n",
-                    after.corrected - before.corrected,
-                    after.failed - before.failed, pos);
-            // copy the comparison baseline for the next read.
-            memcpy(&before, &after, sizeof(struct mtd_ecc_stats));
-        } else if ((mgbb = ioctl(fd, MEMGETBADBLOCK, &pos))) {
-            fprintf(stderr,
-                    "mtd: MEMGETBADBLOCK returned %d at 0x%08llx (errno=%d)\n",
-                    mgbb, pos, errno);
-        } else {
+        report_block(ctx, &r);
+        if (r.status == MTD_BLOCK_READ || r.status == MTD_BLOCK_ERASED)
             return 0;  // Success!
-        }
 
         pos += partition->erase_size;
     }
@@ -334,7 +718,7 @@ ssize_t mtd_read_data(MtdReadContext *ctx, char *data, size_t len)
         // Read complete blocks directly into the user's buffer
         while (ctx->consumed == ctx->partition->erase_size &&
                len - read >= ctx->partition->erase_size) {
-            if (read_block(ctx->partition, ctx->fd, data + read)) return -1;
+            if (read_block(ctx, data + read)) return -1;
             read += ctx->partition->erase_size;
         }
 
@@ -344,7 +728,7 @@ ssize_t mtd_read_data(MtdReadContext *ctx, char *data, size_t len)
 
         // Read the next block into the buffer
         if (ctx->consumed == ctx->partition->erase_size && read < (int) len) {
-            if (read_block(ctx->partition, ctx->fd, ctx->buffer)) return -1;
+            if (read_block(ctx, ctx->buffer)) return -1;
             ctx->consumed = 0;
         }
     }
@@ -354,6 +738,7 @@ ssize_t mtd_read_data(MtdReadContext *ctx, char *data, size_t len)
 
 void mtd_read_close(MtdReadContext *ctx)
 {
+    stop_read_ahead(ctx);
     close(ctx->fd);
     free(ctx->buffer);
     free(ctx);
@@ -361,15 +746,50 @@ void mtd_read_close(MtdReadContext *ctx)
 
 MtdWriteContext *mtd_write_partition(const MtdPartition *partition)
 {
-    MtdWriteContext *ctx = (MtdWriteContext*) malloc(sizeof(MtdWriteContext));
-    if (ctx == NULL) return NULL;
+    return mtd_write_partition_flags(partition, 0);
+}
 
-    ctx->bad_block_offsets = NULL;
-    ctx->bad_block_alloc = 0;
-    ctx->bad_block_count = 0;
+// Erases the first good block for MTD_WRITE_DEFER_FIRST_BLOCK and moves
+// the write position past it.
+static int reserve_first_block(MtdWriteContext *ctx)
+{
+    const MtdPartition *partition = ctx->partition;
+    off_t pos = 0;
+    while (pos + partition->erase_size <= partition->size) {
+        if (!block_is_bad(partition, ctx->fd, pos)) {
+            struct erase_info_user erase_info;
+            erase_info.start = pos;
+            erase_info.length = partition->erase_size;
+            int retry;
+            for (retry = 0; retry < 2; ++retry) {
+                if (ioctl(ctx->fd, MEMERASE, &erase_info) == 0) {
+                    ctx->first_block_pos = pos;
+                    ctx->first_block_erased = 1;
+                    pos += partition->erase_size;
+                    return lseek(ctx->fd, pos, SEEK_SET) == pos ? 0 : -1;
+                }
+                fprintf(stderr, "mtd: erase failure at 0x%08lx (%s)\n",
+                        pos, strerror(errno));
+            }
+            fprintf(stderr, "mtd: skipping write block at 0x%08lx\n", pos);
+            mark_block_bad(partition, pos);
+        }
+        pos += partition->erase_size;
+    }
+    errno = ENOSPC;
+    return -1;
+}
+
+MtdWriteContext *mtd_write_partition_flags(const MtdPartition *partition, int flags)
+{
+    MtdWriteContext *ctx = (MtdWriteContext*) calloc(1, sizeof(MtdWriteContext));
+    if (ctx == NULL) return NULL;
 
     ctx->buffer = malloc(partition->erase_size);
-    if (ctx->buffer == NULL) {
+    ctx->verify = malloc(partition->erase_size);
+    if (ctx->buffer == NULL || ctx->verify == NULL) {
+        free(ctx->buffer);
+        free(ctx->verify);
         free(ctx);
         return NULL;
     }
@@ -379,25 +799,125 @@ MtdWriteContext *mtd_write_partition(const MtdPartition *partition)
     ctx->fd = open(mtddevname, O_RDWR);
     if (ctx->fd < 0) {
         free(ctx->buffer);
+        free(ctx->verify);
         free(ctx);
         return NULL;
     }
 
     ctx->partition = partition;
     ctx->stored = 0;
+    ctx->flags = flags;
+
+    if (flags & MTD_WRITE_DEFER_FIRST_BLOCK) {
+        ctx->first_block = malloc(partition->erase_size);
+        if (ctx->first_block == NULL || reserve_first_block(ctx)) {
+            close(ctx->fd);
+            free(ctx->first_block);
+            free(ctx->buffer);
+            free(ctx->verify);
+            free(ctx);
+            return NULL;
+        }
+    }
     return ctx;
 }
 
-static void add_bad_block_offset(MtdWriteContext *ctx, off_t pos) {
-    if (ctx->bad_block_count + 1 > ctx->bad_block_alloc) {
-        ctx->bad_block_alloc = (ctx->bad_block_alloc*2) + 1;
-        ctx->bad_block_offsets = realloc(ctx->bad_block_offsets,
-                                         ctx->bad_block_alloc * sizeof(off_t));
+// Fletcher style sum of 64-bit words, erase_size is always a multiple of
+// 8.  Any single flipped bit changes it, which is what a bad write does.
+static unsigned long long block_checksum(const char *data, size_t len)
+{
+    unsigned long long a = 0, b = 0, word;
+    size_t i;
+    for (i = 0; i + sizeof(word) <= len; i += sizeof(word)) {
+        memcpy(&word, data + i, sizeof(word));
+        a += word;
+        b += a;
     }
-    ctx->bad_block_offsets[ctx->bad_block_count++] = pos;
+    return a ^ (b << 32 | b >> 32);
 }
 
-static int write_block(MtdWriteContext *ctx, const char *data)
+static int add_written_block(MtdWriteContext *ctx, off_t pos, const char *data) {
+    if (ctx->written_count + 1 > ctx->written_alloc) {
+        int alloc = ctx->written_alloc * 2 + 64;
+        off_t *offsets = realloc(ctx->written_offsets, alloc * sizeof(off_t));
+        if (offsets == NULL) return -1;
+        ctx->written_offsets = offsets;
+        unsigned long long *sums = realloc(ctx->written_sums, alloc * sizeof(unsigned long long));
+        if (sums == NULL) return -1;
+        ctx->written_sums = sums;
+        ctx->written_alloc = alloc;
+    }
+    ctx->written_offsets[ctx->written_count] = pos;
+    ctx->written_sums[ctx->written_count] = block_checksum(data, ctx->partition->erase_size);
+    ctx->written_count++;
+    return 0;
+}
+
+// Erases the good blocks among the next erase_ahead_blocks from pos on,
+// each run of them with a single MEMERASE.  Blocks that fail to erase
+// here are left to write_block.  The window doubles each time up to
+// MTD_ERASE_AHEAD_BLOCKS, so a short image doesn't erase far past its end.
+static void erase_ahead(MtdWriteContext *ctx, off_t pos)
+{
+    const MtdPartition *partition = ctx->partition;
+    if (ctx->erase_ahead_blocks == 0)
+        ctx->erase_ahead_blocks = 1;
+    off_t end = pos + ctx->erase_ahead_blocks * partition->erase_size;
+    if (ctx->erase_ahead_blocks < MTD_ERASE_AHEAD_BLOCKS)
+        ctx->erase_ahead_blocks *= 2;
+    if (end > (off_t) partition->size)
+        end = partition->size - partition->size % partition->erase_size;
+
+    ctx->erased_start = pos;
+    ctx->erased_end = end;
+    ctx->erased_mask = 0;
+    while (pos < end) {
+        // find the run of good blocks starting at pos
+        off_t run_end = pos;
+        while (run_end < end && !block_is_bad(partition, ctx->fd, run_end))
+            run_end += partition->erase_size;
+
+        if (run_end > pos) {
+            struct erase_info_user erase_info;
+            erase_info.start = pos;
+            erase_info.length = run_end - pos;
+            if (ioctl(ctx->fd, MEMERASE, &erase_info) == 0) {
+                off_t bpos;
+                for (bpos = pos; bpos < run_end; bpos += partition->erase_size)
+                    ctx->erased_mask |= 1ULL << ((bpos - ctx->erased_start) / partition->erase_size);
+            } else {
+                fprintf(stderr, "mtd: erase failure at 0x%08lx-0x%08lx (%s)\n",
+                        pos, run_end, strerror(errno));
+            }
+        }
+        // skip the bad block that ended the run
+        pos = run_end + partition->erase_size;
+    }
+}
+
+// Returns 1 if reserve_first_block() or erase_ahead() erased the block at
+// pos, and forgets it: it is about to be written.
+static int take_erased_block(MtdWriteContext *ctx, off_t pos)
+{
+    if (ctx->first_block_erased && pos == ctx->first_block_pos) {
+        ctx->first_block_erased = 0;
+        return 1;
+    }
+    if (!(ctx->flags & MTD_WRITE_ERASE_AHEAD))
+        return 0;
+    if (pos < ctx->erased_start || pos >= ctx->erased_end)
+        erase_ahead(ctx, pos);
+    off_t block = (pos - ctx->erased_start) / (off_t) ctx->partition->erase_size;
+    unsigned long long bit = 1ULL << block;
+    if (!(ctx->erased_mask & bit))
+        return 0;
+    ctx->erased_mask &= ~bit;
+    return 1;
+}
+
+// Writes a block at the current position, or the first good block after
+// it that takes the write and ends by end.
+static int write_block_before(MtdWriteContext *ctx, const char *data, off_t end)
 {
     const MtdPartition *partition = ctx->partition;
     int fd = ctx->fd;
@@ -406,19 +926,13 @@ static int write_block(MtdWriteContext *ctx, const char *data)
     if (pos == (off_t) -1) return 1;
 
     ssize_t size = partition->erase_size;
+    char *verify = ctx->verify;
+    // an erased block reads back as 0xff already, nothing to program
+    int blank = mtd_block_is_erased(data, size);
 
-    char *verify = malloc(size);
-    if (verify == NULL)
-        return 1;
-
-    while (pos + size <= (int) partition->size) {
-        loff_t bpos = pos;
-        int ret = ioctl(fd, MEMGETBADBLOCK, &bpos);
-        if (ret != 0 && !(ret == -1 && errno == EOPNOTSUPP)) {
-            add_bad_block_offset(ctx, pos);
-            fprintf(stderr,
-                    "mtd: not writing bad block at 0x%08lx (ret %d errno %d)\n",
-                    pos, ret, errno);
+    while (pos + size <= end) {
+        if (block_is_bad(partition, fd, pos)) {
+            fprintf(stderr, "mtd: not writing bad block at 0x%08lx\n", pos);
             pos += partition->erase_size;
             continue;  // Don't try to erase known factory-bad blocks.
         }
@@ -426,17 +940,28 @@ static int write_block(MtdWriteContext *ctx, const char *data)
         struct erase_info_user erase_info;
         erase_info.start = pos;
         erase_info.length = size;
+        int erased = take_erased_block(ctx, pos);
         int retry;
         for (retry = 0; retry < 2; ++retry) {
-            if (ioctl(fd, MEMERASE, &erase_info) < 0) {
+            if (!(retry == 0 && erased) && ioctl(fd, MEMERASE, &erase_info) < 0) {
                 fprintf(stderr, "mtd: erase failure at 0x%08lx (%s)\n",
                         pos, strerror(errno));
                 continue;
             }
-            if (lseek(fd, pos, SEEK_SET) != pos ||
-                write(fd, data, size) != size) {
+            off_t next = blank ? pos + size : pos;
+            if (lseek(fd, next, SEEK_SET) != next ||
+                (!blank && write(fd, data, size) != size)) {
                 fprintf(stderr, "mtd: write error at 0x%08lx (%s)\n",
                         pos, strerror(errno));
+                if (ctx->flags & MTD_WRITE_DEFER_VERIFY)
+                    continue;
+            }
+
+            if (ctx->flags & MTD_WRITE_DEFER_VERIFY) {
+                // checked by mtd_write_close()
+                if (add_written_block(ctx, pos, data))
+                    return -1;
+                return 0;
             }
 
             if (lseek(fd, pos, SEEK_SET) != pos ||
@@ -454,28 +979,36 @@ static int write_block(MtdWriteContext *ctx, const char *data)
             if (retry > 0) {
                 fprintf(stderr, "mtd: wrote block after %d retries\n", retry);
             }
-            fprintf(stderr, "mtd: successfully wrote block at %llx\n", pos);
-            free(verify);
+            fprintf(stderr, "mtd: successfully wrote block at %llx\n", (unsigned long long) pos);
             return 0;  // Success!
         }
 
         // Try to erase it once more as we give up on this block
-        add_bad_block_offset(ctx, pos);
+        mark_block_bad(partition, pos);
         fprintf(stderr, "mtd: skipping write block at 0x%08lx\n", pos);
         ioctl(fd, MEMERASE, &erase_info);
         pos += partition->erase_size;
     }
 
-    free(verify);
-
     // Ran out of space on the device
     errno = ENOSPC;
     return -1;
 }
 
+static int write_block(MtdWriteContext *ctx, const char *data)
+{
+    return write_block_before(ctx, data, ctx->partition->size);
+}
+
 ssize_t mtd_write_data(MtdWriteContext *ctx, const char *data, size_t len)
 {
     size_t wrote = 0;
+    if (ctx->first_block != NULL && ctx->first_stored < ctx->partition->erase_size) {
+        size_t avail = ctx->partition->erase_size - ctx->first_stored;
+        wrote = len < avail ? len : avail;
+        memcpy(ctx->first_block + ctx->first_stored, data, wrote);
+        ctx->first_stored += wrote;
+    }
     while (wrote < len) {
         // Coalesce partial writes into complete blocks
         if (ctx->stored > 0 || len - wrote < ctx->partition->erase_size) {
@@ -524,8 +1057,7 @@ off_t mtd_erase_blocks(MtdWriteContext *ctx, int blocks)
 
     // Erase the specified number of blocks
     while (blocks-- > 0) {
-        loff_t bpos = pos;
-        if (ioctl(ctx->fd, MEMGETBADBLOCK, &bpos) > 0) {
+        if (block_is_bad(ctx->partition, ctx->fd, pos)) {
             fprintf(stderr, "mtd: not erasing bad block at 0x%08lx\n", pos);
             pos += ctx->partition->erase_size;
             continue;  // Don't try to erase known factory-bad blocks.
@@ -543,44 +1075,89 @@ off_t mtd_erase_blocks(MtdWriteContext *ctx, int blocks)
     return pos;
 }
 
+// Reads back the blocks MTD_WRITE_DEFER_VERIFY wrote, in one pass.
+static int verify_written_blocks(MtdWriteContext *ctx)
+{
+    ssize_t size = ctx->partition->erase_size;
+    int i, r = 0;
+    for (i = 0; i < ctx->written_count; ++i) {
+        off_t pos = ctx->written_offsets[i];
+        if (lseek(ctx->fd, pos, SEEK_SET) != pos ||
+            read(ctx->fd, ctx->verify, size) != size) {
+            fprintf(stderr, "mtd: re-read error at 0x%08lx (%s)\n",
+                    pos, strerror(errno));
+            r = -1;
+        } else if (block_checksum(ctx->verify, size) != ctx->written_sums[i]) {
+            fprintf(stderr, "mtd: verification error at 0x%08lx\n", pos);
+            r = -1;
+        }
+    }
+    if (r) errno = EIO;
+    return r;
+}
+
+// Writes the block MTD_WRITE_DEFER_FIRST_BLOCK held back into the block
+// reserved for it, and nowhere else: the rest of the data follows it.
+static int write_first_block(MtdWriteContext *ctx)
+{
+    if (ctx->first_block == NULL || ctx->first_stored == 0)
+        return 0;
+    size_t size = ctx->partition->erase_size;
+    memset(ctx->first_block + ctx->first_stored, 0, size - ctx->first_stored);
+    // nothing left to erase ahead for
+    ctx->flags &= ~MTD_WRITE_ERASE_AHEAD;
+    if (lseek(ctx->fd, ctx->first_block_pos, SEEK_SET) != ctx->first_block_pos)
+        return -1;
+    return write_block_before(ctx, ctx->first_block, ctx->first_block_pos + size);
+}
+
+static int free_write_context(MtdWriteContext *ctx)
+{
+    int r = close(ctx->fd) ? -1 : 0;
+    free(ctx->first_block);
+    free(ctx->written_offsets);
+    free(ctx->written_sums);
+    free(ctx->verify);
+    free(ctx->buffer);
+    free(ctx);
+    return r;
+}
+
 int mtd_write_close(MtdWriteContext *ctx)
 {
     int r = 0;
     // Make sure any pending data gets written
     if (mtd_erase_blocks(ctx, 0) == (off_t) -1) r = -1;
-    if (close(ctx->fd)) r = -1;
-    free(ctx->bad_block_offsets);
-    free(ctx->buffer);
-    free(ctx);
+    if (r == 0 && write_first_block(ctx)) r = -1;
+    if (r == 0 && verify_written_blocks(ctx)) r = -1;
+    if (free_write_context(ctx)) r = -1;
     return r;
 }
 
+void mtd_write_abort(MtdWriteContext *ctx)
+{
+    free_write_context(ctx);
+}
+
 /* Return the offset of the first good block at or after pos (which
  * might be pos itself).
  */
 off_t mtd_find_write_start(MtdWriteContext *ctx, off_t pos) {
-    int i;
-    for (i = 0; i < ctx->bad_block_count; ++i) {
-        if (ctx->bad_block_offsets[i] == pos) {
-            pos += ctx->partition->erase_size;
-        } else if (ctx->bad_block_offsets[i] > pos) {
-            return pos;
-        }
+    while (pos + ctx->partition->erase_size <= ctx->partition->size &&
+           block_is_bad(ctx->partition, ctx->fd, pos)) {
+        pos += ctx->partition->erase_size;
     }
     return pos;
 }
 
-#define BLOCK_SIZE    2048
-#define SPARE_SIZE    (BLOCK_SIZE >> 5)
-#define HEADER_SIZE 2048
-
-int cmd_mtd_restore_raw_partition(const char *partition_name, const char *filename)
+// The image goes in in a single pass: the context holds back its first
+// block, where the header is, and writes it at close once everything
+// else is on flash.
+//
+// Returns -2 if the data was written but mtd_write_close() failed, which
+// with MTD_WRITE_DEFER_VERIFY means a block didn't read back right.
+static int mtd_restore_raw_partition(const char *partition_name, const char *filename, int flags)
 {
-    const MtdPartition *ptn;
-    MtdWriteContext *write;
-    void *data;
-    unsigned sz;
-
     if (mtd_scan_partitions() <= 0)
     {
         printf("error scanning partitions");
@@ -600,123 +1177,169 @@ int cmd_mtd_restore_raw_partition(const char *partition_name, const char *filena
         return -1;
     }
 
-    char header[HEADER_SIZE];
-    int headerlen = read(fd, header, sizeof(header));
-    if (headerlen <= 0)
-    {
-        printf("error reading %s header", filename);
-        return -1;
-    }
-
-    // Skip the header (we'll come back to it), write everything else
     printf("flashing %s from %s\n", partition_name, filename);
 
-    MtdWriteContext *out = mtd_write_partition(partition);
+    MtdWriteContext *out = mtd_write_partition_flags(partition, flags | MTD_WRITE_DEFER_FIRST_BLOCK);
     if (out == NULL)
-    {
-       printf("error writing %s", partition_name);
-       return -1;
-    }
-
-    char buf[HEADER_SIZE];
-    memset(buf, 0, headerlen);
-    int wrote = mtd_write_data(out, buf, headerlen);
-    if (wrote != headerlen)
     {
         printf("error writing %s", partition_name);
+        close(fd);
         return -1;
     }
 
+    char buf[4096];
     int len;
     while ((len = read(fd, buf, sizeof(buf))) > 0) {
-        wrote = mtd_write_data(out, buf, len);
-        if (wrote != len)
+        if (mtd_write_data(out, buf, len) != len)
         {
+            // not closed: that would write the header over half an image
             printf("error writing %s", partition_name);
+            mtd_write_abort(out);
+            close(fd);
             return -1;
         }
     }
     if (len < 0)
     {
-       printf("error reading %s", filename);
-       return -1;
+        printf("error reading %s", filename);
+        mtd_write_abort(out);
+        close(fd);
+        return -1;
     }
+    close(fd);
 
     if (mtd_write_close(out))
     {
         printf("error closing %s", partition_name);
-        return -1;
+        return -2;
     }
+    return 0;
+}
 
-    // Now come back and write the header last
-
-    out = mtd_write_partition(partition);
-    if (out == NULL)
+int cmd_mtd_restore_raw_partition_flags(const char *partition_name, const char *filename, int flags)
+{
+    int ret = mtd_restore_raw_partition(partition_name, filename, flags);
+    if (ret == -2 && flags != 0)
     {
-        printf("error re-opening %s", partition_name);
-        return -1;
+        // the blocks that failed to verify are only known at the end, go
+        // over it again the slow way, which retries and skips them
+        printf("\nverify failed, writing %s again block by block\n", partition_name);
+        ret = mtd_restore_raw_partition(partition_name, filename, 0);
     }
+    return ret < 0 ? -1 : ret;
+}
 
-    wrote = mtd_write_data(out, header, headerlen);
-    if (wrote != headerlen)
-    {
-        printf("error re-writing %s", partition_name);
-        return -1;
-    }
+int cmd_mtd_restore_raw_partition(const char *partition_name, const char *filename)
+{
+    return cmd_mtd_restore_raw_partition_flags(partition_name, filename, 0);
+}
 
-    // Need to write a complete block, so write the rest of the first block
-    size_t block_size;
-    if (mtd_partition_info(partition, NULL, &block_size, NULL))
-    {
-        printf("error getting %s block size", partition_name);
-        return -1;
-    }
 
-    if (lseek(fd, headerlen, SEEK_SET) != headerlen)
-    {
-        printf("error rewinding %s", filename);
-        return -1;
-    }
+// The raw dump reads whole erase blocks into a ring of MTD_DUMP_SLOTS
+// buffers of about MTD_DUMP_SLOT_SIZE bytes each, which a writer thread
+// drains to the output so that the NAND reads and the writes overlap.
+#define MTD_DUMP_SLOTS      4
+#define MTD_DUMP_SLOT_SIZE  (1024 * 1024)
 
-    int left = block_size - headerlen;
-    while (left < 0) left += block_size;
-    while (left > 0) {
-        len = read(fd, buf, left > (int)sizeof(buf) ? (int)sizeof(buf) : left);
-        if (len == 0)
+typedef struct {
+    char *buffer;
+    size_t slot_size;
+    size_t lengths[MTD_DUMP_SLOTS];
+    int fd;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    // slots filled by the reader and written out, counting from the start
+    unsigned int filled;
+    unsigned int drained;
+    int done;
+    int error;
+} MtdDump;
+
+static void *mtd_dump_writer(void *cookie)
+{
+    MtdDump *dump = (MtdDump *) cookie;
+    pthread_mutex_lock(&dump->mutex);
+    for (;;) {
+        while (dump->drained == dump->filled && !dump->done)
+            pthread_cond_wait(&dump->cond, &dump->mutex);
+        if (dump->drained == dump->filled)
             break;
-        if (len < 0){
-            printf("error reading %s", filename);
-            return -1;
-        }
-        if (mtd_write_data(out, buf, len) != len)
-        {
-            printf("error writing %s", partition_name);
-            return -1;
+        unsigned int slot = dump->drained % MTD_DUMP_SLOTS;
+        pthread_mutex_unlock(&dump->mutex);
+
+        const char *data = dump->buffer + slot * dump->slot_size;
+        size_t len = dump->lengths[slot];
+        size_t wrote = 0;
+        int error = 0;
+        while (wrote < len) {
+            ssize_t w = write(dump->fd, data + wrote, len - wrote);
+            if (w < 0 && errno == EINTR)
+                continue;
+            if (w <= 0) {
+                error = errno ? errno : EIO;
+                break;
+            }
+            wrote += w;
         }
 
-        left -= len;
+        pthread_mutex_lock(&dump->mutex);
+        if (error) {
+            dump->error = error;
+            pthread_cond_signal(&dump->cond);
+            break;
+        }
+        dump->drained++;
+        pthread_cond_signal(&dump->cond);
     }
+    pthread_mutex_unlock(&dump->mutex);
+    return NULL;
+}
 
-    if (mtd_write_close(out))
-    {
-        printf("error closing %s", partition_name);
-        return -1;
+// Per block ECC statistics, <image>.ecc next to the image.  Only blocks
+// that had something to report are listed.
+typedef struct {
+    FILE *f;
+    unsigned int blocks;
+    unsigned int bad;
+    unsigned int skipped;
+    unsigned int erased;
+    unsigned int corrected;
+    unsigned int failed;
+} MtdEccLog;
+
+static void mtd_ecc_log_block(loff_t offset, int status,
+        unsigned int corrected, unsigned int failed, void *cookie)
+{
+    MtdEccLog *log = (MtdEccLog *) cookie;
+    log->blocks++;
+    log->corrected += corrected;
+    log->failed += failed;
+    if (status == MTD_BLOCK_SKIPPED_BAD)
+        log->bad++;
+    else if (status == MTD_BLOCK_SKIPPED_ERROR)
+        log->skipped++;
+    else if (status == MTD_BLOCK_ERASED)
+        log->erased++;
+    if (log->f != NULL && (status == MTD_BLOCK_SKIPPED_BAD ||
+            status == MTD_BLOCK_SKIPPED_ERROR || corrected || failed)) {
+        static const char *names[] = { "read", "bad", "skipped", "erased" };
+        fprintf(log->f, "0x%08llx %s %u %u\n", (unsigned long long) offset,
+                names[status], corrected, failed);
     }
-    return 0;
 }
 
-
-int cmd_mtd_backup_raw_partition(const char *partition_name, const char *filename)
+/* data_fn, if not NULL, is handed every slot of the dump in order as it
+ * goes to the writer, to look at the image on the way.
+ */
+int cmd_mtd_backup_raw_partition_data(const char *partition_name, const char *filename,
+        void (*data_fn)(void *cookie, const char *data, size_t len), void *cookie)
 {
     MtdReadContext *in;
     const MtdPartition *partition;
-    char buf[BLOCK_SIZE + SPARE_SIZE];
     size_t partition_size;
-    size_t read_size;
-    size_t total;
+    size_t erase_size;
     int fd;
-    int wrote;
-    int len;
 
     if (mtd_scan_partitions() <= 0)
     {
@@ -731,12 +1354,13 @@ int cmd_mtd_backup_raw_partition(const char *partition_name, const char *filenam
         return -1;
     }
 
-    if (mtd_partition_info(partition, &partition_size, NULL, NULL)) {
+    if (mtd_partition_info(partition, &partition_size, &erase_size, NULL)) {
         printf("can't get info of partition %s", partition_name);
         return -1;
     }
 
-    if (!strcmp(filename, "-")) {
+    int to_stdout = !strcmp(filename, "-");
+    if (to_stdout) {
         fd = fileno(stdout);
     }
     else {
@@ -757,21 +1381,103 @@ int cmd_mtd_backup_raw_partition(const char *partition_name, const char *filenam
         return -1;
     }
 
-    total = 0;
-    while ((len = mtd_read_data(in, buf, BLOCK_SIZE)) > 0) {
-        wrote = write(fd, buf, len);
-        if (wrote != len) {
-            close(fd);
-            unlink(filename);
-            printf("error writing %s", filename);
-            return -1;
+    MtdEccLog log;
+    memset(&log, 0, sizeof(log));
+    char log_path[PATH_MAX];
+    if (!to_stdout && snprintf(log_path, sizeof(log_path), "%s.ecc", filename) < (int) sizeof(log_path)) {
+        log.f = fopen(log_path, "w");
+        if (log.f != NULL)
+            fprintf(log.f, "# offset status corrected failed\n");
+    }
+    mtd_read_set_block_callback(in, mtd_ecc_log_block, &log);
+    // not fatal, the blocks are read in line then
+    mtd_read_ahead(in, MTD_READ_AHEAD_BLOCKS);
+
+    MtdDump dump;
+    memset(&dump, 0, sizeof(dump));
+    dump.fd = fd;
+    dump.slot_size = MTD_DUMP_SLOT_SIZE / erase_size * erase_size;
+    if (dump.slot_size == 0)
+        dump.slot_size = erase_size;
+    dump.buffer = memalign(4096, dump.slot_size * MTD_DUMP_SLOTS);
+    pthread_mutex_init(&dump.mutex, NULL);
+    pthread_cond_init(&dump.cond, NULL);
+    pthread_t writer;
+    if (dump.buffer == NULL || pthread_create(&writer, NULL, mtd_dump_writer, &dump) != 0) {
+        free(dump.buffer);
+        mtd_read_close(in);
+        close(fd);
+        unlink(filename);
+        if (log.f != NULL) {
+            fclose(log.f);
+            unlink(log_path);
         }
-        total += BLOCK_SIZE;
+        printf("error starting backup of %s", partition_name);
+        return -1;
     }
 
+    // the dump ends at the first block that can't be read, as it always
+    // has, which is the end of the partition unless it is failing
+    int eof = 0;
+    while (!eof) {
+        pthread_mutex_lock(&dump.mutex);
+        while (dump.filled - dump.drained == MTD_DUMP_SLOTS && !dump.error)
+            pthread_cond_wait(&dump.cond, &dump.mutex);
+        int error = dump.error;
+        pthread_mutex_unlock(&dump.mutex);
+        if (error)
+            break;
+
+        unsigned int slot = dump.filled % MTD_DUMP_SLOTS;
+        char *data = dump.buffer + slot * dump.slot_size;
+        size_t len = 0;
+        while (len < dump.slot_size) {
+            if (mtd_read_data(in, data + len, erase_size) != (ssize_t) erase_size) {
+                eof = 1;
+                break;
+            }
+            len += erase_size;
+        }
+        if (len == 0)
+            break;
+        if (data_fn != NULL)
+            data_fn(cookie, data, len);
+
+        pthread_mutex_lock(&dump.mutex);
+        dump.lengths[slot] = len;
+        dump.filled++;
+        pthread_cond_signal(&dump.cond);
+        pthread_mutex_unlock(&dump.mutex);
+    }
+
+    pthread_mutex_lock(&dump.mutex);
+    dump.done = 1;
+    pthread_cond_signal(&dump.cond);
+    pthread_mutex_unlock(&dump.mutex);
+    pthread_join(writer, NULL);
+    pthread_mutex_destroy(&dump.mutex);
+    pthread_cond_destroy(&dump.cond);
+    free(dump.buffer);
+
     mtd_read_close(in);
 
-    if (close(fd)) {
+    if (log.f != NULL) {
+        fprintf(log.f, "# blocks %u bad %u skipped %u erased %u corrected %u failed %u\n",
+                log.blocks, log.bad, log.skipped, log.erased, log.corrected, log.failed);
+        fclose(log.f);
+    }
+
+    if (dump.error) {
+        if (!to_stdout) {
+            close(fd);
+            unlink(filename);
+            unlink(log_path);
+        }
+        printf("error writing %s", filename);
+        return -1;
+    }
+
+    if (!to_stdout && close(fd)) {
         unlink(filename);
         printf("error closing %s", filename);
         return -1;
@@ -779,12 +1485,15 @@ int cmd_mtd_backup_raw_partition(const char *partition_name, const char *filenam
     return 0;
 }
 
+int cmd_mtd_backup_raw_partition(const char *partition_name, const char *filename)
+{
+    return cmd_mtd_backup_raw_partition_data(partition_name, filename, NULL, NULL);
+}
+
 int cmd_mtd_erase_raw_partition(const char *partition_name)
 {
     MtdWriteContext *out;
     size_t erased;
-    size_t total_size;
-    size_t erase_size;
 
     if (mtd_scan_partitions() <= 0)
     {
@@ -838,7 +1547,7 @@ int cmd_mtd_mount_partition(const char *partition, const char *mount_point, cons
 int cmd_mtd_get_partition_device(const char *partition, char *device)
 {
     mtd_scan_partitions();
-    MtdPartition *p = mtd_find_partition_by_name(partition);
+    const MtdPartition *p = mtd_find_partition_by_name(partition);
     if (p == NULL)
         return -1;
     sprintf(device, "/dev/block/mtdblock%d", p->device_index);
@@ -45,19 +45,70 @@ typedef struct MtdWriteContext MtdWriteContext;
 MtdReadContext *mtd_read_partition(const MtdPartition *);
 ssize_t mtd_read_data(MtdReadContext *, char *data, size_t data_len);
 void mtd_read_close(MtdReadContext *);
-void mtd_read_skip_to(const MtdReadContext *, size_t offset);
+void mtd_read_skip_to(MtdReadContext *, size_t offset);
+
+/* reads up to blocks erase blocks ahead of mtd_read_data() in a thread,
+ * until the context is closed.  the thread owns the fd and the ECC
+ * counters; the block callback is still called from the reader.
+ * returns 0 on success.
+ */
+#define MTD_READ_AHEAD_BLOCKS   8
+int mtd_read_ahead(MtdReadContext *, int blocks);
+
+/* called for every erase block a read context reads or skips, with the
+ * ECC corrections and failures the driver counted while reading it.
+ */
+#define MTD_BLOCK_READ          0
+#define MTD_BLOCK_SKIPPED_BAD   1
+#define MTD_BLOCK_SKIPPED_ERROR 2   /* read error or uncorrectable ECC error */
+#define MTD_BLOCK_ERASED        3   /* read, and every byte is 0xff */
+typedef void (*mtd_block_callback)(loff_t offset, int status,
+        unsigned int corrected, unsigned int failed, void *cookie);
+void mtd_read_set_block_callback(MtdReadContext *, mtd_block_callback, void *cookie);
+
+/* returns 1 if every byte of data is 0xff, as in an erased block, so
+ * consumers can skip storing or hashing it.
+ */
+int mtd_block_is_erased(const char *data, size_t len);
 
 MtdWriteContext *mtd_write_partition(const MtdPartition *);
+
+/* write modes, or'ed together.  by default every block is erased, written
+ * and read back before the next one.  MTD_WRITE_ERASE_AHEAD erases runs of
+ * good blocks ahead of the writes with one ioctl, up to 64 blocks past
+ * the end of the data, so it is only for writing whole images.
+ * MTD_WRITE_DEFER_VERIFY reads everything back in one pass at close, which
+ * fails if a block doesn't match.  the data is gone by then, so it can't
+ * be rewritten.
+ */
+#define MTD_WRITE_ERASE_AHEAD   0x1
+#define MTD_WRITE_DEFER_VERIFY  0x2
+#define MTD_WRITE_FAST          (MTD_WRITE_ERASE_AHEAD | MTD_WRITE_DEFER_VERIFY)
+/* the first block of data is kept in memory and written at close, after
+ * everything else.  the block it goes to is erased when the context is
+ * opened, so an image cut short has no header and won't be booted.
+ */
+#define MTD_WRITE_DEFER_FIRST_BLOCK 0x4
+MtdWriteContext *mtd_write_partition_flags(const MtdPartition *, int flags);
 ssize_t mtd_write_data(MtdWriteContext *, const char *data, size_t data_len);
 off_t mtd_erase_blocks(MtdWriteContext *, int blocks);  /* 0 ok, -1 for all */
 off_t mtd_find_write_start(MtdWriteContext *ctx, off_t pos);
 int mtd_write_close(MtdWriteContext *);
+/* frees the context without writing what is pending, eg. after an error.
+ * with MTD_WRITE_DEFER_FIRST_BLOCK the first block stays erased, so the
+ * half written partition has no header.
+ */
+void mtd_write_abort(MtdWriteContext *);
 
 struct MtdPartition {
     int device_index;
     unsigned int size;
     unsigned int erase_size;
     char *name;
+    /* which erase blocks are known to be good or bad, filled in as they
+     * are used and shared by every context on the partition.
+     */
+    unsigned char *block_states;
 };
 
 #endif  // MTDUTILS_H_
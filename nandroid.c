@@ -18,6 +18,7 @@
 #include <sys/stat.h>
 
 #include <signal.h>
+#include <pthread.h>
 #include <sys/wait.h>
 
 #include "bootloader.h"
@@ -40,7 +41,14 @@
 #include "mounts.h"
 
 #include "flashutils/flashutils.h"
+#include "mtdutils/mtdutils.h"
+#include "mmcutils/mmcutils.h"
+#include "topology/topology.h"
+#include "tarutils/tarutils.h"
+#include "dedupe/dedupe.h"
+#include "ubitools/ubi_tools.h"
 #include <libgen.h>
+#include <openssl/md5.h>
 
 void nandroid_generate_timestamp_path(const char* backup_path)
 {
@@ -63,12 +71,38 @@ static int print_and_error(const char* message) {
     return 1;
 }
 
-static int yaffs_files_total = 0;
-static int yaffs_files_count = 0;
-static void yaffs_callback(const char* filename)
+// Progress is weighted by bytes, so a few large apks don't rush the bar
+// to the end while thousands of tiny files crawl.  Every entry also
+// costs a fixed amount for its header/inode work.
+#define NANDROID_PROGRESS_ENTRY_WEIGHT 4096
+
+static pthread_mutex_t progress_mutex = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t nandroid_progress_total = 0;
+static uint64_t nandroid_progress_done = 0;
+
+static void nandroid_update_progress_locked()
 {
-    if (filename == NULL)
+    if (nandroid_progress_total != 0)
+        ui_set_progress((float)((double)nandroid_progress_done / (double)nandroid_progress_total));
+}
+
+static void nandroid_add_progress(uint64_t weight)
+{
+    pthread_mutex_lock(&progress_mutex);
+    nandroid_progress_done += weight;
+    nandroid_update_progress_locked();
+    pthread_mutex_unlock(&progress_mutex);
+}
+
+static void nandroid_file_progress(const char* filename, uint64_t bytes)
+{
+    if (filename == NULL) {
+        // already in the archive of a resumed backup
+        nandroid_add_progress(bytes + NANDROID_PROGRESS_ENTRY_WEIGHT);
         return;
+    }
+    // backup jobs may run concurrently, see nandroid_backup_worker.
+    pthread_mutex_lock(&progress_mutex);
     const char* justfile = basename(filename);
     char tmp[PATH_MAX];
     strcpy(tmp, justfile);
@@ -76,56 +110,540 @@ static void yaffs_callback(const char* filename)
         tmp[strlen(tmp) - 1] = NULL;
     if (strlen(tmp) < 30)
         ui_print("%s", tmp);
-    yaffs_files_count++;
-    if (yaffs_files_total != 0)
-        ui_set_progress((float)yaffs_files_count / (float)yaffs_files_total);
+    nandroid_progress_done += bytes + NANDROID_PROGRESS_ENTRY_WEIGHT;
+    nandroid_update_progress_locked();
     ui_reset_text_col();
+    pthread_mutex_unlock(&progress_mutex);
 }
 
-static void compute_directory_stats(const char* directory)
+static void yaffs_callback(const char* filename)
 {
-    char tmp[PATH_MAX];
-    sprintf(tmp, "find %s | wc -l > /tmp/dircount", directory);
-    __system(tmp);
-    char count_text[100];
-    FILE* f = fopen("/tmp/dircount", "r");
-    fread(count_text, 1, sizeof(count_text), f);
-    fclose(f);
-    yaffs_files_count = 0;
-    yaffs_files_total = atoi(count_text);
-    ui_reset_progress();
-    ui_show_progress(1, 0);
+    if (filename == NULL)
+        return;
+    // mkyaffs2image only hands us the path
+    struct stat st;
+    uint64_t bytes = 0;
+    if (lstat(filename, &st) == 0 && S_ISREG(st.st_mode))
+        bytes = st.st_size;
+    nandroid_file_progress(filename, bytes);
+}
+
+// Walks the partition once, without forking find.  The result sizes the
+// progress bar and is the work list tar_compress_wrapper archives.
+static TarScan* compute_directory_stats(const char* directory, const char** excludes)
+{
+    TarScan* scan = tar_scan(directory, excludes);
+    if (scan == NULL) {
+        ui_print("Error scanning %s (%s)\n", directory, strerror(errno));
+        return NULL;
+    }
+    pthread_mutex_lock(&progress_mutex);
+    nandroid_progress_total += tar_scan_bytes(scan) +
+            tar_scan_entries(scan) * NANDROID_PROGRESS_ENTRY_WEIGHT;
+    pthread_mutex_unlock(&progress_mutex);
+    return scan;
+}
+
+// The file a backup handler produced and its md5 sum, which goes
+// into nandroid.md5.
+typedef struct {
+    char file[PATH_MAX];
+    unsigned char md5[MD5_DIGEST_LENGTH];
+} nandroid_digest;
+
+// Used for images written by code we can't hash inline (yaffs2, raw
+// partition dumps).  Those were just written, so they mostly come back
+// from the page cache.
+static int compute_file_md5(const char* path, unsigned char* md5)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        ui_print("Can't open %s (%s)\n", path, strerror(errno));
+        return -1;
+    }
+    const size_t size = 1024 * 1024;
+    char* buffer = malloc(size);
+    if (buffer == NULL) {
+        close(fd);
+        return -1;
+    }
+    MD5_CTX ctx;
+    MD5_Init(&ctx);
+    ssize_t len;
+    while ((len = read(fd, buffer, size)) != 0) {
+        if (len < 0 && errno == EINTR)
+            continue;
+        if (len < 0) {
+            ui_print("Error reading %s (%s)\n", path, strerror(errno));
+            break;
+        }
+        MD5_Update(&ctx, buffer, len);
+    }
+    MD5_Final(md5, &ctx);
+    free(buffer);
+    close(fd);
+    return len < 0 ? -1 : 0;
+}
+
+static int parse_md5(const char* hex, unsigned char* md5)
+{
+    int i;
+    for (i = 0; i < MD5_DIGEST_LENGTH; i++) {
+        unsigned int byte;
+        if (!isxdigit(hex[i * 2]) || !isxdigit(hex[i * 2 + 1]) || sscanf(hex + i * 2, "%2x", &byte) != 1)
+            return -1;
+        md5[i] = byte;
+    }
+    return 0;
+}
+
+static void md5_to_hex(const unsigned char* md5, char* hex)
+{
+    int i;
+    for (i = 0; i < MD5_DIGEST_LENGTH; i++)
+        sprintf(hex + i * 2, "%02x", md5[i]);
+}
+
+// An interrupted backup or restore leaves nandroid.journal in the backup
+// directory.  Running the same backup or restore again skips the
+// partitions the journal lists as done, and picks the partition it was
+// working on up from its last checkpoint:
+//
+//   backup | restore <boot> <system> <data> <cache> <sdext> <wimax>
+//   done <mount point> [<md5> <file>]
+//   checkpoint <mount point> <file> <tarutils/dedupe checkpoint>
+//
+// Records are appended and synced one at a time, the last one for a
+// partition counts.  The journal is deleted once everything is done.
+#define NANDROID_JOURNAL_MAX_ENTRIES 16
+
+typedef struct {
+    char mount_point[PATH_MAX];
+    int done;
+    // of a backup that is done
+    int has_digest;
+    unsigned char md5[MD5_DIGEST_LENGTH];
+    // the image the checkpoint is for
+    char file[NAME_MAX + 1];
+    char checkpoint[PATH_MAX + 512];
+} nandroid_journal_entry;
+
+static pthread_mutex_t journal_mutex = PTHREAD_MUTEX_INITIALIZER;
+static FILE* journal = NULL;
+static char journal_dir[PATH_MAX];
+static nandroid_journal_entry journal_entries[NANDROID_JOURNAL_MAX_ENTRIES];
+static int journal_count = 0;
+
+static nandroid_journal_entry* nandroid_journal_find(const char* mount_point)
+{
+    int i;
+    for (i = 0; i < journal_count; i++) {
+        if (strcmp(journal_entries[i].mount_point, mount_point) == 0)
+            return &journal_entries[i];
+    }
+    return NULL;
+}
+
+static void nandroid_journal_load_record(char* line)
+{
+    char* mount_point = strchr(line, ' ');
+    if (mount_point == NULL)
+        return;
+    *mount_point++ = '\0';
+    char* rest = strchr(mount_point, ' ');
+    if (rest != NULL)
+        *rest++ = '\0';
+    if (strlen(mount_point) >= PATH_MAX)
+        return;
+
+    nandroid_journal_entry* entry = nandroid_journal_find(mount_point);
+    if (entry == NULL) {
+        if (journal_count == NANDROID_JOURNAL_MAX_ENTRIES)
+            return;
+        entry = &journal_entries[journal_count++];
+        memset(entry, 0, sizeof(*entry));
+        strcpy(entry->mount_point, mount_point);
+    }
+
+    if (strcmp(line, "done") == 0) {
+        entry->done = 1;
+        // "<md5> <file>"
+        if (rest != NULL && strlen(rest) > MD5_DIGEST_LENGTH * 2 + 1 &&
+                rest[MD5_DIGEST_LENGTH * 2] == ' ' && parse_md5(rest, entry->md5) == 0 &&
+                strlen(rest + MD5_DIGEST_LENGTH * 2 + 1) <= NAME_MAX) {
+            entry->has_digest = 1;
+            strcpy(entry->file, rest + MD5_DIGEST_LENGTH * 2 + 1);
+        }
+    }
+    else if (strcmp(line, "checkpoint") == 0 && rest != NULL) {
+        // "<file> <checkpoint>"
+        char* checkpoint = strchr(rest, ' ');
+        if (checkpoint == NULL || checkpoint - rest > NAME_MAX ||
+                strlen(checkpoint + 1) >= sizeof(entry->checkpoint))
+            return;
+        *checkpoint++ = '\0';
+        entry->done = 0;
+        strcpy(entry->file, rest);
+        strcpy(entry->checkpoint, checkpoint);
+    }
+}
+
+// Starts journaling into backup_path.  If the journal there was left by
+// the same kind of operation (same header), it is picked up and 1 is
+// returned, otherwise a new one is started.  Journaling is best effort,
+// without it the operation just can't be resumed.
+static int nandroid_journal_open(const char* backup_path, const char* header)
+{
+    char path[PATH_MAX];
+    char line[PATH_MAX * 2 + 512];
+    sprintf(path, "%s/nandroid.journal", backup_path);
+    strcpy(journal_dir, backup_path);
+    journal_count = 0;
+
+    int resuming = 0;
+    FILE* f = fopen(path, "r");
+    if (f != NULL) {
+        if (fgets(line, sizeof(line), f) != NULL && strncmp(line, header, strlen(header)) == 0 &&
+                line[strlen(header)] == '\n') {
+            resuming = 1;
+            while (fgets(line, sizeof(line), f) != NULL) {
+                int len = strlen(line);
+                // a record cut short by the interruption
+                if (len == 0 || line[len - 1] != '\n')
+                    break;
+                line[len - 1] = '\0';
+                nandroid_journal_load_record(line);
+            }
+        }
+        fclose(f);
+    }
+
+    journal = fopen(path, resuming ? "a" : "w");
+    if (journal == NULL) {
+        ui_print("Can't create %s, this can't be resumed if interrupted.\n", path);
+        journal_count = 0;
+        return 0;
+    }
+    if (!resuming) {
+        fprintf(journal, "%s\n", header);
+        fflush(journal);
+        fsync(fileno(journal));
+    }
+    return resuming;
+}
+
+// Deletes the journal if the operation finished.
+static void nandroid_journal_close(int finished)
+{
+    if (journal == NULL)
+        return;
+    fclose(journal);
+    journal = NULL;
+    journal_count = 0;
+    if (finished) {
+        char path[PATH_MAX];
+        sprintf(path, "%s/nandroid.journal", journal_dir);
+        unlink(path);
+    }
+    else {
+        ui_print("Run it again to pick up where it stopped.\n");
+    }
+}
+
+static void nandroid_journal_write(const char* record)
+{
+    if (journal == NULL)
+        return;
+    // backup jobs run concurrently
+    pthread_mutex_lock(&journal_mutex);
+    fprintf(journal, "%s\n", record);
+    fflush(journal);
+    fsync(fileno(journal));
+    pthread_mutex_unlock(&journal_mutex);
+}
+
+// Returns 1 if the journal has the partition done.  For backups, digest
+// is set to the image the interrupted run wrote, which must still be
+// there.
+static int nandroid_journal_done(const char* mount_point, nandroid_digest* digest)
+{
+    nandroid_journal_entry* entry = nandroid_journal_find(mount_point);
+    if (entry == NULL || !entry->done)
+        return 0;
+    if (digest == NULL)
+        return 1;
+    struct stat st;
+    if (!entry->has_digest)
+        return 0;
+    sprintf(digest->file, "%s/%s", journal_dir, entry->file);
+    memcpy(digest->md5, entry->md5, MD5_DIGEST_LENGTH);
+    if (stat(digest->file, &st) != 0) {
+        digest->file[0] = '\0';
+        return 0;
+    }
+    return 1;
+}
+
+static void nandroid_journal_finish(const char* mount_point, const nandroid_digest* digest)
+{
+    char record[PATH_MAX * 2 + 64];
+    if (digest != NULL && digest->file[0] != '\0') {
+        // called from the backup workers, no basename() here
+        const char* name = strrchr(digest->file, '/');
+        name = name == NULL ? digest->file : name + 1;
+        char hex[MD5_DIGEST_LENGTH * 2 + 1];
+        md5_to_hex(digest->md5, hex);
+        sprintf(record, "done %s %s %s", mount_point, hex, name);
+    }
+    else {
+        sprintf(record, "done %s", mount_point);
+    }
+    nandroid_journal_write(record);
+}
+
+// The last checkpoint recorded for the partition, if it was for file.
+static const char* nandroid_journal_resume(const char* mount_point, const char* file)
+{
+    nandroid_journal_entry* entry = nandroid_journal_find(mount_point);
+    if (entry == NULL || entry->done || entry->checkpoint[0] == '\0')
+        return NULL;
+    const char* name = strrchr(file, '/');
+    name = name == NULL ? file : name + 1;
+    if (strcmp(entry->file, name) != 0)
+        return NULL;
+    return entry->checkpoint;
+}
+
+// Cookie of the tarutils and dedupe callbacks.
+typedef struct {
+    const char* mount_point;
+    const char* file;
+} nandroid_journal_cookie;
+
+static void nandroid_journal_checkpoint(const char* checkpoint, void* cookie)
+{
+    nandroid_journal_cookie* c = (nandroid_journal_cookie*)cookie;
+    const char* name = strrchr(c->file, '/');
+    name = name == NULL ? c->file : name + 1;
+    char record[PATH_MAX * 3 + 512];
+    snprintf(record, sizeof(record), "checkpoint %s %s %s", c->mount_point, name, checkpoint);
+    nandroid_journal_write(record);
 }
 
 typedef void (*file_event_callback)(const char* filename);
-typedef int (*nandroid_backup_handler)(const char* backup_path, const char* backup_file_image, int callback);
+// scan is the tree as compute_directory_stats found it.
+typedef int (*nandroid_backup_handler)(const char* backup_path, const char* backup_file_image, int callback, const TarScan* scan, nandroid_digest* digest);
 
-static int mkyaffs2image_wrapper(const char* backup_path, const char* backup_file_image, int callback) {
-    char backup_file_image_with_extension[PATH_MAX];
-    sprintf(backup_file_image_with_extension, "%s.img", backup_file_image);
-    return mkyaffs2image(backup_path, backup_file_image_with_extension, 0, callback ? yaffs_callback : NULL);
+static int mkyaffs2image_wrapper(const char* backup_path, const char* backup_file_image, int callback, const TarScan* scan, nandroid_digest* digest) {
+    sprintf(digest->file, "%s.img", backup_file_image);
+    int ret = mkyaffs2image(backup_path, digest->file, 0, callback ? yaffs_callback : NULL);
+    if (ret != 0)
+        return ret;
+    // mkyaffs2image lives in external/yaffs2 and writes the image itself,
+    // with no way to see the data on the way, so it is read back
+    return compute_file_md5(digest->file, digest->md5);
 }
 
-static int tar_compress_wrapper(const char* backup_path, const char* backup_file_image, int callback) {
-    char tmp[PATH_MAX];
+static void tar_file_callback_wrapper(const char* path, uint64_t bytes, void* cookie) {
+    nandroid_file_progress(path, bytes);
+}
+
+// ro.cwm.backup_compression is "none", "gzip" or "gzip-<level>".
+// gzip defaults to the fastest level, slow sdcards are the bottleneck
+// and a low level already shrinks most partitions a lot.
+static int get_backup_compression() {
+    char str[PROPERTY_VALUE_MAX];
+    property_get("ro.cwm.backup_compression", str, "none");
+    if (strcmp(str, "gzip") == 0)
+        return 1;
+    if (strncmp(str, "gzip-", 5) == 0) {
+        int level = atoi(str + 5);
+        if (level >= 1 && level <= 9)
+            return level;
+        return 1;
+    }
+    return 0;
+}
+
+// On devices without an sdcard partition, /data/media is the sdcard
+// and is not part of the /data backup.  Names are as tar_scan sees them.
+static const char** get_backup_excludes(const char* backup_path) {
+    static const char* data_media_excludes[] = { "data/media", NULL };
     if (strcmp(backup_path, "/data") == 0 && volume_for_path("/sdcard") == NULL)
-      sprintf(tmp, "cd $(dirname %s) ; tar cvf %s.tar --exclude 'media' $(basename %s) ; exit $?", backup_path, backup_file_image, backup_path);
+        return data_media_excludes;
+    return NULL;
+}
+
+static int tar_compress_wrapper(const char* backup_path, const char* backup_file_image, int callback, const TarScan* scan, nandroid_digest* digest) {
+    int compression = get_backup_compression();
+    sprintf(digest->file, "%s.%s", backup_file_image, compression ? "tar.gz" : "tar");
+
+    // the index next to the archive lets nandroid_restore_paths pick
+    // single files out of it
+    char index_path[PATH_MAX];
+    sprintf(index_path, "%s.idx", digest->file);
+    nandroid_journal_cookie cookie = { backup_path, digest->file };
+    const char* resume = nandroid_journal_resume(backup_path, digest->file);
+    if (resume != NULL)
+        ui_print("Resuming interrupted backup of %s...\n", backup_path);
+    if (0 != tar_create_resume(digest->file, scan, index_path, compression, digest->md5,
+            resume, journal != NULL ? nandroid_journal_checkpoint : NULL,
+            callback ? tar_file_callback_wrapper : NULL, &cookie)) {
+        ui_print("Error creating %s (%s)\n", digest->file, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+// ubifs volumes are backed up as an image of the volume, <name>.ubifs.ubi,
+// read LEB by LEB from the volume device, so a restore is one volume
+// update instead of a format and every file written through ubifs.
+// Unmapped LEBs read as 0xff and the ones at the end are left out: the
+// update leaves whatever it is not given unmapped.  ubifs keeps writing
+// to a mounted volume, nandroid_schedule_backup_extended unmounts it
+// before the job runs.
+static int ubi_backup_wrapper(const char* backup_path, const char* backup_file_image, int callback, const TarScan* scan, nandroid_digest* digest) {
+    Volume* v = volume_for_path(backup_path);
+    sprintf(digest->file, "%s.ubi", backup_file_image);
+    int leb_size = ubi_vol_leb_size(v->device);
+    if (leb_size <= 0) {
+        ui_print("Can't get the LEB size of %s\n", v->device);
+        return -1;
+    }
+
+    // the scan sized the progress bar, the volume is read in its share
+    uint64_t weight = tar_scan_bytes(scan) + tar_scan_entries(scan) * NANDROID_PROGRESS_ENTRY_WEIGHT;
+    uint64_t added = 0;
+    int ret = -1;
+    int in = open(v->device, O_RDONLY);
+    int out = open(digest->file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    char* buffer = malloc(leb_size);
+    char* erased = malloc(leb_size);
+    off64_t size = in >= 0 ? lseek64(in, 0, SEEK_END) : -1;
+    if (in < 0 || out < 0 || buffer == NULL || erased == NULL ||
+            size <= 0 || lseek64(in, 0, SEEK_SET) != 0) {
+        ui_print("Error backing up %s (%s)\n", v->device, strerror(errno));
+        goto done;
+    }
+    memset(erased, 0xff, leb_size);
+
+    MD5_CTX md5;
+    MD5_Init(&md5);
+    uint64_t held = 0;  // erased LEBs not written yet
+    uint64_t pos = 0;
+    ssize_t len;
+    while (pos < (uint64_t) size) {
+        len = read(in, buffer, leb_size);
+        if (len < 0 && errno == EINTR)
+            continue;
+        if (len <= 0)
+            break;
+        pos += len;
+        if (mtd_block_is_erased(buffer, len)) {
+            held += len;
+        }
+        else {
+            while (held > 0) {
+                size_t n = held < (uint64_t) leb_size ? held : leb_size;
+                if (write(out, erased, n) != (ssize_t) n)
+                    break;
+                MD5_Update(&md5, erased, n);
+                held -= n;
+            }
+            if (held > 0 || write(out, buffer, len) != len)
+                break;
+            MD5_Update(&md5, buffer, len);
+        }
+        uint64_t progress = weight * pos / size;
+        nandroid_add_progress(progress - added);
+        added = progress;
+    }
+    MD5_Final(digest->md5, &md5);
+    if (pos != (uint64_t) size)
+        ui_print("Error backing up %s (%s)\n", v->device, strerror(errno));
     else
-      sprintf(tmp, "cd $(dirname %s) ; tar cvf %s.tar $(basename %s) ; exit $?", backup_path, backup_file_image, backup_path);
+        ret = 0;
+
+done:
+    free(buffer);
+    free(erased);
+    if (in >= 0)
+        close(in);
+    if (out >= 0 && close(out) != 0)
+        ret = -1;
+    return ret;
+}
 
-    FILE *fp = __popen(tmp, "r");
-    if (fp == NULL) {
-        ui_print("Unable to execute tar.\n");
+// Backups live in <storage>/clockworkmod/backup/<name>/ and all of them
+// share the dedupe blob store in <storage>/clockworkmod/blobs.
+static void get_blob_dir(const char* backup_file_image, char* blob_dir)
+{
+    int i;
+    strcpy(blob_dir, backup_file_image);
+    for (i = 0; i < 3; i++) {
+        char* slash = strrchr(blob_dir, '/');
+        if (slash == NULL || slash == blob_dir) {
+            strcpy(blob_dir, "/sdcard/clockworkmod");
+            break;
+        }
+        *slash = '\0';
+    }
+    strcat(blob_dir, "/blobs");
+}
+
+static void dedupe_callback_wrapper(const char* name, uint64_t bytes, void* cookie) {
+    nandroid_file_progress(name, bytes);
+}
+
+// Stores the partition file by file in the shared blob store; only files
+// that no earlier backup contained take up space on the sdcard.
+static int dedupe_compress_wrapper(const char* backup_path, const char* backup_file_image, int callback, const TarScan* scan, nandroid_digest* digest) {
+    char blob_dir[PATH_MAX];
+    get_blob_dir(backup_file_image, blob_dir);
+    if (mkdir(blob_dir, 0777) != 0 && errno != EEXIST) {
+        ui_print("Can't create %s (%s)\n", blob_dir, strerror(errno));
         return -1;
     }
+    sprintf(digest->file, "%s.dup", backup_file_image);
 
-    while (fgets(tmp, PATH_MAX, fp) != NULL) {
-        tmp[PATH_MAX - 1] = NULL;
-        if (callback)
-            yaffs_callback(tmp);
+    const char* data_media_excludes[] = { "media", NULL };
+    const char** excludes = NULL;
+    if (strcmp(backup_path, "/data") == 0 && volume_for_path("/sdcard") == NULL)
+        excludes = data_media_excludes;
+
+    nandroid_journal_cookie cookie = { backup_path, digest->file };
+    const char* resume = nandroid_journal_resume(backup_path, digest->file);
+    if (resume != NULL)
+        ui_print("Resuming interrupted backup of %s...\n", backup_path);
+    // the manifest names every blob by its sha256, so its md5 covers
+    // the whole backup.
+    if (0 != dedupe_store_resume(backup_path, blob_dir, digest->file, excludes, digest->md5,
+            resume, journal != NULL ? nandroid_journal_checkpoint : NULL,
+            callback ? dedupe_callback_wrapper : NULL, &cookie)) {
+        ui_print("Error creating %s\n", digest->file);
+        return -1;
     }
+    return 0;
+}
 
-    return __pclose(fp);
+// /sdcard/clockworkmod/.default_backup_format holds "tar" or "dup",
+// falling back to ro.cwm.backup_format.
+static int nandroid_use_dedupe() {
+    char format[PROPERTY_VALUE_MAX];
+    FILE* f = fopen("/sdcard/clockworkmod/.default_backup_format", "r");
+    if (f == NULL || fgets(format, sizeof(format), f) == NULL)
+        property_get("ro.cwm.backup_format", format, "tar");
+    if (f != NULL)
+        fclose(f);
+    return strncmp(format, "dup", 3) == 0;
+}
+
+// ro.cwm.ubi_backup=tar backs ubifs up file by file instead.  Volumes
+// that are not mounted from /dev/ubiX_Y can't be updated and always are.
+static int nandroid_use_ubi_image(Volume* v) {
+    char str[PROPERTY_VALUE_MAX];
+    property_get("ro.cwm.ubi_backup", str, "image");
+    return strcmp(str, "tar") != 0 && v->device != NULL && ubi_vol_leb_size(v->device) > 0;
 }
 
 static nandroid_backup_handler get_backup_handler(const char *backup_path) {
@@ -140,10 +658,18 @@ static nandroid_backup_handler get_backup_handler(const char *backup_path) {
         return NULL;
     }
 
+    if (nandroid_use_dedupe()) {
+        return dedupe_compress_wrapper;
+    }
+
     if (strcmp(backup_path, "/data") == 0 && is_data_media()) {
         return tar_compress_wrapper;
     }
 
+    if (strcmp("ubifs", mv->filesystem) == 0 && nandroid_use_ubi_image(v)) {
+        return ubi_backup_wrapper;
+    }
+
     // cwr5, we prefer tar for everything except yaffs2
     if (strcmp("yaffs2", mv->filesystem) == 0) {
         return mkyaffs2image_wrapper;
@@ -159,69 +685,961 @@ static nandroid_backup_handler get_backup_handler(const char *backup_path) {
     return tar_compress_wrapper;
 }
 
+// Returns a key naming the physical device the given path is read from.
+// Backup jobs with the same key are never run at the same time, so two
+// jobs do not fight over the same eMMC or NAND chip.
+static void get_backup_device_group(const char* path, char* group)
+{
+    Volume *v = volume_for_path(path);
+    if (v == NULL || v->device == NULL) {
+        strcpy(group, path);
+        return;
+    }
 
-int nandroid_backup_partition_extended(const char* backup_path, const char* mount_point, int umount_when_finished) {
-    int ret = 0;
-    char* name = basename(mount_point);
+    // mtd partitions are referred to by name, and all of them (as well
+    // as bml, stl and ubi volumes) sit on the same NAND chip.
+    if (v->device[0] != '/' ||
+            strstr(v->device, "/dev/block/bml") == v->device ||
+            strstr(v->device, "/dev/block/stl") == v->device ||
+            strstr(v->device, "/dev/block/mtd") == v->device ||
+            strstr(v->device, "/dev/ubi") == v->device) {
+        strcpy(group, "nand");
+        return;
+    }
 
+    // resolve by-name links, then strip the partition number:
+    // /dev/block/mmcblk0p12 -> /dev/block/mmcblk0, /dev/block/sda1 -> /dev/block/sda
+    if (realpath(v->device, group) == NULL)
+        strcpy(group, v->device);
+    int len = strlen(group);
+    int digits = len;
+    while (digits > 0 && isdigit(group[digits - 1]))
+        digits--;
+    if (digits == len)
+        return;
+    if (strstr(group, "mmcblk") != NULL) {
+        if (digits > 1 && group[digits - 1] == 'p' && isdigit(group[digits - 2]))
+            group[digits - 1] = '\0';
+    }
+    else {
+        group[digits] = '\0';
+    }
+}
+
+#define NANDROID_MAX_BACKUP_JOBS 16
+
+typedef struct {
+    const char* mount_point;
+    char name[PATH_MAX];
+    char backup_file_image[PATH_MAX];
+    // set for partitions that are dumped as raw images (mtd, bml, emmc)
+    Volume* raw_volume;
+    nandroid_backup_handler handler;
+    nandroid_digest digest;
+    // what the progress bar was sized from; raw jobs have none
+    TarScan* scan;
+    uint64_t raw_size;
+    // raw images that may be stored as a delta against the last backup
+    int differential;
+    // finished by the interrupted run this backup resumes
+    int done;
+    int callback;
+    int umount_when_finished;
+    // unmounted for the backup, mounted again once it is finished
+    int remount;
+    int group;
+} nandroid_backup_job;
+
+typedef struct {
+    nandroid_backup_job jobs[NANDROID_MAX_BACKUP_JOBS];
+    int job_count;
+    char groups[NANDROID_MAX_BACKUP_JOBS][PATH_MAX];
+    int group_count;
+
+    pthread_mutex_t mutex;
+    int next_group;
+    int ret;
+} nandroid_backup_schedule;
+
+static void nandroid_schedule_init(nandroid_backup_schedule* schedule)
+{
+    memset(schedule, 0, sizeof(*schedule));
+    pthread_mutex_init(&schedule->mutex, NULL);
+    nandroid_progress_done = 0;
+    nandroid_progress_total = 0;
+}
+
+static nandroid_backup_job* nandroid_schedule_add_job(nandroid_backup_schedule* schedule, const char* mount_point)
+{
+    if (schedule->job_count == NANDROID_MAX_BACKUP_JOBS)
+        return NULL;
+
+    char group[PATH_MAX];
+    get_backup_device_group(mount_point, group);
+
+    nandroid_backup_job* job = &schedule->jobs[schedule->job_count++];
+    memset(job, 0, sizeof(*job));
+    job->mount_point = mount_point;
+    strcpy(job->name, basename(mount_point));
+    for (job->group = 0; job->group < schedule->group_count; job->group++) {
+        if (strcmp(schedule->groups[job->group], group) == 0)
+            break;
+    }
+    if (job->group == schedule->group_count)
+        strcpy(schedule->groups[schedule->group_count++], group);
+    return job;
+}
+
+// Raw images are weighted by the size of the partition.  Unknown sizes
+// count as one entry.
+static uint64_t get_raw_partition_size(Volume* vol)
+{
+    uint64_t size = 0;
+    if (strcmp(vol->fs_type, "mtd") == 0) {
+        size_t total_size;
+        const MtdPartition* partition;
+        if (mtd_scan_partitions() > 0 &&
+                (partition = mtd_find_partition_by_name(vol->device)) != NULL &&
+                mtd_partition_info(partition, &total_size, NULL, NULL) == 0)
+            size = total_size;
+    }
+    else {
+        int fd = open(vol->device, O_RDONLY);
+        if (fd >= 0) {
+            off64_t end = lseek64(fd, 0, SEEK_END);
+            if (end > 0)
+                size = end;
+            close(fd);
+        }
+    }
+    return size != 0 ? size : NANDROID_PROGRESS_ENTRY_WEIGHT;
+}
+
+static int nandroid_schedule_raw_backup(nandroid_backup_schedule* schedule, Volume* vol, const char* mount_point, const char* backup_file_image)
+{
+    nandroid_backup_job* job = nandroid_schedule_add_job(schedule, mount_point);
+    if (job == NULL)
+        return print_and_error("Too many partitions to back up.\n");
+    if (nandroid_journal_done(mount_point, &job->digest)) {
+        ui_print("%s is already backed up.\n", mount_point);
+        job->done = 1;
+        return 0;
+    }
+    job->raw_volume = vol;
+    strcpy(job->backup_file_image, backup_file_image);
+    job->raw_size = get_raw_partition_size(vol);
+    nandroid_progress_total += job->raw_size;
+    return 0;
+}
+
+// Mounts the partition and picks its backup handler. The actual backup
+// is done later by nandroid_run_backup_job.
+static int nandroid_schedule_backup_extended(nandroid_backup_schedule* schedule, const char* backup_path, const char* mount_point, int umount_when_finished) {
+    int ret = 0;
     struct stat file_info;
-    int callback = stat("/sdcard/clockworkmod/.hidenandroidprogress", &file_info) != 0;
-    
-    ui_print("Backing up %s...\n", name);
+    nandroid_backup_job* job = nandroid_schedule_add_job(schedule, mount_point);
+    if (job == NULL)
+        return print_and_error("Too many partitions to back up.\n");
+    if (nandroid_journal_done(mount_point, &job->digest)) {
+        ui_print("%s is already backed up.\n", mount_point);
+        job->done = 1;
+        return 0;
+    }
+
+    job->callback = stat("/sdcard/clockworkmod/.hidenandroidprogress", &file_info) != 0;
+    job->umount_when_finished = umount_when_finished;
+
     if (0 != (ret = ensure_path_mounted(mount_point) != 0)) {
         ui_print("Can't mount %s!\n", mount_point);
         return ret;
     }
-    compute_directory_stats(mount_point);
-    char tmp[PATH_MAX];
+    job->scan = compute_directory_stats(mount_point, get_backup_excludes(mount_point));
+    if (job->scan == NULL)
+        return -1;
     scan_mounted_volumes();
     Volume *v = volume_for_path(mount_point);
     MountedVolume *mv = NULL;
     if (v != NULL)
         mv = find_mounted_volume_by_mount_point(v->mount_point);
     if (mv == NULL || mv->filesystem == NULL)
-        sprintf(tmp, "%s/%s.auto", backup_path, name);
+        sprintf(job->backup_file_image, "%s/%s.auto", backup_path, job->name);
     else
-        sprintf(tmp, "%s/%s.%s", backup_path, name, mv->filesystem);
-    nandroid_backup_handler backup_handler = get_backup_handler(mount_point);
-    if (backup_handler == NULL) {
+        sprintf(job->backup_file_image, "%s/%s.%s", backup_path, job->name, mv->filesystem);
+    job->handler = get_backup_handler(mount_point);
+    if (job->handler == NULL) {
         ui_print("Error finding an appropriate backup handler.\n");
         return -2;
     }
-    ret = backup_handler(mount_point, tmp, callback);
-    if (umount_when_finished) {
-        ensure_path_unmounted(mount_point);
-    }
-    if (0 != ret) {
-        ui_print("Error while making a backup image of %s!\n", mount_point);
-        return ret;
+    // mounting and unmounting rebuild the mount table, which the workers
+    // share, so it is done here on the scheduling thread
+    if (job->handler == ubi_backup_wrapper) {
+        if (0 != (ret = ensure_path_unmounted(mount_point))) {
+            ui_print("Can't unmount %s!\n", mount_point);
+            return ret;
+        }
+        job->remount = !umount_when_finished;
     }
     return 0;
 }
 
-int nandroid_backup_partition(const char* backup_path, const char* root) {
+static int nandroid_schedule_backup(nandroid_backup_schedule* schedule, const char* backup_path, const char* root) {
     Volume *vol = volume_for_path(root);
     // make sure the volume exists before attempting anything...
     if (vol == NULL || vol->fs_type == NULL)
         return NULL;
 
     // see if we need a raw backup (mtd)
-    char tmp[PATH_MAX];
-    int ret;
     if (strcmp(vol->fs_type, "mtd") == 0 ||
             strcmp(vol->fs_type, "bml") == 0 ||
             strcmp(vol->fs_type, "emmc") == 0) {
-        const char* name = basename(root);
-        sprintf(tmp, "%s/%s.img", backup_path, name);
-        ui_print("Backing up %s image...\n", name);
-        if (0 != (ret = backup_raw_partition(vol->fs_type, vol->device, tmp))) {
-            ui_print("Error while backing up %s image!", name);
-            return ret;
+        char tmp[PATH_MAX];
+        sprintf(tmp, "%s/%s.img", backup_path, basename(root));
+        int ret = nandroid_schedule_raw_backup(schedule, vol, root, tmp);
+        if (ret == 0)
+            schedule->jobs[schedule->job_count - 1].differential = 1;
+        return ret;
+    }
+
+    return nandroid_schedule_backup_extended(schedule, backup_path, root, 1);
+}
+
+// Raw images come with a block hash map, <image>.map:
+//
+//   rawmap 1
+//   size <bytes>
+//   block <block size>
+//   md5 <md5 of the whole image>
+//   base <image the unchanged blocks come from>     (deltas only)
+//   <md5 of block 0> <i|b|d>
+//   ...
+//
+// i: the block is in the image next to the map, b: in the base image at
+// the same offset, d: next in <image>.delta.  The next backup hashes the
+// partition and compares: an identical partition is hard linked to the
+// previous image, a partition with a few changed blocks only stores
+// those in a delta against it, with the previous image linked next to it
+// as <image>.base where the sdcard allows.
+#define NANDROID_RAW_BLOCK_SIZE (256 * 1024)
+
+typedef struct {
+    uint64_t size;
+    int block_size;
+    int block_count;
+    unsigned char (*blocks)[MD5_DIGEST_LENGTH];
+    char* sources;
+    unsigned char md5[MD5_DIGEST_LENGTH];
+    char base[PATH_MAX];
+} nandroid_raw_map;
+
+static void nandroid_raw_map_free(nandroid_raw_map* map)
+{
+    free(map->blocks);
+    free(map->sources);
+    memset(map, 0, sizeof(*map));
+}
+
+static int nandroid_raw_map_alloc(nandroid_raw_map* map, int block_count)
+{
+    void* blocks = realloc(map->blocks, block_count * MD5_DIGEST_LENGTH);
+    if (blocks != NULL)
+        map->blocks = blocks;
+    char* sources = realloc(map->sources, block_count);
+    if (sources != NULL)
+        map->sources = sources;
+    return blocks != NULL && sources != NULL ? 0 : -1;
+}
+
+// Builds a map from the image data as it goes by, in pieces of any size.
+// Against a previous map, the blocks that differ are marked 'd' and the
+// others 'b', otherwise they are all 'i'.
+typedef struct {
+    nandroid_raw_map* map;
+    const nandroid_raw_map* previous;
+    MD5_CTX whole;
+    MD5_CTX block;
+    int block_fill;
+    int alloc;
+    int changed;
+    int error;
+} nandroid_raw_hasher;
+
+static void nandroid_raw_hasher_init(nandroid_raw_hasher* hasher, nandroid_raw_map* map, const nandroid_raw_map* previous)
+{
+    memset(hasher, 0, sizeof(*hasher));
+    memset(map, 0, sizeof(*map));
+    map->block_size = NANDROID_RAW_BLOCK_SIZE;
+    hasher->map = map;
+    hasher->previous = previous;
+    MD5_Init(&hasher->whole);
+}
+
+static void nandroid_raw_hasher_end_block(nandroid_raw_hasher* hasher)
+{
+    nandroid_raw_map* map = hasher->map;
+    const nandroid_raw_map* previous = hasher->previous;
+    hasher->block_fill = 0;
+    if (map->block_count == hasher->alloc) {
+        hasher->alloc = hasher->alloc * 2 + 64;
+        if (nandroid_raw_map_alloc(map, hasher->alloc)) {
+            hasher->error = 1;
+            return;
+        }
+    }
+    int i = map->block_count++;
+    MD5_Final(map->blocks[i], &hasher->block);
+    if (previous == NULL) {
+        map->sources[i] = 'i';
+    }
+    else if (i >= previous->block_count || memcmp(map->blocks[i], previous->blocks[i], MD5_DIGEST_LENGTH) != 0) {
+        map->sources[i] = 'd';
+        hasher->changed++;
+    }
+    else {
+        map->sources[i] = 'b';
+    }
+}
+
+static void nandroid_raw_hash_data(void* cookie, const char* data, size_t len)
+{
+    nandroid_raw_hasher* hasher = (nandroid_raw_hasher*)cookie;
+    MD5_Update(&hasher->whole, data, len);
+    hasher->map->size += len;
+    while (len > 0 && !hasher->error) {
+        if (hasher->block_fill == 0)
+            MD5_Init(&hasher->block);
+        size_t chunk = hasher->map->block_size - hasher->block_fill;
+        if (chunk > len)
+            chunk = len;
+        MD5_Update(&hasher->block, data, chunk);
+        hasher->block_fill += chunk;
+        data += chunk;
+        len -= chunk;
+        if (hasher->block_fill == hasher->map->block_size)
+            nandroid_raw_hasher_end_block(hasher);
+    }
+}
+
+// The md5 of the whole image is good even if the map isn't.
+static int nandroid_raw_hasher_finish(nandroid_raw_hasher* hasher)
+{
+    if (hasher->block_fill > 0 && !hasher->error)
+        nandroid_raw_hasher_end_block(hasher);
+    MD5_Final(hasher->map->md5, &hasher->whole);
+    return hasher->error ? -1 : 0;
+}
+
+// Hashes the partition against the map of the previous image, reading it
+// the same way backup_raw_partition does. Returns 1 as soon as more than
+// max_changed blocks differ.
+static int nandroid_raw_map_hash(Volume* vol, nandroid_raw_map* map, char* buffer, const nandroid_raw_map* previous, int max_changed)
+{
+    nandroid_raw_hasher hasher;
+    nandroid_raw_hasher_init(&hasher, map, previous);
+    raw_partition_reader* reader = open_raw_partition(vol->fs_type, vol->device);
+    if (reader == NULL)
+        return -1;
+
+    int ret = 0;
+    ssize_t len;
+    while ((len = read_raw_partition(reader, buffer, map->block_size)) > 0) {
+        nandroid_raw_hash_data(&hasher, buffer, len);
+        if (hasher.changed > max_changed) {
+            ret = 1;
+            break;
+        }
+        if (len < map->block_size)
+            break;
+    }
+    close_raw_partition(reader);
+    if (nandroid_raw_hasher_finish(&hasher) != 0 || len < 0)
+        ret = -1;
+    if (ret != 0)
+        nandroid_raw_map_free(map);
+    return ret;
+}
+
+static int nandroid_raw_map_write(const char* path, const nandroid_raw_map* map)
+{
+    FILE* f = fopen(path, "w");
+    if (f == NULL)
+        return -1;
+    char hex[MD5_DIGEST_LENGTH * 2 + 1];
+    md5_to_hex(map->md5, hex);
+    fprintf(f, "rawmap 1\nsize %llu\nblock %d\nmd5 %s\n", (unsigned long long)map->size, map->block_size, hex);
+    if (map->base[0] != '\0')
+        fprintf(f, "base %s\n", map->base);
+    int i;
+    for (i = 0; i < map->block_count; i++) {
+        md5_to_hex(map->blocks[i], hex);
+        fprintf(f, "%s %c\n", hex, map->sources[i]);
+    }
+    if (fclose(f) != 0) {
+        unlink(path);
+        return -1;
+    }
+    return 0;
+}
+
+static int nandroid_raw_map_load(const char* path, nandroid_raw_map* map)
+{
+    memset(map, 0, sizeof(*map));
+    FILE* f = fopen(path, "r");
+    if (f == NULL)
+        return -1;
+    char line[PATH_MAX + 16];
+    char hex[MD5_DIGEST_LENGTH * 2 + 1];
+    unsigned long long size;
+    int ret = -1;
+    if (fgets(line, sizeof(line), f) == NULL || strcmp(line, "rawmap 1\n") != 0)
+        goto done;
+    if (fgets(line, sizeof(line), f) == NULL || sscanf(line, "size %llu", &size) != 1)
+        goto done;
+    map->size = size;
+    if (fgets(line, sizeof(line), f) == NULL || sscanf(line, "block %d", &map->block_size) != 1 || map->block_size <= 0)
+        goto done;
+    if (fgets(line, sizeof(line), f) == NULL || sscanf(line, "md5 %32s", hex) != 1 || parse_md5(hex, map->md5))
+        goto done;
+    map->block_count = (map->size + map->block_size - 1) / map->block_size;
+    if (nandroid_raw_map_alloc(map, map->block_count + 1))
+        goto done;
+    int i = 0;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        line[strcspn(line, "\n")] = '\0';
+        if (strncmp(line, "base ", 5) == 0) {
+            strcpy(map->base, line + 5);
+            continue;
+        }
+        char source;
+        if (i == map->block_count || sscanf(line, "%32s %c", hex, &source) != 2 || parse_md5(hex, map->blocks[i]))
+            goto done;
+        map->sources[i++] = source;
+    }
+    if (i == map->block_count)
+        ret = 0;
+done:
+    fclose(f);
+    if (ret != 0)
+        nandroid_raw_map_free(map);
+    return ret;
+}
+
+// Looks for the newest earlier backup holding a full image of the same
+// partition, and its map: <backup>/../<other backup>/<name>.
+static int find_previous_raw_image(const char* backup_file_image, char* previous, nandroid_raw_map* map)
+{
+    // no basename/dirname here, backup jobs run on several threads
+    char backup_dir[PATH_MAX];
+    strcpy(backup_dir, backup_file_image);
+    char* slash = strrchr(backup_dir, '/');
+    if (slash == NULL)
+        return -1;
+    *slash = '\0';
+    const char* name = slash + 1;
+    char parent[PATH_MAX];
+    strcpy(parent, backup_dir);
+    slash = strrchr(parent, '/');
+    if (slash == NULL)
+        return -1;
+    *slash = '\0';
+    const char* current = slash + 1;
+
+    DIR* dir = opendir(parent);
+    if (dir == NULL)
+        return -1;
+    time_t newest = 0;
+    int found = -1;
+    struct dirent* de;
+    while ((de = readdir(dir)) != NULL) {
+        if (de->d_name[0] == '.' || strcmp(de->d_name, current) == 0)
+            continue;
+        char image[PATH_MAX];
+        char map_path[PATH_MAX];
+        struct stat st;
+        snprintf(image, sizeof(image), "%s/%s/%s", parent, de->d_name, name);
+        snprintf(map_path, sizeof(map_path), "%s.map", image);
+        if (stat(image, &st) != 0 || !S_ISREG(st.st_mode) || stat(map_path, &st) != 0)
+            continue;
+        if (found == 0 && st.st_mtime <= newest)
+            continue;
+        newest = st.st_mtime;
+        strcpy(previous, image);
+        found = 0;
+    }
+    closedir(dir);
+    if (found != 0)
+        return -1;
+
+    char map_path[PATH_MAX];
+    sprintf(map_path, "%s.map", previous);
+    if (nandroid_raw_map_load(map_path, map) != 0)
+        return -1;
+    if (map->base[0] != '\0') {
+        nandroid_raw_map_free(map);
+        return -1;
+    }
+    return 0;
+}
+
+// Stores the blocks marked 'd' in map, read from the partition once more,
+// in <image>.delta.
+static int nandroid_write_raw_delta(Volume* vol, nandroid_raw_map* map, char* buffer, nandroid_digest* digest)
+{
+    raw_partition_reader* reader = open_raw_partition(vol->fs_type, vol->device);
+    if (reader == NULL)
+        return -1;
+    int fd = open(digest->file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        close_raw_partition(reader);
+        return -1;
+    }
+
+    MD5_CTX ctx;
+    MD5_Init(&ctx);
+    int ret = 0;
+    int i;
+    for (i = 0; ret == 0 && i < map->block_count; i++) {
+        ssize_t len = read_raw_partition(reader, buffer, map->block_size);
+        if (len <= 0) {
+            ret = -1;
+            break;
+        }
+        if (map->sources[i] != 'd')
+            continue;
+        // the partition must not have changed since it was hashed
+        unsigned char md5[MD5_DIGEST_LENGTH];
+        MD5((unsigned char*)buffer, len, md5);
+        if (memcmp(md5, map->blocks[i], MD5_DIGEST_LENGTH) != 0 || write(fd, buffer, len) != len) {
+            ret = -1;
+            break;
         }
+        MD5_Update(&ctx, buffer, len);
+    }
+    MD5_Final(digest->md5, &ctx);
+    close_raw_partition(reader);
+    if (close(fd) != 0)
+        ret = -1;
+    if (ret != 0)
+        unlink(digest->file);
+    return ret;
+}
+
+// Puts the image a delta backup describes back together in image,
+// checking every block against the map.
+static int nandroid_rebuild_raw_image(const char* backup_file_image, const char* image)
+{
+    char tmp[PATH_MAX];
+    nandroid_raw_map map;
+    sprintf(tmp, "%s.map", backup_file_image);
+    if (nandroid_raw_map_load(tmp, &map) != 0 || map.base[0] == '\0') {
+        ui_print("Can't read %s\n", tmp);
+        return -1;
+    }
+
+    strcpy(tmp, backup_file_image);
+    char* slash = strrchr(tmp, '/');
+    sprintf(slash + 1, "%s", map.base);
+    int base_fd = open(tmp, O_RDONLY);
+    if (base_fd < 0) {
+        ui_print("%s needs %s, which is missing!\n", backup_file_image, tmp);
+        nandroid_raw_map_free(&map);
+        return -1;
+    }
+    sprintf(tmp, "%s.delta", backup_file_image);
+    int delta_fd = open(tmp, O_RDONLY);
+    int out_fd = open(image, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    char* buffer = malloc(map.block_size);
+    int ret = delta_fd < 0 || out_fd < 0 || buffer == NULL ? -1 : 0;
+
+    MD5_CTX whole;
+    MD5_Init(&whole);
+    int i;
+    for (i = 0; ret == 0 && i < map.block_count; i++) {
+        uint64_t offset = (uint64_t)i * map.block_size;
+        size_t len = map.size - offset < (uint64_t)map.block_size ? map.size - offset : map.block_size;
+        ssize_t r = -1;
+        if (map.sources[i] == 'b')
+            r = pread64(base_fd, buffer, len, offset);
+        else if (map.sources[i] == 'd')
+            r = read(delta_fd, buffer, len);
+        unsigned char md5[MD5_DIGEST_LENGTH];
+        if (r == (ssize_t)len)
+            MD5((unsigned char*)buffer, len, md5);
+        if (r != (ssize_t)len || memcmp(md5, map.blocks[i], MD5_DIGEST_LENGTH) != 0) {
+            ui_print("Block %d of %s doesn't match its map!\n", i, backup_file_image);
+            ret = -1;
+            break;
+        }
+        if (write(out_fd, buffer, len) != (ssize_t)len) {
+            ret = -1;
+            break;
+        }
+        MD5_Update(&whole, buffer, len);
+    }
+    unsigned char md5[MD5_DIGEST_LENGTH];
+    MD5_Final(md5, &whole);
+    if (ret == 0 && memcmp(md5, map.md5, MD5_DIGEST_LENGTH) != 0)
+        ret = -1;
+
+    free(buffer);
+    close(base_fd);
+    if (delta_fd >= 0)
+        close(delta_fd);
+    if (out_fd >= 0 && close(out_fd) != 0)
+        ret = -1;
+    if (ret != 0)
+        unlink(image);
+    nandroid_raw_map_free(&map);
+    return ret;
+}
+
+// Checks that the image a delta backup is rebuilt from is still there,
+// without reading it: its blocks are checked against the map as the
+// image is rebuilt.
+static int nandroid_check_raw_base(const char* backup_file_image)
+{
+    char tmp[PATH_MAX];
+    nandroid_raw_map map;
+    sprintf(tmp, "%s.map", backup_file_image);
+    if (nandroid_raw_map_load(tmp, &map) != 0 || map.base[0] == '\0') {
+        ui_print("Can't read %s\n", tmp);
+        return -1;
+    }
+    strcpy(tmp, backup_file_image);
+    char* slash = strrchr(tmp, '/');
+    sprintf(slash + 1, "%s", map.base);
+    struct stat st;
+    int ret = 0;
+    if (stat(tmp, &st) != 0) {
+        ui_print("%s needs %s, which is missing!\n", backup_file_image, tmp);
+        ret = -1;
+    }
+    nandroid_raw_map_free(&map);
+    return ret;
+}
+
+// ro.cwm.raw_backup_diff=false always stores full raw images.
+static int nandroid_use_raw_diff()
+{
+    char str[PROPERTY_VALUE_MAX];
+    property_get("ro.cwm.raw_backup_diff", str, "true");
+    return strcmp(str, "false") != 0;
+}
+
+// ro.cwm.raw_backup_sparse=true stores full raw images as sparse images.
+// Their maps wouldn't describe them, so there are no deltas against them.
+static int nandroid_raw_backup_flags()
+{
+    char str[PROPERTY_VALUE_MAX];
+    property_get("ro.cwm.raw_backup_sparse", str, "false");
+    return strcmp(str, "true") == 0 ? BACKUP_RAW_SPARSE : 0;
+}
+
+static int nandroid_backup_raw(nandroid_backup_job* job)
+{
+    Volume* vol = job->raw_volume;
+    char map_path[PATH_MAX];
+    sprintf(map_path, "%s.map", job->backup_file_image);
+
+    nandroid_raw_map map;
+    memset(&map, 0, sizeof(map));
+    char* buffer = NULL;
+    int flags = nandroid_raw_backup_flags();
+    int make_map = job->differential && flags == 0 && nandroid_use_raw_diff();
+
+    nandroid_raw_map previous;
+    char previous_image[PATH_MAX];
+    if (make_map && find_previous_raw_image(job->backup_file_image, previous_image, &previous) == 0) {
+        // a delta only pays if at most half the blocks changed, so hashing
+        // stops once more did and the image is stored in full
+        int block_count = previous.block_count;
+        if (job->raw_size / NANDROID_RAW_BLOCK_SIZE > (uint64_t)block_count)
+            block_count = job->raw_size / NANDROID_RAW_BLOCK_SIZE;
+        buffer = malloc(NANDROID_RAW_BLOCK_SIZE);
+        int hashed = -1;
+        if (buffer != NULL && previous.block_size == NANDROID_RAW_BLOCK_SIZE)
+            hashed = nandroid_raw_map_hash(vol, &map, buffer, &previous, block_count / 2);
+        uint64_t previous_size = previous.size;
+        nandroid_raw_map_free(&previous);
+
+        int changed = 0;
+        int i;
+        for (i = 0; hashed == 0 && i < map.block_count; i++) {
+            if (map.sources[i] == 'd')
+                changed++;
+        }
+        if (hashed == 0 && changed == 0 && map.size == previous_size && link(previous_image, job->backup_file_image) == 0) {
+            // unchanged, and the sdcard filesystem can share the image
+            ui_print("%s image unchanged since the last backup.\n", job->name);
+            for (i = 0; i < map.block_count; i++)
+                map.sources[i] = 'i';
+            strcpy(job->digest.file, job->backup_file_image);
+            memcpy(job->digest.md5, map.md5, MD5_DIGEST_LENGTH);
+            goto write_map;
+        }
+        if (hashed == 0 && changed * 2 <= map.block_count) {
+            ui_print("Backing up %d changed blocks of %s image...\n", changed, job->name);
+            // the base is linked next to the delta, so the older backup can
+            // go; where the sdcard can't link, the delta depends on it
+            char base[PATH_MAX];
+            sprintf(base, "%s.base", job->backup_file_image);
+            unlink(base);
+            if (link(previous_image, base) == 0) {
+                sprintf(map.base, "%s", strrchr(base, '/') + 1);
+            }
+            else {
+                // relative, so the backups can be moved around together
+                const char* previous_dir = previous_image + strlen(previous_image);
+                int slashes = 0;
+                while (previous_dir > previous_image && slashes < 2) {
+                    previous_dir--;
+                    if (*previous_dir == '/')
+                        slashes++;
+                }
+                sprintf(map.base, "..%s", previous_dir);
+                ui_print("%s image depends on %s, keep that backup!\n", job->name, previous_image);
+            }
+            sprintf(job->digest.file, "%s.delta", job->backup_file_image);
+            if (nandroid_write_raw_delta(vol, &map, buffer, &job->digest) == 0)
+                goto write_map;
+            ui_print("Partition changed while backing it up, storing it in full.\n");
+            unlink(base);
+        }
+        nandroid_raw_map_free(&map);
+    }
+
+    ui_print("Backing up %s image...\n", job->name);
+    int ret;
+    // the map and the md5 come from the data as it is written
+    nandroid_raw_hasher hasher;
+    nandroid_raw_hasher_init(&hasher, &map, NULL);
+    if (0 != (ret = backup_raw_partition_data(vol->fs_type, vol->device, job->backup_file_image, flags,
+            flags == 0 ? nandroid_raw_hash_data : NULL, &hasher))) {
+        ui_print("Error while backing up %s image!\n", job->name);
+        goto done;
+    }
+    strcpy(job->digest.file, job->backup_file_image);
+    if (flags != 0) {
+        // the headers of sparse images are filled in after the data, so
+        // they are only hashed once they are written
+        if (0 != (ret = compute_file_md5(job->digest.file, job->digest.md5)))
+            ui_print("Error while generating md5 sum of %s image!\n", job->name);
+        goto done;
+    }
+    int have_map = nandroid_raw_hasher_finish(&hasher) == 0;
+    memcpy(job->digest.md5, map.md5, MD5_DIGEST_LENGTH);
+    if (!make_map || !have_map)
+        goto done;
+
+write_map:
+    if (0 != (ret = nandroid_raw_map_write(map_path, &map)))
+        ui_print("Error writing %s!\n", map_path);
+
+done:
+    nandroid_raw_map_free(&map);
+    free(buffer);
+    return ret;
+}
+
+static int nandroid_run_backup_job(nandroid_backup_job* job)
+{
+    int ret;
+    if (job->done)
         return 0;
+
+    if (job->raw_volume != NULL) {
+        if (0 != (ret = nandroid_backup_raw(job)))
+            return ret;
+        nandroid_add_progress(job->raw_size);
     }
+    else {
+        ui_print("Backing up %s...\n", job->name);
+        ret = job->handler(job->mount_point, job->backup_file_image, job->callback, job->scan, &job->digest);
+        // the file list of a big partition is a lot to keep around while
+        // the others are backed up
+        tar_scan_free(job->scan);
+        job->scan = NULL;
+        if (ret != 0) {
+            ui_print("Error while making a backup image of %s!\n", job->mount_point);
+            return ret;
+        }
+    }
+    nandroid_journal_finish(job->mount_point, &job->digest);
+    return 0;
+}
 
-    return nandroid_backup_partition_extended(backup_path, root, 1);
+// Each worker claims a whole device group and backs up its partitions
+// one after another, until no unclaimed group is left or a job failed.
+static void* nandroid_backup_worker(void* cookie)
+{
+    nandroid_backup_schedule* schedule = (nandroid_backup_schedule*)cookie;
+    for (;;) {
+        pthread_mutex_lock(&schedule->mutex);
+        int group = -1;
+        if (schedule->ret == 0 && schedule->next_group < schedule->group_count)
+            group = schedule->next_group++;
+        pthread_mutex_unlock(&schedule->mutex);
+        if (group < 0)
+            break;
+
+        int i;
+        for (i = 0; i < schedule->job_count; i++) {
+            nandroid_backup_job* job = &schedule->jobs[i];
+            if (job->group != group)
+                continue;
+
+            pthread_mutex_lock(&schedule->mutex);
+            int failed = schedule->ret != 0;
+            pthread_mutex_unlock(&schedule->mutex);
+            if (failed)
+                break;
+
+            int ret = nandroid_run_backup_job(job);
+            if (ret != 0) {
+                pthread_mutex_lock(&schedule->mutex);
+                if (schedule->ret == 0)
+                    schedule->ret = ret;
+                pthread_mutex_unlock(&schedule->mutex);
+                break;
+            }
+        }
+    }
+    return NULL;
+}
+
+// Returns -1 if a partition that was unmounted for its backup can't be
+// mounted again.
+static int nandroid_schedule_finish(nandroid_backup_schedule* schedule)
+{
+    int ret = 0;
+    int i;
+    for (i = 0; i < schedule->job_count; i++) {
+        nandroid_backup_job* job = &schedule->jobs[i];
+        if (job->umount_when_finished)
+            ensure_path_unmounted(job->mount_point);
+        // it was mounted for the scan, leave it as it was
+        if (job->remount && ensure_path_mounted(job->mount_point) != 0) {
+            ui_print("Can't mount %s!\n", job->mount_point);
+            ret = -1;
+        }
+        tar_scan_free(job->scan);
+        job->scan = NULL;
+    }
+    pthread_mutex_destroy(&schedule->mutex);
+    return ret;
+}
+
+// The workers share the mount table and the partition tables of the raw
+// jobs, which their scanners rebuild without a lock.  They are held and
+// read here, so the workers find them current and only read them; the
+// scanners assert that.
+static int nandroid_hold_topology(nandroid_backup_schedule* schedule)
+{
+    int ret = 0;
+    int i;
+    for (i = 0; i < TOPOLOGY_COUNT; i++)
+        topology_hold(i);
+    if (scan_mounted_volumes() != 0)
+        ret = -1;
+    for (i = 0; ret == 0 && i < schedule->job_count; i++) {
+        Volume* vol = schedule->jobs[i].raw_volume;
+        if (vol == NULL || schedule->jobs[i].done)
+            continue;
+        if (strcmp(vol->fs_type, "mtd") == 0 && mtd_scan_partitions() < 0)
+            ret = -1;
+        else if (strcmp(vol->fs_type, "emmc") == 0 && vol->device[0] != '/' && mmc_scan_partitions() < 0)
+            ret = -1;
+    }
+    if (ret != 0)
+        ui_print("Can't read the partition tables!\n");
+    return ret;
+}
+
+static void nandroid_release_topology()
+{
+    int i;
+    for (i = 0; i < TOPOLOGY_COUNT; i++)
+        topology_release(i);
+}
+
+static int nandroid_run_schedule(nandroid_backup_schedule* schedule)
+{
+    char str[PROPERTY_VALUE_MAX];
+    property_get("ro.cwm.backup_threads", str, "2");
+    int threads = atoi(str);
+    if (threads > schedule->group_count)
+        threads = schedule->group_count;
+    if (threads < 1)
+        threads = 1;
+
+    ui_reset_progress();
+    ui_show_progress(1, 0);
+
+    // the calling thread holds the tables the workers share, so it only
+    // waits for them, unless no worker could be started.
+    if (nandroid_hold_topology(schedule) != 0)
+        schedule->ret = -1;
+    pthread_t workers[NANDROID_MAX_BACKUP_JOBS];
+    int started = 0;
+    while (schedule->ret == 0 && started < threads) {
+        if (pthread_create(&workers[started], NULL, nandroid_backup_worker, schedule) != 0)
+            break;
+        started++;
+    }
+    if (started == 0)
+        nandroid_backup_worker(schedule);
+    while (started > 0)
+        pthread_join(workers[--started], NULL);
+    nandroid_release_topology();
+
+    if (nandroid_schedule_finish(schedule) != 0 && schedule->ret == 0)
+        schedule->ret = -1;
+    return schedule->ret;
+}
+
+// Writes the md5 sums the backup jobs computed while writing their
+// images, in md5sum format so "md5sum -c nandroid.md5" still works.
+static int nandroid_write_md5(nandroid_backup_schedule* schedule, const char* backup_path)
+{
+    char tmp[PATH_MAX];
+    sprintf(tmp, "%s/nandroid.md5", backup_path);
+    FILE* f = fopen(tmp, "w");
+    if (f == NULL)
+        return -1;
+
+    int i, j;
+    for (i = 0; i < schedule->job_count; i++) {
+        nandroid_digest* digest = &schedule->jobs[i].digest;
+        if (digest->file[0] == '\0')
+            continue;
+        const char* name = strrchr(digest->file, '/');
+        name = name == NULL ? digest->file : name + 1;
+        for (j = 0; j < MD5_DIGEST_LENGTH; j++)
+            fprintf(f, "%02x", digest->md5[j]);
+        fprintf(f, "  %s\n", name);
+    }
+    return fclose(f) == 0 ? 0 : -1;
+}
+
+int nandroid_backup_partition_extended(const char* backup_path, const char* mount_point, int umount_when_finished) {
+    int ret;
+    nandroid_backup_schedule schedule;
+    nandroid_schedule_init(&schedule);
+    if (0 != (ret = nandroid_schedule_backup_extended(&schedule, backup_path, mount_point, umount_when_finished))) {
+        nandroid_schedule_finish(&schedule);
+        return ret;
+    }
+    return nandroid_run_schedule(&schedule);
+}
+
+int nandroid_backup_partition(const char* backup_path, const char* root) {
+    int ret;
+    nandroid_backup_schedule schedule;
+    nandroid_schedule_init(&schedule);
+    if (0 != (ret = nandroid_schedule_backup(&schedule, backup_path, root))) {
+        nandroid_schedule_finish(&schedule);
+        return ret;
+    }
+    return nandroid_run_schedule(&schedule);
 }
 
 int nandroid_backup(const char* backup_path)
@@ -251,34 +1669,41 @@ int nandroid_backup(const char* backup_path)
     sprintf(tmp, "mkdir -p %s", backup_path);
     __system(tmp);
 
-    if (0 != (ret = nandroid_backup_partition(backup_path, "/boot")))
-        return ret;
+    if (nandroid_journal_open(backup_path, "backup") > 0)
+        ui_print("Resuming interrupted backup...\n");
 
-    if (0 != (ret = nandroid_backup_partition(backup_path, "/recovery")))
-        return ret;
+    // Mount everything and pick the backup handlers up front, then let
+    // the scheduler run the backups of independent devices in parallel.
+    nandroid_backup_schedule schedule;
+    nandroid_schedule_init(&schedule);
+
+    if (0 != (ret = nandroid_schedule_backup(&schedule, backup_path, "/boot")))
+        goto fail;
+
+    if (0 != (ret = nandroid_schedule_backup(&schedule, backup_path, "/recovery")))
+        goto fail;
 
     Volume *vol = volume_for_path("/wimax");
     if (vol != NULL && 0 == stat(vol->device, &s))
     {
         char serialno[PROPERTY_VALUE_MAX];
-        ui_print("Backing up WiMAX...\n");
         serialno[0] = 0;
         property_get("ro.serialno", serialno, "");
         sprintf(tmp, "%s/wimax.%s.img", backup_path, serialno);
-        ret = backup_raw_partition(vol->fs_type, vol->device, tmp);
-        if (0 != ret)
-            return print_and_error("Error while dumping WiMAX image!\n");
+        if (0 != (ret = nandroid_schedule_raw_backup(&schedule, vol, "/wimax", tmp)))
+            goto fail;
+        strcpy(schedule.jobs[schedule.job_count - 1].name, "WiMAX");
     }
 
-    if (0 != (ret = nandroid_backup_partition(backup_path, "/system")))
-        return ret;
+    if (0 != (ret = nandroid_schedule_backup(&schedule, backup_path, "/system")))
+        goto fail;
 
-    if (0 != (ret = nandroid_backup_partition(backup_path, "/data")))
-        return ret;
+    if (0 != (ret = nandroid_schedule_backup(&schedule, backup_path, "/data")))
+        goto fail;
 
     if (has_datadata()) {
-        if (0 != (ret = nandroid_backup_partition(backup_path, "/datadata")))
-            return ret;
+        if (0 != (ret = nandroid_schedule_backup(&schedule, backup_path, "/datadata")))
+            goto fail;
     }
 
     if (0 != stat("/sdcard/.android_secure", &s))
@@ -287,12 +1712,12 @@ int nandroid_backup(const char* backup_path)
     }
     else
     {
-        if (0 != (ret = nandroid_backup_partition_extended(backup_path, "/sdcard/.android_secure", 0)))
-            return ret;
+        if (0 != (ret = nandroid_schedule_backup_extended(&schedule, backup_path, "/sdcard/.android_secure", 0)))
+            goto fail;
     }
 
-    if (0 != (ret = nandroid_backup_partition_extended(backup_path, "/cache", 0)))
-        return ret;
+    if (0 != (ret = nandroid_schedule_backup_extended(&schedule, backup_path, "/cache", 0)))
+        goto fail;
 
     vol = volume_for_path("/sd-ext");
     if (vol == NULL || 0 != stat(vol->device, &s))
@@ -303,55 +1728,270 @@ int nandroid_backup(const char* backup_path)
     {
         if (0 != ensure_path_mounted("/sd-ext"))
             ui_print("Could not mount sd-ext. sd-ext backup may not be supported on this device. Skipping backup of sd-ext.\n");
-        else if (0 != (ret = nandroid_backup_partition(backup_path, "/sd-ext")))
-            return ret;
+        else if (0 != (ret = nandroid_schedule_backup(&schedule, backup_path, "/sd-ext")))
+            goto fail;
+    }
+
+    if (0 != (ret = nandroid_run_schedule(&schedule))) {
+        nandroid_journal_close(0);
+        return ret;
     }
 
     ui_print("Generating md5 sum...\n");
-    sprintf(tmp, "nandroid-md5.sh %s", backup_path);
-    if (0 != (ret = __system(tmp))) {
+    if (0 != (ret = nandroid_write_md5(&schedule, backup_path))) {
         ui_print("Error while generating md5 sum!\n");
+        nandroid_journal_close(0);
         return ret;
     }
-    
-    sync();
-    ui_set_background(BACKGROUND_ICON_NONE);
-    ui_reset_progress();
-    ui_print("\nBackup complete!\n");
+    
+    sync();
+    nandroid_journal_close(1);
+    ui_set_background(BACKGROUND_ICON_NONE);
+    ui_reset_progress();
+    ui_print("\nBackup complete!\n");
+    return 0;
+
+fail:
+    nandroid_schedule_finish(&schedule);
+    nandroid_journal_close(0);
+    return ret;
+}
+
+typedef int (*format_function)(char* root);
+
+static void ensure_directory(const char* dir) {
+    char tmp[PATH_MAX];
+    sprintf(tmp, "mkdir -p %s", dir);
+    __system(tmp);
+}
+
+// md5 sums from nandroid.md5 of the backup being restored, loaded by
+// nandroid_restore.  Only the images of the partitions that are restored
+// are checked, all of them before the first partition is wiped.
+typedef struct {
+    char name[NAME_MAX + 1];
+    unsigned char md5[MD5_DIGEST_LENGTH];
+} nandroid_md5_entry;
+
+static nandroid_md5_entry* restore_md5 = NULL;
+static int restore_md5_count = 0;
+// nandroid_restore goes over the partitions twice: first only checking
+// their images, then restoring them without checking them again.
+static int restore_verify_only = 0;
+static int restore_md5_checked = 0;
+
+static void nandroid_free_md5()
+{
+    free(restore_md5);
+    restore_md5 = NULL;
+    restore_md5_count = 0;
+    restore_md5_checked = 0;
+}
+
+static int nandroid_load_md5(const char* backup_path)
+{
+    nandroid_free_md5();
+
+    char tmp[PATH_MAX];
+    sprintf(tmp, "%s/nandroid.md5", backup_path);
+    FILE* f = fopen(tmp, "r");
+    if (f == NULL)
+        return -1;
+
+    int alloc = 0;
+    char line[PATH_MAX];
+    while (fgets(line, sizeof(line), f) != NULL) {
+        // "<md5>  <file>" or "<md5> *<file>" for binary mode
+        int len = strlen(line);
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+            line[--len] = '\0';
+        if (len < MD5_DIGEST_LENGTH * 2 + 3)
+            continue;
+        const char* name = line + MD5_DIGEST_LENGTH * 2 + 2;
+        if (strlen(name) > NAME_MAX)
+            continue;
+        if (restore_md5_count == alloc) {
+            alloc = alloc ? alloc * 2 : 16;
+            nandroid_md5_entry* entries = realloc(restore_md5, alloc * sizeof(nandroid_md5_entry));
+            if (entries == NULL)
+                break;
+            restore_md5 = entries;
+        }
+        nandroid_md5_entry* entry = &restore_md5[restore_md5_count];
+        if (parse_md5(line, entry->md5) != 0)
+            continue;
+        strcpy(entry->name, name);
+        restore_md5_count++;
+    }
+    fclose(f);
+    if (restore_md5 == NULL) {
+        // an empty manifest can't vouch for anything
+        return -1;
+    }
+    return 0;
+}
+
+static const unsigned char* nandroid_find_md5(const char* file)
+{
+    const char* name = strrchr(file, '/');
+    name = name == NULL ? file : name + 1;
+    int i;
+    for (i = 0; i < restore_md5_count; i++) {
+        if (strcmp(restore_md5[i].name, name) == 0)
+            return restore_md5[i].md5;
+    }
+    ui_print("No MD5 sum for %s!\n", name);
+    return NULL;
+}
+
+static int nandroid_check_md5(const char* file, const unsigned char* md5)
+{
+    const unsigned char* expected = nandroid_find_md5(file);
+    if (expected == NULL)
+        return -1;
+    if (memcmp(expected, md5, MD5_DIGEST_LENGTH) != 0) {
+        ui_print("MD5 mismatch for %s!\n", file);
+        return -1;
+    }
     return 0;
 }
 
-typedef int (*format_function)(char* root);
+// Returns 0 if file matches nandroid.md5, or if no backup is being
+// restored through nandroid_restore or it was checked already.
+static int nandroid_verify_image(const char* file)
+{
+    if (restore_md5 == NULL || restore_md5_checked)
+        return 0;
+    ui_print("Checking MD5 sum...\n");
+    unsigned char md5[MD5_DIGEST_LENGTH];
+    if (0 != compute_file_md5(file, md5))
+        return -1;
+    return nandroid_check_md5(file, md5);
+}
 
-static void ensure_directory(const char* dir) {
-    char tmp[PATH_MAX];
-    sprintf(tmp, "mkdir -p %s", dir);
-    __system(tmp);
+// With ro.cwm.nandroid_verify=stream, every image is checked right
+// before its partition is wiped instead of all of them up front, and tar
+// backups while they are extracted rather than read twice.  That saves
+// a full read of the tar images, but a corrupt image is only noticed
+// after the partitions before it, or its own, have been wiped.
+static int nandroid_verify_while_reading()
+{
+    char str[PROPERTY_VALUE_MAX];
+    property_get("ro.cwm.nandroid_verify", str, "full");
+    return restore_md5 != NULL && strcmp(str, "stream") == 0;
+}
+
+// With ro.cwm.nandroid_raw_write=block, raw MTD images are read back
+// after every block as they are flashed, rather than once at the end.
+// With ro.cwm.raw_skip_unchanged=true, raw eMMC images only rewrite what
+// differs from the partition.
+static int nandroid_raw_restore_flags()
+{
+    char str[PROPERTY_VALUE_MAX];
+    property_get("ro.cwm.nandroid_raw_write", str, "fast");
+    int flags = strcmp(str, "block") == 0 ? 0 : RESTORE_RAW_FAST;
+    property_get("ro.cwm.raw_skip_unchanged", str, "false");
+    if (strcmp(str, "true") == 0)
+        flags |= RESTORE_RAW_SKIP_UNCHANGED;
+    return flags;
+}
+
+// Raw images that report how far they got get a bar of their own while
+// they are written, the rest of a restore shows an indeterminate one.
+static void nandroid_raw_progress(void* cookie, uint64_t done, uint64_t total)
+{
+    int* shown = (int*) cookie;
+    if (total == 0)
+        return;
+    if (!*shown) {
+        ui_reset_progress();
+        ui_show_progress(1.0, 0);
+        *shown = 1;
+    }
+    ui_set_progress((float)((double)done / (double)total));
 }
 
-typedef int (*nandroid_restore_handler)(const char* backup_file_image, const char* backup_path, int callback);
+static int nandroid_restore_raw_image(Volume* vol, const char* image)
+{
+    int shown = 0;
+    int ret = restore_raw_partition_progress(vol->fs_type, vol->device, image,
+            nandroid_raw_restore_flags(), nandroid_raw_progress, &shown);
+    if (shown)
+        ui_show_indeterminate_progress();
+    return ret;
+}
 
-static int unyaffs_wrapper(const char* backup_file_image, const char* backup_path, int callback) {
-    return unyaffs(backup_file_image, backup_path, callback ? yaffs_callback : NULL);
+// If md5 is not NULL, the handler fills in the md5 sum of
+// backup_file_image as it reads it.  resume is the journal's checkpoint
+// for an extraction that was cut short, only handlers that write
+// checkpoints ever get one.
+typedef int (*nandroid_restore_handler)(const char* backup_file_image, const char* backup_path, int callback, unsigned char* md5, const char* resume);
+
+static int unyaffs_wrapper(const char* backup_file_image, const char* backup_path, int callback, unsigned char* md5, const char* resume) {
+    int ret = unyaffs(backup_file_image, backup_path, callback ? yaffs_callback : NULL);
+    if (ret == 0 && md5 != NULL)
+        ret = compute_file_md5(backup_file_image, md5);
+    return ret;
 }
 
-static int tar_extract_wrapper(const char* backup_file_image, const char* backup_path, int callback) {
+static int tar_extract_wrapper(const char* backup_file_image, const char* backup_path, int callback, unsigned char* md5, const char* resume) {
     char tmp[PATH_MAX];
-    sprintf(tmp, "cd $(dirname %s) ; tar xvf %s ; exit $?", backup_path, backup_file_image);
-
-    char path[PATH_MAX];
-    FILE *fp = __popen(tmp, "r");
-    if (fp == NULL) {
-        ui_print("Unable to execute tar.\n");
+    strcpy(tmp, backup_path);
+    // lets compressed archives seek to the checkpoint
+    TarIndex* index = NULL;
+    if (resume != NULL) {
+        char index_path[PATH_MAX];
+        sprintf(index_path, "%s.idx", backup_file_image);
+        index = tar_index_load(index_path);
+    }
+    nandroid_journal_cookie cookie = { backup_path, backup_file_image };
+    int ret = tar_extract_resume(backup_file_image, index, dirname(tmp), md5,
+            resume, journal != NULL ? nandroid_journal_checkpoint : NULL,
+            callback ? tar_file_callback_wrapper : NULL, &cookie);
+    tar_index_free(index);
+    if (ret != 0) {
+        ui_print("Error extracting %s (%s)\n", backup_file_image, strerror(errno));
         return -1;
     }
+    return 0;
+}
 
-    while (fgets(path, PATH_MAX, fp) != NULL) {
-        if (callback)
-            yaffs_callback(path);
+static int dedupe_extract_wrapper(const char* backup_file_image, const char* backup_path, int callback, unsigned char* md5, const char* resume) {
+    char blob_dir[PATH_MAX];
+    get_blob_dir(backup_file_image, blob_dir);
+    nandroid_journal_cookie cookie = { backup_path, backup_file_image };
+    if (0 != dedupe_restore_resume(backup_file_image, blob_dir, backup_path,
+            resume, journal != NULL ? nandroid_journal_checkpoint : NULL,
+            callback ? dedupe_callback_wrapper : NULL, &cookie)) {
+        ui_print("Error extracting %s\n", backup_file_image);
+        return -1;
     }
+    if (md5 != NULL)
+        return compute_file_md5(backup_file_image, md5);
+    return 0;
+}
 
-    return __pclose(fp);
+// The image replaces the whole volume in one update, nothing is formatted
+// or mounted before it.
+static int ubi_restore_wrapper(const char* backup_file_image, const char* backup_path, int callback, unsigned char* md5, const char* resume) {
+    Volume* v = volume_for_path(backup_path);
+    if (v == NULL || ensure_path_unmounted(backup_path) != 0) {
+        ui_print("Can't unmount %s!\n", backup_path);
+        return -1;
+    }
+    struct stat st;
+    int fd = open(backup_file_image, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) != 0 ||
+            ubi_updatevol_fd(v->device, fd, st.st_size) != 0) {
+        ui_print("Error updating %s (%s)\n", v->device, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    close(fd);
+    if (md5 != NULL && compute_file_md5(backup_file_image, md5) != 0)
+        return -1;
+    return ensure_path_mounted(backup_path);
 }
 
 static nandroid_restore_handler get_restore_handler(const char *backup_path) {
@@ -390,6 +2030,11 @@ int nandroid_restore_partition_extended(const char* backup_path, const char* mou
     int ret = 0;
     char* name = basename(mount_point);
 
+    if (nandroid_journal_done(mount_point, NULL)) {
+        ui_print("%s is already restored.\n", mount_point);
+        return 0;
+    }
+
     nandroid_restore_handler restore_handler = NULL;
     const char *filesystems[] = { "yaffs2", "ext2", "ext3", "ext4", "vfat", "rfs", "ubifs", NULL };
     const char* backup_filesystem = NULL;
@@ -420,11 +2065,31 @@ int nandroid_restore_partition_extended(const char* backup_path, const char* mou
                 restore_handler = tar_extract_wrapper;
                 break;
             }
+            // tar_extract detects the compression by itself
+            sprintf(tmp, "%s/%s.%s.tar.gz", backup_path, name, filesystem);
+            if (0 == (ret = statfs(tmp, &file_info))) {
+                backup_filesystem = filesystem;
+                restore_handler = tar_extract_wrapper;
+                break;
+            }
+            sprintf(tmp, "%s/%s.%s.dup", backup_path, name, filesystem);
+            if (0 == (ret = statfs(tmp, &file_info))) {
+                backup_filesystem = filesystem;
+                restore_handler = dedupe_extract_wrapper;
+                break;
+            }
+            sprintf(tmp, "%s/%s.%s.ubi", backup_path, name, filesystem);
+            if (0 == (ret = statfs(tmp, &file_info))) {
+                backup_filesystem = filesystem;
+                restore_handler = ubi_restore_wrapper;
+                break;
+            }
             i++;
         }
 
         if (backup_filesystem == NULL || restore_handler == NULL) {
-            ui_print("%s.img not found. Skipping restore of %s.\n", name, mount_point);
+            if (!restore_verify_only)
+                ui_print("%s.img not found. Skipping restore of %s.\n", name, mount_point);
             return 0;
         }
         else {
@@ -443,23 +2108,44 @@ int nandroid_restore_partition_extended(const char* backup_path, const char* mou
             backup_filesystem = NULL;
     }
 
+    // picking up a restore that was cut short: the partition already
+    // holds everything before the checkpoint, so it is not formatted
+    const char* resume = nandroid_journal_resume(mount_point, tmp);
+    unsigned char md5[MD5_DIGEST_LENGTH];
+    int verify_while_reading = restore_handler == tar_extract_wrapper && nandroid_verify_while_reading() && resume == NULL;
+    if (verify_while_reading) {
+        if (nandroid_find_md5(tmp) == NULL)
+            return -1;
+    }
+    else if (0 != (ret = nandroid_verify_image(tmp))) {
+        return ret;
+    }
+    if (restore_verify_only)
+        return 0;
+
     ensure_directory(mount_point);
 
     int callback = stat("/sdcard/clockworkmod/.hidenandroidprogress", &file_info) != 0;
+    int whole_volume = restore_handler == ubi_restore_wrapper;
 
-    ui_print("Restoring %s...\n", name);
-    if (backup_filesystem == NULL) {
-        if (0 != (ret = format_volume(mount_point))) {
+    if (resume != NULL) {
+        ui_print("Resuming interrupted restore of %s...\n", name);
+    }
+    else {
+        ui_print("Restoring %s...\n", name);
+        if (backup_filesystem == NULL) {
+            if (0 != (ret = format_volume(mount_point))) {
+                ui_print("Error while formatting %s!\n", mount_point);
+                return ret;
+            }
+        }
+        else if (!whole_volume && 0 != (ret = format_device(device, mount_point, backup_filesystem))) {
             ui_print("Error while formatting %s!\n", mount_point);
             return ret;
         }
     }
-    else if (0 != (ret = format_device(device, mount_point, backup_filesystem))) {
-        ui_print("Error while formatting %s!\n", mount_point);
-        return ret;
-    }
 
-    if (0 != (ret = ensure_path_mounted(mount_point))) {
+    if (!whole_volume && 0 != (ret = ensure_path_mounted(mount_point))) {
         ui_print("Can't mount %s!\n", mount_point);
         return ret;
     }
@@ -470,10 +2156,15 @@ int nandroid_restore_partition_extended(const char* backup_path, const char* mou
         ui_print("Error finding an appropriate restore handler.\n");
         return -2;
     }
-    if (0 != (ret = restore_handler(tmp, mount_point, callback))) {
+    if (0 != (ret = restore_handler(tmp, mount_point, callback, verify_while_reading ? md5 : NULL, resume))) {
         ui_print("Error while restoring %s!\n", mount_point);
         return ret;
     }
+    if (verify_while_reading && 0 != (ret = nandroid_check_md5(tmp, md5))) {
+        ui_print("%s was restored from a corrupt backup!\n", mount_point);
+        return ret;
+    }
+    nandroid_journal_finish(mount_point, NULL);
 
     if (umount_when_finished) {
         ensure_path_unmounted(mount_point);
@@ -495,38 +2186,59 @@ int nandroid_restore_partition(const char* backup_path, const char* root) {
             strcmp(vol->fs_type, "emmc") == 0) {
         int ret;
         const char* name = basename(root);
+        if (nandroid_journal_done(root, NULL)) {
+            ui_print("%s is already restored.\n", root);
+            return 0;
+        }
+        sprintf(tmp, "%s%s.img", backup_path, root);
+        // differential backups are put back together in /tmp, before
+        // anything is erased
+        char image[PATH_MAX];
+        char delta[PATH_MAX];
+        struct stat st;
+        strcpy(image, tmp);
+        sprintf(delta, "%s.delta", tmp);
+        if (stat(tmp, &st) != 0 && stat(delta, &st) == 0) {
+            if (0 != (ret = nandroid_verify_image(delta)))
+                return ret;
+            if (restore_verify_only)
+                return nandroid_check_raw_base(tmp);
+            sprintf(image, "/tmp/%s.img", name);
+            ui_print("Rebuilding %s image...\n", name);
+            if (0 != (ret = nandroid_rebuild_raw_image(tmp, image))) {
+                ui_print("Error while rebuilding %s image!\n", name);
+                return ret;
+            }
+        }
+        else if (0 != (ret = nandroid_verify_image(tmp))) {
+            return ret;
+        }
+        if (restore_verify_only)
+            return 0;
         ui_print("Erasing %s before restore...\n", name);
         if (0 != (ret = format_volume(root))) {
             ui_print("Error while erasing %s image!", name);
+            if (strcmp(image, tmp) != 0)
+                unlink(image);
             return ret;
         }
-        sprintf(tmp, "%s%s.img", backup_path, root);
         ui_print("Restoring %s image...\n", name);
-        if (0 != (ret = restore_raw_partition(vol->fs_type, vol->device, tmp))) {
+        ret = nandroid_restore_raw_image(vol, image);
+        if (strcmp(image, tmp) != 0)
+            unlink(image);
+        if (ret != 0) {
             ui_print("Error while flashing %s image!", name);
             return ret;
         }
+        nandroid_journal_finish(root, NULL);
         return 0;
     }
     return nandroid_restore_partition_extended(backup_path, root, 1);
 }
 
-int nandroid_restore(const char* backup_path, int restore_boot, int restore_system, int restore_data, int restore_cache, int restore_sdext, int restore_wimax)
+static int nandroid_restore_partitions(const char* backup_path, int restore_boot, int restore_system, int restore_data, int restore_cache, int restore_sdext, int restore_wimax)
 {
-    ui_set_background(BACKGROUND_ICON_INSTALLING);
-    ui_show_indeterminate_progress();
-    yaffs_files_total = 0;
-
-    if (ensure_path_mounted(backup_path) != 0)
-        return print_and_error("Can't mount backup path\n");
-    
     char tmp[PATH_MAX];
-
-    ui_print("Checking MD5 sums...\n");
-    sprintf(tmp, "cd %s && md5sum -c nandroid.md5", backup_path);
-    if (0 != __system(tmp))
-        return print_and_error("MD5 mismatch!\n");
-    
     int ret;
 
     if (restore_boot && NULL != volume_for_path("/boot") && 0 != (ret = nandroid_restore_partition(backup_path, "/boot")))
@@ -545,19 +2257,28 @@ int nandroid_restore(const char* backup_path, int restore_boot, int restore_syst
         struct stat st;
         if (0 != stat(tmp, &st))
         {
-            ui_print("WARNING: WiMAX partition exists, but nandroid\n");
-            ui_print("         backup does not contain WiMAX image.\n");
-            ui_print("         You should create a new backup to\n");
-            ui_print("         protect your WiMAX keys.\n");
+            if (!restore_verify_only)
+            {
+                ui_print("WARNING: WiMAX partition exists, but nandroid\n");
+                ui_print("         backup does not contain WiMAX image.\n");
+                ui_print("         You should create a new backup to\n");
+                ui_print("         protect your WiMAX keys.\n");
+            }
         }
-        else
+        else if (!nandroid_journal_done("/wimax", NULL))
         {
-            ui_print("Erasing WiMAX before restore...\n");
-            if (0 != (ret = format_volume("/wimax")))
-                return print_and_error("Error while formatting wimax!\n");
-            ui_print("Restoring WiMAX image...\n");
-            if (0 != (ret = restore_raw_partition(vol->fs_type, vol->device, tmp)))
+            if (0 != (ret = nandroid_verify_image(tmp)))
                 return ret;
+            if (!restore_verify_only)
+            {
+                ui_print("Erasing WiMAX before restore...\n");
+                if (0 != (ret = format_volume("/wimax")))
+                    return print_and_error("Error while formatting wimax!\n");
+                ui_print("Restoring WiMAX image...\n");
+                if (0 != (ret = nandroid_restore_raw_image(vol, tmp)))
+                    return ret;
+                nandroid_journal_finish("/wimax", NULL);
+            }
         }
     }
 
@@ -581,6 +2302,368 @@ int nandroid_restore(const char* backup_path, int restore_boot, int restore_syst
     if (restore_sdext && 0 != (ret = nandroid_restore_partition(backup_path, "/sd-ext")))
         return ret;
 
+    return 0;
+}
+
+int nandroid_restore(const char* backup_path, int restore_boot, int restore_system, int restore_data, int restore_cache, int restore_sdext, int restore_wimax)
+{
+    ui_set_background(BACKGROUND_ICON_INSTALLING);
+    ui_show_indeterminate_progress();
+    nandroid_progress_total = 0;
+
+    if (ensure_path_mounted(backup_path) != 0)
+        return print_and_error("Can't mount backup path\n");
+
+    // only the images that are actually restored get checked
+    if (0 != nandroid_load_md5(backup_path))
+        return print_and_error("Can't read nandroid.md5!\n");
+
+    // the same selection of partitions of the same backup resumes
+    char header[64];
+    sprintf(header, "restore %d %d %d %d %d %d", restore_boot, restore_system, restore_data, restore_cache, restore_sdext, restore_wimax);
+    if (nandroid_journal_open(backup_path, header) > 0)
+        ui_print("Resuming interrupted restore...\n");
+
+    int ret = 0;
+    // all of them before the first partition is wiped, so a corrupt
+    // backup leaves the device as it was.  They are read twice either
+    // way, unless tar images are checked while they are extracted.
+    if (!nandroid_verify_while_reading()) {
+        restore_verify_only = 1;
+        ret = nandroid_restore_partitions(backup_path, restore_boot, restore_system, restore_data, restore_cache, restore_sdext, restore_wimax);
+        restore_verify_only = 0;
+        restore_md5_checked = 1;
+    }
+    if (ret == 0)
+        ret = nandroid_restore_partitions(backup_path, restore_boot, restore_system, restore_data, restore_cache, restore_sdext, restore_wimax);
+    nandroid_free_md5();
+    if (ret != 0) {
+        nandroid_journal_close(0);
+        return ret;
+    }
+
+    sync();
+    nandroid_journal_close(1);
+    ui_set_background(BACKGROUND_ICON_NONE);
+    ui_reset_progress();
+    ui_print("\nRestore complete!\n");
+    return 0;
+}
+
+// Reads the header of the journal an interrupted backup or restore left
+// in backup_path.  Returns 0 if there is one.
+static int nandroid_read_journal_header(const char* backup_path, char* header, int len)
+{
+    char path[PATH_MAX];
+    sprintf(path, "%s/nandroid.journal", backup_path);
+    FILE* f = fopen(path, "r");
+    if (f == NULL)
+        return -1;
+    int ret = fgets(header, len, f) == NULL ? -1 : 0;
+    fclose(f);
+    if (ret == 0)
+        header[strcspn(header, "\n")] = '\0';
+    return ret;
+}
+
+int nandroid_resume(const char* backup_path)
+{
+    char header[64];
+    int restore_boot, restore_system, restore_data, restore_cache, restore_sdext, restore_wimax;
+    if (ensure_path_mounted(backup_path) != 0)
+        return print_and_error("Can't mount backup path.\n");
+    if (0 != nandroid_read_journal_header(backup_path, header, sizeof(header)))
+        return print_and_error("No interrupted backup or restore found.\n");
+    if (strcmp(header, "backup") == 0)
+        return nandroid_backup(backup_path);
+    if (sscanf(header, "restore %d %d %d %d %d %d", &restore_boot, &restore_system, &restore_data, &restore_cache, &restore_sdext, &restore_wimax) == 6)
+        return nandroid_restore(backup_path, restore_boot, restore_system, restore_data, restore_cache, restore_sdext, restore_wimax);
+    return print_and_error("Unknown nandroid.journal!\n");
+}
+
+int nandroid_find_interrupted_backup(const char* backup_dir, char* backup_path)
+{
+    DIR* dir = opendir(backup_dir);
+    if (dir == NULL)
+        return -1;
+
+    char path[PATH_MAX];
+    char header[64];
+    struct dirent* de;
+    time_t newest = 0;
+    int ret = -1;
+    while ((de = readdir(dir)) != NULL) {
+        struct stat st;
+        if (de->d_name[0] == '.')
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", backup_dir, de->d_name);
+        if (0 != nandroid_read_journal_header(path, header, sizeof(header)) || strcmp(header, "backup") != 0)
+            continue;
+        strcat(path, "/nandroid.journal");
+        if (stat(path, &st) != 0 || (ret == 0 && st.st_mtime < newest))
+            continue;
+        newest = st.st_mtime;
+        snprintf(backup_path, PATH_MAX, "%s/%s", backup_dir, de->d_name);
+        ret = 0;
+    }
+    closedir(dir);
+    return ret;
+}
+
+int nandroid_has_interrupted_restore(const char* backup_path)
+{
+    char header[64];
+    return nandroid_read_journal_header(backup_path, header, sizeof(header)) == 0 &&
+            strncmp(header, "restore ", 8) == 0;
+}
+
+void nandroid_discard_journal(const char* backup_path)
+{
+    char path[PATH_MAX];
+    sprintf(path, "%s/nandroid.journal", backup_path);
+    unlink(path);
+}
+
+// Drops the blobs in blob_dir that no backup next to it refers to any
+// more, eg. after backups were deleted.
+int nandroid_dedupe_gc(const char* blob_dir)
+{
+    struct stat st;
+    if (stat(blob_dir, &st) != 0) {
+        ui_print("No deduplicated backups in %s.\n", blob_dir);
+        return 0;
+    }
+
+    char backup_dir[PATH_MAX];
+    strcpy(backup_dir, blob_dir);
+    char* slash = strrchr(backup_dir, '/');
+    if (slash == NULL)
+        return print_and_error("Invalid blob directory.\n");
+    strcpy(slash, "/backup");
+
+    // a backup we can't look into might use any blob, give up then
+    DIR* dir = opendir(backup_dir);
+    if (dir == NULL) {
+        ui_print("Can't open %s (%s)\n", backup_dir, strerror(errno));
+        return -1;
+    }
+
+    const char** manifests = NULL;
+    int count = 0;
+    int alloc = 0;
+    int ret = 0;
+    struct dirent* backup;
+    while (ret == 0 && (backup = readdir(dir)) != NULL) {
+        if (backup->d_name[0] == '.')
+            continue;
+        char path[PATH_MAX];
+        sprintf(path, "%s/%s", backup_dir, backup->d_name);
+        DIR* files = opendir(path);
+        if (files == NULL) {
+            if (errno == ENOTDIR)
+                continue;
+            ui_print("Can't open %s (%s)\n", path, strerror(errno));
+            ret = -1;
+            break;
+        }
+        struct dirent* file;
+        while ((file = readdir(files)) != NULL) {
+            int len = strlen(file->d_name);
+            if (len < 4 || strcmp(file->d_name + len - 4, ".dup") != 0)
+                continue;
+            // keep room for the terminating NULL
+            if (count + 1 >= alloc) {
+                alloc = alloc ? alloc * 2 : 16;
+                const char** grown = realloc(manifests, alloc * sizeof(char*));
+                if (grown == NULL) {
+                    ret = -1;
+                    break;
+                }
+                manifests = grown;
+            }
+            char* manifest = malloc(strlen(path) + len + 2);
+            if (manifest == NULL) {
+                ret = -1;
+                break;
+            }
+            sprintf(manifest, "%s/%s", path, file->d_name);
+            manifests[count++] = manifest;
+        }
+        closedir(files);
+    }
+    closedir(dir);
+
+    if (ret == 0) {
+        ui_print("Freeing unused backup data...\n");
+        const char* none[] = { NULL };
+        if (manifests != NULL)
+            manifests[count] = NULL;
+        if (0 != dedupe_gc(blob_dir, manifests != NULL ? manifests : none))
+            ret = print_and_error("Error freeing unused backup data.\n");
+    }
+
+    while (count > 0)
+        free((void*)manifests[--count]);
+    free(manifests);
+    return ret;
+}
+
+// Partitions that are backed up file by file, and can be restored in
+// part.
+static const char* nandroid_file_partitions[] = { "/system", "/data", "/datadata", "/sdcard/.android_secure", "/cache", "/sd-ext", NULL };
+
+enum {
+    NANDROID_FILES_NONE,
+    NANDROID_FILES_TAR,
+    NANDROID_FILES_DUP,
+};
+
+static const char* partition_for_path(const char* path)
+{
+    const char** mount_point;
+    for (mount_point = nandroid_file_partitions; *mount_point != NULL; mount_point++) {
+        int len = strlen(*mount_point);
+        if (strncmp(path, *mount_point, len) == 0 && (path[len] == '/' || path[len] == '\0'))
+            return *mount_point;
+    }
+    return NULL;
+}
+
+// Finds the tar or dedupe backup of mount_point in backup_path.
+static int find_file_backup(const char* backup_path, const char* mount_point, char* image)
+{
+    const char* filesystems[] = { "yaffs2", "ext2", "ext3", "ext4", "vfat", "rfs", "ubifs", "auto", NULL };
+    const char* suffixes[] = { "tar", "tar.gz", "dup", NULL };
+    char name[PATH_MAX];
+    strcpy(name, mount_point);
+    const char* base = basename(name);
+    int i, j;
+    struct stat st;
+    for (i = 0; filesystems[i] != NULL; i++) {
+        for (j = 0; suffixes[j] != NULL; j++) {
+            sprintf(image, "%s/%s.%s.%s", backup_path, base, filesystems[i], suffixes[j]);
+            if (stat(image, &st) == 0)
+                return strcmp(suffixes[j], "dup") == 0 ? NANDROID_FILES_DUP : NANDROID_FILES_TAR;
+        }
+    }
+    return NANDROID_FILES_NONE;
+}
+
+// Turns a path below mount_point into a name as stored in the backup:
+// tar names start with the partition name ("data/app/Foo.apk"), dedupe
+// names are relative to the partition ("app/Foo.apk").
+static void backup_name_for_path(int type, const char* mount_point, const char* path, char* name)
+{
+    const char* rest = path + strlen(mount_point);
+    if (type == NANDROID_FILES_TAR) {
+        char tmp[PATH_MAX];
+        strcpy(tmp, mount_point);
+        sprintf(name, "%s%s", basename(tmp), rest);
+    }
+    else if (*rest == '\0') {
+        strcpy(name, "*");
+    }
+    else {
+        strcpy(name, rest + 1);
+    }
+}
+
+// Restores the paths (absolute, fnmatch patterns allowed) below
+// mount_point from its tar or dedupe backup, without formatting.  The
+// backup isn't checked against nandroid.md5, that would mean reading it
+// all; tar headers and dedupe blobs are checked as they are read.
+static int nandroid_restore_partition_paths(const char* backup_path, const char* mount_point, const char** paths, int count)
+{
+    char image[PATH_MAX];
+    int type = find_file_backup(backup_path, mount_point, image);
+    if (type == NANDROID_FILES_NONE) {
+        ui_print("No tar or dedupe backup of %s found.\n", mount_point);
+        return -1;
+    }
+    if (0 != ensure_path_mounted(mount_point)) {
+        ui_print("Can't mount %s!\n", mount_point);
+        return -1;
+    }
+
+    char (*names)[PATH_MAX] = malloc(count * PATH_MAX);
+    const char** patterns = malloc((count + 1) * sizeof(char*));
+    if (names == NULL || patterns == NULL) {
+        free(names);
+        free(patterns);
+        return -1;
+    }
+    int i;
+    for (i = 0; i < count; i++) {
+        backup_name_for_path(type, mount_point, paths[i], names[i]);
+        patterns[i] = names[i];
+    }
+    patterns[count] = NULL;
+
+    struct stat file_info;
+    int callback = stat("/sdcard/clockworkmod/.hidenandroidprogress", &file_info) != 0;
+    int ret;
+    ui_print("Restoring files to %s...\n", mount_point);
+    if (type == NANDROID_FILES_TAR) {
+        char tmp[PATH_MAX];
+        sprintf(tmp, "%s.idx", image);
+        TarIndex* index = tar_index_load(tmp);
+        if (index == NULL)
+            ui_print("No index found, reading the whole backup.\n");
+        strcpy(tmp, mount_point);
+        ret = tar_extract_paths(image, index, dirname(tmp), patterns, callback ? tar_file_callback_wrapper : NULL, NULL);
+        if (ret != 0)
+            ui_print("Error extracting %s (%s)\n", image, strerror(errno));
+        tar_index_free(index);
+    }
+    else {
+        char blob_dir[PATH_MAX];
+        get_blob_dir(image, blob_dir);
+        ret = dedupe_restore_paths(image, blob_dir, mount_point, patterns, callback ? dedupe_callback_wrapper : NULL, NULL);
+        if (ret != 0)
+            ui_print("Error extracting %s\n", image);
+    }
+    free(names);
+    free(patterns);
+    return ret;
+}
+
+int nandroid_restore_paths(const char* backup_path, const char** paths)
+{
+    ui_set_background(BACKGROUND_ICON_INSTALLING);
+    ui_show_indeterminate_progress();
+    nandroid_progress_total = 0;
+
+    if (ensure_path_mounted(backup_path) != 0)
+        return print_and_error("Can't mount backup path\n");
+
+    int count = 0;
+    while (paths[count] != NULL) {
+        if (partition_for_path(paths[count]) == NULL) {
+            ui_print("%s is not in a partition nandroid backs up file by file.\n", paths[count]);
+            return 1;
+        }
+        count++;
+    }
+
+    // one pass over each backup for all the paths in its partition
+    const char** partition_paths = malloc((count + 1) * sizeof(char*));
+    if (partition_paths == NULL)
+        return 1;
+    int ret = 0;
+    const char** mount_point;
+    for (mount_point = nandroid_file_partitions; ret == 0 && *mount_point != NULL; mount_point++) {
+        int i, n = 0;
+        for (i = 0; i < count; i++) {
+            if (partition_for_path(paths[i]) == *mount_point)
+                partition_paths[n++] = paths[i];
+        }
+        if (n > 0)
+            ret = nandroid_restore_partition_paths(backup_path, *mount_point, partition_paths, n);
+    }
+    free(partition_paths);
+    if (ret != 0)
+        return ret;
+
     sync();
     ui_set_background(BACKGROUND_ICON_NONE);
     ui_reset_progress();
@@ -588,16 +2671,132 @@ int nandroid_restore(const char* backup_path, int restore_boot, int restore_syst
     return 0;
 }
 
+static int compare_strings(const void* a, const void* b)
+{
+    return strcmp(*(const char**)a, *(const char**)b);
+}
+
+static int add_child(char*** children, int* count, int* alloc, const char* name, int is_dir)
+{
+    if (*count + 1 >= *alloc) {
+        int new_alloc = *alloc * 2 + 64;
+        char** list = realloc(*children, new_alloc * sizeof(char*));
+        if (list == NULL)
+            return -1;
+        *children = list;
+        *alloc = new_alloc;
+    }
+    char* child = malloc(strlen(name) + 2);
+    if (child == NULL)
+        return -1;
+    sprintf(child, "%s%s", name, is_dir ? "/" : "");
+    (*children)[(*count)++] = child;
+    (*children)[*count] = NULL;
+    return 0;
+}
+
+// If name is directly below parent, returns its last component.
+static const char* child_name(const char* parent, int parent_len, const char* name)
+{
+    if (strncmp(name, parent, parent_len) != 0 || name[parent_len] != '/')
+        return NULL;
+    name += parent_len + 1;
+    if (*name == '\0' || strchr(name, '/') != NULL)
+        return NULL;
+    return name;
+}
+
+char** nandroid_list_backup_dir(const char* backup_path, const char* dir)
+{
+    const char* mount_point = partition_for_path(dir);
+    if (mount_point == NULL)
+        return NULL;
+    char image[PATH_MAX];
+    int type = find_file_backup(backup_path, mount_point, image);
+    if (type == NANDROID_FILES_NONE) {
+        ui_print("No tar or dedupe backup of %s found.\n", mount_point);
+        return NULL;
+    }
+
+    char parent[PATH_MAX];
+    if (type == NANDROID_FILES_TAR)
+        backup_name_for_path(type, mount_point, dir, parent);
+    else
+        sprintf(parent, ".%s", dir + strlen(mount_point));
+    int parent_len = strlen(parent);
+
+    char** children = NULL;
+    int count = 0, alloc = 0;
+    int ret = 0;
+    if (type == NANDROID_FILES_TAR) {
+        char index_path[PATH_MAX];
+        sprintf(index_path, "%s.idx", image);
+        TarIndex* index = tar_index_load(index_path);
+        if (index == NULL) {
+            ui_print("No index found for %s.\n", image);
+            return NULL;
+        }
+        uint64_t i;
+        for (i = 0; ret == 0 && i < tar_index_count(index); i++) {
+            int is_dir;
+            const char* name = child_name(parent, parent_len, tar_index_name(index, i, &is_dir));
+            if (name != NULL)
+                ret = add_child(&children, &count, &alloc, name, is_dir);
+        }
+        tar_index_free(index);
+    }
+    else {
+        // "<type>\t<mode>\t<uid>\t<gid>\t<name>\t..."
+        FILE* f = fopen(image, "r");
+        if (f == NULL) {
+            ui_print("Can't open %s\n", image);
+            return NULL;
+        }
+        char line[PATH_MAX * 2];
+        while (ret == 0 && fgets(line, sizeof(line), f) != NULL) {
+            char* field = line;
+            int i;
+            for (i = 0; i < 4 && field != NULL; i++) {
+                field = strchr(field, '\t');
+                if (field != NULL)
+                    field++;
+            }
+            char* end = field != NULL ? strchr(field, '\t') : NULL;
+            if (end == NULL)
+                continue;
+            *end = '\0';
+            const char* name = child_name(parent, parent_len, field);
+            if (name != NULL)
+                ret = add_child(&children, &count, &alloc, name, line[0] == 'd');
+        }
+        fclose(f);
+    }
+
+    if (ret != 0) {
+        while (count > 0)
+            free(children[--count]);
+        free(children);
+        return NULL;
+    }
+    if (children == NULL) {
+        children = calloc(1, sizeof(char*));
+        return children;
+    }
+    qsort(children, count, sizeof(char*), compare_strings);
+    return children;
+}
+
 int nandroid_usage()
 {
     printf("Usage: nandroid backup\n");
-    printf("Usage: nandroid restore <directory>\n");
+    printf("Usage: nandroid restore <directory> [<path>...]\n");
+    printf("Usage: nandroid resume <directory>\n");
     return 1;
 }
 
 int nandroid_main(int argc, char** argv)
 {
-    if (argc > 3 || argc < 2)
+    if (argc < 2)
         return nandroid_usage();
     
     if (strcmp("backup", argv[1]) == 0)
@@ -612,10 +2811,21 @@ int nandroid_main(int argc, char** argv)
 
     if (strcmp("restore", argv[1]) == 0)
     {
-        if (argc != 3)
+        if (argc < 3)
             return nandroid_usage();
+        // paths (or patterns like "/data/data/com.foo*") restore just
+        // those files
+        if (argc > 3)
+            return nandroid_restore_paths(argv[2], (const char**)argv + 3);
         return nandroid_restore(argv[2], 1, 1, 1, 1, 1, 0);
     }
+
+    if (strcmp("resume", argv[1]) == 0)
+    {
+        if (argc != 3)
+            return nandroid_usage();
+        return nandroid_resume(argv[2]);
+    }
     
     return nandroid_usage();
 }
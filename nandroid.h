@@ -4,5 +4,18 @@
 int nandroid_main(int argc, char** argv);
 int nandroid_backup(const char* backup_path);
 int nandroid_restore(const char* backup_path, int restore_boot, int restore_system, int restore_data, int restore_cache, int restore_sdext, int restore_wimax);
+int nandroid_restore_paths(const char* backup_path, const char** paths);
+char** nandroid_list_backup_dir(const char* backup_path, const char* dir);
+int nandroid_dedupe_gc(const char* blob_dir);
+
+// Interrupted backups and restores leave a journal in the backup
+// directory, running them again with the same arguments picks them up.
+// nandroid_resume does that with the arguments in the journal.
+int nandroid_resume(const char* backup_path);
+// Sets backup_path to the newest interrupted backup in backup_dir.
+// Returns 0 if there is one.
+int nandroid_find_interrupted_backup(const char* backup_dir, char* backup_path);
+int nandroid_has_interrupted_restore(const char* backup_path);
+void nandroid_discard_journal(const char* backup_path);
 
 #endif
\ No newline at end of file
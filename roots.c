@@ -24,6 +24,7 @@
 
 #include "mtdutils/mtdutils.h"
 #include "mounts.h"
+#include "topology/topology.h"
 #include "roots.h"
 #include "common.h"
 #include "make_ext4fs.h"
@@ -158,8 +159,10 @@ int try_mount(const char* device, const char* mount_point, const char* fs_type,
         sprintf(mount_cmd, "mount -t %s -o%s %s %s", fs_type, fs_options, device, mount_point);
         ret = __system(mount_cmd);
     }
-    if (ret == 0)
+    if (ret == 0) {
+        topology_invalidate(TOPOLOGY_MOUNTS);
         return 0;
+    }
     LOGW("failed to mount %s (%s)\n", device, strerror(errno));
     return ret;
 }
@@ -247,7 +250,9 @@ int ensure_path_mounted_at_mount_point(const char* path, const char* mount_point
         // let's try mounting with the mount binary and hope for the best.
         char mount_cmd[PATH_MAX];
         sprintf(mount_cmd, "mount %s", path);
-        return __system(mount_cmd);
+        result = __system(mount_cmd);
+        topology_invalidate(TOPOLOGY_MOUNTS);
+        return result;
     }
 
     LOGE("unknown fs_type \"%s\" for %s\n", v->fs_type, mount_point);
@@ -292,6 +297,9 @@ int ensure_path_unmounted(const char* path) {
 }
 
 int format_volume(const char* volume) {
+    // whatever way it goes, it may mount and unmount things on the way
+    topology_invalidate(TOPOLOGY_MOUNTS);
+
     Volume* v = volume_for_path(volume);
     if (v == NULL) {
         // no /sdcard? let's assume /data/media
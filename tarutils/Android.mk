@@ -0,0 +1,8 @@
+LOCAL_PATH := $(call my-dir)
+
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES := tar_create.c tar_extract.c tar_gzip.c tar_index.c tar_scan.c
+LOCAL_C_INCLUDES := external/zlib external/openssl/include
+LOCAL_MODULE := libtarutils
+LOCAL_MODULE_TAGS := eng
+include $(BUILD_STATIC_LIBRARY)
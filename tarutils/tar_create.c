@@ -0,0 +1,782 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/types.h>
+
+#include <openssl/md5.h>
+
+#include "tarutils.h"
+#include "tar_format.h"
+#include "tar_gzip.h"
+#include "tar_index.h"
+#include "tar_scan.h"
+
+struct hard_link {
+    dev_t dev;
+    ino_t ino;
+    char *path;
+};
+
+typedef struct {
+    int fd;
+    TarGzWriter *gz;
+    MD5_CTX *md5;
+    char *buffer;
+    size_t fill;
+    uint64_t written;
+
+    tar_file_callback callback;
+    void *cookie;
+
+    struct hard_link *links;
+    int link_count;
+    int link_alloc;
+    // open addressing on (dev, ino), link + 1 or 0 for an empty slot
+    int *link_slots;
+    unsigned int link_slot_count;   // a power of two, at least twice the links
+} TarWriter;
+
+static int tar_flush(TarWriter *tar)
+{
+    if (tar->gz != NULL) {
+        // the compressor takes the buffer and hands back an empty one
+        char *buffer = tar_gz_writer_submit(tar->gz, tar->buffer, tar->fill);
+        if (buffer == NULL)
+            return -1;
+        tar->buffer = buffer;
+        tar->written += tar->fill;
+        tar->fill = 0;
+        return 0;
+    }
+
+    if (tar->md5 != NULL)
+        MD5_Update(tar->md5, tar->buffer, tar->fill);
+    size_t done = 0;
+    while (done < tar->fill) {
+        ssize_t wrote = write(tar->fd, tar->buffer + done, tar->fill - done);
+        if (wrote < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        done += wrote;
+    }
+    tar->written += tar->fill;
+    tar->fill = 0;
+    return 0;
+}
+
+// Makes sure at least one block is free at the end of the buffer.
+static char *tar_reserve_block(TarWriter *tar)
+{
+    if (tar->fill + TAR_BLOCK_SIZE > TAR_IO_BUFFER_SIZE && tar_flush(tar))
+        return NULL;
+    char *block = tar->buffer + tar->fill;
+    memset(block, 0, TAR_BLOCK_SIZE);
+    tar->fill += TAR_BLOCK_SIZE;
+    return block;
+}
+
+static void format_octal(char *field, size_t len, uint64_t value)
+{
+    // len - 1 digits, NUL terminated
+    field[len - 1] = '\0';
+    size_t i = len - 1;
+    while (i > 0) {
+        field[--i] = '0' + (value & 7);
+        value >>= 3;
+    }
+}
+
+// Sizes that don't fit 11 octal digits (8GB and up) use the GNU base-256
+// encoding.
+static void format_size(char *field, size_t len, uint64_t value)
+{
+    if (value < (1ULL << (3 * (len - 1)))) {
+        format_octal(field, len, value);
+        return;
+    }
+    size_t i = len;
+    while (i > 1) {
+        field[--i] = value & 0xff;
+        value >>= 8;
+    }
+    field[0] = 0x80;
+}
+
+static void tar_checksum(struct tar_header *header)
+{
+    unsigned int sum = 0;
+    unsigned char *p = (unsigned char *)header;
+    int i;
+    memset(header->chksum, ' ', sizeof(header->chksum));
+    for (i = 0; i < TAR_BLOCK_SIZE; i++)
+        sum += p[i];
+    // six digits, NUL, space
+    format_octal(header->chksum, 7, sum);
+    header->chksum[7] = ' ';
+}
+
+static int tar_write_data(TarWriter *tar, const char *data, size_t len)
+{
+    while (len > 0) {
+        if (tar->fill == TAR_IO_BUFFER_SIZE && tar_flush(tar))
+            return -1;
+        size_t copy = TAR_IO_BUFFER_SIZE - tar->fill;
+        if (copy > len)
+            copy = len;
+        memcpy(tar->buffer + tar->fill, data, copy);
+        tar->fill += copy;
+        data += copy;
+        len -= copy;
+    }
+    return 0;
+}
+
+static int tar_pad(TarWriter *tar, size_t block)
+{
+    size_t pad = (block - (tar->written + tar->fill) % block) % block;
+    while (pad > 0) {
+        if (tar->fill == TAR_IO_BUFFER_SIZE && tar_flush(tar))
+            return -1;
+        size_t zero = TAR_IO_BUFFER_SIZE - tar->fill;
+        if (zero > pad)
+            zero = pad;
+        memset(tar->buffer + tar->fill, 0, zero);
+        tar->fill += zero;
+        pad -= zero;
+    }
+    return 0;
+}
+
+// Emits a GNU ././@LongLink record carrying a name that doesn't fit
+// the header.  type is 'L' for the entry name, 'K' for the link target.
+static int tar_write_longlink(TarWriter *tar, char type, const char *name)
+{
+    size_t len = strlen(name) + 1;
+    struct tar_header *header = (struct tar_header *)tar_reserve_block(tar);
+    if (header == NULL)
+        return -1;
+    strcpy(header->name, TAR_LONGLINK_NAME);
+    format_octal(header->mode, sizeof(header->mode), 0);
+    format_octal(header->uid, sizeof(header->uid), 0);
+    format_octal(header->gid, sizeof(header->gid), 0);
+    format_size(header->size, sizeof(header->size), len);
+    format_octal(header->mtime, sizeof(header->mtime), 0);
+    header->typeflag = type;
+    memcpy(header->magic, "ustar ", 6);
+    memcpy(header->version, " ", 2);
+    tar_checksum(header);
+    if (tar_write_data(tar, name, len))
+        return -1;
+    return tar_pad(tar, TAR_BLOCK_SIZE);
+}
+
+// Stores name in the ustar name/prefix fields if it fits.
+static int split_name(struct tar_header *header, const char *name)
+{
+    size_t len = strlen(name);
+    if (len <= sizeof(header->name)) {
+        memcpy(header->name, name, len);
+        return 0;
+    }
+    if (len > sizeof(header->prefix) + 1 + sizeof(header->name))
+        return -1;
+    // find a '/' that leaves at most 100 characters for the name
+    const char *split = name + len - sizeof(header->name) - 1;
+    while (*split != '\0' && *split != '/')
+        split++;
+    if (*split == '\0' || split == name || split - name > (int)sizeof(header->prefix))
+        return -1;
+    memcpy(header->prefix, name, split - name);
+    memcpy(header->name, split + 1, len - (split - name) - 1);
+    return 0;
+}
+
+static int tar_write_header(TarWriter *tar, const char *name, const struct stat *st,
+        char type, const char *linkname, uint64_t size)
+{
+    if (linkname != NULL && strlen(linkname) > sizeof(((struct tar_header *)0)->linkname)) {
+        if (tar_write_longlink(tar, 'K', linkname))
+            return -1;
+    }
+
+    struct tar_header *header = (struct tar_header *)tar_reserve_block(tar);
+    if (header == NULL)
+        return -1;
+    if (split_name(header, name)) {
+        // give the reserved block back, the long name record goes first
+        tar->fill -= TAR_BLOCK_SIZE;
+        if (tar_write_longlink(tar, 'L', name))
+            return -1;
+        header = (struct tar_header *)tar_reserve_block(tar);
+        if (header == NULL)
+            return -1;
+        memcpy(header->name, name, sizeof(header->name));
+    }
+
+    format_octal(header->mode, sizeof(header->mode), st->st_mode & 07777);
+    format_octal(header->uid, sizeof(header->uid), st->st_uid);
+    format_octal(header->gid, sizeof(header->gid), st->st_gid);
+    format_size(header->size, sizeof(header->size), size);
+    format_octal(header->mtime, sizeof(header->mtime), st->st_mtime);
+    header->typeflag = type;
+    if (linkname != NULL)
+        strncpy(header->linkname, linkname, sizeof(header->linkname));
+    memcpy(header->magic, "ustar", 6);
+    memcpy(header->version, "00", 2);
+    if (type == '3' || type == '4') {
+        format_octal(header->devmajor, sizeof(header->devmajor), major(st->st_rdev));
+        format_octal(header->devminor, sizeof(header->devminor), minor(st->st_rdev));
+    }
+    tar_checksum(header);
+    return 0;
+}
+
+static unsigned int tar_hard_link_hash(dev_t dev, ino_t ino)
+{
+    uint64_t h = ((uint64_t) dev * 0x9e3779b97f4a7c15ULL) ^ (uint64_t) ino;
+    h *= 0xff51afd7ed558ccdULL;
+    return (unsigned int) (h ^ (h >> 32));
+}
+
+// Returns the slot of (dev, ino), or the empty one it would go in.
+static unsigned int tar_hard_link_slot(const TarWriter *tar, dev_t dev, ino_t ino)
+{
+    unsigned int mask = tar->link_slot_count - 1;
+    unsigned int slot = tar_hard_link_hash(dev, ino) & mask;
+    while (tar->link_slots[slot] != 0) {
+        const struct hard_link *link = &tar->links[tar->link_slots[slot] - 1];
+        if (link->dev == dev && link->ino == ino)
+            break;
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+static int tar_grow_hard_links(TarWriter *tar)
+{
+    if (tar->link_count == tar->link_alloc) {
+        int alloc = tar->link_alloc * 2 + 16;
+        struct hard_link *links = realloc(tar->links, alloc * sizeof(*links));
+        if (links == NULL)
+            return -1;
+        tar->links = links;
+        tar->link_alloc = alloc;
+    }
+    if ((unsigned int) (tar->link_count + 1) * 2 <= tar->link_slot_count)
+        return 0;
+
+    unsigned int count = tar->link_slot_count ? tar->link_slot_count * 2 : 64;
+    int *slots = calloc(count, sizeof(int));
+    if (slots == NULL)
+        return -1;
+    free(tar->link_slots);
+    tar->link_slots = slots;
+    tar->link_slot_count = count;
+    int i;
+    for (i = 0; i < tar->link_count; i++)
+        slots[tar_hard_link_slot(tar, tar->links[i].dev, tar->links[i].ino)] = i + 1;
+    return 0;
+}
+
+// Returns the archive path of an earlier entry for the same inode, or
+// NULL.
+static const char *tar_find_hard_link(TarWriter *tar, const struct stat *st)
+{
+    if (tar->link_slot_count != 0) {
+        int entry = tar->link_slots[tar_hard_link_slot(tar, st->st_dev, st->st_ino)];
+        if (entry != 0)
+            return tar->links[entry - 1].path;
+    }
+    return NULL;
+}
+
+// Remembers name as the entry later links to the same inode point at,
+// once its data is in the archive.  Without memory they get their own
+// copy of the data.
+static void tar_add_hard_link(TarWriter *tar, const struct stat *st, const char *name)
+{
+    if (tar_grow_hard_links(tar))
+        return;
+    struct hard_link *link = &tar->links[tar->link_count];
+    link->path = strdup(name);
+    if (link->path != NULL) {
+        link->dev = st->st_dev;
+        link->ino = st->st_ino;
+        tar->link_slots[tar_hard_link_slot(tar, link->dev, link->ino)] = tar->link_count + 1;
+        tar->link_count++;
+    }
+}
+
+static int tar_write_file(TarWriter *tar, const char *path, const char *name, const struct stat *st)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0 && errno == ENOENT) {
+        fprintf(stderr, "tar: %s: file removed\n", path);
+        return 1;
+    }
+    if (fd < 0) {
+        fprintf(stderr, "tar: can't open %s (%s)\n", path, strerror(errno));
+        return -1;
+    }
+    if (tar_write_header(tar, name, st, '0', NULL, st->st_size)) {
+        close(fd);
+        return -1;
+    }
+
+    // read directly into the output buffer
+    uint64_t left = st->st_size;
+    while (left > 0) {
+        if (tar->fill == TAR_IO_BUFFER_SIZE && tar_flush(tar)) {
+            close(fd);
+            return -1;
+        }
+        size_t chunk = TAR_IO_BUFFER_SIZE - tar->fill;
+        if (chunk > left)
+            chunk = left;
+        ssize_t len = read(fd, tar->buffer + tar->fill, chunk);
+        if (len < 0 && errno == EINTR)
+            continue;
+        if (len < 0) {
+            fprintf(stderr, "tar: error reading %s (%s)\n", path, strerror(errno));
+            close(fd);
+            return -1;
+        }
+        if (len == 0) {
+            // the file shrank since we stat'ed it, the header already
+            // promised st_size bytes so pad with zeroes.
+            fprintf(stderr, "tar: %s: file shrank\n", path);
+            memset(tar->buffer + tar->fill, 0, chunk);
+            len = chunk;
+        }
+        tar->fill += len;
+        left -= len;
+    }
+    close(fd);
+    return tar_pad(tar, TAR_BLOCK_SIZE);
+}
+
+static int tar_write_entry(TarWriter *tar, const char *path, const char *name, const struct stat *st)
+{
+    int ret = 0;
+    uint64_t bytes = 0;
+    if (S_ISREG(st->st_mode)) {
+        const char *link = NULL;
+        if (st->st_nlink > 1)
+            link = tar_find_hard_link(tar, st);
+        if (link != NULL) {
+            ret = tar_write_header(tar, name, st, '1', link, 0);
+        } else {
+            ret = tar_write_file(tar, path, name, st);
+            bytes = st->st_size;
+            // a file that went away can't be linked to
+            if (ret == 0 && st->st_nlink > 1)
+                tar_add_hard_link(tar, st, name);
+        }
+    } else if (S_ISDIR(st->st_mode)) {
+        char dirname[PATH_MAX];
+        snprintf(dirname, sizeof(dirname), "%s/", name);
+        ret = tar_write_header(tar, dirname, st, '5', NULL, 0);
+    } else if (S_ISLNK(st->st_mode)) {
+        char link[PATH_MAX];
+        ssize_t len = readlink(path, link, sizeof(link) - 1);
+        if (len < 0) {
+            fprintf(stderr, "tar: can't read link %s (%s)\n", path, strerror(errno));
+            return -1;
+        }
+        link[len] = '\0';
+        ret = tar_write_header(tar, name, st, '2', link, 0);
+    } else if (S_ISCHR(st->st_mode)) {
+        ret = tar_write_header(tar, name, st, '3', NULL, 0);
+    } else if (S_ISBLK(st->st_mode)) {
+        ret = tar_write_header(tar, name, st, '4', NULL, 0);
+    } else if (S_ISFIFO(st->st_mode)) {
+        ret = tar_write_header(tar, name, st, '6', NULL, 0);
+    }
+    if (ret)
+        return ret;
+
+    if (tar->callback != NULL)
+        tar->callback(name, bytes, tar->cookie);
+    return 0;
+}
+
+static void scan_entry_stat(const TarScanEntry *entry, struct stat *st)
+{
+    memset(st, 0, sizeof(*st));
+    st->st_mode = entry->mode;
+    st->st_uid = entry->uid;
+    st->st_gid = entry->gid;
+    st->st_nlink = entry->nlink;
+    st->st_size = entry->size;
+    st->st_mtime = entry->mtime;
+    st->st_dev = entry->dev;
+    st->st_ino = entry->ino;
+    st->st_rdev = entry->rdev;
+}
+
+// Digest of the names of the first count entries.  A resumed archive
+// only continues if the scan still starts with the same entries.
+static void scan_names_md5(const TarScan *scan, size_t count, unsigned char *md5)
+{
+    MD5_CTX ctx;
+    MD5_Init(&ctx);
+    size_t i;
+    for (i = 0; i < count; i++) {
+        const char *name = scan->names + scan->entries[i].name;
+        MD5_Update(&ctx, name, strlen(name) + 1);
+    }
+    MD5_Final(md5, &ctx);
+}
+
+static void to_hex(const unsigned char *data, size_t len, char *hex)
+{
+    size_t i;
+    for (i = 0; i < len; i++)
+        sprintf(hex + i * 2, "%02x", data[i]);
+    hex[len * 2] = '\0';
+}
+
+static int from_hex(const char *hex, unsigned char *data, size_t len)
+{
+    size_t i;
+    for (i = 0; i < len; i++) {
+        unsigned int byte;
+        if (sscanf(hex + i * 2, "%2x", &byte) != 1)
+            return -1;
+        data[i] = byte;
+    }
+    return hex[len * 2] == '\0' || hex[len * 2] == ' ' ? 0 : -1;
+}
+
+// Where an archive can be picked up again: "c <entries> <stream offset>
+// <archive size> <index size> <compressed> <names md5> <md5 state|->".
+// The running md5 is kept as is, it only has to be read back by the
+// same binary.
+typedef struct {
+    uint64_t entry;
+    uint64_t position;
+    uint64_t archive_size;
+    uint64_t index_size;
+    int compressed;
+    unsigned char names_md5[MD5_DIGEST_LENGTH];
+    int has_md5;
+    MD5_CTX md5;
+} TarCreateCheckpoint;
+
+static int parse_create_checkpoint(const char *str, TarCreateCheckpoint *c)
+{
+    unsigned long long entry, position, archive_size, index_size;
+    char names[MD5_DIGEST_LENGTH * 2 + 1];
+    int consumed;
+    memset(c, 0, sizeof(*c));
+    if (sscanf(str, "c %llu %llu %llu %llu %d %32s %n", &entry, &position, &archive_size,
+            &index_size, &c->compressed, names, &consumed) != 6)
+        return -1;
+    if (from_hex(names, c->names_md5, MD5_DIGEST_LENGTH))
+        return -1;
+    c->entry = entry;
+    c->position = position;
+    c->archive_size = archive_size;
+    c->index_size = index_size;
+    if (strcmp(str + consumed, "-") != 0) {
+        if (from_hex(str + consumed, (unsigned char *)&c->md5, sizeof(MD5_CTX)))
+            return -1;
+        c->has_md5 = 1;
+    }
+    return 0;
+}
+
+// Makes everything before scan entry i durable and hands the caller a
+// checkpoint for it.
+static int tar_create_checkpoint(TarWriter *tar, TarIndexWriter *index, const TarScan *scan,
+        const uint64_t *offsets, size_t i, tar_checkpoint_callback checkpoint)
+{
+    if (tar_flush(tar))
+        return -1;
+    const TarGzMember *members = NULL;
+    size_t member_count = 0;
+    uint64_t archive_size = tar->written;
+    if (tar->gz != NULL && tar_gz_writer_sync(tar->gz, &members, &member_count, &archive_size))
+        return -1;
+    if (fsync(tar->fd))
+        return -1;
+    uint64_t index_size = 0;
+    if (offsets != NULL) {
+        if (tar_index_writer_append(index, scan, offsets, i, members, member_count) ||
+                tar_index_writer_sync(index, &index_size))
+            return -1;
+    }
+
+    unsigned char names_md5[MD5_DIGEST_LENGTH];
+    char names_hex[MD5_DIGEST_LENGTH * 2 + 1];
+    char state_hex[sizeof(MD5_CTX) * 2 + 1];
+    scan_names_md5(scan, i, names_md5);
+    to_hex(names_md5, MD5_DIGEST_LENGTH, names_hex);
+    if (tar->md5 != NULL)
+        to_hex((const unsigned char *)tar->md5, sizeof(MD5_CTX), state_hex);
+    else
+        strcpy(state_hex, "-");
+
+    char str[sizeof(state_hex) + 160];
+    snprintf(str, sizeof(str), "c %llu %llu %llu %llu %d %s %s", (unsigned long long) i,
+            (unsigned long long) tar->written, (unsigned long long) archive_size,
+            (unsigned long long) index_size, tar->gz != NULL, names_hex, state_hex);
+    checkpoint(str, tar->cookie);
+    return 0;
+}
+
+// Sets tar up to append to what the interrupted run left behind.
+// Returns 1 if the archive has to be started over.
+static int tar_create_resume_from(TarWriter *tar, const TarCreateCheckpoint *c,
+        const char *archive_path, const TarScan *scan, const char *index_path,
+        int compression, MD5_CTX *md5_ctx)
+{
+    if (c->entry > scan->count || c->compressed != (compression > 0) ||
+            (tar->md5 != NULL && !c->has_md5) || (index_path != NULL && c->index_size == 0))
+        return 1;
+    unsigned char names_md5[MD5_DIGEST_LENGTH];
+    scan_names_md5(scan, c->entry, names_md5);
+    if (memcmp(names_md5, c->names_md5, MD5_DIGEST_LENGTH) != 0) {
+        fprintf(stderr, "tar: %s changed since the checkpoint\n", scan->prefix);
+        return 1;
+    }
+
+    struct stat st;
+    if (stat(archive_path, &st) || (uint64_t) st.st_size < c->archive_size)
+        return 1;
+    if (index_path != NULL && (stat(index_path, &st) || (uint64_t) st.st_size < c->index_size))
+        return 1;
+    tar->fd = open(archive_path, O_WRONLY);
+    if (tar->fd < 0)
+        return -1;
+    if (ftruncate64(tar->fd, c->archive_size) || lseek64(tar->fd, c->archive_size, SEEK_SET) < 0) {
+        int saved_errno = errno;
+        close(tar->fd);
+        tar->fd = -1;
+        errno = saved_errno;
+        return -1;
+    }
+    tar->written = c->position;
+    if (tar->md5 != NULL)
+        memcpy(md5_ctx, &c->md5, sizeof(MD5_CTX));
+
+    // earlier files are still link targets for later ones, unless they
+    // went away before they were written
+    size_t prefix_len = strlen(scan->prefix);
+    char path[PATH_MAX];
+    strcpy(path, scan->prefix);
+    size_t i;
+    for (i = 0; i < c->entry; i++) {
+        const TarScanEntry *entry = &scan->entries[i];
+        const char *name = scan->names + entry->name;
+        if (S_ISREG(entry->mode) && entry->nlink > 1 && prefix_len + strlen(name) < sizeof(path)) {
+            struct stat st, now;
+            scan_entry_stat(entry, &st);
+            strcpy(path + prefix_len, name);
+            if (lstat(path, &now) == 0 && now.st_dev == st.st_dev && now.st_ino == st.st_ino)
+                tar_add_hard_link(tar, &st, name);
+        }
+        if (tar->callback != NULL)
+            tar->callback(NULL, entry->size, tar->cookie);
+    }
+    return 0;
+}
+
+int tar_create_resume(const char *archive_path, const TarScan *scan,
+        const char *index_path, int compression, unsigned char *md5,
+        const char *resume, tar_checkpoint_callback checkpoint,
+        tar_file_callback callback, void *cookie)
+{
+    MD5_CTX md5_ctx;
+    MD5_Init(&md5_ctx);
+    TarWriter tar;
+    memset(&tar, 0, sizeof(tar));
+    tar.fd = -1;
+    tar.callback = callback;
+    tar.cookie = cookie;
+    if (md5 != NULL)
+        tar.md5 = &md5_ctx;
+
+    tar.buffer = memalign(TAR_IO_ALIGNMENT, TAR_IO_BUFFER_SIZE);
+    if (tar.buffer == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    uint64_t *offsets = NULL;
+    if (index_path != NULL) {
+        // a spare slot, so an empty scan doesn't malloc(0)
+        offsets = malloc((scan->count + 1) * sizeof(uint64_t));
+        if (offsets == NULL) {
+            free(tar.buffer);
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+
+    TarCreateCheckpoint c;
+    memset(&c, 0, sizeof(c));
+    if (resume != NULL) {
+        int r = parse_create_checkpoint(resume, &c);
+        if (r == 0)
+            r = tar_create_resume_from(&tar, &c, archive_path, scan, index_path, compression, &md5_ctx);
+        if (r < 0)
+            fprintf(stderr, "tar: can't resume %s (%s)\n", archive_path, strerror(errno));
+        if (r != 0) {
+            // start over
+            memset(&c, 0, sizeof(c));
+            tar.written = 0;
+            MD5_Init(&md5_ctx);
+        }
+    }
+
+    if (tar.fd < 0)
+        tar.fd = open(archive_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (tar.fd < 0) {
+        fprintf(stderr, "tar: can't create %s (%s)\n", archive_path, strerror(errno));
+        free(offsets);
+        free(tar.buffer);
+        return -1;
+    }
+
+    TarIndexWriter index;
+    if (offsets != NULL && tar_index_writer_open(&index, index_path, c.index_size, c.entry)) {
+        close(tar.fd);
+        free(offsets);
+        free(tar.buffer);
+        return -1;
+    }
+
+    if (compression > 0) {
+        tar.gz = tar_gz_writer_open(tar.fd, compression, tar.md5);
+        if (tar.gz == NULL) {
+            fprintf(stderr, "tar: can't start compressor (%s)\n", strerror(errno));
+            if (offsets != NULL)
+                tar_index_writer_close(&index);
+            close(tar.fd);
+            free(offsets);
+            free(tar.buffer);
+            return -1;
+        }
+        tar_gz_writer_set_offset(tar.gz, c.archive_size, c.position);
+    }
+
+    // the scan already has everything in archive order, no need to walk
+    // the tree again.
+    int ret = 0;
+    size_t i;
+    size_t prefix_len = strlen(scan->prefix);
+    char path[PATH_MAX];
+    strcpy(path, scan->prefix);
+    uint64_t next_checkpoint = tar.written + TAR_CHECKPOINT_INTERVAL;
+    for (i = c.entry; ret == 0 && i < scan->count; i++) {
+        const TarScanEntry *entry = &scan->entries[i];
+        const char *name = scan->names + entry->name;
+        if (prefix_len + strlen(name) >= sizeof(path)) {
+            fprintf(stderr, "tar: path too long: %s%s\n", scan->prefix, name);
+            errno = ENAMETOOLONG;
+            ret = -1;
+            break;
+        }
+        strcpy(path + prefix_len, name);
+
+        if (checkpoint != NULL && tar.written + tar.fill >= next_checkpoint) {
+            if ((ret = tar_create_checkpoint(&tar, &index, scan, offsets, i, checkpoint)))
+                break;
+            next_checkpoint = tar.written + TAR_CHECKPOINT_INTERVAL;
+        }
+
+        struct stat st;
+        scan_entry_stat(entry, &st);
+        if (offsets != NULL)
+            offsets[i] = tar.written + tar.fill;
+        ret = tar_write_entry(&tar, path, name, &st);
+        if (ret > 0) {
+            // gone since the scan, nothing was written for it
+            if (offsets != NULL)
+                offsets[i] = TAR_INDEX_NO_OFFSET;
+            ret = 0;
+        }
+    }
+
+    // end of archive: two zero blocks, padded to a full record
+    if (ret == 0 && (tar_reserve_block(&tar) == NULL || tar_reserve_block(&tar) == NULL))
+        ret = -1;
+    if (ret == 0)
+        ret = tar_pad(&tar, TAR_RECORD_SIZE);
+    if (ret == 0)
+        ret = tar_flush(&tar);
+
+    int saved_errno = errno;
+    TarGzMember *members = NULL;
+    size_t member_count = 0;
+    if (tar.gz != NULL && tar_gz_writer_close(tar.gz, offsets != NULL ? &members : NULL, &member_count) && ret == 0) {
+        saved_errno = errno;
+        ret = -1;
+    }
+    if (close(tar.fd) && ret == 0) {
+        saved_errno = errno;
+        ret = -1;
+    }
+
+    if (offsets != NULL) {
+        int index_ret = 0;
+        if (ret == 0 && tar_index_writer_append(&index, scan, offsets, scan->count, members, member_count))
+            index_ret = -1;
+        if (tar_index_writer_close(&index) && ret == 0)
+            index_ret = -1;
+        if (index_ret) {
+            fprintf(stderr, "tar: error writing %s\n", index_path);
+            saved_errno = errno;
+            ret = -1;
+        }
+        // nobody is going to resume a failed run without checkpoints
+        if (ret != 0 && checkpoint == NULL)
+            unlink(index_path);
+    }
+    free(members);
+    free(offsets);
+
+    if (md5 != NULL)
+        MD5_Final(md5, &md5_ctx);
+
+    int j;
+    for (j = 0; j < tar.link_count; j++)
+        free(tar.links[j].path);
+    free(tar.links);
+    free(tar.link_slots);
+    free(tar.buffer);
+    errno = saved_errno;
+    return ret;
+}
+
+int tar_create_from_scan(const char *archive_path, const TarScan *scan,
+        const char *index_path, int compression, unsigned char *md5,
+        tar_file_callback callback, void *cookie)
+{
+    return tar_create_resume(archive_path, scan, index_path, compression, md5,
+            NULL, NULL, callback, cookie);
+}
+
+int tar_create(const char *archive_path, const char *directory,
+        const char **excludes, int compression, unsigned char *md5,
+        tar_file_callback callback, void *cookie)
+{
+    TarScan *scan = tar_scan(directory, excludes);
+    if (scan == NULL)
+        return -1;
+    int ret = tar_create_from_scan(archive_path, scan, NULL, compression, md5, callback, cookie);
+    int saved_errno = errno;
+    tar_scan_free(scan);
+    errno = saved_errno;
+    return ret;
+}
@@ -0,0 +1,1008 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <sys/time.h>
+#include <sys/types.h>
+
+#include <openssl/md5.h>
+
+#include "tarutils.h"
+#include "tar_format.h"
+#include "tar_gzip.h"
+#include "tar_index.h"
+
+#define TAR_READAHEAD_BUFFERS   4
+// file metadata is applied in batches of this many entries
+#define TAR_META_BATCH          256
+// selected entries closer than this are read through rather than
+// seeked to, starting a reader has its cost too
+#define TAR_SELECT_GAP          (4 * 1024 * 1024)
+
+// Archive reader.  A separate thread keeps up to TAR_READAHEAD_BUFFERS
+// chunks of the archive in memory, so reading the archive overlaps with
+// writing the extracted files.
+typedef struct {
+    int fd;
+    TarGzReader *gz;    // set for compressed archives
+    MD5_CTX *md5;       // digest of the archive file, if wanted
+    char *buffers[TAR_READAHEAD_BUFFERS];
+    size_t lengths[TAR_READAHEAD_BUFFERS];
+    int head;       // buffer the extractor is working on
+    int count;      // filled buffers, including head
+    int eof;
+    int error;
+    int stop;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    pthread_t thread;
+
+    // extractor side
+    size_t consumed;    // bytes used from buffers[head]
+    int holding;        // buffers[head] is being consumed
+    uint64_t position;  // in the uncompressed archive
+} TarReader;
+
+typedef struct {
+    char *path;
+    char *link;
+    char type;
+    mode_t mode;
+    uid_t uid;
+    gid_t gid;
+    time_t mtime;
+} TarMeta;
+
+typedef struct {
+    TarMeta *entries;
+    int count;
+    int alloc;
+} TarMetaList;
+
+static void *tar_readahead_thread(void *cookie)
+{
+    TarReader *reader = (TarReader *)cookie;
+    for (;;) {
+        pthread_mutex_lock(&reader->mutex);
+        while (reader->count == TAR_READAHEAD_BUFFERS && !reader->stop)
+            pthread_cond_wait(&reader->cond, &reader->mutex);
+        int index = (reader->head + reader->count) % TAR_READAHEAD_BUFFERS;
+        int stop = reader->stop;
+        pthread_mutex_unlock(&reader->mutex);
+        if (stop)
+            break;
+
+        // fill the buffer completely so headers never straddle buffers
+        char *buffer = reader->buffers[index];
+        size_t len = 0;
+        int error = 0;
+        while (len < TAR_IO_BUFFER_SIZE) {
+            ssize_t r;
+            if (reader->gz != NULL)
+                r = tar_gz_reader_read(reader->gz, buffer + len, TAR_IO_BUFFER_SIZE - len);
+            else
+                r = read(reader->fd, buffer + len, TAR_IO_BUFFER_SIZE - len);
+            if (r < 0 && errno == EINTR)
+                continue;
+            if (r < 0) {
+                error = errno;
+                break;
+            }
+            if (r == 0)
+                break;
+            len += r;
+        }
+
+        // compressed archives are hashed by the decompressor, which
+        // sees the file data
+        if (reader->md5 != NULL && reader->gz == NULL)
+            MD5_Update(reader->md5, buffer, len);
+
+        pthread_mutex_lock(&reader->mutex);
+        reader->lengths[index] = len;
+        if (error != 0) {
+            reader->error = error;
+        } else {
+            if (len > 0)
+                reader->count++;
+            if (len < TAR_IO_BUFFER_SIZE)
+                reader->eof = 1;
+        }
+        pthread_cond_broadcast(&reader->cond);
+        stop = reader->eof || reader->error;
+        pthread_mutex_unlock(&reader->mutex);
+        if (stop)
+            break;
+    }
+    return NULL;
+}
+
+// Returns a pointer to up to max bytes of archive data and consumes them.
+// Returns the number of bytes, 0 at the end of the archive, -1 on error.
+static ssize_t tar_reader_get(TarReader *reader, const char **data, size_t max)
+{
+    pthread_mutex_lock(&reader->mutex);
+    if (reader->holding && reader->consumed == reader->lengths[reader->head]) {
+        // done with this buffer, hand it back to the read-ahead thread
+        reader->head = (reader->head + 1) % TAR_READAHEAD_BUFFERS;
+        reader->count--;
+        reader->holding = 0;
+        pthread_cond_broadcast(&reader->cond);
+    }
+    if (!reader->holding) {
+        while (reader->count == 0 && !reader->eof && !reader->error)
+            pthread_cond_wait(&reader->cond, &reader->mutex);
+        if (reader->count == 0) {
+            int error = reader->error;
+            pthread_mutex_unlock(&reader->mutex);
+            if (error) {
+                errno = error;
+                return -1;
+            }
+            return 0;
+        }
+        reader->holding = 1;
+        reader->consumed = 0;
+    }
+    size_t avail = reader->lengths[reader->head] - reader->consumed;
+    pthread_mutex_unlock(&reader->mutex);
+
+    if (avail > max)
+        avail = max;
+    *data = reader->buffers[reader->head] + reader->consumed;
+    reader->consumed += avail;
+    reader->position += avail;
+    return avail;
+}
+
+// Returns 0 on success, 1 if the archive ended first, -1 on error.
+static int tar_reader_read(TarReader *reader, char *out, size_t len)
+{
+    while (len > 0) {
+        const char *data;
+        ssize_t got = tar_reader_get(reader, &data, len);
+        if (got < 0)
+            return -1;
+        if (got == 0) {
+            errno = EIO;
+            return 1;
+        }
+        memcpy(out, data, got);
+        out += got;
+        len -= got;
+    }
+    return 0;
+}
+
+static int tar_reader_skip(TarReader *reader, uint64_t len)
+{
+    while (len > 0) {
+        const char *data;
+        ssize_t got = tar_reader_get(reader, &data, len > TAR_IO_BUFFER_SIZE ? TAR_IO_BUFFER_SIZE : len);
+        if (got <= 0) {
+            if (got == 0)
+                errno = EIO;
+            return -1;
+        }
+        len -= got;
+    }
+    return 0;
+}
+
+// Starts reading at file_offset, which must be the start of a gzip
+// member for compressed archives.
+static int tar_reader_open(TarReader *reader, const char *archive_path, MD5_CTX *md5, uint64_t file_offset)
+{
+    int i;
+    memset(reader, 0, sizeof(*reader));
+    reader->md5 = md5;
+    reader->fd = open(archive_path, O_RDONLY);
+    if (reader->fd < 0)
+        return -1;
+    if (tar_gz_detect(reader->fd)) {
+        reader->gz = tar_gz_reader_open(reader->fd, md5);
+        if (reader->gz == NULL) {
+            int saved_errno = errno;
+            close(reader->fd);
+            errno = saved_errno;
+            return -1;
+        }
+    }
+    if (file_offset > 0 && lseek64(reader->fd, file_offset, SEEK_SET) < 0) {
+        int saved_errno = errno;
+        if (reader->gz != NULL)
+            tar_gz_reader_close(reader->gz);
+        close(reader->fd);
+        errno = saved_errno;
+        return -1;
+    }
+    for (i = 0; i < TAR_READAHEAD_BUFFERS; i++) {
+        reader->buffers[i] = memalign(TAR_IO_ALIGNMENT, TAR_IO_BUFFER_SIZE);
+        if (reader->buffers[i] == NULL)
+            goto fail;
+    }
+    pthread_mutex_init(&reader->mutex, NULL);
+    pthread_cond_init(&reader->cond, NULL);
+    if (pthread_create(&reader->thread, NULL, tar_readahead_thread, reader) == 0)
+        return 0;
+    pthread_cond_destroy(&reader->cond);
+    pthread_mutex_destroy(&reader->mutex);
+
+fail:
+    for (i = 0; i < TAR_READAHEAD_BUFFERS; i++)
+        free(reader->buffers[i]);
+    if (reader->gz != NULL)
+        tar_gz_reader_close(reader->gz);
+    close(reader->fd);
+    errno = ENOMEM;
+    return -1;
+}
+
+static void tar_reader_close(TarReader *reader)
+{
+    int i;
+    pthread_mutex_lock(&reader->mutex);
+    reader->stop = 1;
+    pthread_cond_broadcast(&reader->cond);
+    pthread_mutex_unlock(&reader->mutex);
+    pthread_join(reader->thread, NULL);
+    pthread_cond_destroy(&reader->cond);
+    pthread_mutex_destroy(&reader->mutex);
+    for (i = 0; i < TAR_READAHEAD_BUFFERS; i++)
+        free(reader->buffers[i]);
+    if (reader->gz != NULL)
+        tar_gz_reader_close(reader->gz);
+    close(reader->fd);
+}
+
+static uint64_t parse_number(const char *field, size_t len)
+{
+    uint64_t value = 0;
+    size_t i = 0;
+    if ((unsigned char)field[0] & 0x80) {
+        // GNU base-256
+        value = field[0] & 0x7f;
+        for (i = 1; i < len; i++)
+            value = (value << 8) | (unsigned char)field[i];
+        return value;
+    }
+    while (i < len && (field[i] == ' ' || field[i] == '\0'))
+        i++;
+    while (i < len && field[i] >= '0' && field[i] <= '7')
+        value = (value << 3) | (field[i++] - '0');
+    return value;
+}
+
+static int verify_checksum(const struct tar_header *header)
+{
+    const unsigned char *p = (const unsigned char *)header;
+    unsigned int sum = 0;
+    int i;
+    for (i = 0; i < TAR_BLOCK_SIZE; i++) {
+        if (i >= 148 && i < 156)
+            sum += ' ';
+        else
+            sum += p[i];
+    }
+    return sum == parse_number(header->chksum, sizeof(header->chksum));
+}
+
+static int is_zero_block(const char *block)
+{
+    int i;
+    for (i = 0; i < TAR_BLOCK_SIZE; i++) {
+        if (block[i] != 0)
+            return 0;
+    }
+    return 1;
+}
+
+// Reads the body of a long name record (or pax header) into a new buffer.
+static char *read_long_data(TarReader *reader, uint64_t size)
+{
+    if (size > 64 * 1024) {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+    size_t padded = (size + TAR_BLOCK_SIZE - 1) & ~(TAR_BLOCK_SIZE - 1);
+    char *data = malloc(padded + 1);
+    if (data == NULL)
+        return NULL;
+    if (tar_reader_read(reader, data, padded) != 0) {
+        free(data);
+        return NULL;
+    }
+    data[size] = '\0';
+    return data;
+}
+
+// Picks "path", "linkpath" and "size" out of a pax extended header.
+static void parse_pax(char *data, char **path, char **link, uint64_t *size)
+{
+    char *p = data;
+    while (*p != '\0') {
+        char *end;
+        unsigned long len = strtoul(p, &end, 10);
+        if (len == 0 || *end != ' ')
+            break;
+        char *record = end + 1;
+        char *next = p + len;
+        if (next[-1] != '\n')
+            break;
+        next[-1] = '\0';
+        if (strncmp(record, "path=", 5) == 0) {
+            free(*path);
+            *path = strdup(record + 5);
+        } else if (strncmp(record, "linkpath=", 9) == 0) {
+            free(*link);
+            *link = strdup(record + 9);
+        } else if (strncmp(record, "size=", 5) == 0) {
+            *size = strtoull(record + 5, NULL, 10);
+        }
+        p = next;
+    }
+}
+
+// Rejects absolute names and names that would escape the target
+// directory.
+static int is_safe_name(const char *name)
+{
+    const char *p = name;
+    if (*name == '/' || *name == '\0')
+        return 0;
+    while (p != NULL) {
+        if (p[0] == '.' && p[1] == '.' && (p[2] == '/' || p[2] == '\0'))
+            return 0;
+        p = strchr(p, '/');
+        if (p != NULL)
+            p++;
+    }
+    return 1;
+}
+
+static void preallocate(int fd, uint64_t size)
+{
+#ifdef __NR_fallocate
+#if defined(__LP64__)
+    syscall(__NR_fallocate, fd, 0, (off_t) 0, (off_t) size);
+#else
+    // 32 bit ABIs pass the 64 bit offset and length as register pairs
+    syscall(__NR_fallocate, fd, 0, 0, 0, (uint32_t) size, (uint32_t) (size >> 32));
+#endif
+#endif
+}
+
+static int tar_meta_add(TarMetaList *list, const char *path, const char *link,
+        char type, const struct tar_header *header)
+{
+    if (list->count == list->alloc) {
+        int alloc = list->alloc * 2 + TAR_META_BATCH;
+        TarMeta *entries = realloc(list->entries, alloc * sizeof(*entries));
+        if (entries == NULL)
+            return -1;
+        list->entries = entries;
+        list->alloc = alloc;
+    }
+    TarMeta *meta = &list->entries[list->count];
+    meta->path = strdup(path);
+    meta->link = link != NULL ? strdup(link) : NULL;
+    if (meta->path == NULL || (link != NULL && meta->link == NULL)) {
+        free(meta->path);
+        free(meta->link);
+        errno = ENOMEM;
+        return -1;
+    }
+    meta->type = type;
+    meta->mode = parse_number(header->mode, sizeof(header->mode)) & 07777;
+    meta->uid = parse_number(header->uid, sizeof(header->uid));
+    meta->gid = parse_number(header->gid, sizeof(header->gid));
+    meta->mtime = parse_number(header->mtime, sizeof(header->mtime));
+    list->count++;
+    return 0;
+}
+
+static int tar_meta_apply_one(const TarMeta *meta)
+{
+    struct timeval times[2];
+    times[0].tv_sec = times[1].tv_sec = meta->mtime;
+    times[0].tv_usec = times[1].tv_usec = 0;
+
+    if (meta->type == '2') {
+        unlink(meta->path);
+        if (symlink(meta->link, meta->path)) {
+            fprintf(stderr, "tar: can't create symlink %s (%s)\n", meta->path, strerror(errno));
+            return -1;
+        }
+        // Android has no lchmod, symlink modes don't matter anyway
+        lchown(meta->path, meta->uid, meta->gid);
+    } else if (meta->type == '1') {
+        unlink(meta->path);
+        if (link(meta->link, meta->path)) {
+            fprintf(stderr, "tar: can't link %s to %s (%s)\n", meta->path, meta->link, strerror(errno));
+            return -1;
+        }
+    } else {
+        // chown first, it may clear the setuid bits
+        chown(meta->path, meta->uid, meta->gid);
+        chmod(meta->path, meta->mode);
+        utimes(meta->path, times);
+    }
+    return 0;
+}
+
+// Applies ownership, mode and times to a batch of entries, and creates
+// the symlinks and hard links.  Directories are handled last-first so
+// that restricting a parent doesn't get in the way of its children.
+static int tar_meta_apply(TarMetaList *list)
+{
+    int ret = 0;
+    int i;
+    for (i = list->count - 1; i >= 0; i--) {
+        TarMeta *meta = &list->entries[i];
+        if (tar_meta_apply_one(meta))
+            ret = -1;
+        free(meta->path);
+        free(meta->link);
+    }
+    list->count = 0;
+    return ret;
+}
+
+// Like tar_meta_apply, but directories stay on the list: files still to
+// come may go into them and change their times.
+static int tar_meta_apply_keeping_dirs(TarMetaList *list)
+{
+    int ret = 0;
+    int i, kept = 0;
+    for (i = 0; i < list->count; i++) {
+        TarMeta *meta = &list->entries[i];
+        if (tar_meta_apply_one(meta))
+            ret = -1;
+        if (meta->type == '5') {
+            list->entries[kept++] = *meta;
+        } else {
+            free(meta->path);
+            free(meta->link);
+        }
+    }
+    list->count = kept;
+    return ret;
+}
+
+static void tar_meta_free(TarMetaList *list)
+{
+    int i;
+    for (i = 0; i < list->count; i++) {
+        free(list->entries[i].path);
+        free(list->entries[i].link);
+    }
+    free(list->entries);
+}
+
+static int mkdirs(const char *path)
+{
+    char tmp[PATH_MAX];
+    char *p;
+    strncpy(tmp, path, sizeof(tmp) - 1);
+    tmp[sizeof(tmp) - 1] = '\0';
+    for (p = tmp + 1; *p != '\0'; p++) {
+        if (*p != '/')
+            continue;
+        *p = '\0';
+        if (mkdir(tmp, 0755) && errno != EEXIST)
+            return -1;
+        *p = '/';
+    }
+    if (mkdir(tmp, 0755) && errno != EEXIST)
+        return -1;
+    return 0;
+}
+
+static int make_parent_dirs(const char *path)
+{
+    char tmp[PATH_MAX];
+    strncpy(tmp, path, sizeof(tmp) - 1);
+    tmp[sizeof(tmp) - 1] = '\0';
+    char *slash = strrchr(tmp, '/');
+    if (slash == NULL)
+        return 0;
+    *slash = '\0';
+    struct stat st;
+    if (stat(tmp, &st) == 0)
+        return 0;
+    return mkdirs(tmp);
+}
+
+static int write_fully(int fd, const char *data, size_t len)
+{
+    while (len > 0) {
+        ssize_t wrote = write(fd, data, len);
+        if (wrote < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        data += wrote;
+        len -= wrote;
+    }
+    return 0;
+}
+
+static int tar_extract_file(TarReader *reader, const char *path, uint64_t size)
+{
+    uint64_t padded = (size + TAR_BLOCK_SIZE - 1) & ~((uint64_t) TAR_BLOCK_SIZE - 1);
+    unlink(path);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0 && errno == ENOENT && make_parent_dirs(path) == 0)
+        fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        fprintf(stderr, "tar: can't create %s (%s)\n", path, strerror(errno));
+        return -1;
+    }
+    if (size > 0)
+        preallocate(fd, size);
+
+    // write straight out of the read-ahead buffers
+    uint64_t left = size;
+    while (left > 0) {
+        const char *data;
+        ssize_t got = tar_reader_get(reader, &data, left > TAR_IO_BUFFER_SIZE ? TAR_IO_BUFFER_SIZE : left);
+        if (got <= 0) {
+            if (got == 0)
+                errno = EIO;
+            fprintf(stderr, "tar: short read extracting %s\n", path);
+            close(fd);
+            return -1;
+        }
+        if (write_fully(fd, data, got)) {
+            fprintf(stderr, "tar: error writing %s (%s)\n", path, strerror(errno));
+            close(fd);
+            return -1;
+        }
+        left -= got;
+    }
+    if (close(fd)) {
+        fprintf(stderr, "tar: error closing %s (%s)\n", path, strerror(errno));
+        return -1;
+    }
+    return tar_reader_skip(reader, padded - size);
+}
+
+// Everything one extraction needs besides the archive reader, which is
+// restarted for every range of a selective extraction.
+typedef struct {
+    const char *archive_path;
+    char base[PATH_MAX];        // entries are created relative to this
+    const char **patterns;      // NULL extracts everything
+    TarMetaList files;
+    TarMetaList deferred;
+    tar_checkpoint_callback checkpoint;
+    uint64_t next_checkpoint;
+    tar_file_callback callback;
+    void *cookie;
+} TarExtractor;
+
+static void tar_extractor_init(TarExtractor *x, const char *archive_path, const char *directory,
+        const char **patterns, tar_file_callback callback, void *cookie)
+{
+    memset(x, 0, sizeof(*x));
+    x->archive_path = archive_path;
+    x->patterns = patterns;
+    x->callback = callback;
+    x->cookie = cookie;
+
+    // "/" included
+    strncpy(x->base, directory, sizeof(x->base) - 1);
+    x->base[sizeof(x->base) - 1] = '\0';
+    size_t base_len = strlen(x->base);
+    while (base_len > 0 && x->base[base_len - 1] == '/')
+        x->base[--base_len] = '\0';
+}
+
+// Applies the remaining metadata and frees the lists.  Returns ret, or
+// -1 if applying failed.
+static int tar_extractor_finish(TarExtractor *x, int ret)
+{
+    int saved_errno = errno;
+    if (tar_meta_apply(&x->files))
+        ret = -1;
+    // links go in after all the files they may point at
+    if (tar_meta_apply(&x->deferred))
+        ret = -1;
+    tar_meta_free(&x->files);
+    tar_meta_free(&x->deferred);
+    errno = saved_errno;
+    return ret;
+}
+
+// Puts everything before position in the archive on disk for good.  A
+// resumed extraction has none of the pending metadata, so links and
+// directory ownership can't wait for the end.
+static int tar_extractor_checkpoint(TarExtractor *x, uint64_t position)
+{
+    if (tar_meta_apply(&x->files) || tar_meta_apply_keeping_dirs(&x->deferred))
+        return -1;
+    sync();
+    char str[32];
+    snprintf(str, sizeof(str), "x %llu", (unsigned long long) position);
+    x->checkpoint(str, x->cookie);
+    x->next_checkpoint = position + TAR_CHECKPOINT_INTERVAL;
+    return 0;
+}
+
+// An entry is selected if a pattern matches its name or the name of one
+// of the directories it is in.
+static int is_selected(const char **patterns, const char *name)
+{
+    if (patterns == NULL)
+        return 1;
+    char tmp[PATH_MAX];
+    strncpy(tmp, name, sizeof(tmp) - 1);
+    tmp[sizeof(tmp) - 1] = '\0';
+    for (;;) {
+        const char **pattern;
+        for (pattern = patterns; *pattern != NULL; pattern++) {
+            if (fnmatch(*pattern, tmp, 0) == 0)
+                return 1;
+        }
+        char *slash = strrchr(tmp, '/');
+        if (slash == NULL)
+            return 0;
+        *slash = '\0';
+    }
+}
+
+// Extracts entries until the end of the archive, or until the reader
+// gets to end in the uncompressed stream.
+static int tar_extract_entries(TarExtractor *x, TarReader *reader, uint64_t end)
+{
+    char *long_name = NULL;
+    char *long_link = NULL;
+    uint64_t pax_size = 0;
+    int has_pax_size = 0;
+    int ret = 0;
+    struct tar_header header;
+    char path[PATH_MAX];
+    char link_path[PATH_MAX];
+
+    while (reader->position < end) {
+        // only between entries, not after a long name record
+        if (x->checkpoint != NULL && reader->position >= x->next_checkpoint &&
+                long_name == NULL && long_link == NULL && !has_pax_size &&
+                (ret = tar_extractor_checkpoint(x, reader->position)))
+            break;
+        int r = tar_reader_read(reader, (char *) &header, TAR_BLOCK_SIZE);
+        if (r != 0) {
+            // a missing end of archive marker is accepted, like tar does
+            if (r < 0)
+                ret = -1;
+            break;
+        }
+        if (is_zero_block((const char *) &header))
+            break;
+        if (!verify_checksum(&header)) {
+            fprintf(stderr, "tar: bad header checksum in %s\n", x->archive_path);
+            errno = EINVAL;
+            ret = -1;
+            break;
+        }
+
+        uint64_t size = parse_number(header.size, sizeof(header.size));
+        char type = header.typeflag;
+
+        if (type == 'L' || type == 'K' || type == 'x' || type == 'g') {
+            char *data = read_long_data(reader, size);
+            if (data == NULL) {
+                ret = -1;
+                break;
+            }
+            if (type == 'L') {
+                free(long_name);
+                long_name = data;
+            } else if (type == 'K') {
+                free(long_link);
+                long_link = data;
+            } else {
+                if (type == 'x') {
+                    uint64_t s = (uint64_t) -1;
+                    parse_pax(data, &long_name, &long_link, &s);
+                    if (s != (uint64_t) -1) {
+                        pax_size = s;
+                        has_pax_size = 1;
+                    }
+                }
+                free(data);
+            }
+            continue;
+        }
+        if (has_pax_size)
+            size = pax_size;
+
+        char name[PATH_MAX];
+        if (long_name != NULL) {
+            strncpy(name, long_name, sizeof(name) - 1);
+            name[sizeof(name) - 1] = '\0';
+        } else if (header.prefix[0] != '\0' && memcmp(header.magic, "ustar", 6) == 0) {
+            snprintf(name, sizeof(name), "%.155s/%.100s", header.prefix, header.name);
+        } else {
+            snprintf(name, sizeof(name), "%.100s", header.name);
+        }
+        char linkname[PATH_MAX];
+        if (long_link != NULL) {
+            strncpy(linkname, long_link, sizeof(linkname) - 1);
+            linkname[sizeof(linkname) - 1] = '\0';
+        } else {
+            snprintf(linkname, sizeof(linkname), "%.100s", header.linkname);
+        }
+        free(long_name);
+        free(long_link);
+        long_name = long_link = NULL;
+        has_pax_size = 0;
+
+        // strip trailing slashes from directory names
+        size_t len = strlen(name);
+        while (len > 1 && name[len - 1] == '/')
+            name[--len] = '\0';
+
+        uint64_t padded = (size + TAR_BLOCK_SIZE - 1) & ~((uint64_t) TAR_BLOCK_SIZE - 1);
+        if (!is_safe_name(name)) {
+            fprintf(stderr, "tar: skipping unsafe name %s\n", name);
+            if (tar_reader_skip(reader, padded)) {
+                ret = -1;
+                break;
+            }
+            continue;
+        }
+        if (!is_selected(x->patterns, name)) {
+            if (tar_reader_skip(reader, padded)) {
+                ret = -1;
+                break;
+            }
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s/%s", x->base, name);
+
+        uint64_t bytes = 0;
+        mode_t mode = parse_number(header.mode, sizeof(header.mode)) & 07777;
+        switch (type) {
+            case '0':
+            case '\0':
+            case '7':
+                ret = tar_extract_file(reader, path, size);
+                if (ret == 0)
+                    ret = tar_meta_add(&x->files, path, NULL, '0', &header);
+                bytes = size;
+                break;
+            case '5':
+                if (mkdir(path, 0700) && errno != EEXIST) {
+                    if (errno != ENOENT || mkdirs(path)) {
+                        fprintf(stderr, "tar: can't create directory %s (%s)\n", path, strerror(errno));
+                        ret = -1;
+                        break;
+                    }
+                }
+                ret = tar_meta_add(&x->deferred, path, NULL, '5', &header);
+                break;
+            case '2':
+                make_parent_dirs(path);
+                ret = tar_meta_add(&x->deferred, path, linkname, '2', &header);
+                break;
+            case '1':
+                if (!is_safe_name(linkname)) {
+                    fprintf(stderr, "tar: skipping unsafe link %s\n", linkname);
+                    break;
+                }
+                snprintf(link_path, sizeof(link_path), "%s/%s", x->base, linkname);
+                if (!is_selected(x->patterns, linkname) && access(link_path, F_OK) != 0) {
+                    // the data went with the target, which isn't restored
+                    fprintf(stderr, "tar: skipping %s, %s is not selected\n", name, linkname);
+                    break;
+                }
+                ret = tar_meta_add(&x->deferred, path, link_path, '1', &header);
+                break;
+            case '3':
+            case '4':
+            case '6':
+                make_parent_dirs(path);
+                unlink(path);
+                if (mknod(path, mode | (type == '3' ? S_IFCHR : type == '4' ? S_IFBLK : S_IFIFO),
+                        makedev(parse_number(header.devmajor, sizeof(header.devmajor)),
+                                parse_number(header.devminor, sizeof(header.devminor))))) {
+                    fprintf(stderr, "tar: can't create %s (%s)\n", path, strerror(errno));
+                    ret = -1;
+                    break;
+                }
+                ret = tar_meta_add(&x->files, path, NULL, type, &header);
+                break;
+            default:
+                fprintf(stderr, "tar: skipping %s, unknown type %c\n", name, type);
+                ret = tar_reader_skip(reader, padded);
+                break;
+        }
+        if (ret)
+            break;
+
+        if (x->callback != NULL)
+            x->callback(name, bytes, x->cookie);
+        if (x->files.count >= TAR_META_BATCH && (ret = tar_meta_apply(&x->files)))
+            break;
+    }
+
+    int saved_errno = errno;
+    free(long_name);
+    free(long_link);
+    errno = saved_errno;
+    return ret;
+}
+
+// Finds where to start reading to get to start in the uncompressed
+// stream: the last gzip member starting at or before it, or start
+// itself in a plain archive.
+static int find_start(const char *archive_path, const TarIndex *index, uint64_t start,
+        uint64_t *file_offset, uint64_t *data_offset)
+{
+    *file_offset = *data_offset = start;
+    if (start == 0)
+        return 0;
+    if (index != NULL && index->member_count > 0) {
+        size_t lo = 0, hi = index->member_count;
+        while (hi - lo > 1) {
+            size_t mid = (lo + hi) / 2;
+            if (index->members[mid].data_offset <= start)
+                lo = mid;
+            else
+                hi = mid;
+        }
+        *file_offset = index->members[lo].offset;
+        *data_offset = index->members[lo].data_offset;
+        return 0;
+    }
+    int fd = open(archive_path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    if (tar_gz_detect(fd)) {
+        // no index, decompress from the start
+        *file_offset = *data_offset = 0;
+    }
+    close(fd);
+    return 0;
+}
+
+int tar_extract_resume(const char *archive_path, const TarIndex *index, const char *directory,
+        unsigned char *md5, const char *resume, tar_checkpoint_callback checkpoint,
+        tar_file_callback callback, void *cookie)
+{
+    unsigned long long start = 0;
+    if (resume != NULL && (sscanf(resume, "x %llu", &start) != 1 || md5 != NULL)) {
+        errno = EINVAL;
+        return -1;
+    }
+    uint64_t file_offset, data_offset;
+    if (find_start(archive_path, index, start, &file_offset, &data_offset)) {
+        fprintf(stderr, "tar: can't open %s (%s)\n", archive_path, strerror(errno));
+        return -1;
+    }
+
+    MD5_CTX md5_ctx;
+    MD5_Init(&md5_ctx);
+    TarReader reader;
+    if (tar_reader_open(&reader, archive_path, md5 != NULL ? &md5_ctx : NULL, file_offset)) {
+        fprintf(stderr, "tar: can't open %s (%s)\n", archive_path, strerror(errno));
+        return -1;
+    }
+    reader.position = data_offset;
+
+    // file and device metadata is applied every TAR_META_BATCH entries,
+    // directories and links once everything else is in place.
+    TarExtractor x;
+    tar_extractor_init(&x, archive_path, directory, NULL, callback, cookie);
+    x.checkpoint = checkpoint;
+    x.next_checkpoint = start + TAR_CHECKPOINT_INTERVAL;
+    int ret = tar_reader_skip(&reader, start - data_offset);
+    if (ret == 0)
+        ret = tar_extract_entries(&x, &reader, (uint64_t) -1);
+
+    // the digest covers the whole file, including the padding after
+    // the end of archive marker
+    if (ret == 0 && md5 != NULL) {
+        const char *data;
+        ssize_t got;
+        while ((got = tar_reader_get(&reader, &data, TAR_IO_BUFFER_SIZE)) > 0)
+            ;
+        if (got < 0)
+            ret = -1;
+    }
+
+    int saved_errno = errno;
+    tar_reader_close(&reader);
+    if (md5 != NULL)
+        MD5_Final(md5, &md5_ctx);
+    errno = saved_errno;
+    return tar_extractor_finish(&x, ret);
+}
+
+int tar_extract(const char *archive_path, const char *directory,
+        unsigned char *md5, tar_file_callback callback, void *cookie)
+{
+    return tar_extract_resume(archive_path, NULL, directory, md5, NULL, NULL, callback, cookie);
+}
+
+// Extracts the entries between start and end of the uncompressed
+// stream, starting the reader at the closest point before start it can
+// seek to.
+static int tar_extract_range(TarExtractor *x, const TarIndex *index, uint64_t start, uint64_t end)
+{
+    uint64_t file_offset, data_offset;
+    find_start(x->archive_path, index, start, &file_offset, &data_offset);
+
+    TarReader reader;
+    if (tar_reader_open(&reader, x->archive_path, NULL, file_offset)) {
+        fprintf(stderr, "tar: can't open %s (%s)\n", x->archive_path, strerror(errno));
+        return -1;
+    }
+    reader.position = data_offset;
+    int ret = tar_reader_skip(&reader, start - data_offset);
+    if (ret == 0)
+        ret = tar_extract_entries(x, &reader, end);
+    int saved_errno = errno;
+    tar_reader_close(&reader);
+    errno = saved_errno;
+    return ret;
+}
+
+int tar_extract_paths(const char *archive_path, const TarIndex *index, const char *directory,
+        const char **patterns, tar_file_callback callback, void *cookie)
+{
+    TarExtractor x;
+    tar_extractor_init(&x, archive_path, directory, patterns, callback, cookie);
+
+    int ret = 0;
+    if (index == NULL) {
+        // no index, filter the whole archive
+        TarReader reader;
+        if (tar_reader_open(&reader, archive_path, NULL, 0)) {
+            fprintf(stderr, "tar: can't open %s (%s)\n", archive_path, strerror(errno));
+            return -1;
+        }
+        ret = tar_extract_entries(&x, &reader, (uint64_t) -1);
+        int saved_errno = errno;
+        tar_reader_close(&reader);
+        errno = saved_errno;
+        return tar_extractor_finish(&x, ret);
+    }
+
+    // Entries are stored depth first, so a selected directory and
+    // everything below it is one range of the archive.  Ranges close to
+    // each other are merged; tar_extract_entries skips what isn't
+    // selected in between.
+    uint64_t start = 0, end = 0;
+    int have_range = 0;
+    size_t i;
+    for (i = 0; ret == 0 && i < index->count; i++) {
+        const TarIndexEntry *entry = &index->entries[i];
+        if (!is_selected(patterns, index->names + entry->name))
+            continue;
+        uint64_t entry_end = i + 1 < index->count ? index->entries[i + 1].offset : (uint64_t) -1;
+        if (have_range && entry->offset <= end + TAR_SELECT_GAP) {
+            end = entry_end;
+            continue;
+        }
+        if (have_range)
+            ret = tar_extract_range(&x, index, start, end);
+        start = entry->offset;
+        end = entry_end;
+        have_range = 1;
+    }
+    if (ret == 0 && have_range)
+        ret = tar_extract_range(&x, index, start, end);
+    return tar_extractor_finish(&x, ret);
+}
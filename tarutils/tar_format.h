@@ -0,0 +1,36 @@
+#ifndef TAR_FORMAT_H_
+#define TAR_FORMAT_H_
+
+#define TAR_BLOCK_SIZE      512
+#define TAR_RECORD_SIZE     (20 * TAR_BLOCK_SIZE)
+// archives are read and written in chunks of this size, file data goes
+// straight between these buffers and the files.
+#define TAR_IO_BUFFER_SIZE  (1024 * 1024)
+#define TAR_IO_ALIGNMENT    4096
+// resumable archive operations make their progress durable this often
+// (in bytes of the uncompressed stream)
+#define TAR_CHECKPOINT_INTERVAL (64 * 1024 * 1024)
+
+#define TAR_LONGLINK_NAME   "././@LongLink"
+
+struct tar_header {
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char chksum[8];
+    char typeflag;
+    char linkname[100];
+    char magic[6];
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];
+    char padding[12];
+};
+
+#endif  // TAR_FORMAT_H_
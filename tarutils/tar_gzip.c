@@ -0,0 +1,666 @@
+#include <errno.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+#include <zlib.h>
+
+#include "tar_format.h"
+#include "tar_gzip.h"
+
+#define TAR_GZ_MAX_THREADS      8
+// gzip header with one 8 byte extra field: "CW", 4, member length
+#define TAR_GZ_HEADER_SIZE      20
+#define TAR_GZ_TRAILER_SIZE     8
+#define TAR_GZ_STREAM_BUFFER    (128 * 1024)
+
+#define GZ_FLAG_EXTRA           0x04
+#define GZ_OS_UNIX              3
+
+enum {
+    BLOCK_FREE,
+    BLOCK_QUEUED,
+    BLOCK_DONE,
+};
+
+// A chunk in flight.  Chunk n of the stream always uses
+// blocks[n % block_count], so chunks come out in the order they went in.
+typedef struct {
+    char *in;
+    size_t in_len;
+    unsigned char *out;
+    size_t out_len;
+    int state;
+} GzBlock;
+
+struct TarGzWriter {
+    int fd;
+    int level;
+    MD5_CTX *md5;
+    GzBlock *blocks;
+    int block_count;
+    int thread_count;
+    pthread_t threads[TAR_GZ_MAX_THREADS];
+
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    uint64_t submitted;     // chunks handed to tar_gz_writer_submit
+    uint64_t claimed;       // chunks picked up by a worker
+    uint64_t written;       // chunks written to fd
+    int closing;
+    int error;
+
+    // where each member went, for archive indexes
+    TarGzMember *members;
+    size_t member_alloc;
+    uint64_t file_offset;
+    uint64_t data_offset;
+};
+
+struct TarGzReader {
+    int fd;
+    MD5_CTX *md5;
+    GzBlock *blocks;
+    int block_count;
+    int thread_count;
+    pthread_t threads[TAR_GZ_MAX_THREADS];
+
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    uint64_t submitted;     // members read from fd
+    uint64_t claimed;       // members picked up by a worker
+    uint64_t consumed;      // members fully returned to the caller
+    size_t position;        // in the output of blocks[consumed]
+    int eof;
+    int closing;
+    int error;
+
+    // plain gzip streams from other tools
+    int streaming;
+    z_stream stream;
+    unsigned char *stream_buffer;
+};
+
+static int cpu_count()
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1)
+        return 1;
+    if (cpus > TAR_GZ_MAX_THREADS)
+        return TAR_GZ_MAX_THREADS;
+    return cpus;
+}
+
+static size_t max_member_size()
+{
+    return TAR_GZ_HEADER_SIZE + compressBound(TAR_IO_BUFFER_SIZE) + TAR_GZ_TRAILER_SIZE;
+}
+
+static void put_le32(unsigned char *p, uint32_t value)
+{
+    p[0] = value;
+    p[1] = value >> 8;
+    p[2] = value >> 16;
+    p[3] = value >> 24;
+}
+
+static uint32_t get_le32(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static int write_fully(int fd, const unsigned char *data, size_t len)
+{
+    while (len > 0) {
+        ssize_t wrote = write(fd, data, len);
+        if (wrote < 0 && errno == EINTR)
+            continue;
+        if (wrote < 0)
+            return -1;
+        data += wrote;
+        len -= wrote;
+    }
+    return 0;
+}
+
+// Returns the number of bytes read, short only at the end of the file.
+static ssize_t read_fully(int fd, unsigned char *data, size_t len)
+{
+    size_t done = 0;
+    while (done < len) {
+        ssize_t r = read(fd, data + done, len - done);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r < 0)
+            return -1;
+        if (r == 0)
+            break;
+        done += r;
+    }
+    return done;
+}
+
+// read_fully on the archive, keeping its digest up to date.
+static ssize_t gz_read(TarGzReader *gz, unsigned char *data, size_t len)
+{
+    ssize_t r = read_fully(gz->fd, data, len);
+    if (r > 0 && gz->md5 != NULL)
+        MD5_Update(gz->md5, data, r);
+    return r;
+}
+
+static void free_blocks(GzBlock *blocks, int count)
+{
+    int i;
+    if (blocks == NULL)
+        return;
+    for (i = 0; i < count; i++) {
+        free(blocks[i].in);
+        free(blocks[i].out);
+    }
+    free(blocks);
+}
+
+static GzBlock *alloc_blocks(int count, size_t in_size, size_t out_size)
+{
+    GzBlock *blocks = calloc(count, sizeof(GzBlock));
+    if (blocks == NULL)
+        return NULL;
+    int i;
+    for (i = 0; i < count; i++) {
+        blocks[i].in = memalign(TAR_IO_ALIGNMENT, in_size);
+        blocks[i].out = memalign(TAR_IO_ALIGNMENT, out_size);
+        if (blocks[i].in == NULL || blocks[i].out == NULL) {
+            free_blocks(blocks, count);
+            return NULL;
+        }
+    }
+    return blocks;
+}
+
+static int compress_block(z_stream *stream, GzBlock *block)
+{
+    unsigned char *out = block->out;
+    memset(out, 0, TAR_GZ_HEADER_SIZE);
+    out[0] = 0x1f;
+    out[1] = 0x8b;
+    out[2] = Z_DEFLATED;
+    out[3] = GZ_FLAG_EXTRA;
+    out[9] = GZ_OS_UNIX;
+    out[10] = 8;
+    out[12] = 'C';
+    out[13] = 'W';
+    out[14] = 4;
+
+    if (deflateReset(stream) != Z_OK)
+        return -1;
+    stream->next_in = (Bytef *)block->in;
+    stream->avail_in = block->in_len;
+    stream->next_out = out + TAR_GZ_HEADER_SIZE;
+    stream->avail_out = max_member_size() - TAR_GZ_HEADER_SIZE - TAR_GZ_TRAILER_SIZE;
+    if (deflate(stream, Z_FINISH) != Z_STREAM_END)
+        return -1;
+
+    size_t len = TAR_GZ_HEADER_SIZE + stream->total_out;
+    put_le32(out + len, crc32(crc32(0, NULL, 0), (Bytef *)block->in, block->in_len));
+    put_le32(out + len + 4, block->in_len);
+    len += TAR_GZ_TRAILER_SIZE;
+    put_le32(out + 16, len);
+    block->out_len = len;
+    return 0;
+}
+
+// Called in stream order with the writer's mutex held.
+static int record_member(TarGzWriter *gz, const GzBlock *block)
+{
+    if (gz->written == gz->member_alloc) {
+        size_t alloc = gz->member_alloc * 2 + 256;
+        TarGzMember *members = realloc(gz->members, alloc * sizeof(TarGzMember));
+        if (members == NULL)
+            return -1;
+        gz->members = members;
+        gz->member_alloc = alloc;
+    }
+    gz->members[gz->written].offset = gz->file_offset;
+    gz->members[gz->written].data_offset = gz->data_offset;
+    gz->file_offset += block->out_len;
+    gz->data_offset += block->in_len;
+    return 0;
+}
+
+static void *tar_gz_writer_thread(void *cookie)
+{
+    TarGzWriter *gz = (TarGzWriter *)cookie;
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    int init = deflateInit2(&stream, gz->level, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY);
+
+    pthread_mutex_lock(&gz->mutex);
+    if (init != Z_OK) {
+        gz->error = ENOMEM;
+        pthread_cond_broadcast(&gz->cond);
+    }
+    for (;;) {
+        while (gz->claimed == gz->submitted && !gz->closing && !gz->error)
+            pthread_cond_wait(&gz->cond, &gz->mutex);
+        if (gz->claimed == gz->submitted || gz->error)
+            break;
+        uint64_t seq = gz->claimed++;
+        GzBlock *block = &gz->blocks[seq % gz->block_count];
+        pthread_mutex_unlock(&gz->mutex);
+
+        int ret = compress_block(&stream, block);
+
+        // write in order; only the owner of the next chunk writes
+        pthread_mutex_lock(&gz->mutex);
+        while (gz->written != seq && !gz->error)
+            pthread_cond_wait(&gz->cond, &gz->mutex);
+        if (gz->error)
+            break;
+        pthread_mutex_unlock(&gz->mutex);
+        int error = 0;
+        if (ret != 0)
+            error = EIO;
+        else if (write_fully(gz->fd, block->out, block->out_len))
+            error = errno;
+        else if (gz->md5 != NULL)
+            MD5_Update(gz->md5, block->out, block->out_len);
+        pthread_mutex_lock(&gz->mutex);
+        if (!error && record_member(gz, block))
+            error = ENOMEM;
+        if (error)
+            gz->error = error;
+        block->state = BLOCK_FREE;
+        gz->written++;
+        pthread_cond_broadcast(&gz->cond);
+    }
+    pthread_mutex_unlock(&gz->mutex);
+    if (init == Z_OK)
+        deflateEnd(&stream);
+    return NULL;
+}
+
+TarGzWriter *tar_gz_writer_open(int fd, int level, MD5_CTX *md5)
+{
+    TarGzWriter *gz = calloc(1, sizeof(TarGzWriter));
+    if (gz == NULL)
+        return NULL;
+    gz->fd = fd;
+    gz->md5 = md5;
+    gz->level = level;
+    gz->thread_count = cpu_count();
+    // two chunks per thread, so workers never wait on the one writing
+    gz->block_count = gz->thread_count * 2;
+    gz->blocks = alloc_blocks(gz->block_count, TAR_IO_BUFFER_SIZE, max_member_size());
+    if (gz->blocks == NULL) {
+        free(gz);
+        errno = ENOMEM;
+        return NULL;
+    }
+    pthread_mutex_init(&gz->mutex, NULL);
+    pthread_cond_init(&gz->cond, NULL);
+
+    int i;
+    for (i = 0; i < gz->thread_count; i++) {
+        if (pthread_create(&gz->threads[i], NULL, tar_gz_writer_thread, gz) != 0)
+            break;
+    }
+    if (i == 0) {
+        pthread_cond_destroy(&gz->cond);
+        pthread_mutex_destroy(&gz->mutex);
+        free_blocks(gz->blocks, gz->block_count);
+        free(gz);
+        errno = EAGAIN;
+        return NULL;
+    }
+    gz->thread_count = i;
+    return gz;
+}
+
+char *tar_gz_writer_submit(TarGzWriter *gz, char *buffer, size_t len)
+{
+    if (len == 0)
+        return buffer;
+
+    pthread_mutex_lock(&gz->mutex);
+    while (gz->submitted - gz->written >= (uint64_t)gz->block_count && !gz->error)
+        pthread_cond_wait(&gz->cond, &gz->mutex);
+    if (gz->error) {
+        errno = gz->error;
+        pthread_mutex_unlock(&gz->mutex);
+        return NULL;
+    }
+    GzBlock *block = &gz->blocks[gz->submitted % gz->block_count];
+    char *empty = block->in;
+    block->in = buffer;
+    block->in_len = len;
+    block->state = BLOCK_QUEUED;
+    gz->submitted++;
+    pthread_cond_broadcast(&gz->cond);
+    pthread_mutex_unlock(&gz->mutex);
+    return empty;
+}
+
+void tar_gz_writer_set_offset(TarGzWriter *gz, uint64_t file_offset, uint64_t data_offset)
+{
+    pthread_mutex_lock(&gz->mutex);
+    gz->file_offset = file_offset;
+    gz->data_offset = data_offset;
+    pthread_mutex_unlock(&gz->mutex);
+}
+
+int tar_gz_writer_sync(TarGzWriter *gz, const TarGzMember **members, size_t *member_count,
+        uint64_t *file_offset)
+{
+    pthread_mutex_lock(&gz->mutex);
+    while (gz->written != gz->submitted && !gz->error)
+        pthread_cond_wait(&gz->cond, &gz->mutex);
+    int error = gz->error;
+    // nothing is in flight, the table stays put until the next submit
+    *members = gz->members;
+    *member_count = gz->written;
+    *file_offset = gz->file_offset;
+    pthread_mutex_unlock(&gz->mutex);
+    if (error) {
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
+
+int tar_gz_writer_close(TarGzWriter *gz, TarGzMember **members, size_t *member_count)
+{
+    int i;
+    pthread_mutex_lock(&gz->mutex);
+    gz->closing = 1;
+    pthread_cond_broadcast(&gz->cond);
+    pthread_mutex_unlock(&gz->mutex);
+    for (i = 0; i < gz->thread_count; i++)
+        pthread_join(gz->threads[i], NULL);
+
+    int error = gz->error;
+    if (error == 0 && gz->written != gz->submitted)
+        error = EIO;
+    pthread_cond_destroy(&gz->cond);
+    pthread_mutex_destroy(&gz->mutex);
+    free_blocks(gz->blocks, gz->block_count);
+    if (members != NULL && error == 0) {
+        *members = gz->members;
+        *member_count = gz->written;
+    } else {
+        free(gz->members);
+    }
+    free(gz);
+    if (error) {
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
+
+int tar_gz_detect(int fd)
+{
+    unsigned char magic[2];
+    if (pread(fd, magic, sizeof(magic), 0) != sizeof(magic))
+        return 0;
+    return magic[0] == 0x1f && magic[1] == 0x8b;
+}
+
+// Returns 1 if header starts a member written by tar_gz_writer and
+// stores its total length in size.
+static int parse_member_header(const unsigned char *header, size_t *size)
+{
+    if (header[0] != 0x1f || header[1] != 0x8b || header[2] != Z_DEFLATED)
+        return 0;
+    if (header[3] != GZ_FLAG_EXTRA || header[10] != 8 || header[11] != 0)
+        return 0;
+    if (header[12] != 'C' || header[13] != 'W' || header[14] != 4 || header[15] != 0)
+        return 0;
+    *size = get_le32(header + 16);
+    return 1;
+}
+
+static int decompress_block(z_stream *stream, GzBlock *block)
+{
+    const unsigned char *in = (const unsigned char *)block->in;
+    const unsigned char *trailer = in + block->in_len - TAR_GZ_TRAILER_SIZE;
+    uint32_t crc = get_le32(trailer);
+    size_t size = get_le32(trailer + 4);
+    if (size > TAR_IO_BUFFER_SIZE)
+        return -1;
+
+    if (inflateReset(stream) != Z_OK)
+        return -1;
+    stream->next_in = (Bytef *)in + TAR_GZ_HEADER_SIZE;
+    stream->avail_in = block->in_len - TAR_GZ_HEADER_SIZE - TAR_GZ_TRAILER_SIZE;
+    stream->next_out = block->out;
+    stream->avail_out = size;
+    if (inflate(stream, Z_FINISH) != Z_STREAM_END || stream->total_out != size)
+        return -1;
+    if (crc32(crc32(0, NULL, 0), block->out, size) != crc)
+        return -1;
+    block->out_len = size;
+    return 0;
+}
+
+static void *tar_gz_reader_thread(void *cookie)
+{
+    TarGzReader *gz = (TarGzReader *)cookie;
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    int init = inflateInit2(&stream, -MAX_WBITS);
+
+    pthread_mutex_lock(&gz->mutex);
+    if (init != Z_OK) {
+        gz->error = ENOMEM;
+        pthread_cond_broadcast(&gz->cond);
+    }
+    for (;;) {
+        while (gz->claimed == gz->submitted && !gz->closing && !gz->error)
+            pthread_cond_wait(&gz->cond, &gz->mutex);
+        if (gz->closing || gz->error)
+            break;
+        uint64_t seq = gz->claimed++;
+        GzBlock *block = &gz->blocks[seq % gz->block_count];
+        pthread_mutex_unlock(&gz->mutex);
+
+        int ret = decompress_block(&stream, block);
+
+        pthread_mutex_lock(&gz->mutex);
+        if (ret != 0)
+            gz->error = EIO;
+        block->state = BLOCK_DONE;
+        pthread_cond_broadcast(&gz->cond);
+    }
+    pthread_mutex_unlock(&gz->mutex);
+    if (init == Z_OK)
+        inflateEnd(&stream);
+    return NULL;
+}
+
+TarGzReader *tar_gz_reader_open(int fd, MD5_CTX *md5)
+{
+    TarGzReader *gz = calloc(1, sizeof(TarGzReader));
+    if (gz == NULL)
+        return NULL;
+    gz->fd = fd;
+    gz->md5 = md5;
+
+    unsigned char header[TAR_GZ_HEADER_SIZE];
+    size_t size;
+    if (pread(fd, header, sizeof(header), 0) != sizeof(header)
+            || !parse_member_header(header, &size)) {
+        // not one of ours, inflate it the slow way
+        gz->streaming = 1;
+        gz->stream_buffer = malloc(TAR_GZ_STREAM_BUFFER);
+        if (gz->stream_buffer == NULL || inflateInit2(&gz->stream, 16 + MAX_WBITS) != Z_OK) {
+            free(gz->stream_buffer);
+            free(gz);
+            errno = ENOMEM;
+            return NULL;
+        }
+        return gz;
+    }
+
+    gz->thread_count = cpu_count();
+    gz->block_count = gz->thread_count * 2;
+    gz->blocks = alloc_blocks(gz->block_count, max_member_size(), TAR_IO_BUFFER_SIZE);
+    if (gz->blocks == NULL) {
+        free(gz);
+        errno = ENOMEM;
+        return NULL;
+    }
+    pthread_mutex_init(&gz->mutex, NULL);
+    pthread_cond_init(&gz->cond, NULL);
+
+    int i;
+    for (i = 0; i < gz->thread_count; i++) {
+        if (pthread_create(&gz->threads[i], NULL, tar_gz_reader_thread, gz) != 0)
+            break;
+    }
+    if (i == 0) {
+        pthread_cond_destroy(&gz->cond);
+        pthread_mutex_destroy(&gz->mutex);
+        free_blocks(gz->blocks, gz->block_count);
+        free(gz);
+        errno = EAGAIN;
+        return NULL;
+    }
+    gz->thread_count = i;
+    return gz;
+}
+
+static ssize_t tar_gz_stream_read(TarGzReader *gz, char *buffer, size_t len)
+{
+    z_stream *stream = &gz->stream;
+    stream->next_out = (Bytef *)buffer;
+    stream->avail_out = len;
+    while (stream->avail_out > 0 && !gz->eof) {
+        if (stream->avail_in == 0) {
+            ssize_t r = gz_read(gz, gz->stream_buffer, TAR_GZ_STREAM_BUFFER);
+            if (r < 0)
+                return -1;
+            if (r == 0) {
+                gz->eof = 1;
+                break;
+            }
+            stream->next_in = gz->stream_buffer;
+            stream->avail_in = r;
+        }
+        int ret = inflate(stream, Z_NO_FLUSH);
+        if (ret == Z_STREAM_END) {
+            // concatenated members are one stream
+            inflateReset(stream);
+        } else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+            errno = EIO;
+            return -1;
+        }
+    }
+    return len - stream->avail_out;
+}
+
+// Reads the next member into a free block and queues it.
+// Returns 0 on success, 1 at the end of the stream, -1 on error.
+static int tar_gz_queue_member(TarGzReader *gz)
+{
+    GzBlock *block = &gz->blocks[gz->submitted % gz->block_count];
+    unsigned char *in = (unsigned char *)block->in;
+    ssize_t r = gz_read(gz, in, TAR_GZ_HEADER_SIZE);
+    if (r < 0)
+        return -1;
+    if (r == 0)
+        return 1;
+    size_t size;
+    if (r != TAR_GZ_HEADER_SIZE || !parse_member_header(in, &size)
+            || size < TAR_GZ_HEADER_SIZE + TAR_GZ_TRAILER_SIZE || size > max_member_size()) {
+        errno = EIO;
+        return -1;
+    }
+    r = gz_read(gz, in + TAR_GZ_HEADER_SIZE, size - TAR_GZ_HEADER_SIZE);
+    if (r < 0)
+        return -1;
+    if ((size_t)r != size - TAR_GZ_HEADER_SIZE) {
+        errno = EIO;
+        return -1;
+    }
+    block->in_len = size;
+
+    pthread_mutex_lock(&gz->mutex);
+    block->state = BLOCK_QUEUED;
+    gz->submitted++;
+    pthread_cond_broadcast(&gz->cond);
+    pthread_mutex_unlock(&gz->mutex);
+    return 0;
+}
+
+ssize_t tar_gz_reader_read(TarGzReader *gz, char *buffer, size_t len)
+{
+    if (gz->streaming)
+        return tar_gz_stream_read(gz, buffer, len);
+
+    size_t done = 0;
+    while (done < len) {
+        // keep every block busy; the file is read on this thread while
+        // the workers inflate what was queued before
+        while (!gz->eof && gz->submitted - gz->consumed < (uint64_t)gz->block_count) {
+            int ret = tar_gz_queue_member(gz);
+            if (ret < 0)
+                return -1;
+            if (ret > 0)
+                gz->eof = 1;
+        }
+        if (gz->consumed == gz->submitted)
+            break;
+
+        GzBlock *block = &gz->blocks[gz->consumed % gz->block_count];
+        pthread_mutex_lock(&gz->mutex);
+        while (block->state != BLOCK_DONE && !gz->error)
+            pthread_cond_wait(&gz->cond, &gz->mutex);
+        int error = gz->error;
+        pthread_mutex_unlock(&gz->mutex);
+        if (error) {
+            errno = error;
+            return -1;
+        }
+
+        size_t copy = block->out_len - gz->position;
+        if (copy > len - done)
+            copy = len - done;
+        memcpy(buffer + done, block->out + gz->position, copy);
+        done += copy;
+        gz->position += copy;
+        if (gz->position == block->out_len) {
+            block->state = BLOCK_FREE;
+            gz->position = 0;
+            gz->consumed++;
+        }
+    }
+    return done;
+}
+
+void tar_gz_reader_close(TarGzReader *gz)
+{
+    if (gz->streaming) {
+        inflateEnd(&gz->stream);
+        free(gz->stream_buffer);
+        free(gz);
+        return;
+    }
+
+    int i;
+    pthread_mutex_lock(&gz->mutex);
+    gz->closing = 1;
+    pthread_cond_broadcast(&gz->cond);
+    pthread_mutex_unlock(&gz->mutex);
+    for (i = 0; i < gz->thread_count; i++)
+        pthread_join(gz->threads[i], NULL);
+    pthread_cond_destroy(&gz->cond);
+    pthread_mutex_destroy(&gz->mutex);
+    free_blocks(gz->blocks, gz->block_count);
+    free(gz);
+}
@@ -0,0 +1,71 @@
+#ifndef TAR_GZIP_H_
+#define TAR_GZIP_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <openssl/md5.h>
+
+// Block compressed archives.  The stream is cut into chunks of up to
+// TAR_IO_BUFFER_SIZE bytes, each stored as a gzip member of its own, so
+// the result is an ordinary .gz file that zcat and busybox tar read
+// as usual.  Every member carries its compressed length in a "CW" extra
+// field, which lets the reader hand whole members to several threads
+// without decompressing the stream first.
+
+typedef struct TarGzWriter TarGzWriter;
+typedef struct TarGzReader TarGzReader;
+
+// A member starts at offset in the file and holds the uncompressed
+// stream from data_offset on.
+typedef struct {
+    uint64_t offset;
+    uint64_t data_offset;
+} TarGzMember;
+
+// Compresses with the given zlib level (1-9) on one thread per cpu and
+// writes the members to fd in order.  If md5 is not NULL it is updated
+// with everything written to fd.
+TarGzWriter *tar_gz_writer_open(int fd, int level, MD5_CTX *md5);
+
+// Queues the first len bytes of buffer, which must be a
+// TAR_IO_BUFFER_SIZE buffer from memalign(), and returns an empty buffer
+// of the same size to go on with.  Returns NULL with errno set if
+// compressing or writing an earlier chunk failed.
+char *tar_gz_writer_submit(TarGzWriter *gz, char *buffer, size_t len);
+
+// Continues a stream whose first data_offset uncompressed bytes are
+// already in the file, which is file_offset bytes long.  Members are
+// recorded from there on.  Must be called before the first submit.
+void tar_gz_writer_set_offset(TarGzWriter *gz, uint64_t file_offset, uint64_t data_offset);
+
+// Waits for all queued chunks to be written.  members is set to the
+// writer's table of the members written so far, which stays valid
+// until the next submit, and file_offset to the end of the last one.
+// Returns 0 on success, -1 with errno set if writing failed.
+int tar_gz_writer_sync(TarGzWriter *gz, const TarGzMember **members, size_t *member_count,
+        uint64_t *file_offset);
+
+// Waits for all queued chunks to be written and frees the writer.
+// If members is not NULL, it is set to a malloc()ed table of the
+// members written, in order.  Returns 0 on success, -1 with errno set
+// on failure.
+int tar_gz_writer_close(TarGzWriter *gz, TarGzMember **members, size_t *member_count);
+
+// Returns 1 if the file at fd starts with a gzip header.
+int tar_gz_detect(int fd);
+
+// Decompresses the gzip stream read from fd, starting at the current
+// file position.  To start at a member in the middle of the file, seek
+// to it after opening the reader.  Members written by
+// tar_gz_writer are inflated in parallel, anything else is inflated
+// as a plain stream on the calling thread.  If md5 is not NULL it is
+// updated with everything read from fd.
+TarGzReader *tar_gz_reader_open(int fd, MD5_CTX *md5);
+
+// Like read(2) on the decompressed stream.
+ssize_t tar_gz_reader_read(TarGzReader *gz, char *buffer, size_t len);
+
+void tar_gz_reader_close(TarGzReader *gz);
+
+#endif  // TAR_GZIP_H_
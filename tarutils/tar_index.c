@@ -0,0 +1,202 @@
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "tarutils.h"
+#include "tar_index.h"
+
+// One line per gzip member ("m <offset> <data offset>") and one per
+// entry ("<type> <offset> <name>").  The two kinds are interleaved as
+// the archive was written, each of them in archive order.
+#define TAR_INDEX_MAGIC     "tarindex 1\n"
+
+static char entry_type(mode_t mode)
+{
+    if (S_ISDIR(mode))
+        return 'd';
+    if (S_ISREG(mode))
+        return 'f';
+    if (S_ISLNK(mode))
+        return 'l';
+    return 'o';
+}
+
+int tar_index_writer_open(TarIndexWriter *w, const char *index_path, uint64_t size, size_t entries)
+{
+    memset(w, 0, sizeof(*w));
+    if (size > 0 && truncate(index_path, size)) {
+        fprintf(stderr, "tar: can't truncate %s (%s)\n", index_path, strerror(errno));
+        return -1;
+    }
+    w->f = fopen(index_path, size > 0 ? "a" : "w");
+    if (w->f == NULL) {
+        fprintf(stderr, "tar: can't create %s (%s)\n", index_path, strerror(errno));
+        return -1;
+    }
+    if (size == 0)
+        fputs(TAR_INDEX_MAGIC, w->f);
+    w->entries = entries;
+    return 0;
+}
+
+int tar_index_writer_append(TarIndexWriter *w, const TarScan *scan, const uint64_t *offsets,
+        size_t entry_count, const TarGzMember *members, size_t member_count)
+{
+    for (; w->members < member_count; w->members++)
+        fprintf(w->f, "m %llu %llu\n", (unsigned long long) members[w->members].offset,
+                (unsigned long long) members[w->members].data_offset);
+    for (; w->entries < entry_count; w->entries++) {
+        const TarScanEntry *entry = &scan->entries[w->entries];
+        const char *name = scan->names + entry->name;
+        // the index is line based; such entries are still found by a
+        // full scan of the archive
+        if (offsets[w->entries] == TAR_INDEX_NO_OFFSET || strchr(name, '\n') != NULL)
+            continue;
+        fprintf(w->f, "%c %llu %s\n", entry_type(entry->mode),
+                (unsigned long long) offsets[w->entries], name);
+    }
+    return ferror(w->f) ? -1 : 0;
+}
+
+int tar_index_writer_sync(TarIndexWriter *w, uint64_t *size)
+{
+    if (fflush(w->f) || fsync(fileno(w->f)))
+        return -1;
+    off_t end = ftello(w->f);
+    if (end < 0)
+        return -1;
+    *size = end;
+    return 0;
+}
+
+int tar_index_writer_close(TarIndexWriter *w)
+{
+    int error = ferror(w->f);
+    if (fclose(w->f) || error)
+        return -1;
+    return 0;
+}
+
+static int index_add_member(TarIndex *index, uint64_t offset, uint64_t data_offset)
+{
+    if (index->member_count == index->member_alloc) {
+        size_t alloc = index->member_alloc * 2 + 256;
+        TarGzMember *members = realloc(index->members, alloc * sizeof(TarGzMember));
+        if (members == NULL)
+            return -1;
+        index->members = members;
+        index->member_alloc = alloc;
+    }
+    index->members[index->member_count].offset = offset;
+    index->members[index->member_count].data_offset = data_offset;
+    index->member_count++;
+    return 0;
+}
+
+static int index_add_entry(TarIndex *index, char type, uint64_t offset, const char *name)
+{
+    if (index->count == index->alloc) {
+        size_t alloc = index->alloc * 2 + 1024;
+        TarIndexEntry *entries = realloc(index->entries, alloc * sizeof(TarIndexEntry));
+        if (entries == NULL)
+            return -1;
+        index->entries = entries;
+        index->alloc = alloc;
+    }
+    size_t len = strlen(name) + 1;
+    if (index->names_len + len > index->names_alloc) {
+        size_t alloc = index->names_alloc * 2 + 64 * 1024;
+        char *names = realloc(index->names, alloc);
+        if (names == NULL)
+            return -1;
+        index->names = names;
+        index->names_alloc = alloc;
+    }
+    TarIndexEntry *entry = &index->entries[index->count++];
+    entry->offset = offset;
+    entry->type = type;
+    entry->name = index->names_len;
+    memcpy(index->names + index->names_len, name, len);
+    index->names_len += len;
+    return 0;
+}
+
+TarIndex *tar_index_load(const char *index_path)
+{
+    FILE *f = fopen(index_path, "r");
+    if (f == NULL)
+        return NULL;
+    TarIndex *index = calloc(1, sizeof(TarIndex));
+    if (index == NULL) {
+        fclose(f);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    char line[PATH_MAX + 64];
+    int ret = 0;
+    if (fgets(line, sizeof(line), f) == NULL || strcmp(line, TAR_INDEX_MAGIC) != 0)
+        ret = -1;
+    while (ret == 0 && fgets(line, sizeof(line), f) != NULL) {
+        size_t len = strlen(line);
+        if (len == 0 || line[len - 1] != '\n') {
+            ret = -1;
+            break;
+        }
+        line[len - 1] = '\0';
+
+        unsigned long long offset, data_offset;
+        char *end;
+        if (line[0] == 'm') {
+            if (sscanf(line, "m %llu %llu", &offset, &data_offset) != 2)
+                ret = -1;
+            else
+                ret = index_add_member(index, offset, data_offset);
+        } else if (line[0] != '\0' && line[1] == ' ') {
+            // names may start with blanks, so no sscanf here
+            offset = strtoull(line + 2, &end, 10);
+            if (end == line + 2 || *end != ' ')
+                ret = -1;
+            else
+                ret = index_add_entry(index, line[0], offset, end + 1);
+        } else {
+            ret = -1;
+        }
+    }
+    fclose(f);
+
+    if (ret) {
+        fprintf(stderr, "tar: corrupt index %s\n", index_path);
+        tar_index_free(index);
+        errno = EINVAL;
+        return NULL;
+    }
+    return index;
+}
+
+uint64_t tar_index_count(const TarIndex *index)
+{
+    return index->count;
+}
+
+const char *tar_index_name(const TarIndex *index, uint64_t i, int *is_dir)
+{
+    if (is_dir != NULL)
+        *is_dir = index->entries[i].type == 'd';
+    return index->names + index->entries[i].name;
+}
+
+void tar_index_free(TarIndex *index)
+{
+    if (index == NULL)
+        return;
+    free(index->members);
+    free(index->entries);
+    free(index->names);
+    free(index);
+}
@@ -0,0 +1,60 @@
+#ifndef TAR_INDEX_H_
+#define TAR_INDEX_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+#include "tar_gzip.h"
+#include "tar_scan.h"
+
+// offsets[] value for scan entries that did not make it into the archive
+#define TAR_INDEX_NO_OFFSET     ((uint64_t) -1)
+
+typedef struct {
+    uint64_t offset;    // of the first header record of the entry
+    size_t name;        // offset of the archive name in TarIndex.names
+    char type;          // 'd', 'f', 'l' or 'o' for anything else
+} TarIndexEntry;
+
+struct TarIndex {
+    // empty for uncompressed archives
+    TarGzMember *members;
+    size_t member_count;
+    size_t member_alloc;
+
+    TarIndexEntry *entries;
+    size_t count;
+    size_t alloc;
+
+    char *names;
+    size_t names_len;
+    size_t names_alloc;
+};
+
+// Writes the index while the archive is created.  Entry and member
+// lines are appended as the archive grows, so an index cut back to a
+// checkpoint matches an archive cut back to the same checkpoint.
+typedef struct {
+    FILE *f;
+    size_t entries;     // scan entries handled so far
+    size_t members;     // of the current gzip writer's table
+} TarIndexWriter;
+
+// Starts a new index, or if size is not 0, cuts an existing one back
+// to size bytes and continues it after the first entries scan entries.
+int tar_index_writer_open(TarIndexWriter *w, const char *index_path, uint64_t size, size_t entries);
+
+// Appends the scan entries up to entry_count and the members up to
+// member_count that weren't written yet.  offsets[i] is the position of
+// entry i in the uncompressed stream.
+int tar_index_writer_append(TarIndexWriter *w, const TarScan *scan, const uint64_t *offsets,
+        size_t entry_count, const TarGzMember *members, size_t member_count);
+
+// Makes what was appended durable and returns the size of the index.
+int tar_index_writer_sync(TarIndexWriter *w, uint64_t *size);
+
+// Returns 0 if everything was written.
+int tar_index_writer_close(TarIndexWriter *w);
+
+#endif  // TAR_INDEX_H_
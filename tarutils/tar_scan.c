@@ -0,0 +1,226 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+
+#include "tarutils.h"
+#include "tar_scan.h"
+
+// directory entries are read this many bytes at a time
+#define TAR_SCAN_DIRENT_BUFFER  (32 * 1024)
+
+// Not every libc declares getdents64 or its record, the layout is fixed
+// by the kernel.
+struct tar_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+static int is_excluded(const char **excludes, const char *name)
+{
+    const char **exclude;
+    if (excludes == NULL)
+        return 0;
+    for (exclude = excludes; *exclude != NULL; exclude++) {
+        if (strcmp(*exclude, name) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+static int scan_add(TarScan *scan, const char *name, const struct stat *st)
+{
+    if (scan->count == scan->alloc) {
+        size_t alloc = scan->alloc * 2 + 1024;
+        TarScanEntry *entries = realloc(scan->entries, alloc * sizeof(TarScanEntry));
+        if (entries == NULL)
+            return -1;
+        scan->entries = entries;
+        scan->alloc = alloc;
+    }
+    size_t len = strlen(name) + 1;
+    if (scan->names_len + len > scan->names_alloc) {
+        size_t alloc = scan->names_alloc * 2 + 64 * 1024;
+        char *names = realloc(scan->names, alloc);
+        if (names == NULL)
+            return -1;
+        scan->names = names;
+        scan->names_alloc = alloc;
+    }
+
+    TarScanEntry *entry = &scan->entries[scan->count++];
+    entry->name = scan->names_len;
+    memcpy(scan->names + scan->names_len, name, len);
+    scan->names_len += len;
+    entry->mode = st->st_mode;
+    entry->uid = st->st_uid;
+    entry->gid = st->st_gid;
+    entry->nlink = st->st_nlink;
+    entry->size = S_ISREG(st->st_mode) ? st->st_size : 0;
+    entry->mtime = st->st_mtime;
+    entry->dev = st->st_dev;
+    entry->ino = st->st_ino;
+    entry->rdev = st->st_rdev;
+    scan->bytes += entry->size;
+    return 0;
+}
+
+// Records everything below the directory open at fd, depth first in the
+// order tar_create stores it.  name is the archive name of the directory
+// and is used as scratch space for the names of its children.
+static int scan_tree(TarScan *scan, int fd, char *name, const char **excludes)
+{
+    char *buffer = malloc(TAR_SCAN_DIRENT_BUFFER);
+    if (buffer == NULL)
+        return -1;
+
+    size_t name_len = strlen(name);
+    int ret = 0;
+    for (;;) {
+        int len = syscall(__NR_getdents64, fd, buffer, TAR_SCAN_DIRENT_BUFFER);
+        if (len < 0 && errno == EINTR)
+            continue;
+        if (len < 0) {
+            fprintf(stderr, "tar: can't read directory %s (%s)\n", name, strerror(errno));
+            ret = -1;
+            break;
+        }
+        if (len == 0)
+            break;
+
+        int pos;
+        for (pos = 0; ret == 0 && pos < len; ) {
+            struct tar_dirent64 *de = (struct tar_dirent64 *)(buffer + pos);
+            pos += de->d_reclen;
+            if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+                continue;
+            if (name_len + 1 + strlen(de->d_name) >= PATH_MAX) {
+                fprintf(stderr, "tar: path too long: %s/%s\n", name, de->d_name);
+                errno = ENAMETOOLONG;
+                ret = -1;
+                break;
+            }
+            sprintf(name + name_len, "/%s", de->d_name);
+            if (is_excluded(excludes, name))
+                continue;
+
+            struct stat st;
+            if (fstatat(fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW)) {
+                if (errno == ENOENT) {
+                    // deleted since it was listed, tar_create skips those too
+                    fprintf(stderr, "tar: %s: file removed\n", name);
+                    continue;
+                }
+                fprintf(stderr, "tar: can't stat %s (%s)\n", name, strerror(errno));
+                ret = -1;
+                break;
+            }
+            if (S_ISSOCK(st.st_mode)) {
+                // sockets can't be archived, same as tar does.
+                fprintf(stderr, "tar: %s: socket ignored\n", name);
+                continue;
+            }
+            if (scan_add(scan, name, &st)) {
+                ret = -1;
+                break;
+            }
+            if (S_ISDIR(st.st_mode)) {
+                int child = openat(fd, de->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+                if (child < 0 && errno == ENOENT) {
+                    // gone too, it is archived empty
+                    fprintf(stderr, "tar: %s: directory removed\n", name);
+                    continue;
+                }
+                if (child < 0) {
+                    fprintf(stderr, "tar: can't open directory %s (%s)\n", name, strerror(errno));
+                    ret = -1;
+                    break;
+                }
+                ret = scan_tree(scan, child, name, excludes);
+                close(child);
+            }
+        }
+        name[name_len] = '\0';
+        if (ret)
+            break;
+    }
+    free(buffer);
+    return ret;
+}
+
+TarScan *tar_scan(const char *directory, const char **excludes)
+{
+    TarScan *scan = calloc(1, sizeof(TarScan));
+    if (scan == NULL)
+        return NULL;
+
+    // strip trailing slashes, entries are named after the last component
+    char path[PATH_MAX];
+    strncpy(path, directory, sizeof(path) - 1);
+    path[sizeof(path) - 1] = '\0';
+    size_t len = strlen(path);
+    while (len > 1 && path[len - 1] == '/')
+        path[--len] = '\0';
+    const char *base = strrchr(path, '/');
+    base = (base == NULL || base[1] == '\0') ? path : base + 1;
+    memcpy(scan->prefix, path, base - path);
+    scan->prefix[base - path] = '\0';
+
+    char name[PATH_MAX];
+    strcpy(name, base);
+    struct stat st;
+    if (lstat(path, &st)) {
+        fprintf(stderr, "tar: can't stat %s (%s)\n", path, strerror(errno));
+        goto fail;
+    }
+    if (scan_add(scan, name, &st))
+        goto fail;
+    if (S_ISDIR(st.st_mode)) {
+        int fd = open(path, O_RDONLY | O_DIRECTORY);
+        if (fd < 0) {
+            fprintf(stderr, "tar: can't open directory %s (%s)\n", path, strerror(errno));
+            goto fail;
+        }
+        int ret = scan_tree(scan, fd, name, excludes);
+        close(fd);
+        if (ret)
+            goto fail;
+    }
+    return scan;
+
+fail:
+    {
+        int saved_errno = errno;
+        tar_scan_free(scan);
+        errno = saved_errno;
+    }
+    return NULL;
+}
+
+uint64_t tar_scan_entries(const TarScan *scan)
+{
+    return scan->count;
+}
+
+uint64_t tar_scan_bytes(const TarScan *scan)
+{
+    return scan->bytes;
+}
+
+void tar_scan_free(TarScan *scan)
+{
+    if (scan == NULL)
+        return;
+    free(scan->entries);
+    free(scan->names);
+    free(scan);
+}
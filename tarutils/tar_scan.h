@@ -0,0 +1,39 @@
+#ifndef TAR_SCAN_H_
+#define TAR_SCAN_H_
+
+#include <limits.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// What tar_create needs to know about an entry, about half the size of
+// a struct stat.  Scans of /data hold hundreds of thousands of these.
+typedef struct {
+    size_t name;        // offset of the archive name in TarScan.names
+    mode_t mode;
+    uid_t uid;
+    gid_t gid;
+    unsigned int nlink;
+    uint64_t size;
+    time_t mtime;
+    dev_t dev;
+    ino_t ino;
+    dev_t rdev;
+} TarScanEntry;
+
+struct TarScan {
+    // prepended to an archive name to get the path on disk
+    char prefix[PATH_MAX];
+
+    TarScanEntry *entries;
+    size_t count;
+    size_t alloc;
+
+    // archive names, NUL separated, in the order they were found
+    char *names;
+    size_t names_len;
+    size_t names_alloc;
+
+    uint64_t bytes;
+};
+
+#endif  // TAR_SCAN_H_
@@ -0,0 +1,150 @@
+#ifndef TARUTILS_H_
+#define TARUTILS_H_
+
+#include <stdint.h>
+
+/* Called once for every entry stored in (or extracted from) an archive.
+ * path is the name of the entry inside the archive, bytes the amount of
+ * file data that came with it (0 for directories, links and devices).
+ * Entries a resumed archive already holds are reported with a NULL path.
+ */
+typedef void (*tar_file_callback)(const char *path, uint64_t bytes, void *cookie);
+
+/* Archives and extractions can be resumed after they were cut short
+ * (battery pulled, sdcard full).  Every 64MB of archive data the work
+ * done so far is synced to disk and checkpoint is called with a line of
+ * text describing it.  Passing the last one back as resume continues
+ * from there instead of starting over.  The callback shares the cookie
+ * of the tar_file_callback.
+ */
+typedef void (*tar_checkpoint_callback)(const char *checkpoint, void *cookie);
+
+/* Writes a ustar archive of directory to archive_path, without forking
+ * a tar binary.  Like "cd $(dirname directory); tar cf archive_path
+ * $(basename directory)", entries are stored relative to the parent of
+ * directory.  Names that do not fit the ustar header use GNU long name
+ * records, which busybox tar understands.
+ *
+ * excludes is an optional NULL terminated list of archive paths (eg.
+ * "data/media") that are skipped along with everything below them.
+ *
+ * compression is 0 for a plain tar, or a gzip level (1-9) to compress
+ * the archive in independent blocks on all cpus.  The result is a
+ * regular .tar.gz.
+ *
+ * If md5 is not NULL, the MD5 digest (16 bytes) of the archive file is
+ * computed as it is written and stored there, so the archive doesn't
+ * have to be read back to checksum it.
+ *
+ * Returns 0 on success, -1 with errno set on failure.
+ */
+int tar_create(const char *archive_path, const char *directory,
+        const char **excludes, int compression, unsigned char *md5,
+        tar_file_callback callback, void *cookie);
+
+/* A list of everything below a directory, in the order tar_create
+ * stores it, read with getdents64 and fstatat instead of a find(1)
+ * child.  Callers use it to size progress bars before an archive is
+ * written and can hand the same list to tar_create_from_scan, so the
+ * tree is only walked once.
+ */
+typedef struct TarScan TarScan;
+
+/* Scans directory, skipping excludes as tar_create does.  Sockets are
+ * left out.  Returns NULL with errno set on failure.
+ */
+TarScan *tar_scan(const char *directory, const char **excludes);
+
+/* Number of entries (files, directories, links, ...) in the scan. */
+uint64_t tar_scan_entries(const TarScan *scan);
+
+/* Total size of the regular files in the scan. */
+uint64_t tar_scan_bytes(const TarScan *scan);
+
+void tar_scan_free(TarScan *scan);
+
+/* Same as tar_create, but archives the entries of an earlier tar_scan.
+ * Files removed since the scan are skipped.
+ *
+ * If index_path is not NULL, an index of the archive is written there:
+ * where every entry starts, and for compressed archives where every
+ * gzip block starts.  tar_extract_paths uses it to seek straight to
+ * the entries it needs.
+ */
+int tar_create_from_scan(const char *archive_path, const TarScan *scan,
+        const char *index_path, int compression, unsigned char *md5,
+        tar_file_callback callback, void *cookie);
+
+/* Resumable tar_create_from_scan.  If resume is not NULL, archive_path
+ * and index_path are what the interrupted run left behind; they are cut
+ * back to the checkpoint and the rest of the scan is appended, md5
+ * still covering the whole archive.  If the scan no longer starts with
+ * the entries that were archived before the checkpoint, or the files
+ * don't match it, the archive is written from scratch.  checkpoint may
+ * be NULL.
+ */
+int tar_create_resume(const char *archive_path, const TarScan *scan,
+        const char *index_path, int compression, unsigned char *md5,
+        const char *resume, tar_checkpoint_callback checkpoint,
+        tar_file_callback callback, void *cookie);
+
+typedef struct TarIndex TarIndex;
+
+/* Loads an index written by tar_create_from_scan.  Returns NULL with
+ * errno set on failure (ENOENT if there is none).
+ */
+TarIndex *tar_index_load(const char *index_path);
+
+uint64_t tar_index_count(const TarIndex *index);
+
+/* Archive name of entry i, in archive order.  Directories have no
+ * trailing slash, is_dir (if not NULL) tells them apart.
+ */
+const char *tar_index_name(const TarIndex *index, uint64_t i, int *is_dir);
+
+void tar_index_free(TarIndex *index);
+
+/* Extracts archive_path below directory, like "cd directory; tar xf
+ * archive_path".  The archive is read by a separate read-ahead thread
+ * in large chunks, regular files are preallocated from the size in
+ * their header and written with large sequential writes.  Ownership,
+ * modes and times are applied in batches; directories, symlinks and
+ * hard links once all files are in place.
+ *
+ * Understands ustar, GNU long names and pax path/size records.  Gzip
+ * compressed archives are detected and decompressed on the fly, blocks
+ * written by tar_create are decompressed on all cpus.
+ *
+ * If md5 is not NULL, the MD5 digest of the whole archive file is
+ * computed while it is read and stored there.
+ *
+ * Returns 0 on success, -1 with errno set on failure.
+ */
+int tar_extract(const char *archive_path, const char *directory,
+        unsigned char *md5, tar_file_callback callback, void *cookie);
+
+/* Resumable tar_extract.  If resume is not NULL, extraction continues
+ * at the checkpoint; the archive's index (if not NULL) lets compressed
+ * archives seek there instead of decompressing everything before it.
+ * md5 can only be computed for extractions that start from the
+ * beginning.  checkpoint may be NULL.
+ */
+int tar_extract_resume(const char *archive_path, const TarIndex *index, const char *directory,
+        unsigned char *md5, const char *resume, tar_checkpoint_callback checkpoint,
+        tar_file_callback callback, void *cookie);
+
+/* Extracts only the entries selected by patterns, a NULL terminated
+ * list of fnmatch(3) patterns for archive names (eg. "data/data/com.foo"
+ * or "*.db").  Selecting a directory selects everything below
+ * it.  Existing files that aren't selected are left alone.
+ *
+ * With the archive's index, only the parts of the archive holding
+ * selected entries are read.  If index is NULL the whole archive is
+ * read and filtered.
+ *
+ * Returns 0 on success, -1 with errno set on failure.
+ */
+int tar_extract_paths(const char *archive_path, const TarIndex *index, const char *directory,
+        const char **patterns, tar_file_callback callback, void *cookie);
+
+#endif  // TARUTILS_H_
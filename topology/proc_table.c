@@ -0,0 +1,76 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "proc_table.h"
+
+// enough for most tables in one read
+#define PROC_TABLE_MIN_SIZE     4096
+
+int proc_table_read(proc_table* table, int fd)
+{
+    table->len = 0;
+    table->pos = 0;
+    for (;;) {
+        // room for a read and the terminating NUL
+        if (table->size - table->len < PROC_TABLE_MIN_SIZE / 2) {
+            size_t size = table->size ? table->size * 2 : PROC_TABLE_MIN_SIZE;
+            char* data = realloc(table->data, size);
+            if (data == NULL) {
+                errno = ENOMEM;
+                break;
+            }
+            table->data = data;
+            table->size = size;
+        }
+        // proc files hand out a page or so per read, keep going to the end
+        ssize_t n = read(fd, table->data + table->len, table->size - table->len - 1);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            break;
+        if (n == 0) {
+            table->data[table->len] = '\0';
+            return 0;
+        }
+        table->len += n;
+    }
+    table->len = 0;
+    return -1;
+}
+
+char* proc_table_line(proc_table* table)
+{
+    if (table->pos >= table->len)
+        return NULL;
+    char* line = table->data + table->pos;
+    char* end = memchr(line, '\n', table->len - table->pos);
+    if (end == NULL) {
+        // the last line had no newline, the NUL after the text ends it
+        table->pos = table->len;
+    }
+    else {
+        *end = '\0';
+        table->pos = end + 1 - table->data;
+    }
+    return line;
+}
+
+char* proc_table_field(char** line)
+{
+    char* p = *line;
+    while (*p == ' ' || *p == '\t')
+        p++;
+    if (*p == '\0') {
+        *line = p;
+        return NULL;
+    }
+    char* field = p;
+    while (*p != '\0' && *p != ' ' && *p != '\t')
+        p++;
+    if (*p != '\0')
+        *p++ = '\0';
+    *line = p;
+    return field;
+}
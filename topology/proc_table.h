@@ -0,0 +1,29 @@
+#ifndef PROC_TABLE_H
+#define PROC_TABLE_H
+
+#include <stddef.h>
+
+// A table from /proc, like /proc/mounts or /proc/mtd, of any size.  The
+// text is read into a buffer that is kept from one read to the next, so
+// reading a table again allocates nothing once the buffer fits it.  Lines
+// and fields are split off in place and stay valid until the next read.
+typedef struct {
+    char* data;
+    size_t size;        // of data
+    size_t len;         // of the text read
+    size_t pos;         // where the next line starts
+} proc_table;
+
+#define PROC_TABLE_INIT { NULL, 0, 0, 0 }
+
+// Reads fd to its end.  Returns 0, or -1 if it couldn't be read.
+int proc_table_read(proc_table* table, int fd);
+
+// Returns the next line without its newline, or NULL after the last.
+char* proc_table_line(proc_table* table);
+
+// Returns the next whitespace separated field of *line and moves *line
+// past it, or NULL if there are no more.
+char* proc_table_field(char** line);
+
+#endif
@@ -0,0 +1,220 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+
+#include "topology.h"
+
+#define PROC_MOUNTS_FILENAME    "/proc/mounts"
+// what the kernel sends at most per uevent
+#define UEVENT_BUFFER_SIZE      2048
+#define INDEX_MIN_SIZE          64
+
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int g_generation[TOPOLOGY_COUNT] = { 1, 1, 1 };
+// topology_hold calls not released yet, the thread that made them and
+// whether something changed meanwhile
+static int g_held[TOPOLOGY_COUNT];
+static pthread_t g_holder[TOPOLOGY_COUNT];
+static int g_changed[TOPOLOGY_COUNT];
+static int g_watching = 0;
+// mtd and block uevents, -1 if we can't have them
+static int g_uevent_fd = -1;
+// polls with POLLPRI whenever the mount table changes, -1 if it can't
+static int g_mounts_fd = -1;
+
+static void bump(int what)
+{
+    if (g_held[what]) {
+        g_changed[what] = 1;
+        return;
+    }
+    if (++g_generation[what] == 0)
+        g_generation[what] = 1;
+}
+
+static void start_watching()
+{
+    struct sockaddr_nl addr;
+
+    g_watching = 1;
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = 1;
+    g_uevent_fd = socket(PF_NETLINK, SOCK_DGRAM, NETLINK_KOBJECT_UEVENT);
+    if (g_uevent_fd >= 0 && bind(g_uevent_fd, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+        close(g_uevent_fd);
+        g_uevent_fd = -1;
+    }
+    if (g_uevent_fd >= 0) {
+        fcntl(g_uevent_fd, F_SETFD, FD_CLOEXEC);
+        fcntl(g_uevent_fd, F_SETFL, O_NONBLOCK);
+    }
+
+    g_mounts_fd = open(PROC_MOUNTS_FILENAME, O_RDONLY);
+    if (g_mounts_fd >= 0)
+        fcntl(g_mounts_fd, F_SETFD, FD_CLOEXEC);
+}
+
+// Without uevents the partition tables only move on when we change them,
+// they don't on their own in recovery.
+static void read_uevents()
+{
+    char buf[UEVENT_BUFFER_SIZE];
+    int i;
+
+    if (g_uevent_fd < 0)
+        return;
+    for (;;) {
+        ssize_t n = recv(g_uevent_fd, buf, sizeof(buf) - 1, MSG_DONTWAIT);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && errno == ENOBUFS) {
+            // some were dropped, so anything could have happened
+            for (i = 0; i < TOPOLOGY_COUNT; i++)
+                bump(i);
+            continue;
+        }
+        if (n <= 0)
+            break;
+        buf[n] = '\0';
+
+        // "add@/devices/...\0ACTION=add\0DEVPATH=...\0SUBSYSTEM=block\0..."
+        const char* s;
+        for (s = buf; s < buf + n; s += strlen(s) + 1) {
+            if (strcmp(s, "SUBSYSTEM=mtd") == 0)
+                bump(TOPOLOGY_MTD);
+            else if (strcmp(s, "SUBSYSTEM=block") == 0)
+                bump(TOPOLOGY_MMC);
+        }
+    }
+}
+
+static void poll_mounts()
+{
+    struct pollfd fds;
+
+    if (g_mounts_fd < 0) {
+        // nothing tells us about mounts made behind our back
+        bump(TOPOLOGY_MOUNTS);
+        return;
+    }
+    fds.fd = g_mounts_fd;
+    fds.events = POLLPRI;
+    fds.revents = 0;
+    if (poll(&fds, 1, 0) > 0 && (fds.revents & (POLLERR | POLLPRI)))
+        bump(TOPOLOGY_MOUNTS);
+}
+
+unsigned int topology_generation(int what)
+{
+    unsigned int generation;
+
+    pthread_mutex_lock(&g_lock);
+    if (!g_watching)
+        start_watching();
+    if (what == TOPOLOGY_MOUNTS)
+        poll_mounts();
+    else
+        read_uevents();
+    generation = g_generation[what];
+    pthread_mutex_unlock(&g_lock);
+    return generation;
+}
+
+void topology_invalidate(int what)
+{
+    pthread_mutex_lock(&g_lock);
+    bump(what);
+    pthread_mutex_unlock(&g_lock);
+}
+
+void topology_hold(int what)
+{
+    pthread_mutex_lock(&g_lock);
+    if (g_held[what]++ == 0)
+        g_holder[what] = pthread_self();
+    pthread_mutex_unlock(&g_lock);
+}
+
+void topology_release(int what)
+{
+    pthread_mutex_lock(&g_lock);
+    if (--g_held[what] == 0 && g_changed[what]) {
+        g_changed[what] = 0;
+        bump(what);
+    }
+    pthread_mutex_unlock(&g_lock);
+}
+
+int topology_held(int what)
+{
+    int held;
+
+    pthread_mutex_lock(&g_lock);
+    held = g_held[what] != 0 && !pthread_equal(g_holder[what], pthread_self());
+    pthread_mutex_unlock(&g_lock);
+    return held;
+}
+
+static unsigned int hash(const char* key)
+{
+    unsigned int h = 2166136261u;
+    while (*key)
+        h = (h ^ (unsigned char) *key++) * 16777619;
+    return h;
+}
+
+int topology_index_build(topology_index* index, const void* table, int count, topology_key_fn key_fn)
+{
+    unsigned int size = INDEX_MIN_SIZE;
+    int i;
+
+    while (count > 0 && size < (unsigned int) count * 2)
+        size *= 2;
+    if (index->size < size) {
+        free(index->slot);
+        index->slot = malloc(size * sizeof(int));
+        index->size = index->slot != NULL ? size : 0;
+        if (index->slot == NULL)
+            return -1;
+    }
+    memset(index->slot, 0, index->size * sizeof(int));
+
+    for (i = 0; i < count; i++) {
+        const char* key = key_fn(table, i);
+        unsigned int slot;
+        if (key == NULL)
+            continue;
+        slot = hash(key) & (index->size - 1);
+        while (index->slot[slot] != 0) {
+            if (strcmp(key_fn(table, index->slot[slot] - 1), key) == 0)
+                break;
+            slot = (slot + 1) & (index->size - 1);
+        }
+        if (index->slot[slot] == 0)
+            index->slot[slot] = i + 1;
+    }
+    return 0;
+}
+
+int topology_index_find(const topology_index* index, const void* table, topology_key_fn key_fn, const char* key)
+{
+    if (index->size == 0)
+        return -1;
+    unsigned int slot = hash(key) & (index->size - 1);
+    while (index->slot[slot] != 0) {
+        int entry = index->slot[slot] - 1;
+        const char* k = key_fn(table, entry);
+        // an entry can go out of use after it was indexed
+        if (k != NULL && strcmp(k, key) == 0)
+            return entry;
+        slot = (slot + 1) & (index->size - 1);
+    }
+    return -1;
+}
@@ -0,0 +1,56 @@
+#ifndef TOPOLOGY_H
+#define TOPOLOGY_H
+
+// What the partition and mount scanners keep between calls: the MTD
+// partitions from /proc/mtd, the eMMC partition table and the volumes in
+// /proc/mounts.  Each has a generation that moves on whenever what it
+// describes may have changed, either because we mounted, unmounted or
+// formatted something or because the kernel said so (an mtd or block
+// uevent, a change to the mount table).  A scanner keeps what it read
+// for as long as the generation it read it at is current.
+enum {
+    TOPOLOGY_MTD,
+    TOPOLOGY_MMC,
+    TOPOLOGY_MOUNTS,
+    TOPOLOGY_COUNT
+};
+
+// Returns the current generation of what, after taking in whatever the
+// kernel reported since the last call.  Never 0, so a scanner can start
+// from 0 for not read yet.
+unsigned int topology_generation(int what);
+
+// Moves what on to a new generation, for changes we made ourselves.
+void topology_invalidate(int what);
+
+// The scanners keep their tables in globals without a lock, so they are
+// for one thread at a time.  Holding what keeps it at its current
+// generation until it is released, whatever changes meanwhile moves it
+// on at the release.  Once the holding thread has called a scanner, the
+// scanner only reads its tables until the release, and other threads can
+// share them while the holder waits for them.  Holds nest.
+void topology_hold(int what);
+void topology_release(int what);
+// Returns 1 while what is held by another thread than the caller, for the
+// scanners to assert that they don't rebuild a table it is sharing.
+int topology_held(int what);
+
+// Open addressing on the hash of a name, entry + 1 or 0 for an empty
+// slot.  Starts out zeroed, and the slots are kept for the next build.
+typedef struct {
+    int* slot;
+    unsigned int size;  // a power of two, at least twice the entries
+} topology_index;
+
+// Returns the key of entry in table, NULL for an entry not in use.
+typedef const char* (*topology_key_fn)(const void* table, int entry);
+
+// Indexes the first count entries of table.  Keys are looked up in the
+// order of the table, the first entry with a key wins.  Returns -1 if
+// there was no memory for it, and nothing can be found until the next
+// build.
+int topology_index_build(topology_index* index, const void* table, int count, topology_key_fn key_fn);
+// Returns the entry with key, or -1.
+int topology_index_find(const topology_index* index, const void* table, topology_key_fn key_fn, const char* key);
+
+#endif
@@ -16,9 +16,12 @@
 
 #include <sys/ioctl.h>
 #include <sys/stat.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include "ubi-user.h"
 #include "ubi_tools.h"
 
@@ -126,79 +129,214 @@ int ubi_rsvol(const char *ubi_ctrl, int vol_id, int size_bytes)
 	return ret;
 }
 
-int ubi_updatevol(const char *ubi_ctrl, const char *image)
+/* Volume updates are written in whole LEBs, at least this much at a time */
+#define UBI_UPDATE_BUFFER_SIZE	(1024 * 1024)
+
+struct ubi_update {
+	int fd;
+	long long left;		/* bytes promised to UBI_IOCVOLUP not written yet */
+	char *buf;
+	size_t size;
+	size_t len;
+	int error;
+};
+
+int ubi_vol_leb_size(const char *ubi_vol)
 {
-	long long bytes;
-	int fd, ret;
-	struct stat st;
 	char buf[sizeof("/sys/class/ubi/ubi%d_%d/usable_eb_size") + 2 * sizeof(int)*3];
-	int input_fd;
 	unsigned ubinum, volnum;
 	unsigned leb_size;
 	ssize_t len;
-	char *input_data;
-
-	fd = open(ubi_ctrl, O_RDWR);
-	if (fd < 0)
-		return -1;
-
-	if (image == NULL) {
-		// truncate the volume by starting an update for size 0
-		bytes = 0;
-		ret = ioctl(fd, UBI_IOCVOLUP, &bytes);
-		close(fd);
-		return ret;
-	}
+	int fd;
 
 	// Make assumption that device not is in normal format.
 	// Removes need for scanning sysfs tree as full libubi does
-	if (sscanf(ubi_ctrl, "/dev/ubi%u_%u", &ubinum, &volnum) != 2) {
-		close(fd);
+	if (sscanf(ubi_vol, "/dev/ubi%u_%u", &ubinum, &volnum) != 2)
 		return -1;
-	}
 
 	sprintf(buf, "/sys/class/ubi/ubi%u_%u/usable_eb_size", ubinum, volnum);
-	input_fd = open(buf, O_RDONLY);
-	if (input_fd < 0) {
-		close(fd);
+	fd = open(buf, O_RDONLY);
+	if (fd < 0)
 		return -1;
-	}
-	len = read(input_fd, buf, sizeof(buf));
-	close(input_fd);
-	if (len <= 0) {
-		close(fd);
+	len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (len <= 0)
 		return -1;
-	}
-	if (sscanf(buf, "%u", &leb_size) != 1) {
-		close(fd);
+	buf[len] = '\0';
+	if (sscanf(buf, "%u", &leb_size) != 1 || leb_size == 0)
 		return -1;
+	return leb_size;
+}
+
+static int write_all(int fd, const char *data, size_t len)
+{
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = write(fd, data, len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -1;
+		data += ret;
+		len -= ret;
 	}
+	return 0;
+}
 
-	stat(image, &st);
-	bytes = st.st_size;
-	input_fd = open(image, O_RDONLY);
-	if (input_fd < 0) {
-		close(fd);
+ubi_update *ubi_update_open(const char *ubi_vol, long long bytes)
+{
+	ubi_update *up;
+	int leb_size;
+
+	leb_size = ubi_vol_leb_size(ubi_vol);
+	if (leb_size < 0)
+		return NULL;
+
+	up = calloc(1, sizeof(*up));
+	if (up == NULL)
+		return NULL;
+	up->size = leb_size < UBI_UPDATE_BUFFER_SIZE ?
+		UBI_UPDATE_BUFFER_SIZE / leb_size * leb_size : leb_size;
+	up->left = bytes;
+	up->fd = -1;
+	up->buf = malloc(up->size);
+	if (up->buf == NULL)
+		goto fail;
+	up->fd = open(ubi_vol, O_RDWR);
+	if (up->fd < 0)
+		goto fail;
+	if (ioctl(up->fd, UBI_IOCVOLUP, &up->left) < 0)
+		goto fail;
+	return up;
+
+fail:
+	if (up->fd >= 0)
+		close(up->fd);
+	free(up->buf);
+	free(up);
+	return NULL;
+}
+
+static int ubi_update_flush(ubi_update *up)
+{
+	if (up->len > 0 && write_all(up->fd, up->buf, up->len) < 0)
+		up->error = 1;
+	up->len = 0;
+	return up->error ? -1 : 0;
+}
+
+int ubi_update_write(ubi_update *up, const void *data, size_t len)
+{
+	const char *p = data;
+	size_t n;
+
+	if (up->error)
+		return -1;
+	if ((long long) len > up->left) {
+		up->error = 1;
 		return -1;
 	}
+	up->left -= len;
+
+	while (len > 0) {
+		// whole buffers go straight through, no copy
+		if (up->len == 0 && len >= up->size) {
+			n = len / up->size * up->size;
+			if (write_all(up->fd, p, n) < 0) {
+				up->error = 1;
+				return -1;
+			}
+		} else {
+			n = up->size - up->len;
+			if (n > len)
+				n = len;
+			memcpy(up->buf + up->len, p, n);
+			up->len += n;
+			if (up->len == up->size && ubi_update_flush(up) < 0)
+				return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
 
-	ret = ioctl(fd, UBI_IOCVOLUP, &bytes);
-	if (ret < 0) {
-		close(input_fd);
-		close(fd);
+int ubi_update_close(ubi_update *up)
+{
+	int ret;
+
+	ret = ubi_update_flush(up);
+	// a short update leaves the volume marked corrupted
+	if (ret == 0 && up->left != 0)
+		ret = -1;
+	if (close(up->fd) < 0)
+		ret = -1;
+	free(up->buf);
+	free(up);
+	return ret;
+}
+
+int ubi_updatevol_fd(const char *ubi_vol, int fd, long long bytes)
+{
+	ubi_update *up;
+	char *data;
+	ssize_t len;
+	int ret = 0;
+
+	up = ubi_update_open(ubi_vol, bytes);
+	if (up == NULL)
 		return -1;
-	}
 
-	input_data = malloc(leb_size);
-	while ((len = read(input_fd, input_data, leb_size)) > 0) {
-		ret = write(fd, input_data, len);
-		if (ret < 0)
+	// read straight into the update buffer, in whole LEBs
+	while (ret == 0 && up->left > 0) {
+		data = up->buf + up->len;
+		len = up->size - up->len;
+		if (len > up->left)
+			len = up->left;
+		len = read(fd, data, len);
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len <= 0) {
+			ret = -1;
 			break;
+		}
+		up->len += len;
+		up->left -= len;
+		if (up->len == up->size)
+			ret = ubi_update_flush(up);
 	}
-	if (len < 0)
+
+	if (ubi_update_close(up) < 0)
 		ret = -1;
+	return ret;
+}
 
-	close(input_fd);
+int ubi_updatevol(const char *ubi_ctrl, const char *image)
+{
+	long long bytes;
+	int fd, ret;
+	struct stat st;
+
+	if (image == NULL) {
+		fd = open(ubi_ctrl, O_RDWR);
+		if (fd < 0)
+			return -1;
+		// truncate the volume by starting an update for size 0
+		bytes = 0;
+		ret = ioctl(fd, UBI_IOCVOLUP, &bytes);
+		close(fd);
+		return ret;
+	}
+
+	fd = open(image, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return -1;
+	}
+	ret = ubi_updatevol_fd(ubi_ctrl, fd, st.st_size);
 	close(fd);
 	return ret;
 }
@@ -17,6 +17,8 @@
 #ifndef UBI_TOOLS_H_
 #define UBI_TOOLS_H_
 
+#include <stddef.h>
+
 int ubi_attach(const char *ubi_ctrl, int mtd_num, int dev_num);
 int ubi_detach(const char *ubi_ctrl, int dev_num);
 int ubi_mkvol(const char *ubi_ctrl, int dev_num, int vol_id, int size_bytes,
@@ -25,4 +27,22 @@ int ubi_rmvol(const char *ubi_ctrl, int vol_id);
 int ubi_rsvol(const char *ubi_ctrl, int vol_id, int size_bytes);
 int ubi_updatevol(const char *ubi_ctrl, const char *image);
 
+/* Usable bytes per LEB of a /dev/ubiX_Y volume, or -1 */
+int ubi_vol_leb_size(const char *ubi_vol);
+
+/*
+ * Streams a volume update of exactly bytes bytes: UBI_IOCVOLUP is issued at
+ * open and the data goes to the volume in writes of whole LEBs, whatever
+ * sizes it is passed in.  The update only ends when every byte came
+ * through; a volume closed short stays marked corrupted until the next
+ * update.  Close returns 0 if the whole update made it.
+ */
+typedef struct ubi_update ubi_update;
+ubi_update *ubi_update_open(const char *ubi_vol, long long bytes);
+int ubi_update_write(ubi_update *up, const void *data, size_t len);
+int ubi_update_close(ubi_update *up);
+
+/* Updates the volume with the next bytes bytes read from fd */
+int ubi_updatevol_fd(const char *ubi_vol, int fd, long long bytes);
+
 #endif /* UBI_TOOLS_H_ */
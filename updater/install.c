@@ -32,6 +32,7 @@
 #include "mincrypt/sha.h"
 #include "minzip/DirUtil.h"
 #include "mounts.h"
+#include "topology/topology.h"
 #include "mtdutils/mtdutils.h"
 #include "updater.h"
 #include "applypatch/applypatch.h"
@@ -105,6 +106,7 @@ Value* MountFn(const char* name, State* state, int argc, Expr* argv[]) {
                     name, location, mount_point, strerror(errno));
             result = strdup("");
         } else {
+            topology_invalidate(TOPOLOGY_MOUNTS);
             result = mount_point;
         }
     }
@@ -378,6 +380,10 @@ Value* PackageExtractDirFn(const char* name, State* state,
 }
 
 
+static bool write_ubi_data(const unsigned char* data, int data_len, void* cookie) {
+    return ubi_update_write((ubi_update*) cookie, data, data_len) == 0;
+}
+
 // package_extract_file(package_path, destination_path)
 //   or
 // package_extract_file(package_path)
@@ -404,6 +410,21 @@ Value* PackageExtractFileFn(const char* name, State* state,
             goto done2;
         }
 
+        if (strncmp(dest_path, "/dev/ubi", 8) == 0 && isdigit(dest_path[8])) {
+            // a UBI volume only takes data inside a volume update, so the
+            // entry is inflated straight into one
+            ubi_update* up = ubi_update_open(dest_path, mzGetZipEntryUncompLen(entry));
+            if (up == NULL) {
+                fprintf(stderr, "%s: can't start update of %s: %s\n",
+                        name, dest_path, strerror(errno));
+                goto done2;
+            }
+            success = mzProcessZipEntryContents(za, entry, write_ubi_data, up);
+            if (ubi_update_close(up) != 0)
+                success = false;
+            goto done2;
+        }
+
         FILE* f = fopen(dest_path, "wb");
         if (f == NULL) {
             fprintf(stderr, "%s: can't open %s for write: %s\n",
@@ -691,6 +712,16 @@ static bool write_raw_image_cb(const unsigned char* data,
     return false;
 }
 
+// Fills in the bar of the show_progress() the script set up for the
+// write, as far as the image has been written.
+static void write_raw_image_progress(void* cookie, uint64_t done, uint64_t total) {
+    UpdaterInfo* ui = (UpdaterInfo*)cookie;
+    if (total != 0) {
+        fprintf(ui->cmd_pipe, "set_progress %f\n", (double)done / (double)total);
+        fflush(ui->cmd_pipe);
+    }
+}
+
 // write_raw_image(file, partition)
 Value* WriteRawImageFn(const char* name, State* state, int argc, Expr* argv[]) {
     char* result = NULL;
@@ -710,7 +741,8 @@ Value* WriteRawImageFn(const char* name, State* state, int argc, Expr* argv[]) {
         goto done;
     }
 
-    if (0 == restore_raw_partition(NULL, partition, filename))
+    if (0 == restore_raw_partition_progress(NULL, partition, filename, 0,
+                                            write_raw_image_progress, state->cookie))
         result = strdup(partition);
     else
         result = strdup("");